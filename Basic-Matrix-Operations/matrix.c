@@ -1,30 +1,83 @@
+#define _GNU_SOURCE
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include "matrix.h"
 
-matrix_t *matrix_init(unsigned nrows, unsigned ncols) {
-    matrix_t *mat = malloc(sizeof(matrix_t));
-    if (mat == NULL) {
+// Blocks of at least this many bytes are mapped on 2 MB huge pages where possible.
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+// Bytes before the elements: the header and row pointers, rounded to a long.
+static size_t header_size(unsigned nrows) {
+    size_t size = sizeof(matrix_t) + nrows * sizeof(int *);
+    return (size + sizeof(long) - 1) / sizeof(long) * sizeof(long);
+}
+
+// Length of the block holding a matrix, rounded to whole huge pages if it is mapped.
+static size_t block_size(unsigned nrows, unsigned ncols) {
+    size_t size = header_size(nrows) + (size_t) nrows * ncols * sizeof(int);
+    return size < HUGE_PAGE ? size : (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+}
+
+/*
+ * Map a large block on huge pages: reserved ones (MAP_HUGETLB) if the system
+ * has any, otherwise transparent ones requested with madvise. The mapping is
+ * private, so processes forked to read the matrix share its huge pages until
+ * one of them writes. SMOCK_HUGE_PAGES=thp skips MAP_HUGETLB and "off" uses
+ * normal pages.
+ * Returns the block, or NULL on failure
+ */
+static void *map_block(size_t len) {
+    const char *mode = getenv("SMOCK_HUGE_PAGES");
+    int any = mode == NULL || (strcmp(mode, "thp") != 0 && strcmp(mode, "off") != 0);
+    void *ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (any) {
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (ptr != MAP_FAILED) {
+        return ptr;
+    } else if (mode != NULL && strcmp(mode, "off") == 0) {
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return ptr == MAP_FAILED ? NULL : ptr;
+    }
+
+    // Map an extra huge page so the block can start on a huge page boundary,
+    // then trim the unused head and tail.
+    char *raw = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
         return NULL;
     }
-    mat->data = malloc(nrows * sizeof(int *));
-    if (mat->data == NULL) {
-        free(mat);
-        return  NULL;
+    size_t head = (HUGE_PAGE - (size_t) raw % HUGE_PAGE) % HUGE_PAGE;
+    if (head > 0) {
+        munmap(raw, head);
+    }
+    munmap(raw + head + len, HUGE_PAGE - head);
+#ifdef MADV_HUGEPAGE
+    madvise(raw + head, len, MADV_HUGEPAGE);
+#endif
+    return raw + head;
+}
+
+matrix_t *matrix_init(unsigned nrows, unsigned ncols) {
+    // Header, row pointers and elements share one block, so a matrix costs
+    // a single allocation and free instead of one per row.
+    size_t size = block_size(nrows, ncols);
+    char *block = size < HUGE_PAGE ? malloc(size) : map_block(size);
+    if (block == NULL) {
+        return NULL;
     }
 
+    matrix_t *mat = (matrix_t *) block;
+    mat->data = (int **) (block + sizeof(matrix_t));
+    int *elements = (int *) (block + header_size(nrows));
     for (int i = 0; i < nrows; i++) {
-        mat->data[i] = malloc(ncols * sizeof(int));
-        if (mat->data[i] == NULL) {
-            // Need to free previously allocated matrix rows
-            for (int j = 0; j < i; j++) {
-                free(mat->data[j]);
-            }
-            free(mat->data);
-            free(mat);
-            return NULL;
-        }
+        mat->data[i] = elements + (size_t) i * ncols;
     }
     mat->nrows = nrows;
     mat->ncols = ncols;
@@ -33,12 +86,13 @@ matrix_t *matrix_init(unsigned nrows, unsigned ncols) {
 }
 
 void matrix_free(matrix_t *mat) {
-    //Need to free each row first.
-    for (int row = 0; row < mat->nrows; row++) {
-        free(mat->data[row]);
+    //Rows live in the same block as the header.
+    size_t size = block_size(mat->nrows, mat->ncols);
+    if (size < HUGE_PAGE) {
+        free(mat);
+    } else if (munmap(mat, size) == -1) {
+        perror("munmap");
     }
-    free(mat->data);
-    free(mat);
 }
 
 void matrix_put(matrix_t *mat, unsigned i, unsigned j, int val) {
@@ -50,7 +104,8 @@ int matrix_get(const matrix_t *mat, unsigned i, unsigned j) {
 }
 
 long matrix_sum(const matrix_t *mat) {
-    int sum = 0;
+    // Accumulates in a long: an int sum overflows on large matrices.
+    long sum = 0;
     for (int row = 0; row < mat->nrows; row++) {
         for (int col = 0; col < mat->ncols; col++) {
             sum = sum + mat->data[row][col];
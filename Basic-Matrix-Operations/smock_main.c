@@ -95,12 +95,12 @@ int main(int argc, char *argv[]) {
         } 
 
         else if (strcmp("sum", input) == 0) {
-            int val;
+            long val;
             if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
                 val = matrix_sum(mat);
-                printf("%d \n",val);
+                printf("%ld \n",val);
             }
         } 
 
@@ -0,0 +1,40 @@
+#include <time.h>
+#include "cancel.h"
+
+// Incremented by cancel_interrupt. A lock-free atomic, so a signal handler may
+// update it while the interrupted thread reads it.
+static unsigned long interrupts;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void cancel_token_init(cancel_token_t *token, unsigned timeout_ms) {
+    token->generation = __atomic_load_n(&interrupts, __ATOMIC_ACQUIRE);
+    token->deadline_ns = timeout_ms > 0 ? now_ns() + (uint64_t) timeout_ms * 1000000 : 0;
+    token->cancelled = 0;
+}
+
+void cancel_token_cancel(cancel_token_t *token) {
+    __atomic_store_n(&token->cancelled, 1, __ATOMIC_RELEASE);
+}
+
+void cancel_interrupt(void) {
+    __atomic_add_fetch(&interrupts, 1, __ATOMIC_RELEASE);
+}
+
+cancel_reason_t cancel_requested(const cancel_token_t *token) {
+    if (token == NULL) {
+        return CANCEL_NONE;
+    }
+    if (__atomic_load_n(&token->cancelled, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&interrupts, __ATOMIC_ACQUIRE) != token->generation) {
+        return CANCEL_REQUESTED;
+    }
+    if (token->deadline_ns != 0 && now_ns() >= token->deadline_ns) {
+        return CANCEL_DEADLINE;
+    }
+    return CANCEL_NONE;
+}
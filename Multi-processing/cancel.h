@@ -0,0 +1,60 @@
+#ifndef CANCEL_H
+#define CANCEL_H
+
+#include <stdint.h>
+
+/*
+ * Cooperative cancellation of long-running queries. Kernels that take a
+ * token check it between chunks of work (rows, or chunks of elements) and
+ * stop early once it is cancelled, so the threads, workers and processes
+ * they use are free again within one chunk. A cancelled kernel returns -1,
+ * and its caller tells cancellation apart from failure with cancel_requested.
+ *
+ * A token is cancelled when any of these happens:
+ *   cancel_token_cancel is called on it
+ *   its deadline passes
+ *   cancel_interrupt is called after it was initialized. The shells call it
+ *     from their SIGINT handler, so Ctrl-C stops every running query.
+ */
+
+typedef enum {
+    CANCEL_NONE,
+    CANCEL_REQUESTED, // By cancel_token_cancel or cancel_interrupt
+    CANCEL_DEADLINE
+} cancel_reason_t;
+
+/*
+ * A per-query cancellation token
+ *   generation: Number of cancel_interrupt calls before the token was initialized
+ *   deadline_ns: CLOCK_MONOTONIC time at which the query is stopped, 0 for none
+ *   cancelled: Set by cancel_token_cancel
+ */
+typedef struct {
+    unsigned long generation;
+    uint64_t deadline_ns;
+    int cancelled;
+} cancel_token_t;
+
+/*
+ * Initialize a token for a query that starts now
+ *   timeout_ms: Time the query may run before it is stopped, 0 for no limit
+ */
+void cancel_token_init(cancel_token_t *token, unsigned timeout_ms);
+
+/*
+ * Cancel one token. Safe to call from any thread.
+ */
+void cancel_token_cancel(cancel_token_t *token);
+
+/*
+ * Cancel every token initialized so far. Async-signal-safe.
+ */
+void cancel_interrupt(void);
+
+/*
+ * Whether and why the query holding 'token' should stop. A NULL token is
+ * never cancelled.
+ */
+cancel_reason_t cancel_requested(const cancel_token_t *token);
+
+#endif // CANCEL_H
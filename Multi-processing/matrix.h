@@ -1,6 +1,9 @@
 #ifndef SMOCK_FUNC_H
 #define SMOCK_FUNC_H
 
+#include <stddef.h>
+#include "cancel.h"
+
 /*
  * Matrix data structure
  * data: Two-dimensional integer array (dynamically allocated)
@@ -98,7 +101,7 @@ matrix_t *matrix_read_bin(const char *file_name);
  * 'result': Pointer to memory where result will be stored
  * Returns 0 on success or -1 on error
  */
-int matrix_parallel_sum(const matrix_t *mat, unsigned n_procs, int *result);
+int matrix_parallel_sum(const matrix_t *mat, unsigned n_procs, long *result);
 
 /*
  * Computes the maximum of all matrix elements in parallel with n_procs processes
@@ -109,4 +112,37 @@ int matrix_parallel_sum(const matrix_t *mat, unsigned n_procs, int *result);
  */
 int matrix_parallel_max(const matrix_t *mat, unsigned n_procs, int *result);
 
+/*
+ * matrix_parallel_sum and matrix_parallel_max that can be stopped. While the
+ * children run, the parent checks 'cancel' every few tens of milliseconds and
+ * as soon as a signal interrupts it. Once cancelled, it kills the children
+ * and reaps them before returning.
+ * 'cancel': Token to stop on, or NULL
+ * Returns 0 on success or -1 on error or cancellation
+ */
+int matrix_parallel_sum_cancel(const matrix_t *mat, unsigned n_procs,
+                               const cancel_token_t *cancel, long *result);
+int matrix_parallel_max_cancel(const matrix_t *mat, unsigned n_procs,
+                               const cancel_token_t *cancel, int *result);
+
+/*
+ * How the pages holding a matrix's elements are backed
+ * mapped: Bytes of elements
+ * resident: Bytes of them currently in memory
+ * huge: Bytes of them backed by huge pages, reserved or transparent
+ */
+typedef struct {
+    size_t mapped;
+    size_t resident;
+    size_t huge;
+} matrix_page_usage_t;
+
+/*
+ * Find how much of a matrix is backed by huge pages, from /proc/self/smaps
+ * 'mat': Pointer to matrix instance
+ * 'usage': Pointer to memory where the result will be stored
+ * Returns 0 on success or -1 on error
+ */
+int matrix_page_usage(const matrix_t *mat, matrix_page_usage_t *usage);
+
 #endif // SMOCK_FUNC_H
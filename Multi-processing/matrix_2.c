@@ -1,6 +1,9 @@
+#include <errno.h>
 #include <limits.h>
-#include <math.h>
 #include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,8 +12,87 @@
 #include <unistd.h>
 #include "matrix.h"
 
-int matrix_parallel_sum(const matrix_t *mat, unsigned n_procs, int *result) {
-    int total_elements = mat->nrows * mat->ncols;
+// How often a parent waiting for its children checks for a passed deadline
+#define CANCEL_POLL_MS 50
+
+// Kills the n_procs children in 'pids' and waits for them to exit.
+static void kill_children(pid_t *pids, unsigned n_procs) {
+    for (unsigned i = 0; i < n_procs; i++) {
+        kill(pids[i], SIGKILL);
+    }
+    for (unsigned i = 0; i < n_procs; i++) {
+        while (waitpid(pids[i], NULL, 0) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+/*
+ * Reads one 'size'-byte result from each of the n_procs children in 'pids'
+ * into 'results', then reaps them. If 'cancel' is cancelled or a child fails
+ * first, the remaining children are killed and reaped instead.
+ * Returns 0 on success or -1 on error or cancellation
+ */
+static int collect_children(pid_t *pids, unsigned n_procs, int read_fd,
+                            const cancel_token_t *cancel, void *results, size_t size) {
+    unsigned n_read = 0;
+    while (n_read < n_procs) {
+        if (cancel_requested(cancel) != CANCEL_NONE) {
+            kill_children(pids, n_procs);
+            return -1;
+        }
+        struct pollfd pfd = {read_fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, cancel != NULL ? CANCEL_POLL_MS : -1);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
+            kill_children(pids, n_procs);
+            return -1;
+        } else if (ready <= 0) {
+            continue; // Interrupted or timed out, so check the token again
+        }
+        // Each write is at most PIPE_BUF bytes, so it is read whole.
+        ssize_t len = read(read_fd, (char *) results + n_read * size, size);
+        if (len == -1 && errno == EINTR) {
+            continue;
+        } else if (len != (ssize_t) size) {
+            // End of file: every child exited, at least one without writing.
+            kill_children(pids, n_procs);
+            return -1;
+        }
+        n_read++;
+    }
+
+    int ret = 0;
+    for (unsigned i = 0; i < n_procs; i++) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(pids[i], &status, 0)) == -1 && errno == EINTR) {
+        }
+        if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/*
+ * The elements, in row-major order, that child 'i' of 'n_procs' reads:
+ * [*start, *end). The first total % n_procs children take one extra.
+ */
+static void child_range(size_t total_elements, unsigned n_procs, unsigned i, size_t *start,
+                        size_t *end) {
+    size_t child_size = total_elements / n_procs;
+    size_t extra = total_elements % n_procs;
+    *start = i * child_size + (i < extra ? i : extra);
+    *end = *start + child_size + (i < extra);
+}
+
+int matrix_parallel_sum(const matrix_t *mat, unsigned n_procs, long *result) {
+    return matrix_parallel_sum_cancel(mat, n_procs, NULL, result);
+}
+
+int matrix_parallel_sum_cancel(const matrix_t *mat, unsigned n_procs,
+                               const cancel_token_t *cancel, long *result) {
+    size_t total_elements = (size_t) mat->nrows * mat->ncols;
     *result = 0;
     int my_pipe[2]; 
     if (pipe(my_pipe) == -1) {
@@ -20,64 +102,59 @@ int matrix_parallel_sum(const matrix_t *mat, unsigned n_procs, int *result) {
         return -1;
     }
 
-    for (int i = 0; i < n_procs; i++) {
+    pid_t pids[n_procs];
+    for (unsigned i = 0; i < n_procs; i++) {
         pid_t is_child = fork();
         if (is_child < 0) {
+            perror("fork");
+            kill_children(pids, i); // Reap the children already started
             close(my_pipe[0]);
             close(my_pipe[1]);
             return -1;
         } else if (is_child==0) {
             close(my_pipe[0]); //Child never reads from pipe.
-            int temp_sum = 0;
-            //Determines where child starts reading the matrix from.
-            int child_size = ceil((double)total_elements / (double)n_procs);
-            int flattened_index = (i * child_size);
-            int last_child = 0;
-            //Don't want the last child to read past the matrix's end.
-            if ((i == n_procs - 1) && (total_elements % n_procs) != 0) {
-                last_child = n_procs - (total_elements % n_procs);
-            }
-            for (int j = 0; j < child_size - last_child; j++) {
-                int row = flattened_index / mat->ncols;
-                int col = flattened_index - row * mat->ncols;
+            // A long, so large matrices do not overflow the partial sums.
+            long temp_sum = 0;
+            size_t start;
+            size_t end;
+            child_range(total_elements, n_procs, i, &start, &end);
+            for (size_t flattened_index = start; flattened_index < end; flattened_index++) {
+                size_t row = flattened_index / mat->ncols;
+                size_t col = flattened_index - row * mat->ncols;
                 temp_sum += mat->data[row][col];
-                flattened_index++;
             }
-            int is_valid = write(my_pipe[1],&temp_sum,sizeof(int));
+            int is_valid = write(my_pipe[1],&temp_sum,sizeof(long));
             close(my_pipe[1]);
             if (is_valid < 0) {
-                exit(-1);
+                _exit(1);
             }
-            exit(0); //Don't want child to produce other children.
+            // _exit so the child does not flush stdio output copied from the parent.
+            _exit(0); //Don't want child to produce other children.
         }
+        pids[i] = is_child;
     }
     close(my_pipe[1]); //No longer need to write out to pipe
 
-    //Each child will end the wait call exactly once 
-    //After writing to pipe exactly once
-    //And order doesn't matter.
-    //So for each child, the parent must wait and read from the pipe exaclty once.
-    for (int i = 0; i < n_procs; i++) {
-        int status;
-        wait(&status); 
-        if (status != 0) {
-            close(my_pipe[0]);
-            return -1;
-        }
-        int partial_sum;
-        status = read(my_pipe[0],&partial_sum,sizeof(int));
-        if (status < 0) {
-            close(my_pipe[0]);
-            return -1;
-        }
-        *result += partial_sum;
-    }    
+    //Each child writes to the pipe exactly once, and order doesn't matter.
+    long partial_sums[n_procs];
+    int status = collect_children(pids, n_procs, my_pipe[0], cancel, partial_sums, sizeof(long));
     close(my_pipe[0]);
+    if (status != 0) {
+        return -1;
+    }
+    for (unsigned i = 0; i < n_procs; i++) {
+        *result += partial_sums[i];
+    }
     return 0;
 }
 
 int matrix_parallel_max(const matrix_t *mat, unsigned n_procs, int *result) {
-    int total_elements = mat->nrows * mat->ncols;
+    return matrix_parallel_max_cancel(mat, n_procs, NULL, result);
+}
+
+int matrix_parallel_max_cancel(const matrix_t *mat, unsigned n_procs,
+                               const cancel_token_t *cancel, int *result) {
+    size_t total_elements = (size_t) mat->nrows * mat->ncols;
     *result = mat->data[0][0];
     int my_pipe[2]; 
     if (pipe(my_pipe) == -1) {
@@ -87,62 +164,121 @@ int matrix_parallel_max(const matrix_t *mat, unsigned n_procs, int *result) {
         return -1;
     }
 
-    for (int i = 0; i < n_procs; i++) {
+    pid_t pids[n_procs];
+    for (unsigned i = 0; i < n_procs; i++) {
         pid_t is_child = fork();
         if (is_child < 0) {
+            perror("fork");
+            kill_children(pids, i); // Reap the children already started
             close(my_pipe[0]);
             close(my_pipe[1]);
             return -1;
         } else if (is_child == 0) {
             close(my_pipe[0]); //Child never reads from pipe.
             int temp_max = mat->data[0][0];
-            //Determines where child starts reading the matrix from.
-            int child_size = ceil((double)total_elements / (double)n_procs);
-            int flattened_index = (i * child_size);
-            int last_child = 0;
-            //Don't want the last child to read past the matrix's end.
-            if ((i == n_procs - 1) && (total_elements % n_procs) != 0) {
-                last_child = n_procs - (total_elements % n_procs);
-            }
-            for (int j = 0; j < child_size - last_child; j++) {
-                int row = flattened_index / mat->ncols;
-                int col = flattened_index - row * mat->ncols;
+            size_t start;
+            size_t end;
+            child_range(total_elements, n_procs, i, &start, &end);
+            for (size_t flattened_index = start; flattened_index < end; flattened_index++) {
+                size_t row = flattened_index / mat->ncols;
+                size_t col = flattened_index - row * mat->ncols;
                 if (temp_max < mat->data[row][col]) {
                     temp_max = mat->data[row][col];
-                }    
-                flattened_index++;
+                }
             }
             int is_valid = write(my_pipe[1],&temp_max,sizeof(int));
             close(my_pipe[1]); 
             if (is_valid < 0) {
-                exit(-1);
+                _exit(1);
             }
-            exit(0); //Don't want child to produce other children.
+            // _exit so the child does not flush stdio output copied from the parent.
+            _exit(0); //Don't want child to produce other children.
         }
+        pids[i] = is_child;
     }
     close(my_pipe[1]); //No longer need to write out to pipe
 
-    //Each child will end the wait call exactly once 
-    //After writing to pipe exactly once
-    //And order doesn't matter.
-    //So for each child, the parent must wait and read from the pipe exaclty once.
-    for (int i = 0; i < n_procs; i++) {
-        int status;
-        wait(&status);
-        if (status != 0) {
-            close(my_pipe[0]);
-            return -1;
-        }
-        int local_max;
-        status = read(my_pipe[0],&local_max,sizeof(int));
-        if (status < 0) {
-            close(my_pipe[0]);
-            return -1;
+    //Each child writes to the pipe exactly once, and order doesn't matter.
+    int local_maxes[n_procs];
+    int status = collect_children(pids, n_procs, my_pipe[0], cancel, local_maxes, sizeof(int));
+    close(my_pipe[0]);
+    if (status != 0) {
+        return -1;
+    }
+    for (unsigned i = 0; i < n_procs; i++) {
+        if (*result < local_maxes[i]) {
+            *result = local_maxes[i];
         }
-        if (*result < local_max) {
-            *result = local_max;
+    }
+    return 0;
+}
+
+/*
+ * One mapping from /proc/self/smaps, as far as it overlaps the matrix
+ * len: Length of the whole mapping
+ * overlap: Bytes of it holding matrix elements
+ * rss_kb, huge_kb: Resident and transparent huge page kilobytes of the mapping
+ * hugetlb_kb: Kilobytes of reserved huge pages, which smaps counts apart from rss_kb
+ */
+typedef struct {
+    size_t len;
+    size_t overlap;
+    long rss_kb;
+    long huge_kb;
+    long hugetlb_kb;
+} smaps_vma_t;
+
+// Adds the mapping's share of its counts to 'usage'.
+static void add_vma(matrix_page_usage_t *usage, const smaps_vma_t *vma) {
+    if (vma->overlap == 0) {
+        return;
+    }
+    double share = (double) vma->overlap / vma->len;
+    size_t resident = (vma->rss_kb + vma->hugetlb_kb) * 1024 * share;
+    size_t huge = (vma->huge_kb + vma->hugetlb_kb) * 1024 * share;
+    usage->resident += resident < vma->overlap ? resident : vma->overlap;
+    usage->huge += huge < vma->overlap ? huge : vma->overlap;
+}
+
+int matrix_page_usage(const matrix_t *mat, matrix_page_usage_t *usage) {
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    //Elements are contiguous from the first row on.
+    usage->mapped = (size_t) mat->nrows * mat->ncols * sizeof(int);
+    usage->resident = 0;
+    usage->huge = 0;
+    uintptr_t start = mat->nrows > 0 ? (uintptr_t) mat->data[0] : 0;
+    uintptr_t end = start + usage->mapped;
+
+    char line[512];
+    smaps_vma_t vma = {0};
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned long lo, hi;
+        long kb;
+        //Each mapping starts with its address range, followed by one field per line.
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            add_vma(usage, &vma);
+            memset(&vma, 0, sizeof(vma));
+            uintptr_t from = lo > start ? lo : start;
+            uintptr_t to = hi < end ? hi : end;
+            vma.len = hi - lo;
+            vma.overlap = to > from ? to - from : 0;
+        } else if (vma.overlap == 0) {
+            continue;
+        } else if (sscanf(line, "Rss: %ld kB", &kb) == 1) {
+            vma.rss_kb = kb;
+        } else if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1 ||
+                   sscanf(line, "ShmemPmdMapped: %ld kB", &kb) == 1 ||
+                   sscanf(line, "FilePmdMapped: %ld kB", &kb) == 1) {
+            vma.huge_kb += kb;
+        } else if (sscanf(line, "Shared_Hugetlb: %ld kB", &kb) == 1 ||
+                   sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1) {
+            vma.hugetlb_kb += kb;
         }
-    }    
-    close(my_pipe[0]);
+    }
+    add_vma(usage, &vma);
+    fclose(f);
     return 0;
 }
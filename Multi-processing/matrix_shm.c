@@ -0,0 +1,248 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "matrix_shm.h"
+
+// Longest segment name, including MATRIX_SHM_PREFIX, that shm_open accepts everywhere
+#define SEGMENT_NAME_MAX 255
+
+// Builds the shared memory object name for 'name'. Returns 0 on success or -1 if invalid.
+static int segment_name(char *dest, const char *name) {
+    if (*name == '\0' || strchr(name, '/') != NULL) {
+        return -1;
+    }
+    int len = snprintf(dest, SEGMENT_NAME_MAX + 1, "%s%s", MATRIX_SHM_PREFIX, name);
+    return len > SEGMENT_NAME_MAX ? -1 : 0;
+}
+
+static size_t segment_size(unsigned nrows, unsigned ncols) {
+    return sizeof(matrix_shm_header_t) + (size_t) nrows * ncols * sizeof(int);
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Whether process 'pid' still exists. One owned by another user does too.
+static int process_alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// Yields at first, then sleeps once a wait has lasted MATRIX_SHM_WAIT_MS.
+static void wait_turn(long start) {
+    if (now_ms() - start > MATRIX_SHM_WAIT_MS) {
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    } else {
+        sched_yield();
+    }
+}
+
+/*
+ * Become the segment's writer and make the sequence count odd, waiting for
+ * any other publisher to finish first. The count of a writer that died is
+ * taken over and moved on by two, so that it stays odd and differs from
+ * anything the dead writer could have stored.
+ * Returns the odd count to pass to write_unlock
+ */
+static uint64_t write_lock(matrix_shm_header_t *header) {
+    int32_t self = getpid();
+    long start = now_ms();
+    while (1) {
+        int32_t writer = __atomic_load_n(&header->writer, __ATOMIC_ACQUIRE);
+        if ((writer == 0 || !process_alive(writer)) &&
+            __atomic_compare_exchange_n(&header->writer, &writer, self, 0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            break;
+        }
+        wait_turn(start);
+    }
+    uint64_t seq = __atomic_load_n(&header->seq, __ATOMIC_RELAXED);
+    seq += seq % 2 == 0 ? 1 : 2;
+    __atomic_store_n(&header->seq, seq, __ATOMIC_RELAXED);
+    // Readers must see the odd count before any of the elements change.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return seq;
+}
+
+static void write_unlock(matrix_shm_header_t *header, uint64_t seq) {
+    // Both fail, harmlessly, for a writer whose turn was taken over.
+    __atomic_compare_exchange_n(&header->seq, &seq, seq + 1, 0, __ATOMIC_RELEASE,
+                                __ATOMIC_RELAXED);
+    int32_t self = getpid();
+    __atomic_compare_exchange_n(&header->writer, &self, 0, 0, __ATOMIC_RELEASE,
+                                __ATOMIC_RELAXED);
+}
+
+/*
+ * Mark the segment open as 'fd' retired and remove its name, so the name can
+ * be reused with other dimensions
+ */
+static void retire(int fd, const char *seg_name, size_t size) {
+    if (size >= sizeof(matrix_shm_header_t)) {
+        matrix_shm_header_t *header = mmap(NULL, sizeof(matrix_shm_header_t),
+                                           PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (header != MAP_FAILED) {
+            uint64_t seq = write_lock(header);
+            header->retired = 1;
+            write_unlock(header, seq);
+            munmap(header, sizeof(matrix_shm_header_t));
+        }
+    }
+    shm_unlink(seg_name);
+}
+
+int matrix_shm_publish(const char *name, const int *data, unsigned nrows, unsigned ncols) {
+    char seg_name[SEGMENT_NAME_MAX + 1];
+    if (segment_name(seg_name, name) != 0) {
+        return -1;
+    }
+    size_t size = segment_size(nrows, ncols);
+    int fd = shm_open(seg_name, O_RDWR | O_CREAT, 0666);
+    struct stat st;
+    if (fd == -1) {
+        return -1;
+    } else if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    matrix_shm_header_t *header = NULL;
+    if ((size_t) st.st_size == size) {
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (header == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        // A segment of the same size may still hold other dimensions.
+        if (header->magic == MATRIX_SHM_MAGIC &&
+            (header->nrows != nrows || header->ncols != ncols)) {
+            munmap(header, size);
+            header = NULL;
+        }
+    }
+    if (header == NULL && st.st_size != 0) {
+        // Readers may still be attached, so give the name a new segment
+        // rather than resizing the one they map.
+        retire(fd, seg_name, st.st_size);
+        close(fd);
+        fd = shm_open(seg_name, O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (fd == -1) {
+            return -1;
+        }
+    }
+    if (header == NULL) {
+        if (ftruncate(fd, size) == -1) {
+            close(fd);
+            return -1;
+        }
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (header == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    uint64_t seq = write_lock(header);
+    header->magic = MATRIX_SHM_MAGIC;
+    header->nrows = nrows;
+    header->ncols = ncols;
+    header->retired = 0;
+    memcpy(header + 1, data, size - sizeof(matrix_shm_header_t));
+    write_unlock(header, seq);
+    munmap(header, size);
+    return 0;
+}
+
+int matrix_shm_unpublish(const char *name) {
+    char seg_name[SEGMENT_NAME_MAX + 1];
+    if (segment_name(seg_name, name) != 0) {
+        return -1;
+    }
+    return shm_unlink(seg_name);
+}
+
+int matrix_shm_attach(matrix_shm_t *shm, const char *name) {
+    char seg_name[SEGMENT_NAME_MAX + 1];
+    if (segment_name(seg_name, name) != 0) {
+        return -1;
+    }
+    int fd = shm_open(seg_name, O_RDONLY, 0);
+    struct stat st;
+    if (fd == -1) {
+        return -1;
+    } else if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(matrix_shm_header_t)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    // A segment still being created for the first time has no magic yet.
+    const matrix_shm_header_t *header = map;
+    if (header->magic != MATRIX_SHM_MAGIC ||
+        segment_size(header->nrows, header->ncols) != (size_t) st.st_size) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    shm->header = header;
+    shm->data = (const int *) (header + 1);
+    shm->map_len = st.st_size;
+    return 0;
+}
+
+void matrix_shm_detach(matrix_shm_t *shm) {
+    munmap((void *) shm->header, shm->map_len);
+    shm->header = NULL;
+    shm->data = NULL;
+}
+
+int matrix_shm_read_begin(const matrix_shm_t *shm, uint64_t *seq) {
+    long start = now_ms();
+    while (1) {
+        *seq = __atomic_load_n(&shm->header->seq, __ATOMIC_ACQUIRE);
+        if (*seq % 2 == 0) {
+            return 0;
+        }
+        if (now_ms() - start > MATRIX_SHM_WAIT_MS) {
+            // A live writer is only slow. One that died left the elements
+            // torn, unless the count moved on while its ID was looked up.
+            int32_t writer = __atomic_load_n(&shm->header->writer, __ATOMIC_ACQUIRE);
+            if ((writer == 0 || !process_alive(writer)) &&
+                __atomic_load_n(&shm->header->seq, __ATOMIC_ACQUIRE) == *seq) {
+                return -1;
+            }
+        }
+        wait_turn(start);
+    }
+}
+
+int matrix_shm_read_retry(const matrix_shm_t *shm, uint64_t seq) {
+    // The elements read must not be reordered after the second look at the count.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&shm->header->seq, __ATOMIC_RELAXED) != seq;
+}
+
+int matrix_shm_copy(const matrix_shm_t *shm, int *dest) {
+    uint64_t seq;
+    do {
+        if (matrix_shm_read_begin(shm, &seq) != 0) {
+            return -1;
+        }
+        memcpy(dest, shm->data, shm->map_len - sizeof(matrix_shm_header_t));
+    } while (matrix_shm_read_retry(shm, seq));
+    return 0;
+}
@@ -0,0 +1,108 @@
+#ifndef MATRIX_SHM_H
+#define MATRIX_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Matrices shared between processes on one host through POSIX shared memory.
+ * A segment named "<name>" is the object MATRIX_SHM_PREFIX "<name>": a
+ * header followed by the elements in row-major order. Attaching maps it
+ * read-only, so every process reads the same physical pages without loading
+ * or copying anything.
+ *
+ * Publishing again with the same dimensions rewrites the elements in place,
+ * guarded by a sequence count: it is odd while a publisher writes, and grows
+ * with every publish. Readers take the count before reading and check it
+ * afterwards, and read again if it changed. Publishing with new dimensions
+ * creates a new segment under the name and marks the old one retired;
+ * processes still attached to it keep its last contents until they attach
+ * again.
+ *
+ * Publishers take turns: the one writing records its process ID in the
+ * header, and others wait for it to finish however long that takes. A
+ * publisher that dies mid-write leaves the count odd. Once its process is
+ * gone, readers stop waiting and fail, and the next publisher takes over,
+ * moving the count on by two so that no value the dead writer could have
+ * stored is ever accepted. Waits longer than MATRIX_SHM_WAIT_MS check
+ * whether the writer is still alive rather than spinning.
+ */
+
+#define MATRIX_SHM_PREFIX "/smock."
+#define MATRIX_SHM_MAGIC 0x31534d53u // "SMS1" in little-endian byte order
+#define MATRIX_SHM_WAIT_MS 1000
+
+/*
+ * The start of every segment, padded so the elements start on a cache line
+ *   magic: MATRIX_SHM_MAGIC
+ *   nrows, ncols: Dimensions of the matrix
+ *   retired: Set once the name refers to a newer segment
+ *   seq: Odd while a publisher writes the elements
+ *   writer: Process ID of the publisher writing, 0 if none
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t nrows;
+    uint32_t ncols;
+    uint32_t retired;
+    uint64_t seq;
+    int32_t writer;
+    char pad[36];
+} matrix_shm_header_t;
+
+/*
+ * A segment attached read-only
+ *   header: The mapped header
+ *   data: The elements, right after the header
+ *   map_len: Bytes mapped
+ */
+typedef struct {
+    const matrix_shm_header_t *header;
+    const int *data;
+    size_t map_len;
+} matrix_shm_t;
+
+/*
+ * Publish 'nrows' x 'ncols' elements under 'name', creating the segment or
+ * rewriting it
+ * Returns 0 on success or -1 on error
+ */
+int matrix_shm_publish(const char *name, const int *data, unsigned nrows, unsigned ncols);
+
+/*
+ * Remove 'name'. Processes attached to it keep their mapping.
+ * Returns 0 on success or -1 on error
+ */
+int matrix_shm_unpublish(const char *name);
+
+/*
+ * Map the segment published under 'name' read-only
+ * Returns 0 on success or -1 on error
+ */
+int matrix_shm_attach(matrix_shm_t *shm, const char *name);
+
+/*
+ * Unmap a segment mapped by matrix_shm_attach
+ */
+void matrix_shm_detach(matrix_shm_t *shm);
+
+/*
+ * Start reading the elements, waiting for a publish in progress to finish
+ *   seq: Where the sequence count to pass to matrix_shm_read_retry is stored
+ * Returns 0 on success or -1 if the publisher died before finishing
+ */
+int matrix_shm_read_begin(const matrix_shm_t *shm, uint64_t *seq);
+
+/*
+ * Whether a publish happened since matrix_shm_read_begin returned 'seq', in
+ * which case anything read in between must be read again
+ */
+int matrix_shm_read_retry(const matrix_shm_t *shm, uint64_t seq);
+
+/*
+ * Copy the elements out consistently, retrying around publishes
+ * Returns 0 on success or -1 as for matrix_shm_read_begin
+ */
+int matrix_shm_copy(const matrix_shm_t *shm, int *dest);
+
+#endif // MATRIX_SHM_H
@@ -0,0 +1,170 @@
+#ifndef MATRIX_TYPED_H
+#define MATRIX_TYPED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Matrices with element types other than int. Every element type gets its
+ * own struct and functions, generated from a single definition, so each
+ * kernel is compiled for its exact type and narrow types move less memory.
+ *   Suffix  Element  Sum result
+ *   i8      int8_t   int64_t
+ *   i16     int16_t  int64_t
+ *   i32     int32_t  int64_t
+ *   i64     int64_t  int64_t
+ *   f32     float    double
+ *   f64     double   double
+ * Integer sums overflow if the total does not fit in int64_t, which the checked
+ * sums below detect. The matrix_typed_* macros at the end of this file pick
+ * the function for a matrix from its type, e.g. matrix_typed_sum(mat).
+ */
+
+/*
+ * Element type codes, as stored in typed binary files
+ */
+typedef enum {
+    MATRIX_TYPE_I8 = 1,
+    MATRIX_TYPE_I16,
+    MATRIX_TYPE_I32,
+    MATRIX_TYPE_I64,
+    MATRIX_TYPE_F32,
+    MATRIX_TYPE_F64
+} matrix_elem_type_t;
+
+// First word of a typed binary file. Untyped files start with nrows instead.
+#define MATRIX_TYPED_MAGIC 0x31544d53u // "SMT1" in little-endian byte order
+
+// Nonzero if 'elem_t' is a floating point type
+#define MATRIX_ELEM_IS_FLOAT(elem_t) ((elem_t) 0.5 != 0)
+
+/*
+ * Applies X(suffix, element type, sum type, type code) to every element type
+ */
+#define MATRIX_TYPED_FOR_EACH(X) \
+    MATRIX_TYPED_FOR_EACH_INT(X) \
+    X(f32, float, double, MATRIX_TYPE_F32) \
+    X(f64, double, double, MATRIX_TYPE_F64)
+
+// As MATRIX_TYPED_FOR_EACH, for the integer element types only
+#define MATRIX_TYPED_FOR_EACH_INT(X) \
+    X(i8, int8_t, int64_t, MATRIX_TYPE_I8) \
+    X(i16, int16_t, int64_t, MATRIX_TYPE_I16) \
+    X(i32, int32_t, int64_t, MATRIX_TYPE_I32) \
+    X(i64, int64_t, int64_t, MATRIX_TYPE_I64)
+
+/*
+ * Declares the matrix type and functions for one element type, where S is
+ * the suffix
+ *   matrix_S_t: The elements are one row-major array, unlike matrix_t
+ *   matrix_S_init, matrix_S_free, matrix_S_put, matrix_S_get: As for matrix_t
+ *   matrix_S_sum: Sum of all elements, accumulated in 'acc_t'
+ *   matrix_S_max: Maximum of all elements, or 0 for an empty matrix
+ *   matrix_S_write_text, matrix_S_read_text: Text files in the same format
+ *     as matrix_t. Floating point values are written with full precision,
+ *     and reading fails on an integer that does not fit the element type.
+ *   matrix_S_write_bin, matrix_S_read_bin: Binary files holding
+ *     MATRIX_TYPED_MAGIC, the type code, nrows and ncols, then the elements
+ *     in row-major order. Reading fails if the file has another element type.
+ *   matrix_S_parallel_sum, matrix_S_parallel_max: As matrix_parallel_sum and
+ *     matrix_parallel_max, with 'n_procs' child processes. Partial sums are
+ *     combined in child order, so floating point results do not depend on
+ *     which child finishes first.
+ * Functions returning an int return 0 on success or -1 on error.
+ * matrix_S_parallel_max fails on an empty matrix.
+ */
+#define MATRIX_TYPED_DECLARE(S, elem_t, acc_t, type_code) \
+    typedef struct { \
+        elem_t *data; \
+        unsigned nrows; \
+        unsigned ncols; \
+    } matrix_##S##_t; \
+    matrix_##S##_t *matrix_##S##_init(unsigned nrows, unsigned ncols); \
+    void matrix_##S##_free(matrix_##S##_t *mat); \
+    void matrix_##S##_put(matrix_##S##_t *mat, unsigned i, unsigned j, elem_t val); \
+    elem_t matrix_##S##_get(const matrix_##S##_t *mat, unsigned i, unsigned j); \
+    acc_t matrix_##S##_sum(const matrix_##S##_t *mat); \
+    elem_t matrix_##S##_max(const matrix_##S##_t *mat); \
+    int matrix_##S##_write_text(const matrix_##S##_t *mat, const char *file_name); \
+    matrix_##S##_t *matrix_##S##_read_text(const char *file_name); \
+    int matrix_##S##_write_bin(const matrix_##S##_t *mat, const char *file_name); \
+    matrix_##S##_t *matrix_##S##_read_bin(const char *file_name); \
+    int matrix_##S##_parallel_sum(const matrix_##S##_t *mat, unsigned n_procs, acc_t *result); \
+    int matrix_##S##_parallel_max(const matrix_##S##_t *mat, unsigned n_procs, elem_t *result);
+
+MATRIX_TYPED_FOR_EACH(MATRIX_TYPED_DECLARE)
+
+/*
+ * Declares the checked sum for one integer element type, where S is the suffix
+ *   matrix_S_sum_checked: Stores the sum of all elements in 'result', or
+ *     returns -1 if it does not fit in 'acc_t' where matrix_S_sum would
+ *     overflow. Overflow is checked once per 2^32 elements, so narrow types
+ *     cost the same as matrix_S_sum.
+ */
+#define MATRIX_TYPED_DECLARE_CHECKED(S, elem_t, acc_t, type_code) \
+    int matrix_##S##_sum_checked(const matrix_##S##_t *mat, acc_t *result);
+
+MATRIX_TYPED_FOR_EACH_INT(MATRIX_TYPED_DECLARE_CHECKED)
+
+#ifdef __SIZEOF_INT128__
+// Defined when the compiler has 128-bit integers and matrix_i64_sum_wide exists
+#define MATRIX_HAVE_INT128 1
+
+/*
+ * Exact sum of all elements of an i64 matrix, which cannot overflow for any
+ * matrix that fits in memory
+ */
+__int128 matrix_i64_sum_wide(const matrix_i64_t *mat);
+#endif
+
+/*
+ * Size in bytes of one element of type 'type', or 0 for an unknown type
+ */
+size_t matrix_elem_size(matrix_elem_type_t type);
+
+/*
+ * Convert between type codes and their suffixes ("i8", "f64", ...)
+ * matrix_elem_type_name returns NULL for an unknown type and
+ * matrix_elem_type_parse returns -1 for an unknown name
+ */
+const char *matrix_elem_type_name(matrix_elem_type_t type);
+int matrix_elem_type_parse(const char *name);
+
+/*
+ * Element type of a typed binary file
+ * 'file_name': String storing name of file to inspect
+ * Returns the type code, or -1 if the file cannot be read or is not a typed
+ * binary file
+ */
+int matrix_typed_file_type(const char *file_name);
+
+// Picks matrix_S_<op> from the type of 'mat'.
+#define MATRIX_TYPED_SELECT(mat, op) _Generic((mat), \
+    matrix_i8_t *: matrix_i8_##op, const matrix_i8_t *: matrix_i8_##op, \
+    matrix_i16_t *: matrix_i16_##op, const matrix_i16_t *: matrix_i16_##op, \
+    matrix_i32_t *: matrix_i32_##op, const matrix_i32_t *: matrix_i32_##op, \
+    matrix_i64_t *: matrix_i64_##op, const matrix_i64_t *: matrix_i64_##op, \
+    matrix_f32_t *: matrix_f32_##op, const matrix_f32_t *: matrix_f32_##op, \
+    matrix_f64_t *: matrix_f64_##op, const matrix_f64_t *: matrix_f64_##op)
+
+#define matrix_typed_free(mat) MATRIX_TYPED_SELECT(mat, free)(mat)
+#define matrix_typed_put(mat, i, j, val) MATRIX_TYPED_SELECT(mat, put)(mat, i, j, val)
+#define matrix_typed_get(mat, i, j) MATRIX_TYPED_SELECT(mat, get)(mat, i, j)
+#define matrix_typed_sum(mat) MATRIX_TYPED_SELECT(mat, sum)(mat)
+#define matrix_typed_max(mat) MATRIX_TYPED_SELECT(mat, max)(mat)
+#define matrix_typed_sum_checked(mat, result) _Generic((mat), \
+    matrix_i8_t *: matrix_i8_sum_checked, const matrix_i8_t *: matrix_i8_sum_checked, \
+    matrix_i16_t *: matrix_i16_sum_checked, const matrix_i16_t *: matrix_i16_sum_checked, \
+    matrix_i32_t *: matrix_i32_sum_checked, const matrix_i32_t *: matrix_i32_sum_checked, \
+    matrix_i64_t *: matrix_i64_sum_checked, const matrix_i64_t *: matrix_i64_sum_checked) \
+    (mat, result)
+#define matrix_typed_write_text(mat, file_name) \
+    MATRIX_TYPED_SELECT(mat, write_text)(mat, file_name)
+#define matrix_typed_write_bin(mat, file_name) \
+    MATRIX_TYPED_SELECT(mat, write_bin)(mat, file_name)
+#define matrix_typed_parallel_sum(mat, n_procs, result) \
+    MATRIX_TYPED_SELECT(mat, parallel_sum)(mat, n_procs, result)
+#define matrix_typed_parallel_max(mat, n_procs, result) \
+    MATRIX_TYPED_SELECT(mat, parallel_max)(mat, n_procs, result)
+
+#endif // MATRIX_TYPED_H
@@ -0,0 +1,424 @@
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "matrix.h"
+
+/*
+ * Throughput benchmark for the Multiprocessing backends: serial matrix_sum and
+ * matrix_max from Basic-Matrix-Operations and the forked matrix_parallel_sum
+ * and matrix_parallel_max (matrix_2.c). Multi-threading/smock_bench.c
+ * measures the threaded backends and prints results in the same format.
+ *
+ * Matrices of every size from MIN_ELEMENTS up to the maximum, growing 4x at a
+ * time, are run as square, tall (16 columns) and wide (16 rows) shapes. Each
+ * backend runs 'warmup' untimed and 'reps' timed repetitions for every worker
+ * count, and its results are checked against the serial ones. With pinning
+ * on, a run with N workers is restricted to the first N usable CPUs, and the
+ * child processes it forks inherit that restriction.
+ *
+ * Every row also shows how much of the matrix is backed by huge pages and,
+ * where the hardware counter is available, data TLB load misses per KB
+ * scanned, including those of the forked children. With -H each matrix is
+ * run twice, first on normal pages (SMOCK_HUGE_PAGES=off) and then as
+ * configured, to show what huge pages save.
+ */
+
+#define DEFAULT_REPS 11
+#define DEFAULT_WARMUP 2
+#define DEFAULT_MAX_ELEMENTS (1u << 22)
+#define MIN_ELEMENTS (1u << 16)
+#define NARROW_DIM 16
+
+/*
+ * Benchmark settings from the command line
+ *   reps: Number of timed repetitions per measurement
+ *   warmup: Number of untimed repetitions before them
+ *   max_workers: Largest worker count to run
+ *   max_elements: Largest matrix size, in elements
+ *   pin: Whether to restrict each run to as many CPUs as it has workers
+ *   json: Whether to print JSON instead of a table
+ *   compare_pages: Whether to run each matrix on normal pages first
+ */
+typedef struct {
+    unsigned reps;
+    unsigned warmup;
+    unsigned max_workers;
+    unsigned max_elements;
+    int pin;
+    int json;
+    int compare_pages;
+} bench_opts_t;
+
+/*
+ * One backend and operation under test
+ *   backend, op: Names used in the output
+ *   parallel: Whether the function takes a worker count
+ *   func: Computes the result for 'mat' with 'workers' workers
+ */
+typedef struct {
+    const char *backend;
+    const char *op;
+    int parallel;
+    int (*func)(const matrix_t *mat, unsigned workers, long *result);
+} bench_case_t;
+
+/*
+ * Timing summary of one measurement
+ *   median_ns, p99_ns: Median and 99th percentile time of one repetition
+ *   tlb_misses_per_kb: Data TLB load misses per KB scanned, or -1 if not counted
+ *   correct: Whether every repetition produced the expected result
+ */
+typedef struct {
+    double median_ns;
+    double p99_ns;
+    double tlb_misses_per_kb;
+    int correct;
+} bench_result_t;
+
+static int serial_sum(const matrix_t *mat, unsigned workers, long *result) {
+    *result = matrix_sum(mat);
+    return 0;
+}
+
+static int serial_max(const matrix_t *mat, unsigned workers, long *result) {
+    *result = matrix_max(mat);
+    return 0;
+}
+
+static int fork_sum(const matrix_t *mat, unsigned workers, long *result) {
+    return matrix_parallel_sum(mat, workers, result);
+}
+
+static int fork_max(const matrix_t *mat, unsigned workers, long *result) {
+    int max;
+    if (matrix_parallel_max(mat, workers, &max) != 0) {
+        return -1;
+    }
+    *result = max;
+    return 0;
+}
+
+// Serial cases come first: they provide the expected results and baselines.
+static const bench_case_t cases[] = {
+    {"serial", "sum", 0, serial_sum},
+    {"serial", "max", 0, serial_max},
+    {"fork", "sum", 1, fork_sum},
+    {"fork", "max", 1, fork_max},
+};
+#define N_CASES (sizeof(cases) / sizeof(cases[0]))
+
+// CPUs this process was allowed to run on when it started.
+static cpu_set_t usable_cpus;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Restricts this process and the children it forks to 'n' usable CPUs.
+static int pin_to_cpus(unsigned n) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    unsigned count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < n; cpu++) {
+        if (CPU_ISSET(cpu, &usable_cpus)) {
+            CPU_SET(cpu, &set);
+            count++;
+        }
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Open a counter of data TLB load misses in this thread and in the threads
+ * and processes it creates while the counter is open, starting disabled.
+ * Returns its descriptor, or -1 where the hardware or kernel offers none
+ */
+static int tlb_counter_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Make matrices created from now on use normal pages, or go back to the
+ * huge page setting the benchmark was started with
+ *   configured: That setting, or NULL if SMOCK_HUGE_PAGES was not set
+ */
+static void use_normal_pages(int normal, const char *configured) {
+    if (normal) {
+        setenv("SMOCK_HUGE_PAGES", "off", 1);
+    } else if (configured != NULL) {
+        setenv("SMOCK_HUGE_PAGES", configured, 1);
+    } else {
+        unsetenv("SMOCK_HUGE_PAGES");
+    }
+}
+
+// Fills 'mat' with the same pseudo-random values on every run.
+static void fill_matrix(matrix_t *mat, unsigned seed) {
+    for (unsigned i = 0; i < mat->nrows; i++) {
+        for (unsigned j = 0; j < mat->ncols; j++) {
+            matrix_put(mat, i, j, rand_r(&seed) % 2001 - 1000);
+        }
+    }
+}
+
+static int measure(const bench_case_t *c, const matrix_t *mat, unsigned workers,
+                   long expected, const bench_opts_t *opts, bench_result_t *out) {
+    double *samples = malloc(opts->reps * sizeof(double));
+    if (samples == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    int tlb_fd = tlb_counter_open();
+    out->correct = 1;
+    for (unsigned rep = 0; rep < opts->warmup + opts->reps; rep++) {
+        long result;
+        if (rep == opts->warmup && tlb_fd != -1) {
+            ioctl(tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        double start = now_ns();
+        if (c->func(mat, workers, &result) != 0) {
+            if (tlb_fd != -1) {
+                close(tlb_fd);
+            }
+            free(samples);
+            return -1;
+        }
+        double elapsed = now_ns() - start;
+        if (result != expected) {
+            out->correct = 0;
+        }
+        if (rep >= opts->warmup) {
+            samples[rep - opts->warmup] = elapsed;
+        }
+    }
+
+    out->tlb_misses_per_kb = -1;
+    if (tlb_fd != -1) {
+        uint64_t misses;
+        double kb = (double) mat->nrows * mat->ncols * sizeof(int) / 1024 * opts->reps;
+        if (read(tlb_fd, &misses, sizeof(misses)) == sizeof(misses) && kb > 0) {
+            out->tlb_misses_per_kb = misses / kb;
+        }
+        close(tlb_fd);
+    }
+
+    qsort(samples, opts->reps, sizeof(double), compare_doubles);
+    unsigned mid = opts->reps / 2;
+    out->median_ns = opts->reps % 2 ? samples[mid] : (samples[mid - 1] + samples[mid]) / 2;
+    // Nearest-rank percentile
+    unsigned rank = (opts->reps * 99 + 99) / 100;
+    out->p99_ns = samples[rank - 1];
+    free(samples);
+    return 0;
+}
+
+static void print_result(const bench_opts_t *opts, const bench_case_t *c, const matrix_t *mat,
+                         unsigned workers, const bench_result_t *res, double baseline_ns,
+                         double huge_pct) {
+    static int printed_any = 0;
+    double bytes = (double) mat->nrows * mat->ncols * sizeof(int);
+    double gb_per_s = bytes / res->median_ns;
+    double speedup = baseline_ns / res->median_ns;
+    char tlb[32];
+    snprintf(tlb, sizeof(tlb), "%.3f", res->tlb_misses_per_kb);
+
+    if (opts->json) {
+        printf("%s\n    {\"backend\": \"%s\", \"op\": \"%s\", \"nrows\": %u, \"ncols\": %u, "
+               "\"workers\": %u, \"median_ns\": %.0f, \"p99_ns\": %.0f, "
+               "\"gb_per_s\": %.3f, \"speedup\": %.3f, \"huge_pct\": %.1f, "
+               "\"tlb_misses_per_kb\": %s, \"correct\": %s}",
+               printed_any ? "," : "", c->backend, c->op, mat->nrows, mat->ncols, workers,
+               res->median_ns, res->p99_ns, gb_per_s, speedup, huge_pct,
+               res->tlb_misses_per_kb < 0 ? "null" : tlb, res->correct ? "true" : "false");
+    } else {
+        printf("%-8s %-4s %9u x %-9u %7u %12.1f %12.1f %8.2f %8.2f %6.1f %10s%s\n", c->backend,
+               c->op, mat->nrows, mat->ncols, workers, res->median_ns / 1e3, res->p99_ns / 1e3,
+               gb_per_s, speedup, huge_pct, res->tlb_misses_per_kb < 0 ? "-" : tlb,
+               res->correct ? "" : "  WRONG RESULT");
+    }
+    printed_any = 1;
+}
+
+// Runs every case on one matrix. Returns 0 on success or -1 on error.
+static int bench_matrix(const matrix_t *mat, const bench_opts_t *opts) {
+    long expected[N_CASES];
+    double baseline_ns[N_CASES];
+    size_t size = (size_t) mat->nrows * mat->ncols * sizeof(int);
+    matrix_page_usage_t usage;
+    double huge_pct = 0;
+    if (matrix_page_usage(mat, &usage) == 0 && size > 0) {
+        huge_pct = 100.0 * usage.huge / size;
+    }
+
+    // Serial baselines, on a single CPU
+    if (opts->pin && pin_to_cpus(1) != 0) {
+        return -1;
+    }
+    for (unsigned k = 0; k < N_CASES; k++) {
+        if (cases[k].parallel) {
+            continue;
+        }
+        bench_result_t res;
+        cases[k].func(mat, 1, &expected[k]);
+        if (measure(&cases[k], mat, 1, expected[k], opts, &res) != 0) {
+            return -1;
+        }
+        baseline_ns[k] = res.median_ns;
+        print_result(opts, &cases[k], mat, 1, &res, res.median_ns, huge_pct);
+    }
+
+    // Worker counts double from 1, ending with max_workers itself.
+    unsigned workers = 1;
+    while (1) {
+        if (opts->pin && pin_to_cpus(workers) != 0) {
+            return -1;
+        }
+        for (unsigned k = 0; k < N_CASES; k++) {
+            if (!cases[k].parallel) {
+                continue;
+            }
+            // Compare against the serial case for the same operation.
+            unsigned base = 0;
+            while (cases[base].parallel || strcmp(cases[base].op, cases[k].op) != 0) {
+                base++;
+            }
+            bench_result_t res;
+            if (measure(&cases[k], mat, workers, expected[base], opts, &res) != 0) {
+                return -1;
+            }
+            print_result(opts, &cases[k], mat, workers, &res, baseline_ns[base], huge_pct);
+        }
+        if (workers == opts->max_workers) {
+            break;
+        }
+        workers = workers * 2 < opts->max_workers ? workers * 2 : opts->max_workers;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (sched_getaffinity(0, sizeof(usable_cpus), &usable_cpus) == -1) {
+        perror("sched_getaffinity");
+        return 1;
+    }
+
+    bench_opts_t opts = {DEFAULT_REPS, DEFAULT_WARMUP, CPU_COUNT(&usable_cpus),
+                         DEFAULT_MAX_ELEMENTS, 1, 0, 0};
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:t:s:njH")) != -1) {
+        switch (opt) {
+        case 'r':
+            opts.reps = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            opts.warmup = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            opts.max_workers = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            opts.max_elements = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            opts.pin = 0;
+            break;
+        case 'j':
+            opts.json = 1;
+            break;
+        case 'H':
+            opts.compare_pages = 1;
+            break;
+        default:
+            printf("Usage: %s [-r reps] [-w warmup] [-t max_workers] [-s max_elements] "
+                   "[-n (no CPU pinning)] [-j (JSON output)] [-H (compare with normal pages)]\n",
+                   argv[0]);
+            return 0;
+        }
+    }
+    if (opts.reps == 0 || opts.max_workers == 0 || opts.max_elements < MIN_ELEMENTS) {
+        printf("Error: reps and max_workers must be positive and max_elements at least %u\n",
+               MIN_ELEMENTS);
+        return 1;
+    }
+
+    if (opts.json) {
+        printf("{\"benchmark\": \"smock_bench\", \"cpus\": %d, \"reps\": %u, \"warmup\": %u, "
+               "\"pinned\": %s, \"results\": [", CPU_COUNT(&usable_cpus), opts.reps,
+               opts.warmup, opts.pin ? "true" : "false");
+    } else {
+        printf("%-8s %-4s %21s %7s %12s %12s %8s %8s %6s %10s\n", "backend", "op", "shape",
+               "workers", "median_us", "p99_us", "GB/s", "speedup", "huge%", "tlbmiss/KB");
+    }
+
+    char *configured = getenv("SMOCK_HUGE_PAGES");
+    if (configured != NULL) {
+        configured = strdup(configured);
+    }
+
+    int ret = 0;
+    for (unsigned n = MIN_ELEMENTS; n <= opts.max_elements && ret == 0; n *= 4) {
+        unsigned side = 1;
+        while (side * side < n) {
+            side *= 2;
+        }
+        unsigned shapes[3][2] = {{side, n / side}, {n / NARROW_DIM, NARROW_DIM},
+                                 {NARROW_DIM, n / NARROW_DIM}};
+        for (int s = 0; s < 3 && ret == 0; s++) {
+            // Comparisons run each shape on normal pages first.
+            for (int normal = opts.compare_pages; normal >= 0 && ret == 0; normal--) {
+                if (opts.compare_pages) {
+                    use_normal_pages(normal, configured);
+                }
+                matrix_t *mat = matrix_init(shapes[s][0], shapes[s][1]);
+                if (mat == NULL) {
+                    printf("Matrix creation failed\n");
+                    ret = -1;
+                    break;
+                }
+                fill_matrix(mat, n + s);
+                ret = bench_matrix(mat, &opts);
+                matrix_free(mat);
+            }
+        }
+        if (n > opts.max_elements / 4) {
+            break;
+        }
+    }
+
+    if (opts.json) {
+        printf("\n]}\n");
+    }
+    free(configured);
+    return ret == 0 ? 0 : 1;
+}
@@ -1,11 +1,101 @@
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "matrix.h"
+#include "matrix_shm.h"
 
 #define MAX_INPUT_LEN 128
 #define PROMPT ">> "
 
+// Whether the shell is waiting for a command at the prompt
+static volatile sig_atomic_t at_prompt;
+
+/*
+ * Build a matrix whose rows point into the attached segment 'shm', so reading
+ * it reads the shared pages directly. Header and row pointers share one
+ * malloc'd block, released with release_matrix.
+ * Returns the view, or NULL on failure
+ */
+static matrix_t *shm_view(const matrix_shm_t *shm) {
+    unsigned nrows = shm->header->nrows;
+    unsigned ncols = shm->header->ncols;
+    matrix_t *mat = malloc(sizeof(matrix_t) + nrows * sizeof(int *));
+    if (mat == NULL) {
+        return NULL;
+    }
+    mat->data = (int **) (mat + 1);
+    for (int i = 0; i < nrows; i++) {
+        mat->data[i] = (int *) shm->data + (size_t) i * ncols;
+    }
+    mat->nrows = nrows;
+    mat->ncols = ncols;
+    return mat;
+}
+
+/*
+ * Copy an attached matrix into private memory so it can be modified
+ * Returns the copy, or NULL on failure
+ */
+static matrix_t *shm_private_copy(const matrix_t *view, const matrix_shm_t *shm) {
+    matrix_t *mat = matrix_init(view->nrows, view->ncols);
+    if (mat == NULL) {
+        return NULL;
+    } else if (view->nrows > 0 && matrix_shm_copy(shm, mat->data[0]) != 0) {
+        matrix_free(mat);
+        return NULL;
+    }
+    return mat;
+}
+
+// Free the current matrix, detaching 'shm' if it is a view of that segment.
+static void release_matrix(matrix_t *mat, matrix_shm_t *shm) {
+    if (shm->header != NULL) {
+        free(mat);
+        matrix_shm_detach(shm);
+    } else {
+        matrix_free(mat);
+    }
+}
+
+// Start reading the current matrix. A private matrix never changes under a read.
+static int read_begin(const matrix_shm_t *shm, uint64_t *seq) {
+    return shm->header == NULL ? 0 : matrix_shm_read_begin(shm, seq);
+}
+
+// Whether the current matrix was republished during a read, which must then be repeated
+static int read_retry(const matrix_shm_t *shm, uint64_t seq) {
+    return shm->header != NULL && matrix_shm_read_retry(shm, seq);
+}
+
+// Ctrl-C stops the running query instead of the shell.
+static void on_interrupt(int sig) {
+    (void) sig;
+    cancel_interrupt();
+    if (at_prompt) {
+        // Nothing is running, so just start a fresh line.
+        ssize_t ret = write(STDOUT_FILENO, "\n" PROMPT, sizeof("\n" PROMPT) - 1);
+        (void) ret;
+    }
+}
+
+// Prints why a query failed: 'message' unless it was cancelled.
+static void print_query_failure(const cancel_token_t *cancel, const char *message) {
+    switch (cancel_requested(cancel)) {
+    case CANCEL_REQUESTED:
+        printf("Query cancelled\n");
+        break;
+    case CANCEL_DEADLINE:
+        printf("Query timed out\n");
+        break;
+    case CANCEL_NONE:
+        printf("%s\n", message);
+        break;
+    }
+}
+
 int main(int argc, char *argv[]) {
     int file_given = argc-1; //Two arguments means file was given; One means it wasn't.
     FILE *input_file;
@@ -32,16 +122,44 @@ int main(int argc, char *argv[]) {
         printf("  read_bin <file_name>: Read current matrix from a binary file\n");
         printf("  parallel_sum <n_procs>: Compute matrix sum with multiple processes\n");
         printf("  parallel_max <n_procs>: Compute matrix max with multiple processes\n");
+        printf("  timeout <milliseconds>: Stop parallel_sum and parallel_max after this long,\n"
+               "    0 for no limit. Ctrl-C stops the running query.\n");
+        printf("  pages: Show how much of the current matrix is backed by huge pages\n");
+        printf("  publish <name>: Share current matrix with other processes through shared memory\n");
+        printf("  attach <name>: Use the shared matrix <name> read-only as current matrix\n");
+        printf("  unpublish <name>: Remove the shared matrix <name>\n");
         printf("  exit: Quit this program\n");
         input_file = stdin; //Any file reference will only reference the terminal.
     }
     char input[MAX_INPUT_LEN];
     matrix_t *mat = NULL;
+    // Segment 'mat' reads from while attached; header is NULL for a private matrix
+    matrix_shm_t shm = {0};
+    uint64_t seq;
+    int err;
+    // Time a query may run before it is stopped, 0 for no limit
+    unsigned timeout_ms = 0;
+    cancel_token_t cancel;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_interrupt;
+    action.sa_flags = SA_RESTART; // Reads at the prompt carry on after Ctrl-C
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGINT, &action, NULL) == -1) {
+        perror("sigaction");
+    }
+
     while (1) { // Keep reading until we break out of loop
-        if (!file_given)
+        if (!file_given) {
             printf("%s", PROMPT);
+            fflush(stdout);
+        }
 
-        if (fscanf(input_file,"%s", input) == EOF) {
+        at_prompt = !file_given;
+        int scanned = fscanf(input_file,"%s", input);
+        at_prompt = 0;
+        if (scanned == EOF) {
             printf("\n");
             break;
         }
@@ -77,7 +195,7 @@ int main(int argc, char *argv[]) {
             if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
-                matrix_free(mat);
+                release_matrix(mat, &shm);
                 mat = NULL;
             }
         }
@@ -117,6 +235,16 @@ int main(int argc, char *argv[]) {
             if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
+                if (shm.header != NULL) {
+                    // Attached matrices are read-only, so modify a private copy.
+                    matrix_t *copy = shm_private_copy(mat, &shm);
+                    if (copy == NULL) {
+                        printf("Failed to copy shared matrix\n");
+                        continue;
+                    }
+                    release_matrix(mat, &shm);
+                    mat = copy;
+                }
                 matrix_put(mat, i, j, val);
             }
         }
@@ -125,7 +253,18 @@ int main(int argc, char *argv[]) {
             if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
-                printf("%ld\n", matrix_sum(mat));
+                long sum;
+                while ((err = read_begin(&shm, &seq)) == 0) {
+                    sum = matrix_sum(mat);
+                    if (!read_retry(&shm, seq)) {
+                        break;
+                    }
+                }
+                if (err != 0) {
+                    printf("Error: The shared matrix's publisher died mid-write\n");
+                } else {
+                    printf("%ld\n", sum);
+                }
             }
         }
 
@@ -133,7 +272,18 @@ int main(int argc, char *argv[]) {
             if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
-                printf("%d\n", matrix_max(mat));
+                int max;
+                while ((err = read_begin(&shm, &seq)) == 0) {
+                    max = matrix_max(mat);
+                    if (!read_retry(&shm, seq)) {
+                        break;
+                    }
+                }
+                if (err != 0) {
+                    printf("Error: The shared matrix's publisher died mid-write\n");
+                } else {
+                    printf("%d\n", max);
+                }
             }
         }
 
@@ -194,15 +344,29 @@ int main(int argc, char *argv[]) {
         else if (strcmp("parallel_sum", input) == 0) {
             // Still have to read these even if no active matrix
             unsigned n_procs;
-            int result;
+            long result;
             fscanf(input_file,"%d",&n_procs);
             if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else if (n_procs == 0) {
                 printf("Error: Invalid n_procs argument\n");
             } else {
-                matrix_parallel_sum(mat,n_procs,&result);
-                printf("%d\n",result);
+                // Children of an attached matrix read the shared segment itself.
+                int ret = 0;
+                cancel_token_init(&cancel, timeout_ms);
+                while ((err = read_begin(&shm, &seq)) == 0) {
+                    ret = matrix_parallel_sum_cancel(mat,n_procs,&cancel,&result);
+                    if (ret != 0 || !read_retry(&shm, seq)) {
+                        break;
+                    }
+                }
+                if (err != 0) {
+                    printf("Error: The shared matrix's publisher died mid-write\n");
+                } else if (ret != 0) {
+                    print_query_failure(&cancel, "Matrix parallel sum failed");
+                } else {
+                    printf("%ld\n",result);
+                }
             }
         }
 
@@ -216,8 +380,74 @@ int main(int argc, char *argv[]) {
             } else if (n_procs == 0) {
                 printf("Error: Invalid n_procs argument\n");
             } else {
-                matrix_parallel_max(mat,n_procs,&result);
-                printf("%d\n", result);
+                int ret = 0;
+                cancel_token_init(&cancel, timeout_ms);
+                while ((err = read_begin(&shm, &seq)) == 0) {
+                    ret = matrix_parallel_max_cancel(mat,n_procs,&cancel,&result);
+                    if (ret != 0 || !read_retry(&shm, seq)) {
+                        break;
+                    }
+                }
+                if (err != 0) {
+                    printf("Error: The shared matrix's publisher died mid-write\n");
+                } else if (ret != 0) {
+                    print_query_failure(&cancel, "Matrix parallel max failed");
+                } else {
+                    printf("%d\n", result);
+                }
+            }
+        }
+
+        else if (strcmp("timeout", input) == 0) {
+            if (fscanf(input_file,"%u",&timeout_ms) != 1) {
+                printf("Error: Usage: timeout <milliseconds>\n");
+            }
+        }
+
+        else if (strcmp("pages", input) == 0) {
+            matrix_page_usage_t usage;
+            if (mat == NULL) {
+                printf("Error: There is no active matrix\n");
+            } else if (matrix_page_usage(mat, &usage) != 0) {
+                printf("Failed to read page usage\n");
+            } else {
+                printf("%zu KB mapped, %zu KB resident, %zu KB in huge pages (%.0f%%)\n",
+                       usage.mapped / 1024, usage.resident / 1024, usage.huge / 1024,
+                       usage.mapped ? 100.0 * usage.huge / usage.mapped : 0.0);
+            }
+        }
+
+        else if (strcmp("publish", input) == 0) {
+            fscanf(input_file,"%s", input); // Read in segment name
+            if (mat == NULL) {
+                printf("Error: There is no active matrix\n");
+            } else {
+                const int *data = mat->nrows > 0 ? mat->data[0] : NULL;
+                if (matrix_shm_publish(input, data, mat->nrows, mat->ncols) != 0) {
+                    printf("Failed to publish matrix '%s'\n", input);
+                }
+            }
+        }
+
+        else if (strcmp("attach", input) == 0) {
+            fscanf(input_file,"%s", input); // Read in segment name
+            if (mat != NULL) {
+                printf("Error: You must clear the current matrix first\n");
+            } else if (matrix_shm_attach(&shm, input) != 0) {
+                printf("Failed to attach shared matrix '%s'\n", input);
+            } else {
+                mat = shm_view(&shm);
+                if (mat == NULL) {
+                    printf("Failed to attach shared matrix '%s'\n", input);
+                    matrix_shm_detach(&shm);
+                }
+            }
+        }
+
+        else if (strcmp("unpublish", input) == 0) {
+            fscanf(input_file,"%s", input); // Read in segment name
+            if (matrix_shm_unpublish(input) != 0) {
+                printf("Failed to unpublish matrix '%s'\n", input);
             }
         }
 
@@ -227,7 +457,7 @@ int main(int argc, char *argv[]) {
     }
 
     if (mat != NULL) {
-        matrix_free(mat);
+        release_matrix(mat, &shm);
     }
 
     fclose(input_file);
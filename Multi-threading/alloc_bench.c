@@ -0,0 +1,168 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "matrix.h"
+#include "matrix_alloc.h"
+
+/*
+ * Allocation-rate and memory benchmark for the matrix allocator.
+ * Each thread repeatedly creates a batch of small matrices of random shape
+ * and frees them again, first through matrix_init/matrix_free and then with
+ * the two plain mallocs the allocator replaced. After that, a few large
+ * matrices are created to report how much of them is huge page backed.
+ */
+
+#define BATCH_SIZE 64
+#define MAX_SMALL_DIM 32
+#define N_LARGE 4
+#define LARGE_DIM 4096
+
+/*
+ * Work description for one benchmark thread
+ *   iterations: Number of batches to allocate and free
+ *   seed: Seed for the thread's random matrix shapes
+ *   use_allocator: Whether to use matrix_init or plain malloc
+ */
+typedef struct {
+    unsigned iterations;
+    unsigned seed;
+    int use_allocator;
+} bench_task_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Resident set size in kilobytes, read from /proc/self/statm.
+static long rss_kb(void) {
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    if (fscanf(f, "%*s %ld", &pages) != 1) {
+        pages = -1;
+    }
+    fclose(f);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// AnonHugePages of the whole process in kilobytes, or -1 if unavailable.
+static long anon_huge_kb(void) {
+    char line[256];
+    long kb = -1;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+static void *bench_thread(void *arg) {
+    bench_task_t *task = arg;
+    unsigned seed = task->seed;
+    matrix_t *mats[BATCH_SIZE];
+    int *data[BATCH_SIZE];
+
+    for (unsigned iter = 0; iter < task->iterations; iter++) {
+        for (int k = 0; k < BATCH_SIZE; k++) {
+            unsigned nrows = rand_r(&seed) % MAX_SMALL_DIM + 1;
+            unsigned ncols = rand_r(&seed) % MAX_SMALL_DIM + 1;
+            if (task->use_allocator) {
+                mats[k] = matrix_init(nrows, ncols);
+                mats[k]->data[0] = k;
+            } else {
+                // What matrix_init did before: header and data separately.
+                mats[k] = malloc(sizeof(matrix_t));
+                data[k] = malloc((size_t) nrows * ncols * sizeof(int));
+                data[k][0] = k;
+            }
+        }
+        for (int k = 0; k < BATCH_SIZE; k++) {
+            if (task->use_allocator) {
+                matrix_free(mats[k]);
+            } else {
+                free(data[k]);
+                free(mats[k]);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Returns matrix create/free pairs per second over all threads.
+static double run_small(unsigned n_threads, unsigned iterations, int use_allocator) {
+    pthread_t threads[n_threads];
+    bench_task_t tasks[n_threads];
+
+    double start = now_seconds();
+    for (unsigned i = 0; i < n_threads; i++) {
+        tasks[i].iterations = iterations;
+        tasks[i].seed = i + 1;
+        tasks[i].use_allocator = use_allocator;
+        pthread_create(&threads[i], NULL, bench_thread, &tasks[i]);
+    }
+    for (unsigned i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    return (double) n_threads * iterations * BATCH_SIZE / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Usage: %s <max_threads> <iterations>\n", argv[0]);
+        return 0;
+    }
+    unsigned max_threads = atoi(argv[1]);
+    unsigned iterations = atoi(argv[2]);
+    if (max_threads == 0 || iterations == 0) {
+        printf("Error: Arguments must be positive\n");
+        return 1;
+    }
+
+    printf("%8s %16s %16s %10s %10s\n", "threads", "malloc ops/s", "matrix ops/s",
+           "speedup", "rss_kb");
+    for (unsigned n = 1; n <= max_threads; n *= 2) {
+        double base = run_small(n, iterations, 0);
+        double pooled = run_small(n, iterations, 1);
+        printf("%8u %16.0f %16.0f %10.2f %10ld\n", n, base, pooled, pooled / base, rss_kb());
+    }
+
+    // Large matrices: touch every page so they are actually resident.
+    matrix_t *large[N_LARGE];
+    long rss_before = rss_kb();
+    for (int i = 0; i < N_LARGE; i++) {
+        large[i] = matrix_init(LARGE_DIM, LARGE_DIM);
+        if (large[i] == NULL) {
+            printf("Large matrix allocation failed\n");
+            return 1;
+        }
+        memset(large[i]->data, 1, (size_t) LARGE_DIM * LARGE_DIM * sizeof(int));
+    }
+
+    matrix_alloc_stats_t stats;
+    matrix_alloc_get_stats(&stats);
+    printf("\n%d large %ux%u matrices: rss +%ld kB, AnonHugePages %ld kB\n", N_LARGE,
+           LARGE_DIM, LARGE_DIM, rss_kb() - rss_before, anon_huge_kb());
+    printf("allocator: %lu small allocs (%lu lock-free), %zu slab bytes, "
+           "%zu large bytes (%zu MAP_HUGETLB, %zu THP)\n",
+           stats.small_allocs, stats.thread_cache_hits, stats.slab_bytes,
+           stats.large_bytes, stats.huge_tlb_bytes, stats.thp_bytes);
+
+    for (int i = 0; i < N_LARGE; i++) {
+        matrix_free(large[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "instrument.h"
+
+// Commands ahead of the oldest unprinted one that may start, per worker.
+// Bounds the output held in memory and how far loads run ahead.
+#define BATCH_WINDOW_PER_WORKER 4
+#define BATCH_WORDS " \t\r"
+
+enum { WAITING, RUNNING, DONE };
+
+// Key of the state every command reads and barrier commands write
+static const char *ALL_STATE = "*";
+// Pads out values missing at the end of a script
+static char ZERO_VALUE[] = "0";
+
+/*
+ * Last use of one piece of state while building dependencies
+ *   key: The state's access key, or NULL for an empty slot
+ *   last_writer: The last command that wrote it, or -1
+ *   readers: Commands that read it since then
+ */
+typedef struct {
+    const char *key;
+    int last_writer;
+    unsigned *readers;
+    unsigned n_readers;
+    unsigned readers_cap;
+} resource_use_t;
+
+/*
+ * State shared by the thread running a script and its workers
+ *   script, session, run, ctx: As passed to batch_run
+ *   mutex: Protects the scheduling fields of every command and the fields below
+ *   changed: Signaled whenever a command finishes
+ *   n_running: Number of commands started but not finished
+ *   stop: Set once a command asks for the script to stop
+ *   window_start: Index of the oldest command not yet printed
+ */
+typedef struct {
+    batch_script_t *script;
+    session_t *session;
+    batch_run_t run;
+    void *ctx;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    unsigned n_running;
+    int stop;
+    unsigned window_start;
+} batch_engine_t;
+
+/*
+ * Argument of a command run on a worker
+ */
+typedef struct {
+    batch_engine_t *engine;
+    batch_command_t *cmd;
+} batch_task_t;
+
+// FNV-1a, as used by the session.
+static unsigned long hash_key(const char *key) {
+    unsigned long hash = 14695981039346656037UL;
+    for (; *key != '\0'; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static char *read_all(FILE *in) {
+    size_t cap = 4096;
+    size_t len = 0;
+    char *text = malloc(cap);
+    if (text == NULL) {
+        return NULL;
+    }
+    while (1) {
+        if (len + 1 == cap) {
+            char *bigger = realloc(text, cap * 2);
+            if (bigger == NULL) {
+                free(text);
+                return NULL;
+            }
+            text = bigger;
+            cap *= 2;
+        }
+        size_t n = fread(text + len, 1, cap - len - 1, in);
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    if (ferror(in)) {
+        perror("fread");
+        free(text);
+        return NULL;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+// Cuts the next line out of the text at '*pos' and moves past it. Returns NULL at the end.
+static char *next_line(char **pos) {
+    char *line = *pos;
+    if (*line == '\0') {
+        return NULL;
+    }
+    char *end = strchr(line, '\n');
+    if (end == NULL) {
+        *pos = line + strlen(line);
+    } else {
+        *end = '\0';
+        *pos = end + 1;
+    }
+    return line;
+}
+
+static int push_word(batch_command_t *cmd, unsigned *cap, char *word) {
+    if ((unsigned) cmd->n_args == *cap) {
+        unsigned new_cap = *cap == 0 ? 8 : *cap * 2;
+        char **args = realloc(cmd->args, new_cap * sizeof(char *));
+        if (args == NULL) {
+            return -1;
+        }
+        cmd->args = args;
+        *cap = new_cap;
+    }
+    cmd->args[cmd->n_args++] = word;
+    return 0;
+}
+
+/*
+ * Appends at most 'max' words of 'line' to the command's words
+ * Returns the number of words appended, or -1 on error
+ */
+static long split_words(batch_command_t *cmd, unsigned *cap, char *line, unsigned long max) {
+    unsigned long n = 0;
+    char *save;
+    for (char *tok = strtok_r(line, BATCH_WORDS, &save); tok != NULL && n < max;
+         tok = strtok_r(NULL, BATCH_WORDS, &save)) {
+        if (push_word(cmd, cap, tok) != 0) {
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Appends up to 'max' values from 'line' to the command's words. As with
+ * scanf("%d"), values stop at the first word that does not start with an
+ * integer, in which case '*stopped' is set.
+ * Returns the number of values appended, or -1 on error
+ */
+static long take_values(batch_command_t *cmd, unsigned *cap, char *line, unsigned long max,
+                        int *stopped) {
+    unsigned long n = 0;
+    char *save;
+    for (char *tok = strtok_r(line, BATCH_WORDS, &save); tok != NULL && n < max;
+         tok = strtok_r(NULL, BATCH_WORDS, &save)) {
+        char *end;
+        strtol(tok, &end, 10);
+        if (end == tok) {
+            *stopped = 1;
+            break;
+        }
+        if (push_word(cmd, cap, tok) != 0) {
+            return -1;
+        }
+        n++;
+        if (*end != '\0') {
+            *stopped = 1;
+            break;
+        }
+    }
+    return n;
+}
+
+static int push_command(batch_script_t *script, unsigned *cap, batch_command_t *cmd) {
+    if (script->n_commands == *cap) {
+        unsigned new_cap = *cap == 0 ? 64 : *cap * 2;
+        batch_command_t *commands = realloc(script->commands, new_cap * sizeof(batch_command_t));
+        if (commands == NULL) {
+            return -1;
+        }
+        script->commands = commands;
+        *cap = new_cap;
+    }
+    script->commands[script->n_commands++] = *cmd;
+    return 0;
+}
+
+int batch_read(batch_script_t *script, FILE *in, batch_input_values_t input_values) {
+    script->commands = NULL;
+    script->n_commands = 0;
+    script->text = read_all(in);
+    if (script->text == NULL) {
+        return -1;
+    }
+
+    unsigned commands_cap = 0;
+    unsigned line_num = 0;
+    char *pos = script->text;
+    char *line;
+    while ((line = next_line(&pos)) != NULL) {
+        line_num++;
+        batch_command_t cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.line = line_num;
+        unsigned words_cap = 0;
+        if (split_words(&cmd, &words_cap, line, -1UL) == -1) {
+            free(cmd.args);
+            batch_free(script);
+            return -1;
+        }
+        if (cmd.n_args == 0) {
+            continue;
+        }
+
+        // Values the command reads from the following lines become more of its words.
+        unsigned long needed = input_values(cmd.n_args, cmd.args);
+        int err = 0;
+        int stopped = 0;
+        while (needed > 0 && !err && !stopped && (line = next_line(&pos)) != NULL) {
+            line_num++;
+            long n = take_values(&cmd, &words_cap, line, needed, &stopped);
+            err = n == -1;
+            needed -= err ? 0 : n;
+        }
+        for (; needed > 0 && !err; needed--) {
+            err = push_word(&cmd, &words_cap, ZERO_VALUE);
+        }
+
+        if (err || push_command(script, &commands_cap, &cmd) != 0) {
+            free(cmd.args);
+            batch_free(script);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void batch_free(batch_script_t *script) {
+    for (unsigned i = 0; i < script->n_commands; i++) {
+        batch_command_t *cmd = &script->commands[i];
+        for (unsigned a = 0; a < cmd->n_accesses; a++) {
+            free(cmd->accesses[a].key);
+        }
+        free(cmd->accesses);
+        free(cmd->args);
+        free(cmd->dependents);
+        free(cmd->output);
+    }
+    free(script->commands);
+    free(script->text);
+    script->commands = NULL;
+    script->n_commands = 0;
+    script->text = NULL;
+}
+
+int batch_access(batch_command_t *cmd, batch_resource_t kind, const char *name, int write) {
+    static const char kind_codes[] = {'m', 'c', 'f', 's'};
+    if (kind == BATCH_CURRENT) {
+        name = "";
+    }
+    char *key = malloc(strlen(name) + 2);
+    if (key == NULL) {
+        return -1;
+    }
+    key[0] = kind_codes[kind];
+    strcpy(key + 1, name);
+
+    batch_access_t *accesses = realloc(cmd->accesses,
+                                       (cmd->n_accesses + 1) * sizeof(batch_access_t));
+    if (accesses == NULL) {
+        free(key);
+        return -1;
+    }
+    cmd->accesses = accesses;
+    cmd->accesses[cmd->n_accesses].key = key;
+    cmd->accesses[cmd->n_accesses].write = write;
+    cmd->n_accesses++;
+    return 0;
+}
+
+// Makes command 'to' wait for command 'from'.
+static int add_dependency(batch_script_t *script, unsigned from, unsigned to) {
+    batch_command_t *src = &script->commands[from];
+    if (from == to || (src->n_dependents > 0 && src->dependents[src->n_dependents - 1] == to)) {
+        return 0;
+    }
+    unsigned *dependents = realloc(src->dependents, (src->n_dependents + 1) * sizeof(unsigned));
+    if (dependents == NULL) {
+        return -1;
+    }
+    src->dependents = dependents;
+    src->dependents[src->n_dependents++] = to;
+    script->commands[to].n_deps++;
+    return 0;
+}
+
+static resource_use_t *find_use(resource_use_t *uses, unsigned n_slots, const char *key) {
+    unsigned idx = hash_key(key) & (n_slots - 1);
+    while (uses[idx].key != NULL && strcmp(uses[idx].key, key) != 0) {
+        idx = (idx + 1) & (n_slots - 1);
+    }
+    if (uses[idx].key == NULL) {
+        uses[idx].key = key;
+        uses[idx].last_writer = -1;
+    }
+    return &uses[idx];
+}
+
+/*
+ * Command 'idx' uses some state: it waits for the last command that wrote
+ * it, and if it writes the state too, for every command that read it since.
+ */
+static int use_state(batch_script_t *script, resource_use_t *use, unsigned idx, int write) {
+    if (use->last_writer >= 0 && add_dependency(script, use->last_writer, idx) != 0) {
+        return -1;
+    }
+    if (write) {
+        for (unsigned r = 0; r < use->n_readers; r++) {
+            if (add_dependency(script, use->readers[r], idx) != 0) {
+                return -1;
+            }
+        }
+        use->n_readers = 0;
+        use->last_writer = idx;
+        return 0;
+    }
+    if (use->n_readers == use->readers_cap) {
+        unsigned new_cap = use->readers_cap == 0 ? 4 : use->readers_cap * 2;
+        unsigned *readers = realloc(use->readers, new_cap * sizeof(unsigned));
+        if (readers == NULL) {
+            return -1;
+        }
+        use->readers = readers;
+        use->readers_cap = new_cap;
+    }
+    use->readers[use->n_readers++] = idx;
+    return 0;
+}
+
+// Finds which earlier commands each command has to wait for.
+static int build_dependencies(batch_script_t *script) {
+    // Keep the table at most half full.
+    unsigned long n_keys = 1;
+    for (unsigned i = 0; i < script->n_commands; i++) {
+        n_keys += script->commands[i].n_accesses;
+    }
+    unsigned n_slots = 16;
+    while (n_slots < 2 * n_keys) {
+        n_slots *= 2;
+    }
+    resource_use_t *uses = calloc(n_slots, sizeof(resource_use_t));
+    if (uses == NULL) {
+        return -1;
+    }
+
+    int ret_val = 0;
+    resource_use_t *all = find_use(uses, n_slots, ALL_STATE);
+    for (unsigned i = 0; i < script->n_commands && ret_val == 0; i++) {
+        batch_command_t *cmd = &script->commands[i];
+        ret_val = use_state(script, all, i, cmd->barrier);
+        for (unsigned a = 0; a < cmd->n_accesses && ret_val == 0; a++) {
+            resource_use_t *use = find_use(uses, n_slots, cmd->accesses[a].key);
+            ret_val = use_state(script, use, i, cmd->accesses[a].write);
+        }
+    }
+
+    for (unsigned i = 0; i < n_slots; i++) {
+        free(uses[i].readers);
+    }
+    free(uses);
+    return ret_val;
+}
+
+// Keeps every matrix used by a running command resident. Called with the engine's mutex held.
+static void update_hold(batch_engine_t *engine, unsigned window_end) {
+    unsigned long oldest = 0;
+    for (unsigned i = engine->window_start; i < window_end; i++) {
+        batch_command_t *cmd = &engine->script->commands[i];
+        if (cmd->state == RUNNING && (oldest == 0 || cmd->ticket < oldest)) {
+            oldest = cmd->ticket;
+        }
+    }
+    session_hold(engine->session, oldest);
+}
+
+// Runs a command into its output buffer and releases the commands waiting for it.
+static void run_one(batch_engine_t *engine, batch_command_t *cmd) {
+    int stop = 0;
+    FILE *out = open_memstream(&cmd->output, &cmd->output_len);
+    if (out == NULL) {
+        perror("open_memstream");
+    } else {
+        INSTR_START(start);
+        stop = engine->run(engine->ctx, cmd->n_args, cmd->args, out);
+        INSTR_RECORD_COMMAND(cmd->args[0], start);
+        fclose(out);
+    }
+
+    pthread_mutex_lock(&engine->mutex);
+    cmd->state = DONE;
+    for (unsigned d = 0; d < cmd->n_dependents; d++) {
+        engine->script->commands[cmd->dependents[d]].n_deps--;
+    }
+    engine->n_running--;
+    if (stop) {
+        engine->stop = 1;
+    }
+    pthread_cond_signal(&engine->changed);
+    pthread_mutex_unlock(&engine->mutex);
+}
+
+static void run_task(void *arg) {
+    batch_task_t *task = arg;
+    run_one(task->engine, task->cmd);
+}
+
+int batch_run(batch_script_t *script, session_t *session, worker_pool_t *pool,
+              batch_run_t run, void *ctx, FILE *out) {
+    if (build_dependencies(script) != 0) {
+        return -1;
+    }
+    batch_task_t *tasks = malloc((script->n_commands + 1) * sizeof(batch_task_t));
+    if (tasks == NULL) {
+        return -1;
+    }
+    batch_engine_t engine = {.script = script, .session = session, .run = run, .ctx = ctx};
+    int err = pthread_mutex_init(&engine.mutex, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(err));
+        free(tasks);
+        return -1;
+    }
+    err = pthread_cond_init(&engine.changed, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_cond_init: %s\n", strerror(err));
+        pthread_mutex_destroy(&engine.mutex);
+        free(tasks);
+        return -1;
+    }
+
+    unsigned window = pool->size * BATCH_WINDOW_PER_WORKER;
+    pthread_mutex_lock(&engine.mutex);
+    while (engine.window_start < script->n_commands) {
+        batch_command_t *oldest = &script->commands[engine.window_start];
+        if (oldest->state == DONE) {
+            // Output is written in script order, without holding up the workers.
+            pthread_mutex_unlock(&engine.mutex);
+            fwrite(oldest->output, 1, oldest->output_len, out);
+            free(oldest->output);
+            oldest->output = NULL;
+            pthread_mutex_lock(&engine.mutex);
+            engine.window_start++;
+            continue;
+        }
+        if (engine.stop) {
+            break;
+        }
+
+        unsigned window_end = engine.window_start + window;
+        if (window_end > script->n_commands) {
+            window_end = script->n_commands;
+        }
+        int started = 0;
+        for (unsigned i = engine.window_start; i < window_end && !engine.stop &&
+             engine.n_running < pool->size; i++) {
+            batch_command_t *cmd = &script->commands[i];
+            if (cmd->state != WAITING || cmd->n_deps > 0) {
+                continue;
+            }
+            cmd->state = RUNNING;
+            cmd->ticket = session_next_command(session);
+            engine.n_running++;
+            update_hold(&engine, window_end);
+            started = 1;
+
+            // Workers need the mutex to finish, so never block on the queue holding it.
+            pthread_mutex_unlock(&engine.mutex);
+            tasks[i].engine = &engine;
+            tasks[i].cmd = cmd;
+            if (cmd->barrier || worker_pool_submit(pool, run_task, &tasks[i]) != 0) {
+                // Barriers may use the pool themselves, so they run here.
+                run_one(&engine, cmd);
+            }
+            pthread_mutex_lock(&engine.mutex);
+        }
+        if (!started) {
+            update_hold(&engine, window_end);
+            pthread_cond_wait(&engine.changed, &engine.mutex);
+        }
+    }
+    // Only a barrier can stop the script, so nothing is left running.
+    pthread_mutex_unlock(&engine.mutex);
+    session_hold(session, 0);
+
+    pthread_cond_destroy(&engine.changed);
+    pthread_mutex_destroy(&engine.mutex);
+    free(tasks);
+    return 0;
+}
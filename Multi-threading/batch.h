@@ -0,0 +1,132 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "session.h"
+#include "worker_pool.h"
+
+/*
+ * Batch execution of shell scripts. The whole script is read and split into
+ * commands up front. Each command then declares which named matrices, files
+ * and other state it reads and writes, and commands that do not conflict
+ * with any earlier unfinished command run at once on a worker pool. Loads
+ * therefore start while earlier commands are still computing, but every
+ * command's output is buffered and written in script order, so the output
+ * is the same as running the script one command at a time.
+ */
+
+/*
+ * Kinds of state a command can read or write
+ */
+typedef enum {
+    BATCH_MATRIX,   // A named matrix
+    BATCH_CURRENT,  // The current (unnamed) matrix
+    BATCH_FILE,     // A file, by path as written in the script
+    BATCH_SEGMENT,  // A shared memory segment, by name
+} batch_resource_t;
+
+/*
+ * One use of a piece of state by a command
+ *   key: Kind of state followed by its name
+ *   write: Whether the command modifies it
+ */
+typedef struct {
+    char *key;
+    int write;
+} batch_access_t;
+
+/*
+ * One command of a script
+ *   args, n_args: The command's words, pointing into the script's text
+ *   line: Line number of the command in the script, from 1
+ *   accesses, n_accesses: State the command uses
+ *   barrier: Whether the command must run alone, after every earlier command
+ *     and before every later one
+ *   dependents, n_dependents: Later commands that must wait for this one
+ *   n_deps: Number of unfinished earlier commands this one waits for
+ *   state, ticket: Scheduling state and session clock value when started
+ *   output, output_len: Everything the command printed
+ */
+typedef struct {
+    char **args;
+    int n_args;
+    unsigned line;
+    batch_access_t *accesses;
+    unsigned n_accesses;
+    int barrier;
+    unsigned *dependents;
+    unsigned n_dependents;
+    unsigned n_deps;
+    int state;
+    unsigned long ticket;
+    char *output;
+    size_t output_len;
+} batch_command_t;
+
+/*
+ * A script split into commands
+ *   text: The script's contents, split into words in place
+ *   commands, n_commands: The script's commands in order
+ */
+typedef struct {
+    char *text;
+    batch_command_t *commands;
+    unsigned n_commands;
+} batch_script_t;
+
+/*
+ * Returns how many values a command reads from the lines after it, like
+ * 'new' does for matrix elements not given on its own line
+ */
+typedef unsigned (*batch_input_values_t)(int n_args, char **args);
+
+/*
+ * Runs one command, writing its results to 'out'
+ * Returns 1 if the script should stop, 0 otherwise
+ */
+typedef int (*batch_run_t)(void *ctx, int n_args, char **args, FILE *out);
+
+/*
+ * Read a whole script and split it into commands, skipping blank lines
+ *   script: The script to initialize
+ *   in: Stream to read the script from
+ *   input_values: Number of extra values each command takes from the
+ *     following lines. They are appended to its words, and the rest of the
+ *     line holding the last one is ignored. As with scanf("%d"), values end
+ *     at the first word that is not an integer or at the end of the script,
+ *     and any still missing are "0".
+ * Returns 0 on success or -1 on error
+ */
+int batch_read(batch_script_t *script, FILE *in, batch_input_values_t input_values);
+
+/*
+ * Free a script and everything its commands hold
+ */
+void batch_free(batch_script_t *script);
+
+/*
+ * Record that a command reads or writes a piece of state. Commands with no
+ * recorded state never wait for others, unless marked as a barrier.
+ *   cmd: The command
+ *   kind, name: The state, where 'name' is ignored for BATCH_CURRENT
+ *   write: Whether the command modifies it
+ * Returns 0 on success or -1 on error
+ */
+int batch_access(batch_command_t *cmd, batch_resource_t kind, const char *name, int write);
+
+/*
+ * Run a script whose commands have all had their state recorded
+ *   script: The script to run
+ *   session: Session the commands use, so matrices stay resident while
+ *     commands using them run
+ *   pool: Workers to run commands on. Barrier commands run on the calling
+ *     thread, so only they may use the pool themselves.
+ *   run, ctx: Runs one command
+ *   out: Where the output of every command is written, in script order
+ * Returns 0 on success or -1 on error
+ */
+int batch_run(batch_script_t *script, session_t *session, worker_pool_t *pool,
+              batch_run_t run, void *ctx, FILE *out);
+
+#endif // BATCH_H
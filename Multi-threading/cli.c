@@ -0,0 +1,365 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cli.h"
+#include "daemon.h"
+#include "matrix.h"
+#include "matrix_zone.h"
+
+#define CLI_MAX_ARGS 64
+// Output buffer of the server, flushed only when it waits for a request
+#define SERVE_BUFFER_SIZE (64 * 1024)
+
+typedef enum { OP_SUM, OP_MAX, OP_STATS } cli_op_t;
+typedef enum { FORMAT_TEXT, FORMAT_JSON, FORMAT_BINARY } cli_format_t;
+
+static const char *op_names[] = {"sum", "max", "stats"};
+
+/*
+ * Parsed command line
+ *   op: What to compute
+ *   n_threads: Threads per computation, 1 to compute serially
+ *   format: How to write results
+ *   files, n_files: Matrix files to compute over
+ */
+typedef struct {
+    cli_op_t op;
+    unsigned n_threads;
+    cli_format_t format;
+    char **files;
+    int n_files;
+} cli_args_t;
+
+/*
+ * Buffered reader of the server's requests
+ *   fd: File descriptor to read from
+ *   buf, start, end: Bytes read but not yet used are buf[start..end)
+ */
+typedef struct {
+    int fd;
+    char buf[SERVE_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+} input_t;
+
+static void print_usage(FILE *out) {
+    fprintf(out, "Usage: smock_main <sum|max|stats> [--threads N] [--format text|json|binary] "
+            "<file>...\n");
+    fprintf(out, "       smock_main serve\n");
+    fprintf(out, "       smock_main daemon <socket_path> [--workers N] [--queue N] [--budget MB]\n");
+}
+
+/*
+ * Fills in 'args' from argv, where argv[0] is the command. File names are
+ * moved to the front of argv[1..], which 'args->files' then points to.
+ * Returns CLI_EXIT_OK or CLI_EXIT_USAGE after writing the problem to 'err'
+ */
+static int parse_args(int argc, char **argv, cli_args_t *args, FILE *err) {
+    int op = 0;
+    while (op < 3 && strcmp(argv[0], op_names[op]) != 0) {
+        op++;
+    }
+    if (op == 3) {
+        fprintf(err, "Error: Unknown command '%s'\n", argv[0]);
+        return CLI_EXIT_USAGE;
+    }
+    args->op = op;
+    args->n_threads = 1;
+    args->format = FORMAT_TEXT;
+    args->files = argv + 1;
+    args->n_files = 0;
+
+    int options_done = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (options_done || arg[0] != '-' || arg[1] == '\0') {
+            args->files[args->n_files++] = argv[i];
+        } else if (strcmp(arg, "--") == 0) {
+            options_done = 1;
+        } else if (strcmp(arg, "--json") == 0) {
+            args->format = FORMAT_JSON;
+        } else if (strcmp(arg, "--binary") == 0) {
+            args->format = FORMAT_BINARY;
+        } else if ((strcmp(arg, "--threads") == 0 || strcmp(arg, "-t") == 0) && i + 1 < argc) {
+            char *end;
+            args->n_threads = strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || args->n_threads == 0) {
+                fprintf(err, "Error: Invalid thread count '%s'\n", argv[i]);
+                return CLI_EXIT_USAGE;
+            }
+        } else if ((strcmp(arg, "--format") == 0 || strcmp(arg, "-f") == 0) && i + 1 < argc) {
+            const char *format = argv[++i];
+            if (strcmp(format, "text") == 0) {
+                args->format = FORMAT_TEXT;
+            } else if (strcmp(format, "json") == 0) {
+                args->format = FORMAT_JSON;
+            } else if (strcmp(format, "binary") == 0) {
+                args->format = FORMAT_BINARY;
+            } else {
+                fprintf(err, "Error: Unknown format '%s'\n", format);
+                return CLI_EXIT_USAGE;
+            }
+        } else {
+            fprintf(err, "Error: Invalid option '%s'\n", arg);
+            return CLI_EXIT_USAGE;
+        }
+    }
+    if (args->n_files == 0) {
+        fprintf(err, "Error: No matrix files given\n");
+        return CLI_EXIT_USAGE;
+    }
+    return CLI_EXIT_OK;
+}
+
+static int is_text_file(const char *file_name) {
+    size_t len = strlen(file_name);
+    return len >= 4 && strcmp(file_name + len - 4, ".txt") == 0;
+}
+
+static matrix_t *read_matrix_file(const char *file_name) {
+    return is_text_file(file_name) ? matrix_read_text(file_name) : matrix_read_bin(file_name);
+}
+
+// Computes what 'op' needs. Returns 0 on success or -1 on error.
+static int compute(const matrix_t *mat, const cli_args_t *args, long *sum, long *max) {
+    if (args->op != OP_MAX) {
+        if (args->n_threads == 1) {
+            *sum = matrix_sum(mat);
+        } else if (matrix_parallel_sum(mat, args->n_threads, sum) != 0) {
+            return -1;
+        }
+    }
+    if (args->op != OP_SUM) {
+        if (args->n_threads == 1) {
+            *max = matrix_max(mat);
+        } else if (matrix_parallel_max(mat, args->n_threads, max) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void write_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (; *str != '\0'; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void write_result(FILE *out, const cli_args_t *args, const char *file_name,
+                         unsigned nrows, unsigned ncols, long sum, long max) {
+    if (args->format == FORMAT_BINARY) {
+        if (args->op == OP_STATS) {
+            cli_stats_record_t record = {nrows, ncols, sum, max};
+            fwrite(&record, sizeof(record), 1, out);
+        } else {
+            int64_t result = args->op == OP_SUM ? sum : max;
+            fwrite(&result, sizeof(result), 1, out);
+        }
+    } else if (args->format == FORMAT_JSON) {
+        fprintf(out, "{\"op\": \"%s\", \"file\": ", op_names[args->op]);
+        write_json_string(out, file_name);
+        fprintf(out, ", \"nrows\": %u, \"ncols\": %u", nrows, ncols);
+        if (args->op != OP_MAX) {
+            fprintf(out, ", \"sum\": %ld", sum);
+        }
+        if (args->op != OP_SUM) {
+            fprintf(out, ", \"max\": %ld", max);
+        }
+        fprintf(out, "}\n");
+    } else if (args->op == OP_STATS) {
+        fprintf(out, "%u x %u: sum %ld max %ld\n", nrows, ncols, sum, max);
+    } else {
+        fprintf(out, "%ld\n", args->op == OP_SUM ? sum : max);
+    }
+}
+
+/*
+ * Runs one command, writing results to 'out' and problems to 'err'
+ * Files that cannot be read are skipped, but make the command fail.
+ * Returns the exit code
+ */
+static int run_command(int argc, char **argv, FILE *out, FILE *err) {
+    cli_args_t args;
+    int status = parse_args(argc, argv, &args, err);
+    if (status != CLI_EXIT_OK) {
+        return status;
+    }
+
+    for (int i = 0; i < args.n_files; i++) {
+        // Binary files with a zone map are answered without reading their elements.
+        matrix_zone_map_t map;
+        if (!is_text_file(args.files[i]) && matrix_zone_map_read(&map, args.files[i]) == 0) {
+            write_result(out, &args, args.files[i], map.nrows, map.ncols,
+                         matrix_zone_map_sum(&map), matrix_zone_map_max(&map));
+            matrix_zone_map_free(&map);
+            continue;
+        }
+        matrix_t *mat = read_matrix_file(args.files[i]);
+        if (mat == NULL) {
+            fprintf(err, "Error: Failed to read matrix from '%s'\n", args.files[i]);
+            status = CLI_EXIT_IO;
+            continue;
+        }
+        long sum = 0;
+        long max = 0;
+        if (compute(mat, &args, &sum, &max) != 0) {
+            fprintf(err, "Error: Matrix %s failed for '%s'\n", op_names[args.op], args.files[i]);
+            if (status == CLI_EXIT_OK) {
+                status = CLI_EXIT_FAILED;
+            }
+        } else {
+            write_result(out, &args, args.files[i], mat->nrows, mat->ncols, sum, max);
+        }
+        matrix_free(mat);
+    }
+    return status;
+}
+
+/*
+ * Reads exactly 'n' bytes. Pending output is flushed before waiting for
+ * more input, so responses go out in batches instead of one at a time.
+ * Returns 0 on success, 1 if the input ended before the first byte, or -1
+ * if it ended part way or could not be read
+ */
+static int input_read(input_t *in, void *dest, size_t n) {
+    size_t copied = 0;
+    while (copied < n) {
+        if (in->start == in->end) {
+            if (fflush(stdout) != 0) {
+                perror("fflush");
+                return -1;
+            }
+            ssize_t got = read(in->fd, in->buf, sizeof(in->buf));
+            if (got == -1 && errno == EINTR) {
+                continue;
+            } else if (got == -1) {
+                perror("read");
+                return -1;
+            } else if (got == 0) {
+                return copied == 0 ? 1 : -1;
+            }
+            in->start = 0;
+            in->end = got;
+        }
+        size_t take = in->end - in->start;
+        if (take > n - copied) {
+            take = n - copied;
+        }
+        memcpy((char *) dest + copied, in->buf + in->start, take);
+        in->start += take;
+        copied += take;
+    }
+    return 0;
+}
+
+// Answers length-prefixed requests on standard input until it ends.
+static int serve(void) {
+    static input_t in;
+    in.fd = STDIN_FILENO;
+    setvbuf(stdout, NULL, _IOFBF, SERVE_BUFFER_SIZE);
+
+    char *request = malloc(CLI_MAX_REQUEST + 1);
+    if (request == NULL) {
+        perror("malloc");
+        return CLI_EXIT_FAILED;
+    }
+    int status = CLI_EXIT_OK;
+    while (1) {
+        uint32_t len;
+        int ret = input_read(&in, &len, sizeof(len));
+        if (ret == 1) {
+            break;
+        } else if (ret != 0) {
+            fprintf(stderr, "Error: Truncated request\n");
+            status = CLI_EXIT_IO;
+            break;
+        }
+        if (len > CLI_MAX_REQUEST) {
+            // The rest of the stream cannot be trusted, so stop here.
+            fprintf(stderr, "Error: Request of %u bytes is over the %d byte limit\n", len,
+                    CLI_MAX_REQUEST);
+            status = CLI_EXIT_USAGE;
+            break;
+        }
+        if (input_read(&in, request, len) != 0) {
+            fprintf(stderr, "Error: Truncated request\n");
+            status = CLI_EXIT_IO;
+            break;
+        }
+        request[len] = '\0';
+
+        char *argv[CLI_MAX_ARGS];
+        int argc = 0;
+        char *save;
+        for (char *tok = strtok_r(request, " \t\r\n", &save); tok != NULL && argc < CLI_MAX_ARGS;
+             tok = strtok_r(NULL, " \t\r\n", &save)) {
+            argv[argc++] = tok;
+        }
+
+        // Errors go into the response, after the results of any good files.
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *body_out = open_memstream(&body, &body_len);
+        if (body_out == NULL) {
+            perror("open_memstream");
+            status = CLI_EXIT_FAILED;
+            break;
+        }
+        cli_response_header_t header;
+        if (argc == 0) {
+            fprintf(body_out, "Error: Empty request\n");
+            header.status = CLI_EXIT_USAGE;
+        } else {
+            header.status = run_command(argc, argv, body_out, body_out);
+        }
+        fclose(body_out);
+        header.length = body_len;
+        fwrite(&header, sizeof(header), 1, stdout);
+        fwrite(body, 1, body_len, stdout);
+        free(body);
+    }
+
+    free(request);
+    if (fflush(stdout) != 0) {
+        perror("fflush");
+        status = CLI_EXIT_IO;
+    }
+    return status;
+}
+
+int cli_main(int argc, char *argv[]) {
+    if (strcmp(argv[0], "serve") == 0) {
+        if (argc > 1) {
+            print_usage(stderr);
+            return CLI_EXIT_USAGE;
+        }
+        return serve();
+    }
+    if (strcmp(argv[0], "daemon") == 0) {
+        return daemon_main(argc, argv);
+    }
+    if (strcmp(argv[0], "help") == 0 || strcmp(argv[0], "--help") == 0) {
+        print_usage(stdout);
+        return CLI_EXIT_OK;
+    }
+    int status = run_command(argc, argv, stdout, stderr);
+    if (status == CLI_EXIT_USAGE) {
+        print_usage(stderr);
+    }
+    if (fflush(stdout) != 0) {
+        perror("fflush");
+        return CLI_EXIT_IO;
+    }
+    return status;
+}
@@ -0,0 +1,70 @@
+#ifndef CLI_H
+#define CLI_H
+
+/*
+ * Non-interactive use of SMOCK from scripts and other programs:
+ *
+ *   smock_main <sum|max|stats> [--threads N] [--format text|json|binary] <file>...
+ *   smock_main serve
+ *
+ * The first form computes one result per matrix file (.txt files are read
+ * as text, anything else as binary) and exits without a banner or prompt.
+ * Binary files saved with a zone map (see matrix_zone.h) are answered from
+ * the map without reading their elements.
+ * Output formats:
+ *   text: One line per file, "<result>" or "<nrows> x <ncols>: sum <s> max <m>"
+ *   json: One object per line, e.g. {"op": "sum", "file": "a.bin",
+ *     "nrows": 3, "ncols": 3, "sum": 45}
+ *   binary: Per file, a 64-bit result in native byte order, or for stats
+ *     a cli_stats_record_t
+ *
+ * The serve form reads requests from standard input until it ends. Each
+ * request is a 32-bit length in native byte order followed by that many
+ * bytes holding the arguments of the first form, e.g. "sum --threads 4
+ * a.bin". Each response is a cli_response_header_t followed by what the
+ * first form would have written, or by an error message. Responses are
+ * flushed only when no further request has arrived, so a client can send
+ * many requests at once and get the responses back in one write.
+ *
+ * "smock_main daemon" runs a long-lived server instead, see daemon.h.
+ */
+
+#include <stdint.h>
+
+// Exit codes, also used as the status of server responses
+#define CLI_EXIT_OK 0
+#define CLI_EXIT_FAILED 1  // A computation failed
+#define CLI_EXIT_USAGE 2   // Invalid arguments or request
+#define CLI_EXIT_IO 3      // A matrix file could not be read
+
+// Largest request the server accepts, in bytes
+#define CLI_MAX_REQUEST (64 * 1024)
+
+/*
+ * Binary output of the stats command for one file
+ */
+typedef struct {
+    uint32_t nrows;
+    uint32_t ncols;
+    int64_t sum;
+    int64_t max;
+} cli_stats_record_t;
+
+/*
+ * Start of every server response
+ *   length: Number of bytes that follow the header
+ *   status: One of the CLI_EXIT_* codes
+ */
+typedef struct {
+    uint32_t length;
+    uint32_t status;
+} cli_response_header_t;
+
+/*
+ * Run the non-interactive command line
+ *   argc, argv: The arguments after the program name, starting with the command
+ * Returns the exit code
+ */
+int cli_main(int argc, char *argv[]);
+
+#endif // CLI_H
@@ -0,0 +1,718 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "cli.h"
+#include "daemon.h"
+#include "matrix.h"
+#include "session.h"
+#include "worker_pool.h"
+
+#define DAEMON_DEFAULT_QUEUE 256
+#define DAEMON_BACKLOG 128
+#define DAEMON_MAX_EVENTS 64
+#define DAEMON_READ_SIZE (64 * 1024)
+// A client is not read from while this much of its input or output is pending.
+#define DAEMON_MAX_BUFFERED (1024 * 1024)
+
+/*
+ * A growable byte buffer
+ *   data: The bytes, of which data[start..len) have not been used yet
+ *   cap: Allocated size of data
+ */
+typedef struct {
+    char *data;
+    size_t start;
+    size_t len;
+    size_t cap;
+} buffer_t;
+
+/*
+ * One connected client
+ *   fd: The client's socket
+ *   in, out: Bytes received but not yet handled, and responses not yet sent
+ *   events: Events the client is currently registered for with epoll
+ *   busy: Whether one of the client's requests is running
+ *   stalled: Whether the client has a whole request waiting for the daemon
+ *     to have fewer requests running. It is not read from meanwhile.
+ *   eof: Whether the client has finished sending
+ *   closed: Whether the socket was closed. The client is freed once no
+ *     request of it is running, between batches of events.
+ *   prev, next: Links in the daemon's list of clients
+ */
+typedef struct client {
+    int fd;
+    buffer_t in;
+    buffer_t out;
+    uint32_t events;
+    int busy;
+    int stalled;
+    int eof;
+    int closed;
+    struct client *prev;
+    struct client *next;
+} client_t;
+
+struct daemon;
+
+/*
+ * A request being run on the worker pool
+ *   daemon, client: Where it came from
+ *   header, payload: The request, with payload zero terminated
+ *   response, body, body_len: The response to send back
+ *   next: Next finished request
+ */
+typedef struct request {
+    struct daemon *daemon;
+    client_t *client;
+    daemon_request_t header;
+    char *payload;
+    daemon_response_t response;
+    char *body;
+    size_t body_len;
+    struct request *next;
+} request_t;
+
+/*
+ * Everything the daemon keeps between requests
+ *   session: Matrices loaded by clients
+ *   pool: Workers that run requests
+ *   reduce_pool: Workers that sum rows and take their maxima for the
+ *     requests. They never wait on other tasks, so a request waiting for its
+ *     rows cannot starve them the way it could in its own pool.
+ *   epoll_fd, listen_fd: The event loop and the listening socket
+ *   done_fd: Counts requests finished by workers, to wake the event loop
+ *   signal_fd: Receives SIGINT and SIGTERM
+ *   done_mutex, done: Requests finished by workers, newest first
+ *   clients: Every client not yet freed
+ *   n_busy: Number of requests running
+ *   max_busy: Most requests running at once, the request queue's capacity,
+ *     so that submitting one never waits on the event loop's thread
+ *   max_threads: Most threads a request may ask for, the number of CPUs
+ *   stopping: Set once the daemon should exit
+ */
+typedef struct daemon {
+    session_t session;
+    worker_pool_t pool;
+    worker_pool_t reduce_pool;
+    int epoll_fd;
+    int listen_fd;
+    int done_fd;
+    int signal_fd;
+    pthread_mutex_t done_mutex;
+    request_t *done;
+    client_t *clients;
+    unsigned n_busy;
+    unsigned max_busy;
+    unsigned max_threads;
+    int stopping;
+} daemon_t;
+
+static int buffer_append(buffer_t *buf, const void *data, size_t len) {
+    if (buf->start > 0 && buf->start == buf->len) {
+        buf->start = buf->len = 0;
+    }
+    if (buf->len + len > buf->cap) {
+        // Reclaim the used space before growing.
+        if (buf->start > 0) {
+            memmove(buf->data, buf->data + buf->start, buf->len - buf->start);
+            buf->len -= buf->start;
+            buf->start = 0;
+        }
+        size_t cap = buf->cap == 0 ? 4096 : buf->cap;
+        while (buf->len + len > cap) {
+            cap *= 2;
+        }
+        if (cap != buf->cap) {
+            char *data = realloc(buf->data, cap);
+            if (data == NULL) {
+                return -1;
+            }
+            buf->data = data;
+            buf->cap = cap;
+        }
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+static size_t buffer_pending(const buffer_t *buf) {
+    return buf->len - buf->start;
+}
+
+// Hands a finished request back to the event loop. Called from any thread.
+static void request_done(request_t *req) {
+    daemon_t *d = req->daemon;
+    req->response.length = req->body_len;
+    req->response.id = req->header.id;
+    pthread_mutex_lock(&d->done_mutex);
+    req->next = d->done;
+    d->done = req;
+    pthread_mutex_unlock(&d->done_mutex);
+    uint64_t one = 1;
+    if (write(d->done_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+    }
+}
+
+static void run_request(void *arg) {
+    request_t *req = arg;
+    daemon_t *d = req->daemon;
+    unsigned n_threads = req->header.n_threads;
+    uint32_t status = DAEMON_STATUS_OK;
+    FILE *out = open_memstream(&req->body, &req->body_len);
+    if (out == NULL) {
+        perror("open_memstream");
+        req->response.status = DAEMON_STATUS_FAILED;
+        goto done;
+    }
+    session_next_command(&d->session);
+
+    switch (req->header.op) {
+    case DAEMON_OP_PING:
+        break;
+
+    case DAEMON_OP_LOAD: {
+        // The payload holds the name and the file, separated by a zero byte.
+        size_t name_len = strlen(req->payload);
+        if (name_len == 0 || name_len + 1 >= req->header.length) {
+            fprintf(out, "Error: Load request must hold a name and a file\n");
+            status = DAEMON_STATUS_BAD_REQUEST;
+        } else if (session_load(&d->session, req->payload, req->payload + name_len + 1) != 0) {
+            fprintf(out, "Failed to load matrix from '%s'\n", req->payload + name_len + 1);
+            status = DAEMON_STATUS_IO;
+        }
+        break;
+    }
+
+    case DAEMON_OP_FREE:
+        if (session_remove(&d->session, req->payload) != 0) {
+            fprintf(out, "Error: No matrix named '%s'\n", req->payload);
+            status = DAEMON_STATUS_NOT_FOUND;
+        }
+        break;
+
+    case DAEMON_OP_SUM:
+    case DAEMON_OP_MAX:
+    case DAEMON_OP_STATS: {
+        if (n_threads > d->max_threads) {
+            fprintf(out, "Error: Requests may use at most %u threads\n", d->max_threads);
+            status = DAEMON_STATUS_BAD_REQUEST;
+            break;
+        }
+        session_buf_t *pin;
+        const matrix_t *mat = session_pin(&d->session, req->payload, &pin);
+        if (mat == NULL) {
+            fprintf(out, "Error: No matrix named '%s'\n", req->payload);
+            status = DAEMON_STATUS_NOT_FOUND;
+            break;
+        }
+        long sum = 0;
+        long max = 0;
+        int err = 0;
+        if (req->header.op != DAEMON_OP_MAX) {
+            if (n_threads <= 1) {
+                sum = matrix_sum(mat);
+            } else {
+                err |= matrix_parallel_sum_pool_cancel(mat, &d->reduce_pool, TASK_CLASS_DEFAULT,
+                                                       NULL, &sum);
+            }
+        }
+        if (req->header.op != DAEMON_OP_SUM) {
+            if (n_threads <= 1) {
+                max = matrix_max(mat);
+            } else {
+                err |= matrix_parallel_max_pool_cancel(mat, &d->reduce_pool, TASK_CLASS_DEFAULT,
+                                                       NULL, &max);
+            }
+        }
+
+        if (err != 0) {
+            fprintf(out, "Error: Computation failed\n");
+            status = DAEMON_STATUS_FAILED;
+        } else if (req->header.op == DAEMON_OP_STATS) {
+            cli_stats_record_t record = {mat->nrows, mat->ncols, sum, max};
+            fwrite(&record, sizeof(record), 1, out);
+        } else {
+            int64_t result = req->header.op == DAEMON_OP_SUM ? sum : max;
+            fwrite(&result, sizeof(result), 1, out);
+        }
+        session_unpin(&d->session, pin);
+        break;
+    }
+
+    case DAEMON_OP_LIST:
+        session_list(&d->session, out);
+        break;
+
+    default:
+        fprintf(out, "Error: Unknown operation %u\n", req->header.op);
+        status = DAEMON_STATUS_BAD_REQUEST;
+    }
+    fclose(out);
+    req->response.status = status;
+
+done:
+    request_done(req);
+}
+
+
+// Registers for exactly the events the client can handle now.
+static void client_update_events(daemon_t *d, client_t *c) {
+    uint32_t events = 0;
+    if (!c->eof && !c->stalled && buffer_pending(&c->in) < DAEMON_MAX_BUFFERED &&
+        buffer_pending(&c->out) < DAEMON_MAX_BUFFERED) {
+        events |= EPOLLIN;
+    }
+    if (buffer_pending(&c->out) > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events != c->events) {
+        struct epoll_event ev = {.events = events, .data.ptr = c};
+        if (epoll_ctl(d->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+            perror("epoll_ctl");
+        }
+        c->events = events;
+    }
+}
+
+// Closes the connection. The client itself is freed later by free_closed_clients.
+static void client_close(daemon_t *d, client_t *c) {
+    epoll_ctl(d->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->closed = 1;
+}
+
+// Frees closed clients with no running request. Events already returned by
+// epoll may still refer to a client, so this only runs between batches.
+static void free_closed_clients(daemon_t *d) {
+    client_t *c = d->clients;
+    while (c != NULL) {
+        client_t *next = c->next;
+        if (c->closed && !c->busy) {
+            if (c->prev != NULL) {
+                c->prev->next = c->next;
+            } else {
+                d->clients = c->next;
+            }
+            if (c->next != NULL) {
+                c->next->prev = c->prev;
+            }
+            free(c->in.data);
+            free(c->out.data);
+            free(c);
+        }
+        c = next;
+    }
+}
+
+/*
+ * Sends as much pending output as the socket takes
+ * Returns 0 on success or -1 if the connection failed
+ */
+static int client_flush(client_t *c) {
+    while (buffer_pending(&c->out) > 0) {
+        ssize_t sent = send(c->fd, c->out.data + c->out.start, buffer_pending(&c->out),
+                            MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        } else if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (sent == -1) {
+            return -1;
+        }
+        c->out.start += sent;
+    }
+    c->out.start = c->out.len = 0;
+    return 0;
+}
+
+/*
+ * Starts the client's next request if it has a whole one and none running.
+ * Closes the client if it sent something invalid or is finished.
+ * Returns 0 if the client is still open, or -1 if it was closed
+ */
+static int client_dispatch(daemon_t *d, client_t *c) {
+    c->stalled = 0;
+    while (!c->busy && buffer_pending(&c->in) >= sizeof(daemon_request_t)) {
+        daemon_request_t header;
+        memcpy(&header, c->in.data + c->in.start, sizeof(header));
+        if (header.length > DAEMON_MAX_PAYLOAD) {
+            client_close(d, c);
+            return -1;
+        }
+        if (buffer_pending(&c->in) < sizeof(header) + header.length) {
+            break;
+        }
+        if (header.op != DAEMON_OP_SHUTDOWN && d->n_busy >= d->max_busy) {
+            c->stalled = 1;
+            break;
+        }
+
+        request_t *req = calloc(1, sizeof(request_t));
+        char *payload = malloc(header.length + 1);
+        if (req == NULL || payload == NULL) {
+            free(req);
+            free(payload);
+            client_close(d, c);
+            return -1;
+        }
+        memcpy(payload, c->in.data + c->in.start + sizeof(header), header.length);
+        payload[header.length] = '\0';
+        c->in.start += sizeof(header) + header.length;
+        req->daemon = d;
+        req->client = c;
+        req->header = header;
+        req->payload = payload;
+
+        if (header.op == DAEMON_OP_SHUTDOWN) {
+            // Answered here, after every earlier request of this client.
+            daemon_response_t response = {0, header.id, DAEMON_STATUS_OK};
+            buffer_append(&c->out, &response, sizeof(response));
+            free(payload);
+            free(req);
+            d->stopping = 1;
+            continue;
+        }
+        c->busy = 1;
+        d->n_busy++;
+        // With n_busy capped, this only fails once the pool is shut down.
+        if (worker_pool_submit(&d->pool, run_request, req) != 0) {
+            req->response.status = DAEMON_STATUS_FAILED;
+            request_done(req);
+        }
+    }
+
+    if (client_flush(c) != 0 ||
+        (c->eof && !c->busy && !c->stalled && buffer_pending(&c->out) == 0)) {
+        client_close(d, c);
+        return -1;
+    }
+    client_update_events(d, c);
+    return 0;
+}
+
+static void client_read(daemon_t *d, client_t *c) {
+    char chunk[DAEMON_READ_SIZE];
+    while (buffer_pending(&c->in) < DAEMON_MAX_BUFFERED) {
+        ssize_t got = recv(c->fd, chunk, sizeof(chunk), 0);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        } else if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (got == -1 || (got > 0 && buffer_append(&c->in, chunk, got) != 0)) {
+            client_close(d, c);
+            return;
+        } else if (got == 0) {
+            c->eof = 1;
+            break;
+        }
+    }
+    client_dispatch(d, c);
+}
+
+static void accept_clients(daemon_t *d) {
+    while (1) {
+        int fd = accept4(d->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept4");
+            }
+            return;
+        }
+        client_t *c = calloc(1, sizeof(client_t));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        if (epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->next = d->clients;
+        if (d->clients != NULL) {
+            d->clients->prev = c;
+        }
+        d->clients = c;
+    }
+}
+
+// Queues the responses of requests finished by workers.
+static void collect_done(daemon_t *d) {
+    uint64_t count;
+    if (read(d->done_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read");
+    }
+    pthread_mutex_lock(&d->done_mutex);
+    request_t *req = d->done;
+    d->done = NULL;
+    pthread_mutex_unlock(&d->done_mutex);
+
+    while (req != NULL) {
+        request_t *next = req->next;
+        client_t *c = req->client;
+        c->busy = 0;
+        d->n_busy--;
+        if (c->closed) {
+            // Nobody to answer
+        } else if (buffer_append(&c->out, &req->response, sizeof(req->response)) != 0 ||
+                   buffer_append(&c->out, req->body, req->body_len) != 0) {
+            client_close(d, c);
+        } else {
+            client_dispatch(d, c);
+        }
+        free(req->payload);
+        free(req->body);
+        free(req);
+        req = next;
+    }
+
+    // Requests finished, so clients that had to wait can start theirs.
+    for (client_t *c = d->clients; c != NULL && d->n_busy < d->max_busy; c = c->next) {
+        if (c->stalled && !c->closed) {
+            client_dispatch(d, c);
+        }
+    }
+}
+
+/*
+ * Binds the listening socket, replacing a socket file no daemon is using
+ * Returns the socket, or -1 on error
+ */
+static int listen_on(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        if (errno != EADDRINUSE) {
+            perror("bind");
+            close(fd);
+            return -1;
+        }
+        // A leftover file from a daemon that exited can be replaced; a live daemon cannot.
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe != -1 && connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+        if (probe != -1) {
+            close(probe);
+        }
+        if (live) {
+            fprintf(stderr, "Error: A daemon is already listening on '%s'\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+            perror("bind");
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, DAEMON_BACKLOG) == -1) {
+        perror("listen");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+static int add_fd(daemon_t *d, int fd, void *tag) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = tag};
+    if (epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+// Runs the event loop until the daemon is stopped and no request is running.
+static void event_loop(daemon_t *d) {
+    struct epoll_event events[DAEMON_MAX_EVENTS];
+    while (!d->stopping || d->n_busy > 0) {
+        if (d->stopping && d->listen_fd != -1) {
+            epoll_ctl(d->epoll_fd, EPOLL_CTL_DEL, d->listen_fd, NULL);
+            close(d->listen_fd);
+            d->listen_fd = -1;
+        }
+        int n = epoll_wait(d->epoll_fd, events, DAEMON_MAX_EVENTS, -1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1) {
+            perror("epoll_wait");
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &d->listen_fd) {
+                if (d->listen_fd != -1) {
+                    accept_clients(d);
+                }
+            } else if (tag == &d->done_fd) {
+                collect_done(d);
+            } else if (tag == &d->signal_fd) {
+                struct signalfd_siginfo info;
+                if (read(d->signal_fd, &info, sizeof(info)) > 0) {
+                    d->stopping = 1;
+                }
+            } else {
+                client_t *c = tag;
+                if (c->closed) {
+                    continue;
+                } else if (events[i].events & EPOLLIN) {
+                    // Also notices the end of the connection.
+                    client_read(d, c);
+                } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    client_close(d, c);
+                } else if (events[i].events & EPOLLOUT) {
+                    client_dispatch(d, c);
+                }
+            }
+        }
+        free_closed_clients(d);
+    }
+
+    // Nothing is running now. Send what can be sent without waiting.
+    for (client_t *c = d->clients; c != NULL; c = c->next) {
+        if (!c->closed) {
+            client_flush(c);
+            client_close(d, c);
+        }
+    }
+    free_closed_clients(d);
+}
+
+static void print_usage(void) {
+    fprintf(stderr, "Usage: smock_main daemon <socket_path> [--workers N] [--queue N] "
+            "[--budget MB]\n");
+}
+
+int daemon_main(int argc, char *argv[]) {
+    if (argc < 2) {
+        print_usage();
+        return CLI_EXIT_USAGE;
+    }
+    const char *path = argv[1];
+    long n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned queue_size = DAEMON_DEFAULT_QUEUE;
+    size_t mem_budget = 0;
+    const char *budget_env = getenv("SMOCK_MEM_BUDGET_MB");
+    if (budget_env != NULL) {
+        mem_budget = strtoul(budget_env, NULL, 10) << 20;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 == argc) {
+            print_usage();
+            return CLI_EXIT_USAGE;
+        } else if (strcmp(argv[i], "--workers") == 0) {
+            n_workers = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--queue") == 0) {
+            queue_size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--budget") == 0) {
+            mem_budget = strtoul(argv[++i], NULL, 10) << 20;
+        } else {
+            print_usage();
+            return CLI_EXIT_USAGE;
+        }
+    }
+    if (n_workers <= 0 || queue_size == 0) {
+        fprintf(stderr, "Error: Worker count and queue size must be positive\n");
+        return CLI_EXIT_USAGE;
+    }
+
+    // Block the signals before the workers start so only signal_fd sees them.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    int err = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_sigmask: %s\n", strerror(err));
+        return CLI_EXIT_FAILED;
+    }
+
+    static daemon_t d;
+    d.done = NULL;
+    d.clients = NULL;
+    d.n_busy = 0;
+    d.max_busy = queue_size;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    d.max_threads = n_cpus < 1 ? 1 : n_cpus;
+    d.stopping = 0;
+    d.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    d.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    d.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (d.epoll_fd == -1 || d.done_fd == -1 || d.signal_fd == -1) {
+        perror("epoll_create1, eventfd or signalfd");
+        return CLI_EXIT_FAILED;
+    }
+    d.listen_fd = listen_on(path);
+    if (d.listen_fd == -1) {
+        return CLI_EXIT_FAILED;
+    }
+    pthread_mutex_init(&d.done_mutex, NULL);
+    if (session_init(&d.session, mem_budget) != 0) {
+        close(d.listen_fd);
+        unlink(path);
+        return CLI_EXIT_FAILED;
+    }
+    if (worker_pool_init(&d.pool, n_workers, queue_size) != 0) {
+        session_free(&d.session);
+        close(d.listen_fd);
+        unlink(path);
+        return CLI_EXIT_FAILED;
+    }
+    if (worker_pool_init(&d.reduce_pool, d.max_threads, queue_size) != 0) {
+        worker_pool_free(&d.pool);
+        session_free(&d.session);
+        close(d.listen_fd);
+        unlink(path);
+        return CLI_EXIT_FAILED;
+    }
+
+    int status = CLI_EXIT_OK;
+    if (add_fd(&d, d.listen_fd, &d.listen_fd) != 0 || add_fd(&d, d.done_fd, &d.done_fd) != 0 ||
+        add_fd(&d, d.signal_fd, &d.signal_fd) != 0) {
+        status = CLI_EXIT_FAILED;
+    } else {
+        event_loop(&d);
+    }
+    unlink(path);
+
+    if (d.listen_fd != -1) {
+        close(d.listen_fd);
+    }
+    worker_pool_free(&d.pool);
+    worker_pool_free(&d.reduce_pool);
+    session_free(&d.session);
+    pthread_mutex_destroy(&d.done_mutex);
+    close(d.signal_fd);
+    close(d.done_fd);
+    close(d.epoll_fd);
+    return status;
+}
@@ -0,0 +1,88 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/*
+ * A long-running SMOCK server on a Unix domain socket:
+ *
+ *   smock_main daemon <socket_path> [--workers N] [--queue N] [--budget MB]
+ *
+ * Matrices loaded by any client stay in one session until they are freed,
+ * and requests run on a worker pool that is started once. Each client may
+ * send many requests without waiting for responses. Requests from one client
+ * run one at a time in the order sent, while requests from different
+ * clients run at the same time.
+ *
+ * Every message is a fixed header in native byte order followed by
+ * 'length' bytes of payload. Request payloads:
+ *   DAEMON_OP_PING, DAEMON_OP_LIST, DAEMON_OP_SHUTDOWN: Empty
+ *   DAEMON_OP_LOAD: The name, a zero byte, then the file (binary, or text if
+ *     it ends in ".txt")
+ *   DAEMON_OP_FREE, DAEMON_OP_SUM, DAEMON_OP_MAX, DAEMON_OP_STATS: The name
+ * Response payloads when the status is DAEMON_STATUS_OK:
+ *   DAEMON_OP_SUM, DAEMON_OP_MAX: A 64-bit result
+ *   DAEMON_OP_STATS: A cli_stats_record_t
+ *   DAEMON_OP_LIST: The named matrices as text, as the shell's list command
+ *   Others: Empty
+ * Responses with any other status hold an error message.
+ */
+
+#include <stdint.h>
+
+enum {
+    DAEMON_OP_PING,
+    DAEMON_OP_LOAD,
+    DAEMON_OP_FREE,
+    DAEMON_OP_SUM,
+    DAEMON_OP_MAX,
+    DAEMON_OP_STATS,
+    DAEMON_OP_LIST,
+    DAEMON_OP_SHUTDOWN,  // Stop accepting clients and exit once running requests finish
+};
+
+enum {
+    DAEMON_STATUS_OK,
+    DAEMON_STATUS_FAILED,       // The computation failed
+    DAEMON_STATUS_BAD_REQUEST,  // Unknown operation, malformed payload or too many threads
+    DAEMON_STATUS_IO,           // The file could not be loaded
+    DAEMON_STATUS_NOT_FOUND,    // No matrix has the name
+};
+
+// Largest request payload the daemon accepts. Clients sending more are disconnected.
+#define DAEMON_MAX_PAYLOAD 4096
+
+/*
+ * Header of every request
+ *   length: Bytes of payload after the header
+ *   id: Any value, returned in the response
+ *   op: One of DAEMON_OP_*
+ *   n_threads: 0 or 1 computes sum, max and stats serially, and more runs them
+ *     on the daemon's reduction workers, one per CPU. More than the daemon's
+ *     CPUs is answered with DAEMON_STATUS_BAD_REQUEST.
+ */
+typedef struct {
+    uint32_t length;
+    uint32_t id;
+    uint16_t op;
+    uint16_t n_threads;
+} daemon_request_t;
+
+/*
+ * Header of every response
+ *   length: Bytes of payload after the header
+ *   id: The id of the request
+ *   status: One of DAEMON_STATUS_*
+ */
+typedef struct {
+    uint32_t length;
+    uint32_t id;
+    uint32_t status;
+} daemon_response_t;
+
+/*
+ * Run the daemon until it is asked to shut down or gets SIGINT or SIGTERM
+ *   argc, argv: The arguments after the program name, starting with "daemon"
+ * Returns the exit code
+ */
+int daemon_main(int argc, char *argv[]);
+
+#endif // DAEMON_H
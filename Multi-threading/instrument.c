@@ -0,0 +1,345 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "instrument.h"
+
+static const char *report_path;
+
+#ifdef SMOCK_INSTRUMENT
+
+// A bucket per 1/8 of each power of two of nanoseconds, up to about 4 hours
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define N_BUCKETS (45 * SUB_BUCKETS)
+// Distinct command names that get their own histogram; later ones share one.
+#define MAX_COMMANDS 48
+#define MAX_COMMAND_NAME 32
+
+/*
+ * Log-linear latency histogram
+ *   count, sum: Number of samples and their total in nanoseconds
+ *   min, max: Smallest and largest sample
+ *   buckets: Number of samples per bucket, see bucket_index
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[N_BUCKETS];
+} histogram_t;
+
+/*
+ * Everything one thread records
+ *   hists: Histograms of timed operations
+ *   commands: Histograms of shell commands by slot, allocated on first use
+ *   counters: Event counters
+ *   prev, next: Links in the list of live threads
+ */
+typedef struct instr_thread {
+    histogram_t hists[INSTR_N_HISTS];
+    histogram_t *commands;
+    uint64_t counters[INSTR_N_COUNTERS];
+    struct instr_thread *prev;
+    struct instr_thread *next;
+} instr_thread_t;
+
+static const char *hist_names[INSTR_N_HISTS] = {
+    "queue_wait", "task_run", "read_text", "read_bin", "write_text", "write_bin",
+    "sum", "max", "parallel_sum", "parallel_max", "pool_sum", "expr_eval",
+};
+
+static const char *counter_names[INSTR_N_COUNTERS] = {
+    "bytes_read", "bytes_written", "syscalls", "tasks_run", "threads_created",
+};
+
+// Registry of live threads and the totals of threads that have exited
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static instr_thread_t *live_threads;
+static instr_thread_t retired;
+static histogram_t retired_commands[MAX_COMMANDS + 1];
+
+// Command names by slot. Slots are only ever added, under registry_mutex.
+static char command_names[MAX_COMMANDS][MAX_COMMAND_NAME];
+static unsigned n_commands;
+
+static __thread instr_thread_t *self;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+// Only the owning thread writes its data, but the report reads it at any time.
+#define BUMP(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define SET(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static unsigned bucket_index(uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+        return ns;
+    }
+    unsigned shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+    unsigned idx = (shift + 1) * SUB_BUCKETS + ((ns >> shift) & (SUB_BUCKETS - 1));
+    return idx < N_BUCKETS ? idx : N_BUCKETS - 1;
+}
+
+// Smallest value that falls into bucket 'idx'
+static uint64_t bucket_start(unsigned idx) {
+    if (idx < SUB_BUCKETS) {
+        return idx;
+    }
+    unsigned shift = idx / SUB_BUCKETS - 1;
+    return (uint64_t) (SUB_BUCKETS + idx % SUB_BUCKETS) << shift;
+}
+
+static void hist_record(histogram_t *h, uint64_t ns) {
+    if (h->count == 0 || ns < h->min) {
+        SET(h->min, ns);
+    }
+    if (ns > h->max) {
+        SET(h->max, ns);
+    }
+    BUMP(h->count, 1);
+    BUMP(h->sum, ns);
+    BUMP(h->buckets[bucket_index(ns)], 1);
+}
+
+static void hist_merge(histogram_t *dest, histogram_t *src) {
+    uint64_t count = LOAD(src->count);
+    if (count == 0) {
+        return;
+    }
+    uint64_t min = LOAD(src->min);
+    uint64_t max = LOAD(src->max);
+    if (dest->count == 0 || min < dest->min) {
+        dest->min = min;
+    }
+    if (max > dest->max) {
+        dest->max = max;
+    }
+    dest->count += count;
+    dest->sum += LOAD(src->sum);
+    for (unsigned i = 0; i < N_BUCKETS; i++) {
+        dest->buckets[i] += LOAD(src->buckets[i]);
+    }
+}
+
+// Adds everything 'src' recorded into 'dest'. Called with registry_mutex held.
+static void thread_merge(instr_thread_t *dest, histogram_t *dest_commands, instr_thread_t *src) {
+    for (unsigned i = 0; i < INSTR_N_HISTS; i++) {
+        hist_merge(&dest->hists[i], &src->hists[i]);
+    }
+    histogram_t *commands = __atomic_load_n(&src->commands, __ATOMIC_ACQUIRE);
+    if (commands != NULL) {
+        for (unsigned i = 0; i <= MAX_COMMANDS; i++) {
+            hist_merge(&dest_commands[i], &commands[i]);
+        }
+    }
+    for (unsigned i = 0; i < INSTR_N_COUNTERS; i++) {
+        dest->counters[i] += LOAD(src->counters[i]);
+    }
+}
+
+// Runs when a thread exits, keeping its data in the retired totals.
+static void retire_thread(void *arg) {
+    instr_thread_t *t = arg;
+    pthread_mutex_lock(&registry_mutex);
+    thread_merge(&retired, retired_commands, t);
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        live_threads = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    free(t->commands);
+    free(t);
+}
+
+static void create_thread_key(void) {
+    pthread_key_create(&thread_key, retire_thread);
+}
+
+static instr_thread_t *get_self(void) {
+    if (self != NULL) {
+        return self;
+    }
+    instr_thread_t *t = calloc(1, sizeof(instr_thread_t));
+    if (t == NULL) {
+        return NULL;
+    }
+    pthread_once(&thread_key_once, create_thread_key);
+    pthread_setspecific(thread_key, t);
+
+    pthread_mutex_lock(&registry_mutex);
+    t->next = live_threads;
+    if (live_threads != NULL) {
+        live_threads->prev = t;
+    }
+    live_threads = t;
+    pthread_mutex_unlock(&registry_mutex);
+
+    self = t;
+    BUMP(t->counters[INSTR_THREADS_CREATED], 1);
+    return t;
+}
+
+uint64_t instr_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void instr_record(instr_hist_t hist, uint64_t ns) {
+    instr_thread_t *t = get_self();
+    if (t != NULL) {
+        hist_record(&t->hists[hist], ns);
+    }
+}
+
+// Finds or adds the slot for a command name. Slot MAX_COMMANDS is "other".
+static unsigned command_slot(const char *name) {
+    if (strlen(name) >= MAX_COMMAND_NAME) {
+        return MAX_COMMANDS;
+    }
+    unsigned n = __atomic_load_n(&n_commands, __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < n; i++) {
+        if (strcmp(command_names[i], name) == 0) {
+            return i;
+        }
+    }
+    pthread_mutex_lock(&registry_mutex);
+    unsigned slot = 0;
+    while (slot < n_commands && strcmp(command_names[slot], name) != 0) {
+        slot++;
+    }
+    if (slot == n_commands && slot < MAX_COMMANDS) {
+        snprintf(command_names[slot], MAX_COMMAND_NAME, "%s", name);
+        __atomic_store_n(&n_commands, slot + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return slot;
+}
+
+void instr_record_command(const char *name, uint64_t ns) {
+    instr_thread_t *t = get_self();
+    if (t == NULL) {
+        return;
+    }
+    if (t->commands == NULL) {
+        histogram_t *commands = calloc(MAX_COMMANDS + 1, sizeof(histogram_t));
+        if (commands == NULL) {
+            return;
+        }
+        __atomic_store_n(&t->commands, commands, __ATOMIC_RELEASE);
+    }
+    hist_record(&t->commands[command_slot(name)], ns);
+}
+
+void instr_count(instr_counter_t counter, uint64_t n) {
+    instr_thread_t *t = get_self();
+    if (t != NULL) {
+        BUMP(t->counters[counter], n);
+    }
+}
+
+// Value below which a fraction 'q' of the samples fall, to bucket precision
+static double hist_percentile(const histogram_t *h, double q) {
+    uint64_t rank = (uint64_t) (q * h->count + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < N_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            // Middle of the bucket, but never beyond the largest sample
+            double mid = (bucket_start(i) + bucket_start(i + 1)) / 2.0;
+            return mid < h->max ? mid : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void print_hist(FILE *out, const char *name, const histogram_t *h) {
+    if (h->count == 0) {
+        return;
+    }
+    fprintf(out, "%-22s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+            (unsigned long) h->count, h->sum / 1e3 / h->count, hist_percentile(h, 0.5) / 1e3,
+            hist_percentile(h, 0.9) / 1e3, hist_percentile(h, 0.99) / 1e3,
+            hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+void instr_report(FILE *out) {
+    // Totals over the exited threads and every live one
+    instr_thread_t *total = calloc(1, sizeof(instr_thread_t));
+    histogram_t *commands = calloc(MAX_COMMANDS + 1, sizeof(histogram_t));
+    if (total == NULL || commands == NULL) {
+        free(total);
+        free(commands);
+        fprintf(out, "Error: Out of memory for stats report\n");
+        return;
+    }
+    pthread_mutex_lock(&registry_mutex);
+    thread_merge(total, commands, &retired);
+    for (unsigned i = 0; i <= MAX_COMMANDS; i++) {
+        hist_merge(&commands[i], &retired_commands[i]);
+    }
+    for (instr_thread_t *t = live_threads; t != NULL; t = t->next) {
+        thread_merge(total, commands, t);
+    }
+    unsigned n = n_commands;
+    pthread_mutex_unlock(&registry_mutex);
+
+    fprintf(out, "%-22s %10s %10s %10s %10s %10s %10s %10s\n", "latency (us)", "count", "mean",
+            "p50", "p90", "p99", "p99.9", "max");
+    char name[sizeof("cmd ") + MAX_COMMAND_NAME];
+    for (unsigned i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "cmd %.*s", MAX_COMMAND_NAME - 1, command_names[i]);
+        print_hist(out, name, &commands[i]);
+    }
+    print_hist(out, "cmd (other)", &commands[MAX_COMMANDS]);
+    for (unsigned i = 0; i < INSTR_N_HISTS; i++) {
+        print_hist(out, hist_names[i], &total->hists[i]);
+    }
+    for (unsigned i = 0; i < INSTR_N_COUNTERS; i++) {
+        if (total->counters[i] != 0) {
+            fprintf(out, "%-22s %10lu\n", counter_names[i], (unsigned long) total->counters[i]);
+        }
+    }
+    free(total);
+    free(commands);
+}
+
+#else
+
+void instr_report(FILE *out) {
+    fprintf(out, "Instrumentation is disabled; rebuild with -DSMOCK_INSTRUMENT\n");
+}
+
+#endif // SMOCK_INSTRUMENT
+
+static void report_at_exit(void) {
+    if (strcmp(report_path, "1") == 0 || strcmp(report_path, "-") == 0) {
+        instr_report(stderr);
+        return;
+    }
+    FILE *f = fopen(report_path, "w");
+    if (f == NULL) {
+        perror("fopen");
+        return;
+    }
+    instr_report(f);
+    fclose(f);
+}
+
+void instr_report_at_exit_from_env(void) {
+    report_path = getenv("SMOCK_STATS");
+    if (report_path != NULL && *report_path != '\0') {
+        atexit(report_at_exit);
+    }
+}
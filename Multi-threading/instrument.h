@@ -0,0 +1,99 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Latency histograms and counters for commands and hot paths. Build with
+ * -DSMOCK_INSTRUMENT to enable them; otherwise the INSTR_* macros expand to
+ * nothing and only the reporting functions remain, printing that
+ * instrumentation is disabled.
+ *
+ * Every thread records into its own histograms, so recording takes no lock.
+ * A histogram has 8 buckets per power of two, so any reported latency is
+ * within 12.5% of the true value. Data from threads that exit is merged into
+ * a shared total.
+ */
+
+/*
+ * Timed operations other than shell commands
+ */
+typedef enum {
+    INSTR_QUEUE_WAIT,     // Time a work item spends in the work queue
+    INSTR_TASK_RUN,       // Time a worker spends running one work item
+    INSTR_READ_TEXT,
+    INSTR_READ_BIN,
+    INSTR_WRITE_TEXT,
+    INSTR_WRITE_BIN,
+    INSTR_SUM,
+    INSTR_MAX,
+    INSTR_PARALLEL_SUM,
+    INSTR_PARALLEL_MAX,
+    INSTR_POOL_SUM,
+    INSTR_EXPR_EVAL,
+    INSTR_N_HISTS
+} instr_hist_t;
+
+/*
+ * Event counters
+ */
+typedef enum {
+    INSTR_BYTES_READ,     // Bytes read from matrix files
+    INSTR_BYTES_WRITTEN,  // Bytes written to matrix files
+    INSTR_SYSCALLS,       // System calls on matrix files, one per BUFSIZ bytes buffered
+    INSTR_TASKS_RUN,      // Work items run by pool workers
+    INSTR_THREADS_CREATED,  // Threads that recorded anything
+    INSTR_N_COUNTERS
+} instr_counter_t;
+
+#ifdef SMOCK_INSTRUMENT
+
+/*
+ * Current time in nanoseconds from a monotonic clock
+ */
+uint64_t instr_now(void);
+
+/*
+ * Record one latency sample for a timed operation or a shell command
+ *   ns: Duration in nanoseconds
+ */
+void instr_record(instr_hist_t hist, uint64_t ns);
+void instr_record_command(const char *name, uint64_t ns);
+
+/*
+ * Add 'n' to a counter
+ */
+void instr_count(instr_counter_t counter, uint64_t n);
+
+// Declares 'var' holding the start time of an operation.
+#define INSTR_START(var) uint64_t var = instr_now()
+// Records the time since 'start' in histogram 'hist'.
+#define INSTR_RECORD(hist, start) instr_record(hist, instr_now() - (start))
+#define INSTR_RECORD_COMMAND(name, start) instr_record_command(name, instr_now() - (start))
+#define INSTR_COUNT(counter, n) instr_count(counter, n)
+
+#else
+
+#define INSTR_START(var) ((void) 0)
+#define INSTR_RECORD(hist, start) ((void) 0)
+#define INSTR_RECORD_COMMAND(name, start) ((void) 0)
+#define INSTR_COUNT(counter, n) ((void) 0)
+
+#endif // SMOCK_INSTRUMENT
+
+/*
+ * Write count, mean, percentiles and maximum of every histogram that has
+ * samples, followed by all nonzero counters
+ *   out: Stream to write the report to
+ */
+void instr_report(FILE *out);
+
+/*
+ * Arrange for a report to be written when the program exits if the
+ * SMOCK_STATS environment variable is set: to stderr if it is "1" or "-",
+ * otherwise to the file it names
+ */
+void instr_report_at_exit_from_env(void);
+
+#endif // INSTRUMENT_H
@@ -0,0 +1,474 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "instrument.h"
+#include "matrix.h"
+#include "matrix_alloc.h"
+#include "matrix_io.h"
+#include "matrix_nt.h"
+
+// The header takes a full cache line so the elements after it stay aligned.
+#define MATRIX_HEADER_SIZE 64
+
+_Static_assert(sizeof(matrix_t) <= MATRIX_HEADER_SIZE, "matrix_t must fit its header slot");
+
+// Number of ints whose sum always fits in a long, since |int| <= 2^31.
+#define MATRIX_SUM_BLOCK ((size_t) 1 << 32)
+
+_Static_assert(sizeof(long) >= 8 && sizeof(size_t) >= 8, "MATRIX_SUM_BLOCK assumes a 64-bit target");
+
+// Elements per block of the cached maximum. A put that lowers a block's
+// maximum rescans this many elements.
+#define MATRIX_AGG_BLOCK 256
+
+/*
+ * Cached aggregates of one matrix
+ *   valid: Whether the fields below match the elements
+ *   sum: Sum of all elements
+ *   n_leaves: Leaves of 'tree', the number of blocks rounded up to a power of two
+ *   tree: Segment tree of block maxima. Leaf tree[n_leaves + b] is the
+ *     maximum of block b, or INT_MIN past the last block, and every other
+ *     tree[i] is the larger of tree[2i] and tree[2i + 1], so tree[1] is the
+ *     maximum of the whole matrix.
+ */
+struct matrix_agg {
+    int valid;
+    long sum;
+    size_t n_leaves;
+    int tree[];
+};
+
+// 16-byte vectors of longs, as in matrix_ops.c, each filled from two ints.
+typedef int vec_i32x2 __attribute__((vector_size(2 * sizeof(int))));
+typedef long vec_i64 __attribute__((vector_size(2 * sizeof(long))));
+
+static size_t matrix_block_size(unsigned nrows, unsigned ncols) {
+    return MATRIX_HEADER_SIZE + (size_t) nrows * ncols * sizeof(int);
+}
+
+matrix_t *matrix_init(unsigned nrows, unsigned ncols) {
+    // Header and elements share one block from the matrix allocator.
+    char *block = matrix_alloc(matrix_block_size(nrows, ncols));
+    if (block == NULL) {
+        return NULL;
+    }
+    matrix_t *mat = (matrix_t *) block;
+    mat->data = (int *) (block + MATRIX_HEADER_SIZE);
+    mat->nrows = nrows;
+    mat->ncols = ncols;
+    mat->agg = NULL;
+    return mat;
+}
+
+void matrix_free(matrix_t *mat) {
+    free(mat->agg);
+    matrix_dealloc(mat, matrix_block_size(mat->nrows, mat->ncols));
+}
+
+// Sums 'n' ints, widening each to a long before it is added.
+static long sum_range(const int *data, size_t n) {
+    // Two accumulators keep two vector adds in flight per iteration.
+    vec_i64 acc0 = {0, 0};
+    vec_i64 acc1 = {0, 0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vec_i32x2 lo;
+        vec_i32x2 hi;
+        memcpy(&lo, data + i, sizeof(lo));
+        memcpy(&hi, data + i + 2, sizeof(hi));
+        acc0 += __builtin_convertvector(lo, vec_i64);
+        acc1 += __builtin_convertvector(hi, vec_i64);
+    }
+    acc0 += acc1;
+    long sum = acc0[0] + acc0[1];
+    for (; i < n; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+static int block_max(const matrix_t *mat, size_t block) {
+    size_t n = (size_t) mat->nrows * mat->ncols;
+    size_t start = block * MATRIX_AGG_BLOCK;
+    size_t end = n - start < MATRIX_AGG_BLOCK ? n : start + MATRIX_AGG_BLOCK;
+    int max = INT_MIN;
+    for (size_t i = start; i < end; i++) {
+        if (max < mat->data[i]) {
+            max = mat->data[i];
+        }
+    }
+    return max;
+}
+
+// Recomputes every cached aggregate from the elements.
+static void agg_rebuild(matrix_t *mat) {
+    struct matrix_agg *agg = mat->agg;
+    size_t n = (size_t) mat->nrows * mat->ncols;
+    size_t n_blocks = (n + MATRIX_AGG_BLOCK - 1) / MATRIX_AGG_BLOCK;
+    agg->sum = sum_range(mat->data, n);
+    for (size_t b = 0; b < agg->n_leaves; b++) {
+        agg->tree[agg->n_leaves + b] = b < n_blocks ? block_max(mat, b) : INT_MIN;
+    }
+    for (size_t i = agg->n_leaves - 1; i > 0; i--) {
+        int left = agg->tree[2 * i];
+        int right = agg->tree[2 * i + 1];
+        agg->tree[i] = left > right ? left : right;
+    }
+    agg->valid = 1;
+}
+
+// Sets the maximum of one block and updates the tree above it.
+static void agg_set_block(struct matrix_agg *agg, size_t block, int max) {
+    size_t i = agg->n_leaves + block;
+    agg->tree[i] = max;
+    for (i /= 2; i > 0; i /= 2) {
+        int left = agg->tree[2 * i];
+        int right = agg->tree[2 * i + 1];
+        int node = left > right ? left : right;
+        // Nodes further up only change if this one does.
+        if (agg->tree[i] == node) {
+            break;
+        }
+        agg->tree[i] = node;
+    }
+}
+
+int matrix_agg_enable(matrix_t *mat) {
+    if (mat->agg != NULL) {
+        return 0;
+    }
+    size_t n = (size_t) mat->nrows * mat->ncols;
+    size_t n_blocks = (n + MATRIX_AGG_BLOCK - 1) / MATRIX_AGG_BLOCK;
+    size_t n_leaves = 1;
+    while (n_leaves < n_blocks) {
+        n_leaves *= 2;
+    }
+    mat->agg = malloc(sizeof(struct matrix_agg) + 2 * n_leaves * sizeof(int));
+    if (mat->agg == NULL) {
+        return -1;
+    }
+    mat->agg->n_leaves = n_leaves;
+    agg_rebuild(mat);
+    return 0;
+}
+
+void matrix_agg_invalidate(matrix_t *mat) {
+    if (mat->agg != NULL) {
+        mat->agg->valid = 0;
+    }
+}
+
+int matrix_agg_valid(const matrix_t *mat) {
+    return mat->agg != NULL && mat->agg->valid;
+}
+
+void matrix_put(matrix_t *mat, unsigned i, unsigned j, int val) {
+    size_t index = (size_t) i * mat->ncols + j;
+    struct matrix_agg *agg = mat->agg;
+    if (agg == NULL) {
+        mat->data[index] = val;
+        return;
+    }
+
+    if (!agg->valid) {
+        agg_rebuild(mat);
+    }
+    int old = mat->data[index];
+    mat->data[index] = val;
+    agg->sum += (long) val - old;
+    size_t block = index / MATRIX_AGG_BLOCK;
+    int max = agg->tree[agg->n_leaves + block];
+    if (val > max) {
+        agg_set_block(agg, block, val);
+    } else if (old == max && val < old) {
+        // The old value may have been the block's only maximum.
+        agg_set_block(agg, block, block_max(mat, block));
+    }
+}
+
+int matrix_get(const matrix_t *mat, unsigned i, unsigned j) {
+    return mat->data[(size_t) i * mat->ncols + j];
+}
+
+long matrix_sum(const matrix_t *mat) {
+    INSTR_START(start);
+    long sum = mat->agg != NULL && mat->agg->valid
+               ? mat->agg->sum : sum_range(mat->data, (size_t) mat->nrows * mat->ncols);
+    INSTR_RECORD(INSTR_SUM, start);
+    return sum;
+}
+
+int matrix_sum_checked(const matrix_t *mat, long *result) {
+    INSTR_START(start);
+    size_t n = (size_t) mat->nrows * mat->ncols;
+    long sum = 0;
+    for (size_t done = 0; done < n;) {
+        // No block of this many ints can overflow a long on its own.
+        size_t len = n - done < MATRIX_SUM_BLOCK ? n - done : MATRIX_SUM_BLOCK;
+        if (__builtin_add_overflow(sum, sum_range(mat->data + done, len), &sum)) {
+            return -1;
+        }
+        done += len;
+    }
+    *result = sum;
+    INSTR_RECORD(INSTR_SUM, start);
+    return 0;
+}
+
+long matrix_max(const matrix_t *mat) {
+    INSTR_START(start);
+    if (mat->agg != NULL && mat->agg->valid) {
+        INSTR_RECORD(INSTR_MAX, start);
+        return mat->agg->tree[1];
+    }
+    size_t n = (size_t) mat->nrows * mat->ncols;
+    long max = mat->data[0];
+    for (size_t i = 1; i < n; i++) {
+        if (max < mat->data[i]) {
+            max = mat->data[i];
+        }
+    }
+    INSTR_RECORD(INSTR_MAX, start);
+    return max;
+}
+
+matrix_t *matrix_copy(const matrix_t *src) {
+    matrix_t *copy = matrix_init(src->nrows, src->ncols);
+    if (copy == NULL) {
+        return NULL;
+    }
+    // The copy is usually modified in only a few places, so a large one is
+    // streamed past the cache rather than evicting what other threads use.
+    matrix_nt_copy(copy->data, src->data, (size_t) src->nrows * src->ncols);
+    return copy;
+}
+
+// Bytes formatted before each write to the file; at least TEXT_MAX_TOKEN more than a row needs.
+#define TEXT_WRITE_SIZE (64 * 1024)
+// Longest piece appended at once: an int with its trailing space, or a newline
+#define TEXT_MAX_TOKEN 16
+// Bytes read from a text file at once, and so the longest token it may hold
+#define TEXT_READ_SIZE (4 * 1024 * 1024)
+
+// Appends 'val' and a space as fprintf's "%d " would. Returns the bytes appended.
+static size_t format_int(char *out, int val) {
+    char digits[10];
+    unsigned long mag = val < 0 ? -(long) val : val;
+    size_t n_digits = 0;
+    size_t len = 0;
+    do {
+        digits[n_digits++] = '0' + mag % 10;
+        mag /= 10;
+    } while (mag > 0);
+    if (val < 0) {
+        out[len++] = '-';
+    }
+    while (n_digits > 0) {
+        out[len++] = digits[--n_digits];
+    }
+    out[len++] = ' ';
+    return len;
+}
+
+int matrix_write_text(const matrix_t *mat, const char *file_name) {
+    INSTR_START(start);
+    // Elements are formatted into a buffer and written a buffer at a time.
+    char *buf = malloc(TEXT_WRITE_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+    matrix_io_file_t file;
+    // A rough size, which only picks the I/O backend
+    size_t size_hint = (size_t) mat->nrows * mat->ncols * 4;
+    if (matrix_io_open_write(&file, file_name, size_hint) != 0) {
+        free(buf);
+        return -1;
+    }
+
+    int ret = 0;
+    size_t len = sprintf(buf, "%u %u\n", mat->nrows, mat->ncols);
+    for (unsigned i = 0; i < mat->nrows && ret == 0; i++) {
+        for (unsigned j = 0; j <= mat->ncols && ret == 0; j++) {
+            if (len > TEXT_WRITE_SIZE - TEXT_MAX_TOKEN) {
+                ret = matrix_io_write(&file, buf, len);
+                len = 0;
+            }
+            if (j < mat->ncols) {
+                len += format_int(buf + len, matrix_get(mat, i, j));
+            } else {
+                // Separates each row with a newline.
+                buf[len++] = '\n';
+            }
+        }
+    }
+    if (ret == 0 && len > 0) {
+        ret = matrix_io_write(&file, buf, len);
+    }
+
+    free(buf);
+    if (matrix_io_close(&file) != 0 || ret != 0) {
+        return -1;
+    }
+    INSTR_RECORD(INSTR_WRITE_TEXT, start);
+    return 0;
+}
+
+/*
+ * Whitespace-separated tokens of a text file, read a buffer at a time
+ *   cap: Bytes 'buf' holds, plus one for a terminating zero
+ *   start, end: The bytes of 'buf' not yet parsed
+ *   eof: Whether the whole file has been read into 'buf'
+ */
+typedef struct {
+    matrix_io_file_t *file;
+    char *buf;
+    size_t cap;
+    size_t start;
+    size_t end;
+    int eof;
+} text_reader_t;
+
+/*
+ * Parses the next token as a decimal integer
+ * Returns 0 on success or -1 at the end of the file, on a read error, or if
+ * the token is not an integer
+ */
+static int text_next(text_reader_t *r, long *val) {
+    while (1) {
+        while (r->start < r->end && isspace((unsigned char) r->buf[r->start])) {
+            r->start++;
+        }
+        size_t token_end = r->start;
+        while (token_end < r->end && !isspace((unsigned char) r->buf[token_end])) {
+            token_end++;
+        }
+        // A token running up to the end of the buffer may continue in the next read.
+        if (r->start < r->end && (token_end < r->end || r->eof)) {
+            char *token = r->buf + r->start;
+            char *parsed_end;
+            r->buf[token_end] = '\0';
+            r->start = token_end < r->end ? token_end + 1 : token_end;
+            errno = 0;
+            *val = strtol(token, &parsed_end, 10);
+            return parsed_end == token || *parsed_end != '\0' || errno != 0 ? -1 : 0;
+        } else if (r->eof) {
+            return -1;
+        }
+
+        // Keep the partial token at the front and read more after it.
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+        if (r->end == r->cap) {
+            return -1;
+        }
+        ssize_t got = matrix_io_read(r->file, r->buf + r->end, r->cap - r->end);
+        if (got < 0) {
+            return -1;
+        } else if (got == 0) {
+            r->eof = 1;
+        }
+        r->end += got;
+    }
+}
+
+matrix_t *matrix_read_text(const char *file_name) {
+    INSTR_START(start);
+    matrix_io_file_t file;
+    if (matrix_io_open_read(&file, file_name) != 0) {
+        return NULL;
+    }
+    text_reader_t reader = {.file = &file};
+    reader.cap = file.size < TEXT_READ_SIZE ? file.size : TEXT_READ_SIZE;
+    reader.buf = malloc(reader.cap + 1);
+
+    long nrows;
+    long ncols;
+    if (reader.buf == NULL || text_next(&reader, &nrows) != 0 || text_next(&reader, &ncols) != 0 ||
+        nrows < 0 || nrows > UINT_MAX || ncols < 0 || ncols > UINT_MAX) {
+        free(reader.buf);
+        matrix_io_close(&file);
+        return NULL;
+    }
+    matrix_t *mat = matrix_init(nrows, ncols);
+    if (mat == NULL) {
+        free(reader.buf);
+        matrix_io_close(&file);
+        return NULL;
+    }
+
+    size_t n = (size_t) nrows * ncols;
+    for (size_t i = 0; i < n; i++) {
+        long val;
+        if (text_next(&reader, &val) != 0 || val < INT_MIN || val > INT_MAX) {
+            matrix_free(mat);
+            free(reader.buf);
+            matrix_io_close(&file);
+            return NULL;
+        }
+        mat->data[i] = val;
+    }
+
+    free(reader.buf);
+    matrix_io_close(&file);
+    INSTR_RECORD(INSTR_READ_TEXT, start);
+    return mat;
+}
+
+int matrix_write_bin(const matrix_t *mat, const char *file_name) {
+    INSTR_START(start);
+    // Header is the number of rows then columns, followed by row-major data.
+    unsigned dims[2] = {mat->nrows, mat->ncols};
+    size_t n = (size_t) mat->nrows * mat->ncols;
+    matrix_io_file_t file;
+    if (matrix_io_open_write(&file, file_name, sizeof(dims) + n * sizeof(int)) != 0) {
+        return -1;
+    }
+    int ret = 0;
+    if (matrix_io_write(&file, dims, sizeof(dims)) != 0 ||
+        matrix_io_write(&file, mat->data, n * sizeof(int)) != 0) {
+        ret = -1;
+    }
+    if (matrix_io_close(&file) != 0 || ret != 0) {
+        return -1;
+    }
+    INSTR_RECORD(INSTR_WRITE_BIN, start);
+    return 0;
+}
+
+matrix_t *matrix_read_bin(const char *file_name) {
+    INSTR_START(start);
+    matrix_io_file_t file;
+    if (matrix_io_open_read(&file, file_name) != 0) {
+        return NULL;
+    }
+
+    // Checking the size first keeps a damaged header from allocating a huge matrix.
+    unsigned dims[2];
+    if (matrix_io_read(&file, dims, sizeof(dims)) != sizeof(dims) ||
+        (size_t) (file.size - sizeof(dims)) / sizeof(int) < (size_t) dims[0] * dims[1]) {
+        matrix_io_close(&file);
+        return NULL;
+    }
+    matrix_t *mat = matrix_init(dims[0], dims[1]);
+    if (mat == NULL) {
+        matrix_io_close(&file);
+        return NULL;
+    }
+
+    // The data is contiguous on disk and in memory, so it is read in one call
+    // that keeps several pieces in flight.
+    size_t bytes = (size_t) dims[0] * dims[1] * sizeof(int);
+    if (matrix_io_read(&file, mat->data, bytes) != (ssize_t) bytes) {
+        matrix_free(mat);
+        matrix_io_close(&file);
+        return NULL;
+    }
+
+    matrix_io_close(&file);
+    INSTR_RECORD(INSTR_READ_BIN, start);
+    return mat;
+}
@@ -1,16 +1,22 @@
 #ifndef SMOCK_FUNC_H
 #define SMOCK_FUNC_H
 
+#include "cancel.h"
+
+struct matrix_agg;
+
 /*
  * Matrix data structure
  * data: One-dimensional integer array (dynamically allocated)
  * nrows: Number of rows in matrix
  * ncols: Number of columns in matrix
+ * agg: Cached sum and maximum, or NULL if not enabled (see matrix_agg_enable)
  */
 typedef struct {
     int *data;
     unsigned nrows;
     unsigned ncols;
+    struct matrix_agg *agg;
 } matrix_t;
 
 /*
@@ -54,6 +60,16 @@ int matrix_get(const matrix_t *mat, unsigned i, unsigned j);
  */
 long matrix_sum(const matrix_t *mat);
 
+/*
+ * Computes sum of all matrix elements, failing instead of wrapping around
+ * The sum is exact in a long for matrices of up to 2^32 elements, so this
+ * checks for overflow once per 2^32 elements and runs as fast as matrix_sum.
+ * 'mat': Pointer to matrix containing elements to sum
+ * 'result': Pointer to memory where the sum will be stored
+ * Returns 0 on success or -1 if the sum does not fit in a long
+ */
+int matrix_sum_checked(const matrix_t *mat, long *result);
+
 /*
  * Computes maximum of all matrix elements
  * 'mat': Pointer to matrix instance
@@ -61,6 +77,48 @@ long matrix_sum(const matrix_t *mat);
  */
 long matrix_max(const matrix_t *mat);
 
+/*
+ * Start caching the sum and maximum of a matrix, so that matrix_sum and
+ * matrix_max return at once. matrix_put keeps the sum current in constant
+ * time and the maximum through a segment tree of block maxima, in time
+ * logarithmic in the number of blocks, plus a scan of one block when a put
+ * lowers that block's maximum. Does nothing if caching is already enabled.
+ * 'mat': Pointer to matrix instance
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+int matrix_agg_enable(matrix_t *mat);
+
+/*
+ * Mark the cached sum and maximum of a matrix as out of date, which any code
+ * writing 'data' other than through matrix_put must do. matrix_sum and
+ * matrix_max then scan the elements until the next matrix_put rebuilds the
+ * cache. Does nothing if caching is not enabled.
+ * 'mat': Pointer to matrix instance
+ */
+void matrix_agg_invalidate(matrix_t *mat);
+
+/*
+ * Whether matrix_sum and matrix_max will return cached values without
+ * scanning the elements
+ * 'mat': Pointer to matrix instance
+ */
+int matrix_agg_valid(const matrix_t *mat);
+
+/*
+ * Create a new matrix holding a copy of another matrix's elements
+ * 'src': Pointer to matrix instance to copy
+ * Returns a pointer to a new matrix_t on success or NULL on failure
+ */
+matrix_t *matrix_copy(const matrix_t *src);
+
+/*
+ * Write matrix data to a text file
+ * 'mat': Pointer to matrix instance to save
+ * 'file_name': String storing name of file to write to
+ * Returns 0 on success or -1 on error
+ */
+int matrix_write_text(const matrix_t *mat, const char *file_name);
+
 /*
  * Read matrix data from a text file
  * 'file_name': String storing name of file to read from
@@ -68,6 +126,21 @@ long matrix_max(const matrix_t *mat);
  */
 matrix_t *matrix_read_text(const char *file_name);
 
+/*
+ * Write matrix data to a binary file
+ * 'mat': Pointer to matrix instance to save
+ * 'file_name': String storing name of file to read from
+ * Returns 0 on success or -1 on error
+ */
+int matrix_write_bin(const matrix_t *mat, const char *file_name);
+
+/*
+ * Read matrix data from a binary file
+ * 'file_name': String storing name of file to read from
+ * Returns pointer to new matrix read from file on success, or NULL on error
+ */
+matrix_t *matrix_read_bin(const char *file_name);
+
 /*
  * Computes the sum of all matrix elements in parallel with n_threads threads
  * 'mat': Pointer to matrix instance
@@ -82,8 +155,51 @@ int matrix_parallel_sum(const matrix_t *mat, unsigned n_threads, long *result);
  * 'mat': Pointer to matrix instance
  * 'n_threads': Number of threads to run in parallel, assumed to be non-zero
  * 'result': Pointer to memory where result will be stored
- * Returns 0 on success or -1 on error
+ * Returns 0 on success or -1 on error or if the matrix is empty
  */
 int matrix_parallel_max(const matrix_t *mat, unsigned n_threads, long *result);
 
+/*
+ * How matrix_parallel_sum_sched and matrix_parallel_max_sched divide a
+ * matrix between their threads
+ *   MATRIX_SCHED_STATIC: Equal runs of rows, fixed before the threads start
+ *   MATRIX_SCHED_DYNAMIC: Chunks of MATRIX_SCHED_CHUNK elements, each taken
+ *     by whichever thread is free next
+ *   MATRIX_SCHED_GUIDED: Like dynamic, but each chunk is a share of the
+ *     elements still unclaimed, shrinking to MATRIX_SCHED_MIN_CHUNK
+ * With dynamic and guided scheduling, a thread that is slowed down (by a
+ * preempted core or a busy SMT sibling) takes fewer chunks instead of
+ * holding up the others at the end.
+ */
+typedef enum {
+    MATRIX_SCHED_STATIC,
+    MATRIX_SCHED_DYNAMIC,
+    MATRIX_SCHED_GUIDED
+} matrix_sched_t;
+
+#define MATRIX_SCHED_CHUNK (64 * 1024)
+#define MATRIX_SCHED_MIN_CHUNK (16 * 1024)
+
+/*
+ * matrix_parallel_sum and matrix_parallel_max with a choice of scheduling
+ * 'sched': How elements are divided between the threads
+ * 'cancel': Token checked between chunks of MATRIX_SCHED_CHUNK elements, or NULL
+ * Returns 0 on success or -1 on error or if cancelled before the last chunk
+ */
+int matrix_parallel_sum_sched(const matrix_t *mat, unsigned n_threads, matrix_sched_t sched,
+                              const cancel_token_t *cancel, long *result);
+int matrix_parallel_max_sched(const matrix_t *mat, unsigned n_threads, matrix_sched_t sched,
+                              const cancel_token_t *cancel, long *result);
+
+/*
+ * Parse "static", "dynamic" or "guided"
+ * Returns the schedule, or -1 if 'name' is none of them
+ */
+int matrix_sched_parse(const char *name);
+
+/*
+ * Name of a schedule, e.g. "guided"
+ */
+const char *matrix_sched_name(matrix_sched_t sched);
+
 #endif // SMOCK_FUNC_H
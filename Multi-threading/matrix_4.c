@@ -4,25 +4,40 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include "instrument.h"
 #include "matrix.h"
 
+/*
+ * Rows handed to one thread of a statically scheduled reduction
+ *   cancel: Checked every MATRIX_SCHED_CHUNK elements, may be NULL
+ *   stopped: Set by the thread if it was cancelled before its last row
+ */
 typedef struct {
     const matrix_t *mat;
     unsigned start;
     unsigned rows_to_add;
+    const cancel_token_t *cancel;
+    int stopped;
 } thread_task_t;
 
 void *parallel_sum_func(void *information) {
     //Making variables local for easier access.
-    const matrix_t *mat = ((thread_task_t *) information)->mat;
-    unsigned start = ((thread_task_t *) information)->start;
-    unsigned rows_to_add = ((thread_task_t *) information)->rows_to_add;
-    unsigned nums_to_add = rows_to_add * mat->ncols;
-    unsigned start_idx = start * mat->ncols;
+    thread_task_t *task = information;
+    const matrix_t *mat = task->mat;
+    size_t nums_to_add = (size_t) task->rows_to_add * mat->ncols;
+    size_t start_idx = (size_t) task->start * mat->ncols;
     long temp_sum = 0;
-    
-    for (unsigned i = 0; i < nums_to_add; i++) {
-        temp_sum += mat->data[start_idx + i];
+
+    for (size_t done = 0; done < nums_to_add; done += MATRIX_SCHED_CHUNK) {
+        if (cancel_requested(task->cancel) != CANCEL_NONE) {
+            task->stopped = 1;
+            break;
+        }
+        size_t end = nums_to_add - done < MATRIX_SCHED_CHUNK ? nums_to_add
+                                                             : done + MATRIX_SCHED_CHUNK;
+        for (size_t i = done; i < end; i++) {
+            temp_sum += mat->data[start_idx + i];
+        }
     }
 
     return (void *) temp_sum;
@@ -30,23 +45,39 @@ void *parallel_sum_func(void *information) {
 
 void *parallel_max_func(void *information) {
     // Making variables local for easier access.
-    const matrix_t *mat = ((thread_task_t *) information)->mat;
-    unsigned ncols = mat->ncols;
-    unsigned index = ((thread_task_t *) information)->start * ncols;
-    unsigned nums_to_add = ((thread_task_t *) information)->rows_to_add * ncols;
+    thread_task_t *task = information;
+    const matrix_t *mat = task->mat;
+    size_t start_idx = (size_t) task->start * mat->ncols;
+    size_t nums_to_add = (size_t) task->rows_to_add * mat->ncols;
     long temp_max = mat->data[0];
 
-    for (unsigned i = 0; i < nums_to_add; i++) {
-        if (temp_max <= mat->data[index]) {
-            temp_max = mat->data[index];
+    for (size_t done = 0; done < nums_to_add; done += MATRIX_SCHED_CHUNK) {
+        if (cancel_requested(task->cancel) != CANCEL_NONE) {
+            task->stopped = 1;
+            break;
+        }
+        size_t end = nums_to_add - done < MATRIX_SCHED_CHUNK ? nums_to_add
+                                                             : done + MATRIX_SCHED_CHUNK;
+        for (size_t i = done; i < end; i++) {
+            if (temp_max <= mat->data[start_idx + i]) {
+                temp_max = mat->data[start_idx + i];
+            }
         }
-        index++;
     }
 
     return (void *) temp_max;
 }
 
-int matrix_parallel_sum(const matrix_t *mat, unsigned n_threads, long *result) {
+// Wait for the first 'n_started' threads, discarding their results
+static void join_started(pthread_t *threads, unsigned n_started) {
+    for (unsigned i = 0; i < n_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static int static_sum(const matrix_t *mat, unsigned n_threads, const cancel_token_t *cancel,
+                      long *result) {
+    INSTR_START(start);
     pthread_t threads[n_threads];
     unsigned nrows = mat->nrows;
     unsigned rows_to_offset = nrows % n_threads;
@@ -60,6 +91,8 @@ int matrix_parallel_sum(const matrix_t *mat, unsigned n_threads, long *result) {
     for (unsigned i = 0; i < n_threads; i++) {
         all_info[i].mat = mat;
         all_info[i].start = start_index;
+        all_info[i].cancel = cancel;
+        all_info[i].stopped = 0;
 
         all_info[i].rows_to_add = nrows / n_threads;
         //Some threads are given an extra row to accomodate the above's remainder
@@ -70,12 +103,15 @@ int matrix_parallel_sum(const matrix_t *mat, unsigned n_threads, long *result) {
         int err = pthread_create(&threads[i], NULL, parallel_sum_func, (void *) &all_info[i]);
         if (err != 0) {
             fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            // Threads already started still read 'all_info', so join them.
+            join_started(threads, i);
             return -1;
         }
         start_index = start_index + all_info[i].rows_to_add;
     }
 
     long sum = 0;
+    int stopped = 0;
     for (unsigned i = 0; i < n_threads; i++) {
         long local_sum;
         int err = pthread_join(threads[i], (void **) &local_sum);
@@ -84,13 +120,23 @@ int matrix_parallel_sum(const matrix_t *mat, unsigned n_threads, long *result) {
             return -1;
         }
         sum += local_sum;
+        stopped |= all_info[i].stopped;
+    }
+    if (stopped) {
+        return -1;
     }
 
     *result = sum;
+    INSTR_RECORD(INSTR_PARALLEL_SUM, start);
     return 0;
 }
 
-int matrix_parallel_max(const matrix_t *mat, unsigned n_threads, long *result) {
+static int static_max(const matrix_t *mat, unsigned n_threads, const cancel_token_t *cancel,
+                      long *result) {
+    INSTR_START(start);
+    if ((size_t) mat->nrows * mat->ncols == 0) {
+        return -1;
+    }
     long max = mat->data[0];
     pthread_t threads[n_threads];
     unsigned start_row = 0;
@@ -102,6 +148,8 @@ int matrix_parallel_max(const matrix_t *mat, unsigned n_threads, long *result) {
     for (unsigned i = 0; i < n_threads; i++) {
         all_info[i].mat = mat;
         all_info[i].start = start_row;
+        all_info[i].cancel = cancel;
+        all_info[i].stopped = 0;
 
         all_info[i].rows_to_add = mat->nrows / n_threads;
         //Some threads are given an extra row to accomodate the above's remainder
@@ -113,13 +161,15 @@ int matrix_parallel_max(const matrix_t *mat, unsigned n_threads, long *result) {
         int err = pthread_create(&threads[i], NULL, parallel_max_func, (void *) &all_info[i]);
         if (err != 0) {
             fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            // Threads already started still read 'all_info', so join them.
+            join_started(threads, i);
             return -1;
         }
 
         start_row += all_info[i].rows_to_add;
     }
 
-
+    int stopped = 0;
     for (unsigned i = 0; i < n_threads; i++) {
         long local_max;
         int err = pthread_join(threads[i], (void **) &local_max);
@@ -131,9 +181,195 @@ int matrix_parallel_max(const matrix_t *mat, unsigned n_threads, long *result) {
         if (max <= local_max) {
             max = local_max;
         }
+        stopped |= all_info[i].stopped;
+    }
+    if (stopped) {
+        return -1;
     }
 
     *result = max;
+    INSTR_RECORD(INSTR_PARALLEL_MAX, start);
+    return 0;
+}
 
+int matrix_parallel_sum(const matrix_t *mat, unsigned n_threads, long *result) {
+    return static_sum(mat, n_threads, NULL, result);
+}
+
+int matrix_parallel_max(const matrix_t *mat, unsigned n_threads, long *result) {
+    return static_max(mat, n_threads, NULL, result);
+}
+
+/*
+ * State shared by the threads of one self-scheduled reduction
+ *   mat: The matrix being reduced
+ *   n: Number of elements in the matrix
+ *   cursor: First element no thread has claimed yet
+ *   n_threads: Number of threads claiming chunks
+ *   sched: How chunk sizes are chosen
+ *   cancel: Checked before each chunk is claimed, may be NULL
+ *   stopped: Set once a thread finds the reduction cancelled
+ */
+typedef struct {
+    const matrix_t *mat;
+    size_t n;
+    size_t cursor;
+    unsigned n_threads;
+    matrix_sched_t sched;
+    const cancel_token_t *cancel;
+    int stopped;
+} shared_cursor_t;
+
+static const char *const sched_names[] = {"static", "dynamic", "guided"};
+
+int matrix_sched_parse(const char *name) {
+    for (int s = MATRIX_SCHED_STATIC; s <= MATRIX_SCHED_GUIDED; s++) {
+        if (strcmp(name, sched_names[s]) == 0) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+const char *matrix_sched_name(matrix_sched_t sched) {
+    return sched_names[sched];
+}
+
+// Claims the next chunk and stores its first element in 'start'.
+// Returns its length, or 0 once every element has been claimed or the
+// reduction has been cancelled.
+static size_t claim_chunk(shared_cursor_t *s, size_t *start) {
+    if (cancel_requested(s->cancel) != CANCEL_NONE) {
+        __atomic_store_n(&s->stopped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (s->sched == MATRIX_SCHED_DYNAMIC) {
+        *start = __atomic_fetch_add(&s->cursor, MATRIX_SCHED_CHUNK, __ATOMIC_RELAXED);
+        if (*start >= s->n) {
+            return 0;
+        }
+        return s->n - *start < MATRIX_SCHED_CHUNK ? s->n - *start : MATRIX_SCHED_CHUNK;
+    }
+
+    // Guided: half of an even share of what is left, so that the last
+    // chunks are small enough for the other threads to absorb a straggler.
+    size_t claimed = __atomic_load_n(&s->cursor, __ATOMIC_RELAXED);
+    size_t len;
+    do {
+        if (claimed >= s->n) {
+            return 0;
+        }
+        size_t remaining = s->n - claimed;
+        len = remaining / (2 * s->n_threads);
+        if (len < MATRIX_SCHED_MIN_CHUNK) {
+            len = remaining < MATRIX_SCHED_MIN_CHUNK ? remaining : MATRIX_SCHED_MIN_CHUNK;
+        }
+    } while (!__atomic_compare_exchange_n(&s->cursor, &claimed, claimed + len, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *start = claimed;
+    return len;
+}
+
+static void *sched_sum_func(void *information) {
+    shared_cursor_t *s = information;
+    const int *data = s->mat->data;
+    long temp_sum = 0;
+    size_t start;
+    size_t len;
+    while ((len = claim_chunk(s, &start)) > 0) {
+        for (size_t i = start; i < start + len; i++) {
+            temp_sum += data[i];
+        }
+    }
+    return (void *) temp_sum;
+}
+
+static void *sched_max_func(void *information) {
+    shared_cursor_t *s = information;
+    const int *data = s->mat->data;
+    long temp_max = LONG_MIN;
+    size_t start;
+    size_t len;
+    while ((len = claim_chunk(s, &start)) > 0) {
+        for (size_t i = start; i < start + len; i++) {
+            if (temp_max < data[i]) {
+                temp_max = data[i];
+            }
+        }
+    }
+    return (void *) temp_max;
+}
+
+// Runs 'func' on n_threads threads sharing one cursor and stores each
+// thread's result in 'results'. Returns 0 on success or -1 on error.
+static int run_self_scheduled(const matrix_t *mat, unsigned n_threads, matrix_sched_t sched,
+                              const cancel_token_t *cancel, void *(*func)(void *), long *results) {
+    pthread_t threads[n_threads];
+    shared_cursor_t shared = {mat, (size_t) mat->nrows * mat->ncols, 0, n_threads, sched,
+                              cancel, 0};
+    unsigned started = 0;
+    int ret = 0;
+
+    for (; started < n_threads; started++) {
+        int err = pthread_create(&threads[started], NULL, func, &shared);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            ret = -1;
+            break;
+        }
+    }
+
+    // Threads already started still use 'shared', so join them all.
+    for (unsigned i = 0; i < started; i++) {
+        int err = pthread_join(threads[i], (void **) &results[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(err));
+            ret = -1;
+        }
+    }
+    // A chunk left unclaimed means the results are incomplete.
+    return shared.stopped ? -1 : ret;
+}
+
+int matrix_parallel_sum_sched(const matrix_t *mat, unsigned n_threads, matrix_sched_t sched,
+                              const cancel_token_t *cancel, long *result) {
+    if (sched == MATRIX_SCHED_STATIC) {
+        return static_sum(mat, n_threads, cancel, result);
+    }
+    INSTR_START(start);
+    long local_sums[n_threads];
+    if (run_self_scheduled(mat, n_threads, sched, cancel, sched_sum_func, local_sums) != 0) {
+        return -1;
+    }
+    long sum = 0;
+    for (unsigned i = 0; i < n_threads; i++) {
+        sum += local_sums[i];
+    }
+    *result = sum;
+    INSTR_RECORD(INSTR_PARALLEL_SUM, start);
+    return 0;
+}
+
+int matrix_parallel_max_sched(const matrix_t *mat, unsigned n_threads, matrix_sched_t sched,
+                              const cancel_token_t *cancel, long *result) {
+    if (sched == MATRIX_SCHED_STATIC) {
+        return static_max(mat, n_threads, cancel, result);
+    }
+    if ((size_t) mat->nrows * mat->ncols == 0) {
+        return -1;
+    }
+    INSTR_START(start);
+    long local_maxes[n_threads];
+    if (run_self_scheduled(mat, n_threads, sched, cancel, sched_max_func, local_maxes) != 0) {
+        return -1;
+    }
+    long max = mat->data[0];
+    for (unsigned i = 0; i < n_threads; i++) {
+        if (max < local_maxes[i]) {
+            max = local_maxes[i];
+        }
+    }
+    *result = max;
+    INSTR_RECORD(INSTR_PARALLEL_MAX, start);
     return 0;
 }
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "matrix_alloc.h"
+
+// Classes are 64, 128, ... MATRIX_ALLOC_SMALL_MAX bytes.
+#define N_CLASSES 13
+#define SLAB_SIZE (1024 * 1024)
+// A thread's list for one class holds at most this many blocks before
+// handing half of them back to the shared list.
+#define THREAD_CACHE_MAX 64
+
+typedef struct free_block {
+    struct free_block *next;
+} free_block_t;
+
+typedef struct {
+    free_block_t *head;
+    unsigned count;
+} block_list_t;
+
+static block_list_t shared_lists[N_CLASSES];
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread block_list_t thread_cache[N_CLASSES];
+static __thread int thread_cache_registered;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static matrix_alloc_stats_t stats;
+
+#define STAT_ADD(field, amount) __atomic_fetch_add(&stats.field, (amount), __ATOMIC_RELAXED)
+#define STAT_SUB(field, amount) __atomic_fetch_sub(&stats.field, (amount), __ATOMIC_RELAXED)
+
+static void list_push(block_list_t *list, void *ptr) {
+    free_block_t *block = ptr;
+    block->next = list->head;
+    list->head = block;
+    list->count++;
+}
+
+static void *list_pop(block_list_t *list) {
+    free_block_t *block = list->head;
+    if (block != NULL) {
+        list->head = block->next;
+        list->count--;
+    }
+    return block;
+}
+
+// Moves up to 'n' blocks from 'src' to 'dest'.
+static void list_move(block_list_t *dest, block_list_t *src, unsigned n) {
+    for (unsigned i = 0; i < n && src->head != NULL; i++) {
+        list_push(dest, list_pop(src));
+    }
+}
+
+static unsigned size_class(size_t size) {
+    unsigned cls = 0;
+    size_t class_size = MATRIX_ALLOC_MIN_CLASS;
+    while (class_size < size) {
+        class_size <<= 1;
+        cls++;
+    }
+    return cls;
+}
+
+static size_t class_size(unsigned cls) {
+    return (size_t) MATRIX_ALLOC_MIN_CLASS << cls;
+}
+
+// Runs when a thread exits so its cached blocks are not lost.
+static void flush_thread_cache(void *cache) {
+    block_list_t *lists = cache;
+    pthread_mutex_lock(&shared_mutex);
+    for (unsigned cls = 0; cls < N_CLASSES; cls++) {
+        list_move(&shared_lists[cls], &lists[cls], lists[cls].count);
+    }
+    pthread_mutex_unlock(&shared_mutex);
+}
+
+static void create_cache_key(void) {
+    pthread_key_create(&cache_key, flush_thread_cache);
+}
+
+static void register_thread_cache(void) {
+    pthread_once(&cache_key_once, create_cache_key);
+    pthread_setspecific(cache_key, thread_cache);
+    thread_cache_registered = 1;
+}
+
+// Carves a new slab into blocks of class 'cls'. Called with shared_mutex held.
+static int refill_shared(unsigned cls) {
+    size_t size = class_size(cls);
+    char *slab = aligned_alloc(64, SLAB_SIZE);
+    if (slab == NULL) {
+        return -1;
+    }
+    for (size_t offset = 0; offset + size <= SLAB_SIZE; offset += size) {
+        list_push(&shared_lists[cls], slab + offset);
+    }
+    STAT_ADD(slab_bytes, SLAB_SIZE);
+    return 0;
+}
+
+static void *small_alloc(size_t size) {
+    unsigned cls = size_class(size);
+    block_list_t *cache = &thread_cache[cls];
+
+    void *ptr = list_pop(cache);
+    if (ptr != NULL) {
+        STAT_ADD(thread_cache_hits, 1);
+        STAT_ADD(small_allocs, 1);
+        return ptr;
+    }
+    if (!thread_cache_registered) {
+        register_thread_cache();
+    }
+
+    // Take a batch at once so the next few allocations need no lock.
+    pthread_mutex_lock(&shared_mutex);
+    if (shared_lists[cls].head == NULL && refill_shared(cls) != 0) {
+        pthread_mutex_unlock(&shared_mutex);
+        return NULL;
+    }
+    list_move(cache, &shared_lists[cls], THREAD_CACHE_MAX / 2);
+    pthread_mutex_unlock(&shared_mutex);
+
+    STAT_ADD(small_allocs, 1);
+    return list_pop(cache);
+}
+
+static void small_dealloc(void *ptr, size_t size) {
+    unsigned cls = size_class(size);
+    block_list_t *cache = &thread_cache[cls];
+    if (!thread_cache_registered) {
+        register_thread_cache();
+    }
+
+    list_push(cache, ptr);
+    STAT_ADD(small_frees, 1);
+    if (cache->count > THREAD_CACHE_MAX) {
+        pthread_mutex_lock(&shared_mutex);
+        list_move(&shared_lists[cls], cache, THREAD_CACHE_MAX / 2);
+        pthread_mutex_unlock(&shared_mutex);
+    }
+}
+
+// How the pages of a large block were obtained
+typedef enum {
+    LARGE_PLAIN,
+    LARGE_HUGETLB,
+    LARGE_THP
+} large_kind_t;
+
+/*
+ * Header stored at the start of every large block, before the caller's part
+ *   len: Length of the whole mapping
+ *   kind: How the mapping's pages were obtained
+ */
+typedef struct {
+    size_t len;
+    large_kind_t kind;
+} large_header_t;
+
+// Keeps the caller's part of a large block 64-byte aligned.
+#define LARGE_HEADER_SIZE 64
+
+/*
+ * Length of the mapping used for a large block. Blocks of at least one huge
+ * page are rounded to whole huge pages so they can be backed by them.
+ */
+static size_t large_length(size_t size) {
+    size_t unit = size >= MATRIX_ALLOC_HUGE_PAGE ? MATRIX_ALLOC_HUGE_PAGE
+                                                 : (size_t) sysconf(_SC_PAGESIZE);
+    return (size + unit - 1) / unit * unit;
+}
+
+// Which huge pages large blocks may use, set by SMOCK_HUGE_PAGES
+typedef enum {
+    HUGE_ANY,
+    HUGE_THP_ONLY,
+    HUGE_OFF
+} huge_mode_t;
+
+static huge_mode_t huge_mode(void) {
+    const char *env = getenv("SMOCK_HUGE_PAGES");
+    if (env != NULL && strcmp(env, "off") == 0) {
+        return HUGE_OFF;
+    } else if (env != NULL && strcmp(env, "thp") == 0) {
+        return HUGE_THP_ONLY;
+    }
+    return HUGE_ANY;
+}
+
+static void *map_large(size_t len, large_kind_t *kind) {
+    void *ptr;
+    huge_mode_t mode = huge_mode();
+    *kind = LARGE_PLAIN;
+    if (len < MATRIX_ALLOC_HUGE_PAGE || mode == HUGE_OFF) {
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return ptr == MAP_FAILED ? NULL : ptr;
+    }
+
+#ifdef MAP_HUGETLB
+    // Only succeeds if huge pages have been reserved on this system.
+    ptr = mode == HUGE_ANY ? mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)
+                           : MAP_FAILED;
+    if (ptr != MAP_FAILED) {
+        *kind = LARGE_HUGETLB;
+        return ptr;
+    }
+#endif
+
+    // Map an extra huge page so the block can start on a huge page boundary,
+    // then trim the unused head and tail.
+    char *raw = mmap(NULL, len + MATRIX_ALLOC_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    size_t head = (MATRIX_ALLOC_HUGE_PAGE - (size_t) raw % MATRIX_ALLOC_HUGE_PAGE)
+                  % MATRIX_ALLOC_HUGE_PAGE;
+    if (head > 0) {
+        munmap(raw, head);
+    }
+    munmap(raw + head + len, MATRIX_ALLOC_HUGE_PAGE - head);
+    ptr = raw + head;
+#ifdef MADV_HUGEPAGE
+    if (madvise(ptr, len, MADV_HUGEPAGE) == 0) {
+        *kind = LARGE_THP;
+    }
+#endif
+    return ptr;
+}
+
+static void *large_alloc(size_t size) {
+    size_t len = large_length(size + LARGE_HEADER_SIZE);
+    large_kind_t kind;
+    large_header_t *header = map_large(len, &kind);
+    if (header == NULL) {
+        return NULL;
+    }
+    header->len = len;
+    header->kind = kind;
+
+    STAT_ADD(large_allocs, 1);
+    STAT_ADD(large_bytes, len);
+    if (kind == LARGE_HUGETLB) {
+        STAT_ADD(huge_tlb_bytes, len);
+    } else if (kind == LARGE_THP) {
+        STAT_ADD(thp_bytes, len);
+    }
+    return (char *) header + LARGE_HEADER_SIZE;
+}
+
+static void large_dealloc(void *ptr) {
+    large_header_t *header = (large_header_t *) ((char *) ptr - LARGE_HEADER_SIZE);
+    size_t len = header->len;
+    large_kind_t kind = header->kind;
+
+    STAT_ADD(large_frees, 1);
+    STAT_SUB(large_bytes, len);
+    if (kind == LARGE_HUGETLB) {
+        STAT_SUB(huge_tlb_bytes, len);
+    } else if (kind == LARGE_THP) {
+        STAT_SUB(thp_bytes, len);
+    }
+    if (munmap(header, len) == -1) {
+        perror("munmap");
+    }
+}
+
+void *matrix_alloc(size_t size) {
+    if (size <= MATRIX_ALLOC_SMALL_MAX) {
+        return small_alloc(size);
+    }
+    return large_alloc(size);
+}
+
+void matrix_dealloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (size <= MATRIX_ALLOC_SMALL_MAX) {
+        small_dealloc(ptr, size);
+    } else {
+        large_dealloc(ptr);
+    }
+}
+
+void matrix_alloc_get_stats(matrix_alloc_stats_t *dest) {
+    dest->small_allocs = __atomic_load_n(&stats.small_allocs, __ATOMIC_RELAXED);
+    dest->small_frees = __atomic_load_n(&stats.small_frees, __ATOMIC_RELAXED);
+    dest->thread_cache_hits = __atomic_load_n(&stats.thread_cache_hits, __ATOMIC_RELAXED);
+    dest->large_allocs = __atomic_load_n(&stats.large_allocs, __ATOMIC_RELAXED);
+    dest->large_frees = __atomic_load_n(&stats.large_frees, __ATOMIC_RELAXED);
+    dest->slab_bytes = __atomic_load_n(&stats.slab_bytes, __ATOMIC_RELAXED);
+    dest->large_bytes = __atomic_load_n(&stats.large_bytes, __ATOMIC_RELAXED);
+    dest->huge_tlb_bytes = __atomic_load_n(&stats.huge_tlb_bytes, __ATOMIC_RELAXED);
+    dest->thp_bytes = __atomic_load_n(&stats.thp_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * One mapping from /proc/self/smaps, as far as it overlaps the range asked about
+ *   len: Length of the whole mapping
+ *   overlap: Bytes of it inside the range
+ *   rss_kb, huge_kb: Resident and transparent huge page kilobytes of the mapping
+ *   hugetlb_kb: Kilobytes of reserved huge pages, which smaps counts apart from rss_kb
+ */
+typedef struct {
+    size_t len;
+    size_t overlap;
+    long rss_kb;
+    long huge_kb;
+    long hugetlb_kb;
+} smaps_vma_t;
+
+static void add_vma(matrix_page_usage_t *usage, const smaps_vma_t *vma) {
+    if (vma->overlap == 0) {
+        return;
+    }
+    double share = (double) vma->overlap / vma->len;
+    size_t resident = (vma->rss_kb + vma->hugetlb_kb) * 1024 * share;
+    size_t huge = (vma->huge_kb + vma->hugetlb_kb) * 1024 * share;
+    usage->resident += resident < vma->overlap ? resident : vma->overlap;
+    usage->huge += huge < vma->overlap ? huge : vma->overlap;
+}
+
+int matrix_alloc_page_usage(const void *ptr, size_t len, matrix_page_usage_t *usage) {
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    uintptr_t start = (uintptr_t) ptr;
+    uintptr_t end = start + len;
+    usage->mapped = len;
+    usage->resident = 0;
+    usage->huge = 0;
+
+    char line[512];
+    smaps_vma_t vma = {0};
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned long lo, hi;
+        long kb;
+        // Each mapping starts with its address range, followed by one field per line.
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            add_vma(usage, &vma);
+            memset(&vma, 0, sizeof(vma));
+            uintptr_t from = lo > start ? lo : start;
+            uintptr_t to = hi < end ? hi : end;
+            vma.len = hi - lo;
+            vma.overlap = to > from ? to - from : 0;
+        } else if (vma.overlap == 0) {
+            continue;
+        } else if (sscanf(line, "Rss: %ld kB", &kb) == 1) {
+            vma.rss_kb = kb;
+        } else if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1 ||
+                   sscanf(line, "ShmemPmdMapped: %ld kB", &kb) == 1 ||
+                   sscanf(line, "FilePmdMapped: %ld kB", &kb) == 1) {
+            vma.huge_kb += kb;
+        } else if (sscanf(line, "Shared_Hugetlb: %ld kB", &kb) == 1 ||
+                   sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1) {
+            vma.hugetlb_kb += kb;
+        }
+    }
+    add_vma(usage, &vma);
+    fclose(f);
+    return 0;
+}
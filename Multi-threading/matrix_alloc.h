@@ -0,0 +1,86 @@
+#ifndef MATRIX_ALLOC_H
+#define MATRIX_ALLOC_H
+
+#include <stddef.h>
+
+/*
+ * Allocator for matrix storage. A matrix header and its elements always
+ * share one block.
+ *   Small blocks (up to MATRIX_ALLOC_SMALL_MAX bytes) come from power of two
+ *   size classes. Each class has a free list per thread, so the common
+ *   init/free cycle takes no lock, backed by a shared free list that is
+ *   refilled from large slabs.
+ *   Large blocks are mapped directly, with 2 MB huge pages when available
+ *   (MAP_HUGETLB first, then transparent huge pages through madvise), and
+ *   are unmapped when freed. Blocks under one huge page use normal pages.
+ * Setting SMOCK_HUGE_PAGES to "thp" skips MAP_HUGETLB, and "off" maps every
+ * block with normal pages. It is read on every large allocation, so it can
+ * be changed between them.
+ */
+
+#define MATRIX_ALLOC_MIN_CLASS 64
+#define MATRIX_ALLOC_SMALL_MAX (256 * 1024)
+#define MATRIX_ALLOC_HUGE_PAGE (2 * 1024 * 1024)
+
+/*
+ * Counters describing allocator activity since the program started
+ *   small_allocs, small_frees: Blocks handed out and returned by size class
+ *   thread_cache_hits: Small allocations served without taking a lock
+ *   large_allocs, large_frees: Blocks mapped and unmapped directly
+ *   slab_bytes: Bytes of slabs carved into small blocks
+ *   large_bytes: Bytes currently mapped for large blocks
+ *   huge_tlb_bytes: Part of large_bytes mapped with MAP_HUGETLB
+ *   thp_bytes: Part of large_bytes advised to use transparent huge pages
+ */
+typedef struct {
+    unsigned long small_allocs;
+    unsigned long small_frees;
+    unsigned long thread_cache_hits;
+    unsigned long large_allocs;
+    unsigned long large_frees;
+    size_t slab_bytes;
+    size_t large_bytes;
+    size_t huge_tlb_bytes;
+    size_t thp_bytes;
+} matrix_alloc_stats_t;
+
+/*
+ * How the pages of an address range are backed, from /proc/self/smaps
+ *   mapped: Bytes in the range
+ *   resident: Bytes of it currently in memory
+ *   huge: Bytes of it backed by huge pages, reserved or transparent
+ * Counts for mappings only partly inside the range are scaled to the part
+ * inside it.
+ */
+typedef struct {
+    size_t mapped;
+    size_t resident;
+    size_t huge;
+} matrix_page_usage_t;
+
+/*
+ * Allocate a block of at least 'size' bytes, aligned to 64 bytes
+ * Returns a pointer to the block, or NULL on failure
+ */
+void *matrix_alloc(size_t size);
+
+/*
+ * Return a block to the allocator
+ *   ptr: Block returned by matrix_alloc, or NULL
+ *   size: The size that was passed to matrix_alloc for this block
+ */
+void matrix_dealloc(void *ptr, size_t size);
+
+/*
+ * Copy the allocator's counters into 'stats'
+ */
+void matrix_alloc_get_stats(matrix_alloc_stats_t *stats);
+
+/*
+ * Find how the 'len' bytes at 'ptr' are backed, for any memory of this
+ * process, so a matrix can report how much of it uses huge pages
+ * Returns 0 on success or -1 if /proc/self/smaps cannot be read
+ */
+int matrix_alloc_page_usage(const void *ptr, size_t len, matrix_page_usage_t *usage);
+
+#endif // MATRIX_ALLOC_H
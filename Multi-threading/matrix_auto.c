@@ -0,0 +1,360 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "matrix_auto.h"
+
+#define PROFILE_VERSION 1
+#define CALIBRATE_REPS 3
+
+// Shapes every backend is timed on. Small and wide have the same rows, so
+// they differ only in elements; wide and tall have the same elements, so they
+// differ only in rows. Small is dominated by startup.
+#define SMALL_ROWS 256
+#define SMALL_COLS 16
+#define WIDE_ROWS 256
+#define WIDE_COLS 16384
+#define TALL_ROWS 16384
+#define TALL_COLS 256
+
+static matrix_auto_profile_t profile;
+static int have_profile;
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const backend_names[] = {"serial", "threads", "pool"};
+
+const char *matrix_backend_name(matrix_backend_t backend) {
+    return backend_names[backend];
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned online_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned) n : 1;
+}
+
+// The serial loop over chunks of MATRIX_SCHED_CHUNK elements, checking
+// 'cancel' between them. Returns 0 on success or -1 if cancelled.
+static int serial_reduce(const matrix_t *mat, int is_max, const cancel_token_t *cancel,
+                         long *result) {
+    size_t n = (size_t) mat->nrows * mat->ncols;
+    if (is_max && n == 0) {
+        return -1;
+    }
+    long acc = is_max ? mat->data[0] : 0;
+    for (size_t done = 0; done < n; done += MATRIX_SCHED_CHUNK) {
+        if (cancel_requested(cancel) != CANCEL_NONE) {
+            return -1;
+        }
+        unsigned len = n - done < MATRIX_SCHED_CHUNK ? n - done : MATRIX_SCHED_CHUNK;
+        matrix_t chunk = {mat->data + done, 1, len, NULL};
+        if (is_max) {
+            long max = matrix_max(&chunk);
+            acc = max > acc ? max : acc;
+        } else {
+            acc += matrix_sum(&chunk);
+        }
+    }
+    *result = acc;
+    return 0;
+}
+
+static int run_model(const matrix_auto_model_t *model, const matrix_t *mat, int is_max,
+                     worker_pool_t *pool, task_class_t cls, const cancel_token_t *cancel,
+                     long *result) {
+    switch (model->backend) {
+    case MATRIX_BACKEND_SERIAL:
+        if ((cancel != NULL && !matrix_agg_valid(mat)) ||
+            (is_max && (size_t) mat->nrows * mat->ncols == 0)) {
+            return serial_reduce(mat, is_max, cancel, result);
+        }
+        *result = is_max ? matrix_max(mat) : matrix_sum(mat);
+        return 0;
+    case MATRIX_BACKEND_THREADS:
+        return is_max ? matrix_parallel_max_sched(mat, model->n_threads, MATRIX_SCHED_STATIC,
+                                                  cancel, result)
+                      : matrix_parallel_sum_sched(mat, model->n_threads, MATRIX_SCHED_STATIC,
+                                                  cancel, result);
+    case MATRIX_BACKEND_POOL:
+        return is_max ? -1 : matrix_parallel_sum_pool_cancel(mat, pool, cls, cancel, result);
+    }
+    return -1;
+}
+
+// Fastest of CALIBRATE_REPS sums after one warm-up, or -1 on error.
+static double time_model(const matrix_auto_model_t *model, const matrix_t *mat,
+                         worker_pool_t *pool) {
+    long result;
+    if (run_model(model, mat, 0, pool, TASK_CLASS_DEFAULT, NULL, &result) != 0) {
+        return -1;
+    }
+    double fastest = -1;
+    for (int rep = 0; rep < CALIBRATE_REPS; rep++) {
+        double start = now_ns();
+        if (run_model(model, mat, 0, pool, TASK_CLASS_DEFAULT, NULL, &result) != 0) {
+            return -1;
+        }
+        double elapsed = now_ns() - start;
+        if (fastest < 0 || elapsed < fastest) {
+            fastest = elapsed;
+        }
+    }
+    return fastest;
+}
+
+static matrix_t *calibration_matrix(unsigned nrows, unsigned ncols) {
+    matrix_t *mat = matrix_init(nrows, ncols);
+    if (mat != NULL) {
+        size_t n = (size_t) nrows * ncols;
+        for (size_t i = 0; i < n; i++) {
+            mat->data[i] = (int) (i % 7) - 3;
+        }
+    }
+    return mat;
+}
+
+static double nonnegative(double val) {
+    return val > 0 ? val : 0;
+}
+
+// Lists the backends to time: serial, powers of two threads up to the CPU
+// count and the CPU count itself, then the pool.
+static void list_models(matrix_auto_profile_t *p) {
+    p->n_models = 0;
+    p->models[p->n_models++] = (matrix_auto_model_t) {.backend = MATRIX_BACKEND_SERIAL,
+                                                      .n_threads = 1};
+    for (unsigned n = 2; p->n_models < MATRIX_AUTO_MAX_MODELS - 1; n *= 2) {
+        unsigned threads = n < p->n_cpus ? n : p->n_cpus;
+        if (threads < 2) {
+            break;
+        }
+        p->models[p->n_models++] = (matrix_auto_model_t) {.backend = MATRIX_BACKEND_THREADS,
+                                                          .n_threads = threads};
+        if (threads == p->n_cpus) {
+            break;
+        }
+    }
+    if (p->pool_size > 0) {
+        p->models[p->n_models++] = (matrix_auto_model_t) {.backend = MATRIX_BACKEND_POOL,
+                                                          .n_threads = p->pool_size};
+    }
+}
+
+// Times every backend and fits its model. Call with profile_mutex held.
+static int calibrate_locked(worker_pool_t *pool) {
+    matrix_auto_profile_t p = {.n_cpus = online_cpus(), .pool_size = pool->size};
+    list_models(&p);
+
+    matrix_t *small = calibration_matrix(SMALL_ROWS, SMALL_COLS);
+    matrix_t *wide = calibration_matrix(WIDE_ROWS, WIDE_COLS);
+    matrix_t *tall = calibration_matrix(TALL_ROWS, TALL_COLS);
+    int ret = small != NULL && wide != NULL && tall != NULL ? 0 : -1;
+    for (unsigned m = 0; ret == 0 && m < p.n_models; m++) {
+        matrix_auto_model_t *model = &p.models[m];
+        double t_small = time_model(model, small, pool);
+        double t_wide = time_model(model, wide, pool);
+        double t_tall = time_model(model, tall, pool);
+        if (t_small < 0 || t_wide < 0 || t_tall < 0) {
+            ret = -1;
+            break;
+        }
+        model->elem_ns = nonnegative((t_wide - t_small) /
+                                     ((double) WIDE_COLS * WIDE_ROWS - SMALL_COLS * SMALL_ROWS));
+        model->row_ns = nonnegative((t_tall - t_wide) / (TALL_ROWS - WIDE_ROWS));
+        model->fixed_ns = nonnegative(t_small - model->row_ns * SMALL_ROWS -
+                                      model->elem_ns * SMALL_ROWS * SMALL_COLS);
+    }
+    if (small != NULL) {
+        matrix_free(small);
+    }
+    if (wide != NULL) {
+        matrix_free(wide);
+    }
+    if (tall != NULL) {
+        matrix_free(tall);
+    }
+    if (ret == 0) {
+        profile = p;
+        have_profile = 1;
+    }
+    return ret;
+}
+
+// Path of the profile file in 'path', or 0 if profiles are not saved.
+static int profile_path(char *path, size_t size) {
+    const char *env = getenv("SMOCK_PROFILE");
+    if (env != NULL) {
+        return strcmp(env, "off") != 0 && snprintf(path, size, "%s", env) < (int) size;
+    }
+    const char *home = getenv("HOME");
+    if (home == NULL) {
+        return 0;
+    }
+    // The cache directory may not exist yet; if it cannot be made, saving fails later.
+    snprintf(path, size, "%s/.cache", home);
+    mkdir(path, 0755);
+    return snprintf(path, size, "%s/.cache/smock_profile", home) < (int) size;
+}
+
+// Reads a profile measured with the same CPUs and pool size.
+static int load_profile(const char *path, worker_pool_t *pool, matrix_auto_profile_t *p) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int version;
+    int ok = fscanf(file, "smock_profile %d cpus %u pool %u models %u", &version, &p->n_cpus,
+                    &p->pool_size, &p->n_models) == 4 &&
+             version == PROFILE_VERSION && p->n_cpus == online_cpus() &&
+             p->pool_size == pool->size && p->n_models <= MATRIX_AUTO_MAX_MODELS;
+    for (unsigned m = 0; ok && m < p->n_models; m++) {
+        matrix_auto_model_t *model = &p->models[m];
+        char name[16];
+        ok = fscanf(file, "%15s %u %lf %lf %lf", name, &model->n_threads, &model->fixed_ns,
+                    &model->row_ns, &model->elem_ns) == 5 && model->n_threads > 0;
+        int known = 0;
+        for (int b = MATRIX_BACKEND_SERIAL; b <= MATRIX_BACKEND_POOL; b++) {
+            if (ok && strcmp(name, backend_names[b]) == 0) {
+                model->backend = b;
+                known = 1;
+            }
+        }
+        ok = known;
+    }
+    // Choosing starts from the serial model, which must come first.
+    ok = ok && p->n_models > 0 && p->models[0].backend == MATRIX_BACKEND_SERIAL;
+    fclose(file);
+    p->from_file = 1;
+    return ok ? 0 : -1;
+}
+
+// Writes the profile to a temporary file and renames it over 'path'.
+static int save_profile(const char *path, const matrix_auto_profile_t *p) {
+    char tmp_name[PATH_MAX];
+    if (snprintf(tmp_name, sizeof(tmp_name), "%s.tmp.%d", path, (int) getpid()) >=
+        (int) sizeof(tmp_name)) {
+        return -1;
+    }
+    FILE *file = fopen(tmp_name, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    fprintf(file, "smock_profile %d\ncpus %u\npool %u\nmodels %u\n", PROFILE_VERSION,
+            p->n_cpus, p->pool_size, p->n_models);
+    for (unsigned m = 0; m < p->n_models; m++) {
+        const matrix_auto_model_t *model = &p->models[m];
+        fprintf(file, "%s %u %.6g %.6g %.6g\n", backend_names[model->backend],
+                model->n_threads, model->fixed_ns, model->row_ns, model->elem_ns);
+    }
+    int ret = ferror(file) ? -1 : 0;
+    if (fclose(file) != 0 || ret != 0 || rename(tmp_name, path) != 0) {
+        unlink(tmp_name);
+        return -1;
+    }
+    return 0;
+}
+
+// Calibrates and saves the result. Call with profile_mutex held.
+static int calibrate_and_save(worker_pool_t *pool) {
+    if (calibrate_locked(pool) != 0) {
+        return -1;
+    }
+    char path[PATH_MAX];
+    if (profile_path(path, sizeof(path)) && save_profile(path, &profile) != 0) {
+        // The profile still applies to this run, so only warn.
+        fprintf(stderr, "Failed to save profile '%s': %s\n", path, strerror(errno));
+    }
+    return 0;
+}
+
+int matrix_auto_calibrate(worker_pool_t *pool) {
+    pthread_mutex_lock(&profile_mutex);
+    int ret = calibrate_and_save(pool);
+    pthread_mutex_unlock(&profile_mutex);
+    return ret;
+}
+
+int matrix_auto_get_profile(worker_pool_t *pool, matrix_auto_profile_t *out) {
+    int ret = 0;
+    pthread_mutex_lock(&profile_mutex);
+    if (!have_profile || profile.pool_size != pool->size) {
+        char path[PATH_MAX];
+        matrix_auto_profile_t loaded;
+        if (profile_path(path, sizeof(path)) && load_profile(path, pool, &loaded) == 0) {
+            profile = loaded;
+            have_profile = 1;
+        } else {
+            ret = calibrate_and_save(pool);
+        }
+    }
+    if (ret == 0) {
+        *out = profile;
+    }
+    pthread_mutex_unlock(&profile_mutex);
+    return ret;
+}
+
+double matrix_auto_predict(const matrix_auto_model_t *model, unsigned nrows, unsigned ncols) {
+    // Work is split by rows, so a matrix with fewer rows than threads
+    // leaves some of them idle.
+    unsigned busy = nrows < model->n_threads ? (nrows > 0 ? nrows : 1) : model->n_threads;
+    double n = (double) nrows * ncols;
+    return model->fixed_ns + model->row_ns * nrows +
+           model->elem_ns * n * model->n_threads / busy;
+}
+
+int matrix_auto_choose(const matrix_t *mat, int is_max, worker_pool_t *pool,
+                       matrix_auto_model_t *choice) {
+    matrix_auto_profile_t p;
+    if (matrix_auto_get_profile(pool, &p) != 0) {
+        return -1;
+    }
+    // The serial backend is always the first model.
+    *choice = p.models[0];
+    if (matrix_agg_valid(mat)) {
+        return 0; // Answered from the cached aggregates without scanning
+    }
+    double best = matrix_auto_predict(choice, mat->nrows, mat->ncols);
+    for (unsigned m = 1; m < p.n_models; m++) {
+        const matrix_auto_model_t *model = &p.models[m];
+        if ((is_max && model->backend == MATRIX_BACKEND_POOL) ||
+            (model->backend == MATRIX_BACKEND_THREADS && model->n_threads > mat->nrows)) {
+            continue;
+        }
+        double predicted = matrix_auto_predict(model, mat->nrows, mat->ncols);
+        if (predicted < best) {
+            best = predicted;
+            *choice = *model;
+        }
+    }
+    return 0;
+}
+
+static int auto_reduce(const matrix_t *mat, int is_max, worker_pool_t *pool, task_class_t cls,
+                       const cancel_token_t *cancel, long *result) {
+    matrix_auto_model_t choice;
+    if (matrix_auto_choose(mat, is_max, pool, &choice) != 0) {
+        return -1;
+    }
+    return run_model(&choice, mat, is_max, pool, cls, cancel, result);
+}
+
+int matrix_auto_sum(const matrix_t *mat, worker_pool_t *pool, task_class_t cls,
+                    const cancel_token_t *cancel, long *result) {
+    return auto_reduce(mat, 0, pool, cls, cancel, result);
+}
+
+int matrix_auto_max(const matrix_t *mat, worker_pool_t *pool, task_class_t cls,
+                    const cancel_token_t *cancel, long *result) {
+    return auto_reduce(mat, 1, pool, cls, cancel, result);
+}
@@ -0,0 +1,104 @@
+#ifndef MATRIX_AUTO_H
+#define MATRIX_AUTO_H
+
+#include "matrix.h"
+#include "worker_pool.h"
+
+/*
+ * Automatic choice between the ways of reducing a matrix: the vectorized
+ * serial loop, matrix_parallel_sum/max with some number of threads, and the
+ * worker pool. Each is timed once on a few matrix shapes and fitted to
+ *   time = fixed_ns + row_ns * nrows + elem_ns * nrows * ncols
+ * which captures thread startup, per-row task overhead and throughput. A
+ * query then runs on whichever backend predicts the lowest time for its
+ * shape. Results of cached aggregates (see matrix_agg_enable) are always
+ * read serially.
+ *
+ * The calibration is saved to a profile file and reused while the number of
+ * CPUs and workers stays the same:
+ *   SMOCK_PROFILE: Path of the profile, by default ~/.cache/smock_profile, or
+ *     "off" to calibrate on every run without saving
+ */
+
+#define MATRIX_AUTO_MAX_MODELS 16
+
+typedef enum {
+    MATRIX_BACKEND_SERIAL,
+    MATRIX_BACKEND_THREADS,
+    MATRIX_BACKEND_POOL
+} matrix_backend_t;
+
+/*
+ * Fitted cost of one backend
+ *   backend: Which backend
+ *   n_threads: Threads it runs on: 1 for serial, the pool's size for the pool
+ *   fixed_ns, row_ns, elem_ns: Coefficients of the cost model above
+ */
+typedef struct {
+    matrix_backend_t backend;
+    unsigned n_threads;
+    double fixed_ns;
+    double row_ns;
+    double elem_ns;
+} matrix_auto_model_t;
+
+/*
+ * Result of a calibration
+ *   n_cpus, pool_size: Machine and pool it was measured on
+ *   n_models: Number of entries in 'models'
+ *   from_file: Whether it was read from the profile file
+ */
+typedef struct {
+    unsigned n_cpus;
+    unsigned pool_size;
+    unsigned n_models;
+    matrix_auto_model_t models[MATRIX_AUTO_MAX_MODELS];
+    int from_file;
+} matrix_auto_profile_t;
+
+/*
+ * Copy the profile for 'pool' into 'profile', reading the profile file or
+ * calibrating if this has not happened yet
+ * Returns 0 on success or -1 on error
+ */
+int matrix_auto_get_profile(worker_pool_t *pool, matrix_auto_profile_t *profile);
+
+/*
+ * Time every backend again and save the result to the profile file
+ * Returns 0 on success or -1 if the backends could not be measured
+ */
+int matrix_auto_calibrate(worker_pool_t *pool);
+
+/*
+ * Predicted time of 'model' on an nrows x ncols matrix, in nanoseconds
+ */
+double matrix_auto_predict(const matrix_auto_model_t *model, unsigned nrows, unsigned ncols);
+
+/*
+ * Pick the backend predicted to reduce 'mat' fastest. Only the serial and
+ * thread backends can compute a maximum.
+ *   is_max: Whether the query is a maximum rather than a sum
+ *   choice: Location to store the chosen model
+ * Returns 0 on success or -1 on error
+ */
+int matrix_auto_choose(const matrix_t *mat, int is_max, worker_pool_t *pool,
+                       matrix_auto_model_t *choice);
+
+/*
+ * Sum or maximum of 'mat' on the backend matrix_auto_choose picks
+ *   cls: Priority and tenant of the pool backend's tasks
+ *   cancel: Token checked between chunks of rows or elements, or NULL
+ * Returns 0 on success or -1 on error or if cancelled. A maximum of an empty
+ * matrix is an error on every backend.
+ */
+int matrix_auto_sum(const matrix_t *mat, worker_pool_t *pool, task_class_t cls,
+                    const cancel_token_t *cancel, long *result);
+int matrix_auto_max(const matrix_t *mat, worker_pool_t *pool, task_class_t cls,
+                    const cancel_token_t *cancel, long *result);
+
+/*
+ * Name of a backend, e.g. "threads"
+ */
+const char *matrix_backend_name(matrix_backend_t backend);
+
+#endif // MATRIX_AUTO_H
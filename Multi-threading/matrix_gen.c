@@ -0,0 +1,302 @@
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrix_gen.h"
+#include "matrix_nt.h"
+#include "task_group.h"
+
+// Multipliers and key increments of Philox 4x32 from Salmon et al., "Parallel
+// Random Numbers: As Easy as 1, 2, 3" (SC 2011).
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+// Sparse matrices take the nonzero test and the value from separate streams.
+#define STREAM_MAIN 0
+#define STREAM_VALUE 1
+
+// Elements are generated BATCH at a time, from BATCH_GROUPS Philox counters of
+// four words each.
+#define BATCH_GROUPS 16
+#define BATCH (4 * BATCH_GROUPS)
+
+// Streamed blocks are generated this many elements at a time into a buffer
+// that stays in L1, then written out with non-temporal stores.
+#define GEN_TILE 1024
+
+#define MAX_PARAMS 2
+
+/*
+ * One matrix_gen_fill call, shared by the tasks that fill its blocks
+ *   data, n: The elements to fill
+ *   next_block: Index of the next block a task may claim
+ *   streamed: Whether blocks are written with non-temporal stores
+ *   group: Completes when every task has run out of blocks
+ */
+typedef struct {
+    int *data;
+    size_t n;
+    matrix_gen_dist_t dist;
+    uint64_t seed;
+    size_t next_block;
+    int streamed;
+    task_group_t group;
+} gen_job_t;
+
+// Philox 4x32-10 on BATCH_GROUPS counters at once, word k of counter l being
+// ctr[k][l]. Independent lanes keep the multipliers busy and let the compiler
+// vectorize the rounds.
+static void philox(uint32_t ctr[4][BATCH_GROUPS], uint64_t seed) {
+    uint32_t k0 = (uint32_t) seed;
+    uint32_t k1 = (uint32_t) (seed >> 32);
+    for (int round = 0; round < PHILOX_ROUNDS; round++) {
+        for (int l = 0; l < BATCH_GROUPS; l++) {
+            uint64_t p0 = (uint64_t) PHILOX_M0 * ctr[0][l];
+            uint64_t p1 = (uint64_t) PHILOX_M1 * ctr[2][l];
+            uint32_t next0 = (uint32_t) (p1 >> 32) ^ ctr[1][l] ^ k0;
+            uint32_t next2 = (uint32_t) (p0 >> 32) ^ ctr[3][l] ^ k1;
+            ctr[1][l] = (uint32_t) p1;
+            ctr[3][l] = (uint32_t) p0;
+            ctr[0][l] = next0;
+            ctr[2][l] = next2;
+        }
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+// Words for the BATCH elements starting at group 'group' (element 4 * group)
+// from one stream, in element order.
+static void random_words(uint32_t words[BATCH], uint64_t group, uint32_t stream,
+                         uint64_t seed) {
+    uint32_t ctr[4][BATCH_GROUPS];
+    for (int l = 0; l < BATCH_GROUPS; l++) {
+        ctr[0][l] = (uint32_t) (group + l);
+        ctr[1][l] = (uint32_t) ((group + l) >> 32);
+        ctr[2][l] = stream;
+        ctr[3][l] = 0;
+    }
+    philox(ctr, seed);
+    for (int l = 0; l < BATCH_GROUPS; l++) {
+        for (int k = 0; k < 4; k++) {
+            words[4 * l + k] = ctr[k][l];
+        }
+    }
+}
+
+// Maps a word evenly onto the 'range' integers starting at 'lo'.
+static inline int scale(uint32_t word, long lo, uint64_t range) {
+    return (int) (lo + (long) (((uint64_t) word * range) >> 32));
+}
+
+static int clamp_int(double val) {
+    if (val <= INT_MIN) {
+        return INT_MIN;
+    }
+    if (val >= INT_MAX) {
+        return INT_MAX;
+    }
+    return (int) lround(val);
+}
+
+// Computes the BATCH elements starting at element 4 * group.
+static void gen_batch(int out[BATCH], uint64_t group, const matrix_gen_dist_t *dist,
+                      uint64_t seed) {
+    uint32_t words[BATCH];
+    switch (dist->kind) {
+    case MATRIX_GEN_UNIFORM: {
+        long lo = (long) dist->a;
+        uint64_t range = (uint64_t) ((long) dist->b - lo) + 1;
+        random_words(words, group, STREAM_MAIN, seed);
+        for (int i = 0; i < BATCH; i++) {
+            out[i] = scale(words[i], lo, range);
+        }
+        break;
+    }
+    case MATRIX_GEN_NORMAL:
+        // Box-Muller turns each pair of words into a pair of normal values.
+        random_words(words, group, STREAM_MAIN, seed);
+        for (int i = 0; i < BATCH; i += 2) {
+            double u1 = (words[i] + 1.0) / 4294967296.0; // In (0, 1], so log(u1) is finite
+            double u2 = words[i + 1] / 4294967296.0;
+            double r = sqrt(-2.0 * log(u1)) * dist->b;
+            out[i] = clamp_int(dist->a + r * cos(2 * M_PI * u2));
+            out[i + 1] = clamp_int(dist->a + r * sin(2 * M_PI * u2));
+        }
+        break;
+    case MATRIX_GEN_SPARSE: {
+        uint64_t threshold = (uint64_t) (dist->a * 4294967296.0);
+        uint32_t values[BATCH];
+        random_words(words, group, STREAM_MAIN, seed);
+        random_words(values, group, STREAM_VALUE, seed);
+        for (int i = 0; i < BATCH; i++) {
+            // -1000..999, then shift the upper half up by one to skip 0
+            int val = scale(values[i], -1000, 2000);
+            val = val >= 0 ? val + 1 : val;
+            out[i] = words[i] < threshold ? val : 0;
+        }
+        break;
+    }
+    case MATRIX_GEN_CONST:
+        for (int i = 0; i < BATCH; i++) {
+            out[i] = (int) dist->a;
+        }
+        break;
+    }
+}
+
+void matrix_gen_range(int *dest, size_t start, size_t n, const matrix_gen_dist_t *dist,
+                      uint64_t seed) {
+    int batch[BATCH];
+    size_t i = 0;
+    // Batches start at multiples of BATCH; a range starting inside one takes
+    // only the end of it.
+    size_t skip = start % BATCH;
+    if (skip != 0 && n > 0) {
+        gen_batch(batch, (start - skip) / 4, dist, seed);
+        i = BATCH - skip < n ? BATCH - skip : n;
+        memcpy(dest, batch + skip, i * sizeof(int));
+    }
+    for (; i + BATCH <= n; i += BATCH) {
+        gen_batch(dest + i, (start + i) / 4, dist, seed);
+    }
+    if (i < n) {
+        gen_batch(batch, (start + i) / 4, dist, seed);
+        memcpy(dest + i, batch, (n - i) * sizeof(int));
+    }
+}
+
+// Parses the ':'-separated numbers after a distribution's name.
+// Returns how many there were, or -1 if one is not a number.
+static int parse_params(const char *text, double params[MAX_PARAMS]) {
+    int count = 0;
+    while (*text == ':') {
+        char *end;
+        double val = strtod(text + 1, &end);
+        if (end == text + 1 || count == MAX_PARAMS) {
+            return -1;
+        }
+        params[count++] = val;
+        text = end;
+    }
+    return *text == '\0' ? count : -1;
+}
+
+static int is_int(double val) {
+    return val >= INT_MIN && val <= INT_MAX && val == floor(val);
+}
+
+int matrix_gen_parse(const char *text, matrix_gen_dist_t *dist) {
+    static const struct {
+        const char *name;
+        matrix_gen_kind_t kind;
+        int n_params; // Parameters needed when any are given
+        double defaults[MAX_PARAMS];
+    } kinds[] = {
+        {"uniform", MATRIX_GEN_UNIFORM, 2, {-1000, 1000}},
+        {"normal", MATRIX_GEN_NORMAL, 2, {0, 100}},
+        {"sparse", MATRIX_GEN_SPARSE, 1, {0.01, 0}},
+        {"const", MATRIX_GEN_CONST, 1, {0, 0}},
+    };
+
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        size_t len = strlen(kinds[k].name);
+        if (strncmp(text, kinds[k].name, len) != 0) {
+            continue;
+        }
+        double params[MAX_PARAMS];
+        memcpy(params, kinds[k].defaults, sizeof(params));
+        int count = parse_params(text + len, params);
+        if (count == -1 || (count != 0 && count != kinds[k].n_params)) {
+            return -1;
+        }
+        if (count == 0 && kinds[k].kind == MATRIX_GEN_CONST) {
+            return -1; // A constant has no default
+        }
+
+        dist->kind = kinds[k].kind;
+        dist->a = params[0];
+        dist->b = params[1];
+        switch (dist->kind) {
+        case MATRIX_GEN_UNIFORM:
+            return is_int(dist->a) && is_int(dist->b) && dist->a <= dist->b ? 0 : -1;
+        case MATRIX_GEN_NORMAL:
+            return dist->b >= 0 ? 0 : -1;
+        case MATRIX_GEN_SPARSE:
+            return dist->a >= 0 && dist->a <= 1 ? 0 : -1;
+        case MATRIX_GEN_CONST:
+            return is_int(dist->a) ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+// Fills blocks on a worker until none are left unclaimed.
+static void gen_blocks(void *arg) {
+    gen_job_t *job = arg;
+    int tile[GEN_TILE] __attribute__((aligned(64)));
+    size_t block;
+    while ((block = __atomic_fetch_add(&job->next_block, 1, __ATOMIC_RELAXED)) * MATRIX_GEN_BLOCK
+           < job->n) {
+        size_t start = block * MATRIX_GEN_BLOCK;
+        size_t end = job->n - start < MATRIX_GEN_BLOCK ? job->n : start + MATRIX_GEN_BLOCK;
+        if (!job->streamed) {
+            matrix_gen_range(job->data + start, start, end - start, &job->dist, job->seed);
+            continue;
+        }
+        for (size_t i = start; i < end; i += GEN_TILE) {
+            size_t len = end - i < GEN_TILE ? end - i : GEN_TILE;
+            matrix_gen_range(tile, i, len, &job->dist, job->seed);
+            matrix_nt_store(job->data + i, tile, len);
+        }
+    }
+    if (job->streamed) {
+        // Each thread must fence its own non-temporal stores.
+        matrix_nt_fence();
+    }
+    task_group_done(&job->group);
+}
+
+int matrix_gen_fill(matrix_t *mat, const matrix_gen_dist_t *dist, uint64_t seed,
+                    worker_pool_t *pool) {
+    gen_job_t job = {
+        .data = mat->data,
+        .n = (size_t) mat->nrows * mat->ncols,
+        .dist = *dist,
+        .seed = seed,
+        .next_block = 0,
+    };
+    job.streamed = matrix_nt_streamed(job.n * sizeof(int));
+
+    // One task per worker, each claiming blocks until they run out, so the
+    // queue holds a handful of items however large the matrix is.
+    size_t n_blocks = (job.n + MATRIX_GEN_BLOCK - 1) / MATRIX_GEN_BLOCK;
+    unsigned n_tasks = n_blocks < pool->size ? (unsigned) n_blocks : pool->size;
+    if (task_group_init(&job.group, n_tasks) == -1) {
+        fprintf(stderr, "Task group initialization failed\n");
+        return -1;
+    }
+
+    int ret = 0;
+    for (unsigned i = 0; i < n_tasks; i++) {
+        if (worker_pool_submit(pool, gen_blocks, &job) != 0) {
+            // Tasks already queued still refer to the group, so wait for those.
+            // They fill every block between them, but report the failure anyway.
+            pthread_mutex_lock(&job.group.mutex);
+            job.group.n_tasks = i;
+            pthread_mutex_unlock(&job.group.mutex);
+            ret = -1;
+            break;
+        }
+    }
+    if (task_group_wait(&job.group) == -1) {
+        ret = -1;
+    }
+    task_group_free(&job.group);
+    matrix_agg_invalidate(mat);
+    return ret;
+}
@@ -0,0 +1,67 @@
+#ifndef MATRIX_GEN_H
+#define MATRIX_GEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "matrix.h"
+#include "worker_pool.h"
+
+/*
+ * Random matrices for load testing. Element i is computed from the Philox
+ * 4x32-10 counter-based generator with i as the counter and the seed as the
+ * key, so any range of elements can be generated on its own. Workers fill
+ * blocks of MATRIX_GEN_BLOCK elements in whatever order they claim them, and
+ * the result depends only on the distribution and seed, never on the
+ * number of threads.
+ *
+ * Distributions, written as in the gen command:
+ *   uniform[:lo:hi]: Integers drawn evenly from [lo, hi], default -1000..1000
+ *   normal[:mean:stddev]: Rounded normal values, default mean 0 and stddev 100
+ *   sparse[:density]: Zero except for the given fraction of elements,
+ *     default 0.01, which are drawn evenly from -1000..1000 without 0
+ *   const:value: Every element equal to 'value'
+ */
+
+#define MATRIX_GEN_BLOCK (1024 * 1024)
+
+typedef enum {
+    MATRIX_GEN_UNIFORM,
+    MATRIX_GEN_NORMAL,
+    MATRIX_GEN_SPARSE,
+    MATRIX_GEN_CONST
+} matrix_gen_kind_t;
+
+/*
+ * A distribution of element values
+ *   kind: Which distribution
+ *   a, b: Its parameters: lo and hi, mean and stddev, density, or the constant
+ */
+typedef struct {
+    matrix_gen_kind_t kind;
+    double a;
+    double b;
+} matrix_gen_dist_t;
+
+/*
+ * Parse a distribution such as "uniform:0:255" or "normal"
+ * Returns 0 on success or -1 if 'text' is not a valid distribution
+ */
+int matrix_gen_parse(const char *text, matrix_gen_dist_t *dist);
+
+/*
+ * Generate elements [start, start + n) of a matrix into 'dest', which holds
+ * just those elements
+ */
+void matrix_gen_range(int *dest, size_t start, size_t n, const matrix_gen_dist_t *dist,
+                      uint64_t seed);
+
+/*
+ * Fill every element of 'mat' on the worker pool
+ *   pool: Workers that generate the blocks. The call must not come from one
+ *     of its workers.
+ * Returns 0 on success or -1 on error
+ */
+int matrix_gen_fill(matrix_t *mat, const matrix_gen_dist_t *dist, uint64_t seed,
+                    worker_pool_t *pool);
+
+#endif // MATRIX_GEN_H
@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "instrument.h"
+#include "matrix_io.h"
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define MATRIX_IO_HAVE_URING 1
+#endif
+
+// O_DIRECT transfers must start, end and sit in memory on this boundary.
+#define DIRECT_ALIGN 4096
+
+static matrix_io_config_t config;
+static int uring_available;
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+static void load_config(void) {
+    const char *backend = getenv("SMOCK_IO");
+    const char *depth = getenv("SMOCK_IO_DEPTH");
+    const char *direct = getenv("SMOCK_IO_DIRECT");
+    config.use_uring = backend == NULL || strcmp(backend, "pread") != 0;
+    config.queue_depth = MATRIX_IO_DEFAULT_DEPTH;
+    if (depth != NULL && atoi(depth) > 0) {
+        config.queue_depth = atoi(depth) < MATRIX_IO_MAX_DEPTH ? atoi(depth) : MATRIX_IO_MAX_DEPTH;
+    }
+    config.direct = direct != NULL && strcmp(direct, "1") == 0;
+
+#ifdef MATRIX_IO_HAVE_URING
+    // Kernels without io_uring, or with it disabled, refuse to create a ring.
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, 1, &params);
+    if (fd != -1) {
+        uring_available = 1;
+        close(fd);
+    }
+#endif
+}
+
+static matrix_io_config_t current_config(void) {
+    pthread_once(&config_once, load_config);
+    pthread_mutex_lock(&config_mutex);
+    matrix_io_config_t copy = config;
+    pthread_mutex_unlock(&config_mutex);
+    return copy;
+}
+
+void matrix_io_get_config(matrix_io_config_t *out) {
+    *out = current_config();
+}
+
+void matrix_io_configure(const matrix_io_config_t *in) {
+    pthread_once(&config_once, load_config);
+    pthread_mutex_lock(&config_mutex);
+    config = *in;
+    if (config.queue_depth < 1) {
+        config.queue_depth = 1;
+    } else if (config.queue_depth > MATRIX_IO_MAX_DEPTH) {
+        config.queue_depth = MATRIX_IO_MAX_DEPTH;
+    }
+    pthread_mutex_unlock(&config_mutex);
+}
+
+const char *matrix_io_backend(void) {
+    return current_config().use_uring && uring_available ? "io_uring" : "pread";
+}
+
+// Reads exactly 'len' bytes at 'offset'. Returns 0 on success or -1 on error.
+static int pread_all(int fd, char *dest, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t got = pread(fd, dest, len, offset);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            return -1;
+        }
+        INSTR_COUNT(INSTR_SYSCALLS, 1);
+        dest += got;
+        len -= got;
+        offset += got;
+    }
+    return 0;
+}
+
+// Writes exactly 'len' bytes at 'offset'. Returns 0 on success or -1 on error.
+static int pwrite_all(int fd, const char *src, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t put = pwrite(fd, src, len, offset);
+        if (put == -1 && errno == EINTR) {
+            continue;
+        } else if (put <= 0) {
+            return -1;
+        }
+        INSTR_COUNT(INSTR_SYSCALLS, 1);
+        src += put;
+        len -= put;
+        offset += put;
+    }
+    return 0;
+}
+
+#ifdef MATRIX_IO_HAVE_URING
+
+/*
+ * One transfer of up to MATRIX_IO_CHUNK bytes, indexed by its slot
+ *   iov: Where its bytes go or come from, and how many were asked for
+ *   offset: Where it starts in the file
+ *   busy: Whether it is in flight
+ */
+typedef struct {
+    struct iovec iov;
+    off_t offset;
+    int busy;
+} piece_t;
+
+/*
+ * A ring and the buffers it owns. Slot i of 'pieces' uses registered buffer
+ * i whenever its bytes pass through one.
+ *   sq_*, cq_*: The submission and completion queues shared with the kernel
+ *   to_submit: Submissions queued and not yet passed to the kernel
+ *   in_flight: Pieces submitted and not yet completed
+ *   buffers: 'depth' buffers of MATRIX_IO_CHUNK bytes, page aligned
+ *   registered: Whether 'buffers' are registered, allowing fixed reads and writes
+ *   next, fill: Slot of the buffer writes are copied into, and bytes in it
+ *   error: Set once any write has failed
+ */
+struct matrix_io_ring {
+    int ring_fd;
+    unsigned depth;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+    unsigned to_submit;
+    unsigned in_flight;
+    char *buffers;
+    int registered;
+    unsigned next;
+    size_t fill;
+    int error;
+    piece_t pieces[];
+};
+
+static void ring_free(struct matrix_io_ring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_len);
+    }
+    // Closing the ring also unregisters its buffers.
+    close(ring->ring_fd);
+    if (ring->buffers != NULL && ring->buffers != MAP_FAILED) {
+        munmap(ring->buffers, (size_t) ring->depth * MATRIX_IO_CHUNK);
+    }
+    free(ring);
+}
+
+static struct matrix_io_ring *ring_create(unsigned depth) {
+    struct io_uring_params params = {0};
+    int ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (ring_fd == -1) {
+        return NULL;
+    }
+    struct matrix_io_ring *ring = calloc(1, sizeof(*ring) + depth * sizeof(piece_t));
+    if (ring == NULL) {
+        close(ring_fd);
+        return NULL;
+    }
+    ring->ring_fd = ring_fd;
+    ring->depth = depth;
+
+    // Both queues live in memory mapped from the ring; newer kernels map them together.
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map && ring->cq_map_len > ring->sq_map_len) {
+        ring->sq_map_len = ring->cq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single_map ? ring->sq_map :
+                   mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    ring->buffers = mmap(NULL, (size_t) depth * MATRIX_IO_CHUNK, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+        ring->sqes == MAP_FAILED || ring->buffers == MAP_FAILED) {
+        ring_free(ring);
+        return NULL;
+    }
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // Registering pins the buffers once instead of on every transfer. It can
+    // fail under a low RLIMIT_MEMLOCK, in which case plain reads and writes
+    // use the same buffers.
+    struct iovec iovs[MATRIX_IO_MAX_DEPTH];
+    for (unsigned i = 0; i < depth; i++) {
+        iovs[i].iov_base = ring->buffers + (size_t) i * MATRIX_IO_CHUNK;
+        iovs[i].iov_len = MATRIX_IO_CHUNK;
+    }
+    ring->registered =
+        syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iovs, depth) == 0;
+    return ring;
+}
+
+static char *slot_buffer(struct matrix_io_ring *ring, unsigned slot) {
+    return ring->buffers + (size_t) slot * MATRIX_IO_CHUNK;
+}
+
+/*
+ * Queue a read or write of one piece in 'slot'. It reaches the kernel with
+ * the next call to ring_complete.
+ */
+static void ring_queue(struct matrix_io_ring *ring, int fd, int writing, unsigned slot,
+                       char *buf, size_t len, off_t offset) {
+    piece_t *piece = &ring->pieces[slot];
+    piece->iov.iov_base = buf;
+    piece->iov.iov_len = len;
+    piece->offset = offset;
+    piece->busy = 1;
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->user_data = slot;
+    if (ring->registered && buf == slot_buffer(ring, slot)) {
+        sqe->opcode = writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (unsigned long) buf;
+        sqe->len = len;
+        sqe->buf_index = slot;
+    } else {
+        sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (unsigned long) &piece->iov;
+        sqe->len = 1;
+    }
+    ring->sq_array[index] = index;
+    // The kernel must see the entry before the tail that publishes it.
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    ring->in_flight++;
+}
+
+/*
+ * Pass queued pieces to the kernel and take the next completion, waiting for
+ * one if none is ready
+ * Returns 0 on success or -1 if the ring itself failed
+ */
+static int ring_complete(struct matrix_io_ring *ring, unsigned *slot, int *res) {
+    while (1) {
+        unsigned head = *ring->cq_head;
+        int ready = head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (ring->to_submit > 0 || !ready) {
+            int ret = syscall(__NR_io_uring_enter, ring->ring_fd, ring->to_submit, ready ? 0 : 1,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret == -1) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                    continue;
+                }
+                return -1;
+            }
+            INSTR_COUNT(INSTR_SYSCALLS, 1);
+            ring->to_submit -= ret;
+            continue;
+        }
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        *slot = cqe->user_data;
+        *res = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        ring->pieces[*slot].busy = 0;
+        ring->in_flight--;
+        return 0;
+    }
+}
+
+/*
+ * Read [file->pos, file->pos + len) with up to 'depth' pieces in flight.
+ * Pieces go straight into 'dest', except with O_DIRECT, where they cover the
+ * aligned span around it and pass through the registered buffers.
+ * Returns 0 on success or -1 on error
+ */
+static int uring_read(matrix_io_file_t *file, char *dest, size_t len) {
+    struct matrix_io_ring *ring = file->ring;
+    off_t start = file->pos;
+    off_t end = start + len;
+    off_t next = start;
+    off_t span_end = end;
+    if (file->direct) {
+        next &= ~(off_t) (DIRECT_ALIGN - 1);
+        span_end = (end + DIRECT_ALIGN - 1) & ~(off_t) (DIRECT_ALIGN - 1);
+    }
+
+    int error = 0;
+    while (1) {
+        for (unsigned slot = 0; slot < ring->depth && next < span_end && !error; slot++) {
+            if (ring->pieces[slot].busy) {
+                continue;
+            }
+            size_t piece_len = span_end - next < MATRIX_IO_CHUNK ? span_end - next : MATRIX_IO_CHUNK;
+            char *buf = file->direct ? slot_buffer(ring, slot) : dest + (next - start);
+            ring_queue(ring, file->fd, 0, slot, buf, piece_len, next);
+            next += piece_len;
+        }
+        if (ring->in_flight == 0) {
+            break;
+        }
+
+        unsigned slot;
+        int res;
+        if (ring_complete(ring, &slot, &res) != 0) {
+            return -1;
+        }
+        if (res < 0 || error) {
+            error = 1;
+            continue;
+        }
+        // Past the end of the file, a piece of the aligned span comes back short.
+        piece_t *piece = &ring->pieces[slot];
+        char *buf = piece->iov.iov_base;
+        off_t piece_end = piece->offset + (off_t) piece->iov.iov_len;
+        off_t wanted_end = piece_end < end ? piece_end : end;
+        off_t got_end = piece->offset + res;
+        if (got_end < wanted_end) {
+            // Short reads are rare, so the rest is read without the ring.
+            if (file->direct ||
+                pread_all(file->fd, buf + res, wanted_end - got_end, got_end) != 0) {
+                error = 1;
+                continue;
+            }
+        }
+        if (file->direct) {
+            off_t copy_start = piece->offset > start ? piece->offset : start;
+            memcpy(dest + (copy_start - start), buf + (copy_start - piece->offset),
+                   wanted_end - copy_start);
+        }
+    }
+    return error ? -1 : 0;
+}
+
+// Handles the completion of one write. With O_DIRECT, the length includes padding.
+static void write_done(matrix_io_file_t *file, unsigned slot, int res) {
+    struct matrix_io_ring *ring = file->ring;
+    piece_t *piece = &ring->pieces[slot];
+    size_t len = piece->iov.iov_len;
+    if (res < 0) {
+        ring->error = 1;
+    } else if ((size_t) res < len) {
+        if (file->direct ||
+            pwrite_all(file->fd, (char *) piece->iov.iov_base + res, len - res,
+                       piece->offset + res) != 0) {
+            ring->error = 1;
+        }
+    }
+}
+
+// Submits the buffer being filled and moves on to the next slot.
+static void write_flush(matrix_io_file_t *file) {
+    struct matrix_io_ring *ring = file->ring;
+    char *buf = slot_buffer(ring, ring->next);
+    size_t len = ring->fill;
+    if (file->direct) {
+        // The final piece is padded to the alignment, then cut off by ftruncate.
+        len = (len + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1);
+        memset(buf + ring->fill, 0, len - ring->fill);
+    }
+    ring_queue(ring, file->fd, 1, ring->next, buf, len, file->pos);
+    file->pos += ring->fill;
+    ring->fill = 0;
+    ring->next = (ring->next + 1) % ring->depth;
+}
+
+static int uring_write(matrix_io_file_t *file, const char *src, size_t len) {
+    struct matrix_io_ring *ring = file->ring;
+    while (len > 0 && !ring->error) {
+        while (ring->pieces[ring->next].busy) {
+            unsigned slot;
+            int res;
+            if (ring_complete(ring, &slot, &res) != 0) {
+                return -1;
+            }
+            write_done(file, slot, res);
+        }
+        size_t n = MATRIX_IO_CHUNK - ring->fill < len ? MATRIX_IO_CHUNK - ring->fill : len;
+        memcpy(slot_buffer(ring, ring->next) + ring->fill, src, n);
+        ring->fill += n;
+        src += n;
+        len -= n;
+        if (ring->fill == MATRIX_IO_CHUNK) {
+            write_flush(file);
+        }
+    }
+    return ring->error ? -1 : 0;
+}
+
+// Submits what is left, waits for every write and releases the ring.
+static int uring_close(matrix_io_file_t *file) {
+    struct matrix_io_ring *ring = file->ring;
+    int ret = 0;
+    if (file->writing && ring->fill > 0) {
+        write_flush(file);
+    }
+    while (ring->in_flight > 0) {
+        unsigned slot;
+        int res;
+        if (ring_complete(ring, &slot, &res) != 0) {
+            ret = -1;
+            break;
+        }
+        if (file->writing) {
+            write_done(file, slot, res);
+        }
+    }
+    if (ring->error || (file->writing && file->direct && ftruncate(file->fd, file->pos) != 0)) {
+        ret = -1;
+    }
+    ring_free(ring);
+    file->ring = NULL;
+    return ret;
+}
+
+#endif // MATRIX_IO_HAVE_URING
+
+/*
+ * Give a file opened as 'fd' a ring if it is large enough, and switch it to
+ * O_DIRECT if it is larger still and the settings and file system allow it
+ */
+static void setup_backend(matrix_io_file_t *file, const char *file_name, int flags, size_t size) {
+#ifdef MATRIX_IO_HAVE_URING
+    matrix_io_config_t cfg = current_config();
+    if (!cfg.use_uring || !uring_available || size < MATRIX_IO_URING_MIN) {
+        return;
+    }
+    file->ring = ring_create(cfg.queue_depth);
+    if (file->ring == NULL || !cfg.direct || size < MATRIX_IO_DIRECT_MIN) {
+        return;
+    }
+    int direct_fd = open(file_name, flags | O_DIRECT);
+    if (direct_fd != -1) {
+        INSTR_COUNT(INSTR_SYSCALLS, 2);
+        close(file->fd);
+        file->fd = direct_fd;
+        file->direct = 1;
+    }
+#else
+    (void) file;
+    (void) file_name;
+    (void) flags;
+    (void) size;
+#endif
+}
+
+int matrix_io_open_read(matrix_io_file_t *file, const char *file_name) {
+    memset(file, 0, sizeof(*file));
+    file->fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (file->fd == -1) {
+        return -1;
+    } else if (fstat(file->fd, &st) == -1) {
+        close(file->fd);
+        return -1;
+    }
+    INSTR_COUNT(INSTR_SYSCALLS, 2);
+    file->size = st.st_size;
+    setup_backend(file, file_name, O_RDONLY, st.st_size);
+    if (!file->direct) {
+        // The kernel can read further ahead when it knows the whole file is wanted in order.
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return 0;
+}
+
+int matrix_io_open_write(matrix_io_file_t *file, const char *file_name, size_t size_hint) {
+    memset(file, 0, sizeof(*file));
+    file->writing = 1;
+    file->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (file->fd == -1) {
+        return -1;
+    }
+    INSTR_COUNT(INSTR_SYSCALLS, 1);
+    setup_backend(file, file_name, O_WRONLY, size_hint);
+    return 0;
+}
+
+ssize_t matrix_io_read(matrix_io_file_t *file, void *dest, size_t len) {
+    if (file->pos >= file->size) {
+        return 0;
+    } else if ((off_t) len > file->size - file->pos) {
+        len = file->size - file->pos;
+    }
+    int ret;
+#ifdef MATRIX_IO_HAVE_URING
+    // A single small piece gains nothing from the ring, unless O_DIRECT needs its buffers.
+    if (file->ring != NULL && (file->direct || len >= MATRIX_IO_CHUNK)) {
+        ret = uring_read(file, dest, len);
+    } else
+#endif
+    {
+        ret = pread_all(file->fd, dest, len, file->pos);
+    }
+    if (ret != 0) {
+        return -1;
+    }
+    INSTR_COUNT(INSTR_BYTES_READ, len);
+    file->pos += len;
+    return len;
+}
+
+int matrix_io_write(matrix_io_file_t *file, const void *src, size_t len) {
+    int ret;
+#ifdef MATRIX_IO_HAVE_URING
+    if (file->ring != NULL) {
+        ret = uring_write(file, src, len);
+    } else
+#endif
+    {
+        ret = pwrite_all(file->fd, src, len, file->pos);
+        file->pos += len;
+    }
+    if (ret == 0) {
+        INSTR_COUNT(INSTR_BYTES_WRITTEN, len);
+    }
+    return ret;
+}
+
+int matrix_io_close(matrix_io_file_t *file) {
+    int ret = 0;
+#ifdef MATRIX_IO_HAVE_URING
+    if (file->ring != NULL) {
+        ret = uring_close(file);
+    }
+#endif
+    if (close(file->fd) != 0) {
+        ret = -1;
+    }
+    INSTR_COUNT(INSTR_SYSCALLS, 1);
+    return ret;
+}
@@ -0,0 +1,113 @@
+#ifndef MATRIX_IO_H
+#define MATRIX_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * File I/O backend for loading and saving matrices. Each open file moves
+ * data in MATRIX_IO_CHUNK-byte pieces with up to 'queue_depth' of them in
+ * flight at once.
+ *   io_uring: Used where the kernel supports it, through its system calls
+ *     directly. Every file gets its own ring, so threads loading and saving
+ *     different matrices never share one. Writes are staged in buffers
+ *     registered with the kernel, and reads go straight to their
+ *     destination unless the file bypasses the page cache.
+ *   pread/pwrite: The fallback, one blocking call at a time. Also used for
+ *     files under MATRIX_IO_URING_MIN bytes, where setting up a ring costs
+ *     more than it saves.
+ * With 'direct' set, files of at least MATRIX_IO_DIRECT_MIN bytes are opened
+ * with O_DIRECT, bypassing the page cache, when their file system allows it.
+ * Their reads then also go through the registered buffers, which are
+ * aligned as O_DIRECT requires.
+ *
+ * Settings start from the environment:
+ *   SMOCK_IO: "pread" to always use the fallback
+ *   SMOCK_IO_DEPTH: Queue depth, default MATRIX_IO_DEFAULT_DEPTH
+ *   SMOCK_IO_DIRECT: "1" to use O_DIRECT for large files
+ */
+
+#define MATRIX_IO_CHUNK (512 * 1024)
+#define MATRIX_IO_DEFAULT_DEPTH 8
+#define MATRIX_IO_MAX_DEPTH 64
+#define MATRIX_IO_URING_MIN (1024 * 1024)
+#define MATRIX_IO_DIRECT_MIN (64 * 1024 * 1024)
+
+/*
+ * Settings used by files opened afterwards
+ *   use_uring: Whether to use io_uring where it is available
+ *   queue_depth: Pieces in flight per file, from 1 to MATRIX_IO_MAX_DEPTH
+ *   direct: Whether large files bypass the page cache
+ */
+typedef struct {
+    int use_uring;
+    unsigned queue_depth;
+    int direct;
+} matrix_io_config_t;
+
+struct matrix_io_ring;
+
+/*
+ * A file open for sequential reading or writing
+ *   fd: The file descriptor
+ *   writing: Whether the file was opened for writing
+ *   direct: Whether the file was opened with O_DIRECT
+ *   pos: Offset of the next byte to read or write
+ *   size: Size of the file when opened for reading
+ *   ring: The file's io_uring, or NULL when using pread/pwrite
+ */
+typedef struct {
+    int fd;
+    int writing;
+    int direct;
+    off_t pos;
+    off_t size;
+    struct matrix_io_ring *ring;
+} matrix_io_file_t;
+
+/*
+ * Read or change the settings. matrix_io_configure clamps the queue depth
+ * to the allowed range.
+ */
+void matrix_io_get_config(matrix_io_config_t *config);
+void matrix_io_configure(const matrix_io_config_t *config);
+
+/*
+ * Name of the backend new files would use for a large file: "io_uring" if the
+ * settings and kernel allow it, otherwise "pread"
+ */
+const char *matrix_io_backend(void);
+
+/*
+ * Open a file for reading
+ * Returns 0 on success or -1 on error
+ */
+int matrix_io_open_read(matrix_io_file_t *file, const char *file_name);
+
+/*
+ * Create or truncate a file for writing
+ *   size_hint: Expected number of bytes, which picks the backend
+ * Returns 0 on success or -1 on error
+ */
+int matrix_io_open_write(matrix_io_file_t *file, const char *file_name, size_t size_hint);
+
+/*
+ * Read the next 'len' bytes, or as many as remain before the end of the file
+ * Returns the number of bytes read or -1 on error
+ */
+ssize_t matrix_io_read(matrix_io_file_t *file, void *dest, size_t len);
+
+/*
+ * Write 'len' bytes after those written so far. They may still be in flight
+ * when this returns, until matrix_io_close.
+ * Returns 0 on success or -1 on error
+ */
+int matrix_io_write(matrix_io_file_t *file, const void *src, size_t len);
+
+/*
+ * Finish every write in flight and close the file
+ * Returns 0 on success or -1 if any write or the close failed
+ */
+int matrix_io_close(matrix_io_file_t *file);
+
+#endif // MATRIX_IO_H
@@ -0,0 +1,295 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "matrix_nt.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Each loop iteration handles one cache line: four 16-byte vectors.
+#define LINE_INTS 16
+#define VEC_LANES 4
+typedef int vec_i32 __attribute__((vector_size(VEC_LANES * sizeof(int))));
+typedef unsigned vec_u32 __attribute__((vector_size(VEC_LANES * sizeof(int))));
+typedef float vec_f32 __attribute__((vector_size(VEC_LANES * sizeof(float))));
+
+// The tuning copy is large enough to run from memory rather than cache.
+#define TUNE_MIN_BYTES (16 * 1024 * 1024)
+#define TUNE_MAX_BYTES (64 * 1024 * 1024)
+#define TUNE_REPS 2
+
+static matrix_nt_config_t config;
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+// Tuning waits for the first kernel call that streams, so runs that never
+// write a large destination do not pay for it.
+static pthread_once_t tune_once = PTHREAD_ONCE_INIT;
+static int distance_from_env;
+
+static inline vec_i32 vec_load(const int *src) {
+    vec_i32 v;
+    memcpy(&v, src, sizeof(v)); // Compiles to a single unaligned load
+    return v;
+}
+
+// Stores one vector to 16-byte aligned 'dest', bypassing the cache where possible.
+static inline void stream_store(void *dest, vec_i32 v) {
+#ifdef __SSE2__
+    _mm_stream_si128((__m128i *) dest, (__m128i) v);
+#else
+    memcpy(dest, &v, sizeof(v));
+#endif
+}
+
+static inline vec_i32 vec_bswap(vec_i32 v) {
+    vec_u32 u = (vec_u32) v;
+    return (vec_i32) ((u << 24) | ((u << 8) & 0xff0000) | ((u >> 8) & 0xff00) | (u >> 24));
+}
+
+static inline int bswap(int val) {
+    return (int) __builtin_bswap32((uint32_t) val);
+}
+
+// Ints to write one at a time before 'dest' reaches a 16-byte boundary.
+static size_t head_ints(const void *dest, size_t n) {
+    size_t head = ((16 - (uintptr_t) dest % 16) % 16) / sizeof(int);
+    return head < n ? head : n;
+}
+
+/*
+ * The kernels below write with non-temporal stores. 'dist' is the prefetch
+ * distance in ints, and the caller fences once the destination is complete.
+ */
+
+static void stream_fill(int *dest, int val, size_t n) {
+    size_t i = head_ints(dest, n);
+    for (size_t j = 0; j < i; j++) {
+        dest[j] = val;
+    }
+    vec_i32 v = (vec_i32) {0} + val;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        stream_store(dest + i, v);
+    }
+    for (; i < n; i++) {
+        dest[i] = val;
+    }
+}
+
+static void stream_copy(int *dest, const int *src, size_t n, size_t dist) {
+    size_t i = head_ints(dest, n);
+    memcpy(dest, src, i * sizeof(int));
+    for (; i + LINE_INTS <= n; i += LINE_INTS) {
+        __builtin_prefetch(src + i + dist, 0, 0);
+        for (int k = 0; k < LINE_INTS; k += VEC_LANES) {
+            stream_store(dest + i + k, vec_load(src + i + k));
+        }
+    }
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        stream_store(dest + i, vec_load(src + i));
+    }
+    memcpy(dest + i, src + i, (n - i) * sizeof(int));
+}
+
+static void stream_convert_f32(float *dest, const int *src, size_t n, size_t dist) {
+    size_t i = head_ints(dest, n);
+    for (size_t j = 0; j < i; j++) {
+        dest[j] = (float) src[j];
+    }
+    for (; i + LINE_INTS <= n; i += LINE_INTS) {
+        __builtin_prefetch(src + i + dist, 0, 0);
+        for (int k = 0; k < LINE_INTS; k += VEC_LANES) {
+            vec_f32 f = __builtin_convertvector(vec_load(src + i + k), vec_f32);
+            stream_store(dest + i + k, (vec_i32) f);
+        }
+    }
+    for (; i < n; i++) {
+        dest[i] = (float) src[i];
+    }
+}
+
+static void stream_bswap(int *dest, const int *src, size_t n, size_t dist) {
+    size_t i = head_ints(dest, n);
+    for (size_t j = 0; j < i; j++) {
+        dest[j] = bswap(src[j]);
+    }
+    for (; i + LINE_INTS <= n; i += LINE_INTS) {
+        __builtin_prefetch(src + i + dist, 0, 0);
+        for (int k = 0; k < LINE_INTS; k += VEC_LANES) {
+            stream_store(dest + i + k, vec_bswap(vec_load(src + i + k)));
+        }
+    }
+    for (; i < n; i++) {
+        dest[i] = bswap(src[i]);
+    }
+}
+
+void matrix_nt_fence(void) {
+#ifdef __SSE2__
+    // Non-temporal stores are weakly ordered; later stores must not pass them.
+    _mm_sfence();
+#endif
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Half the L3 cache, or MATRIX_NT_DEFAULT_MIN where its size is unknown.
+static size_t default_min_bytes(void) {
+    long l3 = 0;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+    return l3 > 0 ? (size_t) l3 / 2 : MATRIX_NT_DEFAULT_MIN;
+}
+
+// Times a streaming copy at every distance. Call with config_mutex held.
+static int tune_locked(void) {
+    size_t bytes = config.min_bytes * 4;
+    if (bytes < TUNE_MIN_BYTES) {
+        bytes = TUNE_MIN_BYTES;
+    } else if (bytes > TUNE_MAX_BYTES) {
+        bytes = TUNE_MAX_BYTES;
+    }
+    size_t n = bytes / sizeof(int);
+    int *src = aligned_alloc(64, bytes);
+    int *dest = aligned_alloc(64, bytes);
+    if (src == NULL || dest == NULL) {
+        free(src);
+        free(dest);
+        return -1;
+    }
+    // Fault every page in before timing anything.
+    memset(src, 1, bytes);
+    memset(dest, 0, bytes);
+
+    static const unsigned distances[MATRIX_NT_N_DISTANCES] = MATRIX_NT_DISTANCES;
+    unsigned best = 0;
+    for (unsigned d = 0; d < MATRIX_NT_N_DISTANCES; d++) {
+        double fastest = 0;
+        for (int rep = 0; rep < TUNE_REPS; rep++) {
+            double start = now_ns();
+            stream_copy(dest, src, n, distances[d] / sizeof(int));
+            matrix_nt_fence();
+            double elapsed = now_ns() - start;
+            if (rep == 0 || elapsed < fastest) {
+                fastest = elapsed;
+            }
+        }
+        config.tune_ns[d] = fastest;
+        if (fastest < config.tune_ns[best]) {
+            best = d;
+        }
+    }
+    config.prefetch_distance = distances[best];
+    config.tuned = 1;
+    free(src);
+    free(dest);
+    return 0;
+}
+
+static void load_config(void) {
+    const char *nt = getenv("SMOCK_NT");
+    const char *distance = getenv("SMOCK_PREFETCH_DISTANCE");
+    if (nt != NULL && strcmp(nt, "off") == 0) {
+        config.min_bytes = SIZE_MAX;
+    } else if (nt != NULL && atol(nt) > 0) {
+        config.min_bytes = (size_t) atol(nt) * 1024;
+    } else {
+        config.min_bytes = default_min_bytes();
+    }
+    config.prefetch_distance = MATRIX_NT_DEFAULT_DISTANCE;
+    if (distance != NULL) {
+        config.prefetch_distance = strtoul(distance, NULL, 10);
+        distance_from_env = 1;
+    }
+}
+
+static void first_tune(void) {
+    if (!distance_from_env) {
+        matrix_nt_tune();
+    }
+}
+
+static matrix_nt_config_t current_config(void) {
+    pthread_once(&config_once, load_config);
+    pthread_mutex_lock(&config_mutex);
+    matrix_nt_config_t copy = config;
+    pthread_mutex_unlock(&config_mutex);
+    return copy;
+}
+
+void matrix_nt_get_config(matrix_nt_config_t *out) {
+    pthread_once(&tune_once, first_tune);
+    *out = current_config();
+}
+
+int matrix_nt_tune(void) {
+    pthread_once(&config_once, load_config);
+    pthread_mutex_lock(&config_mutex);
+    int ret = tune_locked();
+    pthread_mutex_unlock(&config_mutex);
+    return ret;
+}
+
+int matrix_nt_streamed(size_t bytes) {
+    return bytes >= current_config().min_bytes;
+}
+
+// Prefetch distance in ints, tuning first if needed.
+static size_t distance_ints(void) {
+    pthread_once(&tune_once, first_tune);
+    return current_config().prefetch_distance / sizeof(int);
+}
+
+void matrix_nt_fill(int *dest, int val, size_t n) {
+    if (!matrix_nt_streamed(n * sizeof(int))) {
+        for (size_t i = 0; i < n; i++) {
+            dest[i] = val;
+        }
+        return;
+    }
+    stream_fill(dest, val, n);
+    matrix_nt_fence();
+}
+
+void matrix_nt_copy(int *dest, const int *src, size_t n) {
+    if (!matrix_nt_streamed(n * sizeof(int))) {
+        memcpy(dest, src, n * sizeof(int));
+        return;
+    }
+    stream_copy(dest, src, n, distance_ints());
+    matrix_nt_fence();
+}
+
+void matrix_nt_convert_f32(float *dest, const int *src, size_t n) {
+    if (!matrix_nt_streamed(n * sizeof(float))) {
+        for (size_t i = 0; i < n; i++) {
+            dest[i] = (float) src[i];
+        }
+        return;
+    }
+    stream_convert_f32(dest, src, n, distance_ints());
+    matrix_nt_fence();
+}
+
+void matrix_nt_bswap(int *dest, const int *src, size_t n) {
+    if (!matrix_nt_streamed(n * sizeof(int))) {
+        for (size_t i = 0; i < n; i++) {
+            dest[i] = bswap(src[i]);
+        }
+        return;
+    }
+    stream_bswap(dest, src, n, distance_ints());
+    matrix_nt_fence();
+}
+
+void matrix_nt_store(int *dest, const int *src, size_t n) {
+    stream_copy(dest, src, n, 0);
+}
@@ -0,0 +1,93 @@
+#ifndef MATRIX_NT_H
+#define MATRIX_NT_H
+
+#include <stddef.h>
+
+/*
+ * Streaming write kernels for destinations that are written once and not
+ * read again soon: filling, copying, converting and byte swapping whole
+ * matrices. Destinations of at least 'min_bytes' are written with
+ * non-temporal stores, which go to memory without being allocated in the
+ * cache, so a large write does not evict what reductions running on other
+ * cores keep in the shared L3. Smaller destinations use ordinary stores,
+ * since they are likely to be read again while still cached.
+ *
+ * Sources are prefetched 'prefetch_distance' bytes ahead of the loads. The
+ * best distance depends on the microarchitecture, so the first large kernel
+ * call times a copy at each of MATRIX_NT_DISTANCES and keeps the fastest.
+ *
+ * Settings start from the environment:
+ *   SMOCK_NT: "off" to never use non-temporal stores, or 'min_bytes' in KB
+ *   SMOCK_PREFETCH_DISTANCE: Prefetch distance in bytes, skipping the tuning
+ * Non-temporal stores need SSE2. Elsewhere the kernels use ordinary stores.
+ */
+
+#define MATRIX_NT_DEFAULT_MIN (4 * 1024 * 1024)
+#define MATRIX_NT_DEFAULT_DISTANCE 512
+#define MATRIX_NT_DISTANCES {0, 128, 256, 512, 1024, 2048}
+#define MATRIX_NT_N_DISTANCES 6
+
+/*
+ * Settings of the kernels
+ *   min_bytes: Smallest destination written with non-temporal stores, half
+ *     the L3 cache where its size is known
+ *   prefetch_distance: Bytes ahead of the loads that sources are prefetched
+ *   tuned: Whether 'prefetch_distance' was measured on this machine
+ *   tune_ns: Time of the tuning copy at each of MATRIX_NT_DISTANCES, if tuned
+ */
+typedef struct {
+    size_t min_bytes;
+    unsigned prefetch_distance;
+    int tuned;
+    double tune_ns[MATRIX_NT_N_DISTANCES];
+} matrix_nt_config_t;
+
+/*
+ * Copy the current settings into 'config', tuning first if that has not
+ * happened yet
+ */
+void matrix_nt_get_config(matrix_nt_config_t *config);
+
+/*
+ * Measure every prefetch distance again and keep the fastest
+ * Returns 0 on success or -1 if the buffers could not be allocated
+ */
+int matrix_nt_tune(void);
+
+/*
+ * Set 'n' ints at 'dest' to 'val'
+ */
+void matrix_nt_fill(int *dest, int val, size_t n);
+
+/*
+ * Copy 'n' ints from 'src' to 'dest', which must not overlap
+ */
+void matrix_nt_copy(int *dest, const int *src, size_t n);
+
+/*
+ * Convert 'n' ints from 'src' to floats in 'dest', which must not overlap
+ */
+void matrix_nt_convert_f32(float *dest, const int *src, size_t n);
+
+/*
+ * Reverse the byte order of 'n' ints from 'src' into 'dest'. 'dest' may be
+ * 'src' itself, but must not overlap it otherwise.
+ */
+void matrix_nt_bswap(int *dest, const int *src, size_t n);
+
+/*
+ * Copy 'n' ints with non-temporal stores whatever their size, and without
+ * waiting for the stores to complete. For callers that write a large
+ * destination one small tile at a time: they check matrix_nt_streamed once
+ * for the whole destination and call matrix_nt_fence after the last tile.
+ */
+void matrix_nt_store(int *dest, const int *src, size_t n);
+void matrix_nt_fence(void);
+
+/*
+ * Whether a destination of 'bytes' bytes should be written with
+ * non-temporal stores
+ */
+int matrix_nt_streamed(size_t bytes);
+
+#endif // MATRIX_NT_H
@@ -0,0 +1,648 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "instrument.h"
+#include "matrix.h"
+#include "matrix_nt.h"
+#include "matrix_ops.h"
+
+// Number of elements each stack slot holds while evaluating an expression.
+// Small enough that every slot of a full stack stays resident in L1/L2.
+#define MATRIX_EXPR_TILE 512
+
+// 16-byte vectors map onto one SSE2/NEON register, the x86-64 baseline.
+// Building with -mavx2 lets the compiler fuse pairs of them.
+#define VEC_LANES 4
+typedef int vec_i32 __attribute__((vector_size(VEC_LANES * sizeof(int))));
+// Unsigned lanes give wrapping add/sub/mul without signed overflow.
+typedef unsigned vec_u32 __attribute__((vector_size(VEC_LANES * sizeof(int))));
+
+static inline vec_i32 vec_load(const int *src) {
+    vec_i32 v;
+    memcpy(&v, src, sizeof(v)); // Compiles to a single unaligned load
+    return v;
+}
+
+static inline void vec_store(int *dest, vec_i32 v) {
+    memcpy(dest, &v, sizeof(v));
+}
+
+static void kernel_add(int *dest, const int *a, const int *b, size_t n) {
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        vec_store(dest + i, (vec_i32) ((vec_u32) vec_load(a + i) + (vec_u32) vec_load(b + i)));
+    }
+    for (; i < n; i++) {
+        dest[i] = (int) ((unsigned) a[i] + (unsigned) b[i]);
+    }
+}
+
+static void kernel_sub(int *dest, const int *a, const int *b, size_t n) {
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        vec_store(dest + i, (vec_i32) ((vec_u32) vec_load(a + i) - (vec_u32) vec_load(b + i)));
+    }
+    for (; i < n; i++) {
+        dest[i] = (int) ((unsigned) a[i] - (unsigned) b[i]);
+    }
+}
+
+static void kernel_mul(int *dest, const int *a, const int *b, size_t n) {
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        vec_store(dest + i, (vec_i32) ((vec_u32) vec_load(a + i) * (vec_u32) vec_load(b + i)));
+    }
+    for (; i < n; i++) {
+        dest[i] = (int) ((unsigned) a[i] * (unsigned) b[i]);
+    }
+}
+
+static void kernel_scale(int *dest, const int *src, int factor, size_t n) {
+    size_t i = 0;
+    vec_u32 f = (vec_u32) {0} + (unsigned) factor;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        vec_store(dest + i, (vec_i32) ((vec_u32) vec_load(src + i) * f));
+    }
+    for (; i < n; i++) {
+        dest[i] = (int) ((unsigned) src[i] * (unsigned) factor);
+    }
+}
+
+static void kernel_offset(int *dest, const int *src, int offset, size_t n) {
+    size_t i = 0;
+    vec_u32 off = (vec_u32) {0} + (unsigned) offset;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        vec_store(dest + i, (vec_i32) ((vec_u32) vec_load(src + i) + off));
+    }
+    for (; i < n; i++) {
+        dest[i] = (int) ((unsigned) src[i] + (unsigned) offset);
+    }
+}
+
+static void kernel_clamp(int *dest, const int *src, int lo, int hi, size_t n) {
+    size_t i = 0;
+    vec_i32 lo_v = (vec_i32) {0} + lo;
+    vec_i32 hi_v = (vec_i32) {0} + hi;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        vec_i32 v = vec_load(src + i);
+        // Comparisons give all-ones lanes where true, so blend with masks.
+        vec_i32 below = v < lo_v;
+        v = (v & ~below) | (lo_v & below);
+        vec_i32 above = v > hi_v;
+        v = (v & ~above) | (hi_v & above);
+        vec_store(dest + i, v);
+    }
+    for (; i < n; i++) {
+        int val = src[i];
+        if (val < lo) {
+            val = lo;
+        } else if (val > hi) {
+            val = hi;
+        }
+        dest[i] = val;
+    }
+}
+
+static void kernel_threshold(int *dest, const int *src, int thresh, size_t n) {
+    size_t i = 0;
+    vec_i32 t = (vec_i32) {0} + thresh;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        vec_i32 v = vec_load(src + i);
+        vec_store(dest + i, v & (v >= t));
+    }
+    for (; i < n; i++) {
+        dest[i] = src[i] >= thresh ? src[i] : 0;
+    }
+}
+
+static void kernel_fill(int *dest, int val, size_t n) {
+    size_t i = 0;
+    vec_i32 v = (vec_i32) {0} + val;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        vec_store(dest + i, v);
+    }
+    for (; i < n; i++) {
+        dest[i] = val;
+    }
+}
+
+static int same_dims(const matrix_t *a, const matrix_t *b) {
+    return a->nrows == b->nrows && a->ncols == b->ncols;
+}
+
+static size_t num_elements(const matrix_t *mat) {
+    return (size_t) mat->nrows * mat->ncols;
+}
+
+/*
+ * Runs one operation as a single-instruction expression, for destinations
+ * large enough that matrix_expr_eval writes them with non-temporal stores.
+ *   b: Second source for EXPR_ADD, EXPR_SUB and EXPR_MUL, otherwise NULL
+ */
+static int eval_streamed(matrix_t *dest, matrix_expr_op_t op, const matrix_t *a,
+                         const matrix_t *b, int x, int y) {
+    matrix_expr_t expr;
+    matrix_expr_init(&expr);
+    matrix_expr_push(&expr, EXPR_LOAD, a, 0, 0);
+    if (b != NULL) {
+        matrix_expr_push(&expr, EXPR_LOAD, b, 0, 0);
+    }
+    matrix_expr_push(&expr, op, NULL, x, y);
+    return matrix_expr_eval(&expr, dest);
+}
+
+static int streamed(const matrix_t *dest) {
+    return matrix_nt_streamed(num_elements(dest) * sizeof(int));
+}
+
+int matrix_add(matrix_t *dest, const matrix_t *a, const matrix_t *b) {
+    if (!same_dims(dest, a) || !same_dims(a, b)) {
+        return -1;
+    } else if (streamed(dest)) {
+        return eval_streamed(dest, EXPR_ADD, a, b, 0, 0);
+    }
+    kernel_add(dest->data, a->data, b->data, num_elements(a));
+    matrix_agg_invalidate(dest);
+    return 0;
+}
+
+int matrix_sub(matrix_t *dest, const matrix_t *a, const matrix_t *b) {
+    if (!same_dims(dest, a) || !same_dims(a, b)) {
+        return -1;
+    } else if (streamed(dest)) {
+        return eval_streamed(dest, EXPR_SUB, a, b, 0, 0);
+    }
+    kernel_sub(dest->data, a->data, b->data, num_elements(a));
+    matrix_agg_invalidate(dest);
+    return 0;
+}
+
+int matrix_mul(matrix_t *dest, const matrix_t *a, const matrix_t *b) {
+    if (!same_dims(dest, a) || !same_dims(a, b)) {
+        return -1;
+    } else if (streamed(dest)) {
+        return eval_streamed(dest, EXPR_MUL, a, b, 0, 0);
+    }
+    kernel_mul(dest->data, a->data, b->data, num_elements(a));
+    matrix_agg_invalidate(dest);
+    return 0;
+}
+
+int matrix_scale(matrix_t *dest, const matrix_t *src, int factor) {
+    if (!same_dims(dest, src)) {
+        return -1;
+    } else if (streamed(dest)) {
+        return eval_streamed(dest, EXPR_SCALE, src, NULL, factor, 0);
+    }
+    kernel_scale(dest->data, src->data, factor, num_elements(src));
+    matrix_agg_invalidate(dest);
+    return 0;
+}
+
+int matrix_offset(matrix_t *dest, const matrix_t *src, int offset) {
+    if (!same_dims(dest, src)) {
+        return -1;
+    } else if (streamed(dest)) {
+        return eval_streamed(dest, EXPR_OFFSET, src, NULL, offset, 0);
+    }
+    kernel_offset(dest->data, src->data, offset, num_elements(src));
+    matrix_agg_invalidate(dest);
+    return 0;
+}
+
+int matrix_clamp(matrix_t *dest, const matrix_t *src, int lo, int hi) {
+    if (!same_dims(dest, src)) {
+        return -1;
+    } else if (streamed(dest)) {
+        return eval_streamed(dest, EXPR_CLAMP, src, NULL, lo, hi);
+    }
+    kernel_clamp(dest->data, src->data, lo, hi, num_elements(src));
+    matrix_agg_invalidate(dest);
+    return 0;
+}
+
+int matrix_threshold(matrix_t *dest, const matrix_t *src, int thresh) {
+    if (!same_dims(dest, src)) {
+        return -1;
+    } else if (streamed(dest)) {
+        return eval_streamed(dest, EXPR_THRESHOLD, src, NULL, thresh, 0);
+    }
+    kernel_threshold(dest->data, src->data, thresh, num_elements(src));
+    matrix_agg_invalidate(dest);
+    return 0;
+}
+
+void matrix_expr_init(matrix_expr_t *expr) {
+    expr->len = 0;
+    expr->depth = 0;
+    expr->max_depth = 0;
+    expr->nrows = 0;
+    expr->ncols = 0;
+}
+
+int matrix_expr_push(matrix_expr_t *expr, matrix_expr_op_t op, const matrix_t *mat,
+                     int a, int b) {
+    if (expr->len >= MATRIX_EXPR_MAX_INSTRS) {
+        return -1;
+    }
+
+    switch (op) {
+    case EXPR_LOAD:
+        if (mat == NULL) {
+            return -1;
+        }
+        // Every loaded matrix must agree with the first one.
+        if (expr->nrows == 0 && expr->ncols == 0) {
+            expr->nrows = mat->nrows;
+            expr->ncols = mat->ncols;
+        } else if (expr->nrows != mat->nrows || expr->ncols != mat->ncols) {
+            return -1;
+        }
+        // Loads and constants both push one slot.
+        /* fall through */
+    case EXPR_CONST:
+        if (expr->depth >= MATRIX_EXPR_MAX_DEPTH) {
+            return -1;
+        }
+        expr->depth++;
+        break;
+    case EXPR_ADD:
+    case EXPR_SUB:
+    case EXPR_MUL:
+        if (expr->depth < 2) {
+            return -1;
+        }
+        expr->depth--;
+        break;
+    default:
+        if (expr->depth < 1) {
+            return -1;
+        }
+        break;
+    }
+
+    if (expr->depth > expr->max_depth) {
+        expr->max_depth = expr->depth;
+    }
+    matrix_expr_instr_t *instr = &expr->code[expr->len++];
+    instr->op = op;
+    instr->mat = mat;
+    instr->a = a;
+    instr->b = b;
+    return 0;
+}
+
+/*
+ * Runs the whole program over elements [start, start + n) of every matrix.
+ * Stack slots point either straight at source data (after a load) or at a
+ * scratch tile, so loads never copy. The final instruction writes directly
+ * into 'out' since earlier instructions might still need to read 'out'.
+ */
+static void expr_eval_tile(const matrix_expr_t *expr, int *out, size_t start, size_t n,
+                           int scratch[][MATRIX_EXPR_TILE]) {
+    const int *slot[MATRIX_EXPR_MAX_DEPTH];
+    unsigned depth = 0;
+
+    for (unsigned pc = 0; pc < expr->len; pc++) {
+        const matrix_expr_instr_t *instr = &expr->code[pc];
+        int is_last = (pc == expr->len - 1);
+
+        if (instr->op == EXPR_LOAD) {
+            const int *src = instr->mat->data + start;
+            if (is_last) {
+                if (src != out) {
+                    memmove(out, src, n * sizeof(int));
+                }
+            } else {
+                slot[depth++] = src;
+            }
+            continue;
+        }
+        if (instr->op == EXPR_CONST) {
+            int *dest = is_last ? out : scratch[depth];
+            kernel_fill(dest, instr->a, n);
+            slot[depth++] = dest;
+            continue;
+        }
+
+        if (instr->op == EXPR_ADD || instr->op == EXPR_SUB || instr->op == EXPR_MUL) {
+            depth--;
+            int *dest = is_last ? out : scratch[depth - 1];
+            if (instr->op == EXPR_ADD) {
+                kernel_add(dest, slot[depth - 1], slot[depth], n);
+            } else if (instr->op == EXPR_SUB) {
+                kernel_sub(dest, slot[depth - 1], slot[depth], n);
+            } else {
+                kernel_mul(dest, slot[depth - 1], slot[depth], n);
+            }
+            slot[depth - 1] = dest;
+            continue;
+        }
+
+        int *dest = is_last ? out : scratch[depth - 1];
+        switch (instr->op) {
+        case EXPR_SCALE:
+            kernel_scale(dest, slot[depth - 1], instr->a, n);
+            break;
+        case EXPR_OFFSET:
+            kernel_offset(dest, slot[depth - 1], instr->a, n);
+            break;
+        case EXPR_CLAMP:
+            kernel_clamp(dest, slot[depth - 1], instr->a, instr->b, n);
+            break;
+        case EXPR_THRESHOLD:
+            kernel_threshold(dest, slot[depth - 1], instr->a, n);
+            break;
+        default:
+            break;
+        }
+        slot[depth - 1] = dest;
+    }
+}
+
+int matrix_expr_eval(const matrix_expr_t *expr, matrix_t *dest) {
+    if (expr->len == 0 || expr->depth != 1) {
+        return -1;
+    }
+    if (dest->nrows != expr->nrows || dest->ncols != expr->ncols) {
+        return -1;
+    }
+
+    INSTR_START(eval_start);
+    // One scratch tile per stack slot below the top, aligned for vector loads.
+    int scratch[MATRIX_EXPR_MAX_DEPTH][MATRIX_EXPR_TILE] __attribute__((aligned(64)));
+    // Large results are built a tile at a time here and streamed out to 'dest'.
+    int out[MATRIX_EXPR_TILE] __attribute__((aligned(64)));
+    size_t total = num_elements(dest);
+    int stream = streamed(dest);
+    for (size_t start = 0; start < total; start += MATRIX_EXPR_TILE) {
+        size_t n = total - start;
+        if (n > MATRIX_EXPR_TILE) {
+            n = MATRIX_EXPR_TILE;
+        }
+        if (stream) {
+            expr_eval_tile(expr, out, start, n, scratch);
+            matrix_nt_store(dest->data + start, out, n);
+        } else {
+            expr_eval_tile(expr, dest->data + start, start, n, scratch);
+        }
+    }
+    if (stream) {
+        matrix_nt_fence();
+    }
+    matrix_agg_invalidate(dest);
+    INSTR_RECORD(INSTR_EXPR_EVAL, eval_start);
+    return 0;
+}
+
+/*
+ * Recursive descent parser state
+ *   pos: Next unread character of the expression text
+ *   expr: Expression receiving the generated instructions
+ *   lookup, ctx: Resolve matrix names
+ *   error: Set once any error occurs
+ */
+typedef struct {
+    const char *pos;
+    matrix_expr_t *expr;
+    matrix_expr_lookup_t lookup;
+    void *ctx;
+    int error;
+} expr_parser_t;
+
+/*
+ * Value of a parsed subexpression. Constants are held back rather than
+ * emitted so they can be folded or turned into scalar instructions.
+ */
+typedef struct {
+    int is_const;
+    long value;
+} expr_value_t;
+
+static void parser_skip_space(expr_parser_t *p) {
+    while (isspace((unsigned char) *p->pos)) {
+        p->pos++;
+    }
+}
+
+// Consumes 'token' if it is next in the input. Returns 1 if consumed.
+static int parser_accept(expr_parser_t *p, const char *token) {
+    parser_skip_space(p);
+    size_t len = strlen(token);
+    if (strncmp(p->pos, token, len) != 0) {
+        return 0;
+    }
+    // Keywords must not be the prefix of a longer name.
+    if (isalpha((unsigned char) token[0]) &&
+        (isalnum((unsigned char) p->pos[len]) || p->pos[len] == '_')) {
+        return 0;
+    }
+    p->pos += len;
+    return 1;
+}
+
+// Constants are held as long while parsing, but instructions take ints.
+static int fits_int(long value) {
+    return value >= INT_MIN && value <= INT_MAX;
+}
+
+static void parser_emit(expr_parser_t *p, matrix_expr_op_t op, const matrix_t *mat,
+                        long a, long b) {
+    if (!fits_int(a) || !fits_int(b)) {
+        p->error = 1;
+    }
+    if (!p->error && matrix_expr_push(p->expr, op, mat, (int) a, (int) b) != 0) {
+        p->error = 1;
+    }
+}
+
+// Reads an integer literal, which must fit an int. Returns 0 on success.
+static int parser_literal(expr_parser_t *p, long *result) {
+    char *end;
+    errno = 0;
+    *result = strtol(p->pos, &end, 10);
+    if (end == p->pos || errno == ERANGE || !fits_int(*result)) {
+        p->error = 1;
+        return -1;
+    }
+    p->pos = end;
+    return 0;
+}
+
+static int parser_signed_int(expr_parser_t *p, long *result) {
+    parser_skip_space(p);
+    return parser_literal(p, result);
+}
+
+static expr_value_t parse_additive(expr_parser_t *p);
+
+static expr_value_t parse_primary(expr_parser_t *p) {
+    expr_value_t val = {1, 0};
+    parser_skip_space(p);
+
+    if (parser_accept(p, "(")) {
+        val = parse_additive(p);
+        if (!parser_accept(p, ")")) {
+            p->error = 1;
+        }
+    } else if (isdigit((unsigned char) *p->pos)) {
+        parser_literal(p, &val.value);
+    } else if (isalpha((unsigned char) *p->pos) || *p->pos == '_') {
+        char name[128];
+        unsigned len = 0;
+        while ((isalnum((unsigned char) *p->pos) || *p->pos == '_') && len < sizeof(name) - 1) {
+            name[len++] = *p->pos++;
+        }
+        name[len] = '\0';
+        const matrix_t *mat = p->lookup(p->ctx, name);
+        if (mat == NULL) {
+            fprintf(stderr, "Unknown matrix '%s'\n", name);
+            p->error = 1;
+        } else {
+            parser_emit(p, EXPR_LOAD, mat, 0, 0);
+            val.is_const = 0;
+        }
+    } else {
+        p->error = 1;
+    }
+    return val;
+}
+
+static expr_value_t parse_unary(expr_parser_t *p) {
+    if (parser_accept(p, "-")) {
+        expr_value_t val = parse_unary(p);
+        if (val.is_const) {
+            val.value = -val.value;
+            if (!fits_int(val.value)) {
+                p->error = 1;
+            }
+        } else {
+            parser_emit(p, EXPR_SCALE, NULL, -1, 0);
+        }
+        return val;
+    }
+    return parse_primary(p);
+}
+
+/*
+ * Combines two parsed operands with a binary operator. Matrix-matrix pairs
+ * become one binary instruction; a constant on either side becomes a scalar
+ * instruction on the matrix operand, which is already on top of the stack.
+ */
+static expr_value_t combine(expr_parser_t *p, char op, expr_value_t lhs, expr_value_t rhs) {
+    expr_value_t result = {0, 0};
+
+    if (lhs.is_const && rhs.is_const) {
+        // Folded constants must fit an int, as literals do.
+        int folded;
+        int overflow;
+        if (op == '+') {
+            overflow = __builtin_add_overflow((int) lhs.value, (int) rhs.value, &folded);
+        } else if (op == '-') {
+            overflow = __builtin_sub_overflow((int) lhs.value, (int) rhs.value, &folded);
+        } else {
+            overflow = __builtin_mul_overflow((int) lhs.value, (int) rhs.value, &folded);
+        }
+        if (overflow) {
+            p->error = 1;
+        }
+        result.is_const = 1;
+        result.value = folded;
+    } else if (!lhs.is_const && !rhs.is_const) {
+        parser_emit(p, op == '+' ? EXPR_ADD : op == '-' ? EXPR_SUB : EXPR_MUL, NULL, 0, 0);
+    } else if (rhs.is_const) {
+        if (op == '+') {
+            parser_emit(p, EXPR_OFFSET, NULL, rhs.value, 0);
+        } else if (op == '-') {
+            parser_emit(p, EXPR_OFFSET, NULL, -rhs.value, 0);
+        } else {
+            parser_emit(p, EXPR_SCALE, NULL, rhs.value, 0);
+        }
+    } else {
+        if (op == '+') {
+            parser_emit(p, EXPR_OFFSET, NULL, lhs.value, 0);
+        } else if (op == '-') {
+            // c - X is computed as (X * -1) + c
+            parser_emit(p, EXPR_SCALE, NULL, -1, 0);
+            parser_emit(p, EXPR_OFFSET, NULL, lhs.value, 0);
+        } else {
+            parser_emit(p, EXPR_SCALE, NULL, lhs.value, 0);
+        }
+    }
+    return result;
+}
+
+static expr_value_t parse_term(expr_parser_t *p) {
+    expr_value_t val = parse_unary(p);
+    while (!p->error && parser_accept(p, "*")) {
+        val = combine(p, '*', val, parse_unary(p));
+    }
+    return val;
+}
+
+static expr_value_t parse_additive(expr_parser_t *p) {
+    expr_value_t val = parse_term(p);
+    while (!p->error) {
+        if (parser_accept(p, "+")) {
+            val = combine(p, '+', val, parse_term(p));
+        } else if (parser_accept(p, "-")) {
+            val = combine(p, '-', val, parse_term(p));
+        } else {
+            break;
+        }
+    }
+    return val;
+}
+
+static expr_value_t parse_postfix(expr_parser_t *p) {
+    expr_value_t val = parse_additive(p);
+    while (!p->error) {
+        if (parser_accept(p, "clamp")) {
+            long lo;
+            long hi;
+            if (parser_signed_int(p, &lo) != 0 || !parser_accept(p, "..") ||
+                parser_signed_int(p, &hi) != 0 || lo > hi) {
+                p->error = 1;
+                break;
+            }
+            if (val.is_const) {
+                val.value = val.value < lo ? lo : val.value > hi ? hi : val.value;
+            } else {
+                parser_emit(p, EXPR_CLAMP, NULL, lo, hi);
+            }
+        } else if (parser_accept(p, "threshold")) {
+            long thresh;
+            if (parser_signed_int(p, &thresh) != 0) {
+                break;
+            }
+            if (val.is_const) {
+                val.value = val.value >= thresh ? val.value : 0;
+            } else {
+                parser_emit(p, EXPR_THRESHOLD, NULL, thresh, 0);
+            }
+        } else {
+            break;
+        }
+    }
+    return val;
+}
+
+int matrix_expr_parse(matrix_expr_t *expr, const char *text,
+                      matrix_expr_lookup_t lookup, void *ctx) {
+    expr_parser_t parser = {text, expr, lookup, ctx, 0};
+    matrix_expr_init(expr);
+
+    expr_value_t val = parse_postfix(&parser);
+    parser_skip_space(&parser);
+    if (parser.error || *parser.pos != '\0') {
+        return -1;
+    }
+    // Without any matrix there are no dimensions to give the result.
+    if (val.is_const) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+#ifndef MATRIX_OPS_H
+#define MATRIX_OPS_H
+
+#include "matrix.h"
+
+/*
+ * Elementwise and scalar arithmetic on matrices. The eager functions below
+ * each make one pass over memory; chains of them should instead be built as
+ * a matrix_expr_t so the whole chain is fused into a single pass.
+ * 'dest' may alias any of the source matrices in every function, and every
+ * function marks the cached aggregates of 'dest' out of date.
+ * Arithmetic wraps on overflow, the same way the vector kernels do.
+ */
+
+/*
+ * Elementwise dest = a + b, dest = a - b and dest = a * b
+ * All three matrices must have the same dimensions
+ * Returns 0 on success or -1 if the dimensions do not match
+ */
+int matrix_add(matrix_t *dest, const matrix_t *a, const matrix_t *b);
+int matrix_sub(matrix_t *dest, const matrix_t *a, const matrix_t *b);
+int matrix_mul(matrix_t *dest, const matrix_t *a, const matrix_t *b);
+
+/*
+ * Scalar operations applied to every element of 'src'
+ * scale: dest = src * factor
+ * offset: dest = src + offset
+ * clamp: dest = min(max(src, lo), hi), assumes lo <= hi
+ * threshold: dest = src if src >= thresh, otherwise 0
+ * Returns 0 on success or -1 if 'dest' and 'src' dimensions do not match
+ */
+int matrix_scale(matrix_t *dest, const matrix_t *src, int factor);
+int matrix_offset(matrix_t *dest, const matrix_t *src, int offset);
+int matrix_clamp(matrix_t *dest, const matrix_t *src, int lo, int hi);
+int matrix_threshold(matrix_t *dest, const matrix_t *src, int thresh);
+
+#define MATRIX_EXPR_MAX_INSTRS 32
+#define MATRIX_EXPR_MAX_DEPTH 8
+
+typedef enum {
+    EXPR_LOAD,      // Push the elements of 'mat'
+    EXPR_CONST,     // Push 'a' broadcast to every element
+    EXPR_ADD,       // Pop two, push their sum
+    EXPR_SUB,       // Pop two, push (second from top) - (top)
+    EXPR_MUL,       // Pop two, push their elementwise product
+    EXPR_SCALE,     // Multiply top by 'a'
+    EXPR_OFFSET,    // Add 'a' to top
+    EXPR_CLAMP,     // Clamp top to ['a', 'b']
+    EXPR_THRESHOLD  // Zero every element of top below 'a'
+} matrix_expr_op_t;
+
+/*
+ * One instruction of a lazy expression
+ *   op: The operation to perform
+ *   mat: Source matrix for EXPR_LOAD, unused otherwise
+ *   a, b: Scalar operands, meaning depends on 'op'
+ */
+typedef struct {
+    matrix_expr_op_t op;
+    const matrix_t *mat;
+    int a;
+    int b;
+} matrix_expr_instr_t;
+
+/*
+ * A lazy expression over matrices, stored as a postfix program. Nothing is
+ * computed until matrix_expr_eval, which runs the whole program on one small
+ * tile of elements at a time, so no full-size temporaries are allocated.
+ *   code: The postfix instructions
+ *   len: Number of instructions in 'code'
+ *   depth: Stack depth after the last instruction
+ *   max_depth: Largest stack depth reached by the program
+ *   nrows, ncols: Dimensions shared by every matrix in the expression
+ */
+typedef struct {
+    matrix_expr_instr_t code[MATRIX_EXPR_MAX_INSTRS];
+    unsigned len;
+    unsigned depth;
+    unsigned max_depth;
+    unsigned nrows;
+    unsigned ncols;
+} matrix_expr_t;
+
+/*
+ * Looks up a matrix by name while parsing an expression
+ * Returns the matrix, or NULL if no matrix has that name
+ */
+typedef const matrix_t *(*matrix_expr_lookup_t)(void *ctx, const char *name);
+
+/*
+ * Initialize an empty expression
+ */
+void matrix_expr_init(matrix_expr_t *expr);
+
+/*
+ * Append one instruction to an expression
+ *   expr: The expression to extend
+ *   op: The operation to append
+ *   mat: Matrix operand for EXPR_LOAD, NULL otherwise
+ *   a, b: Scalar operands for the operation
+ * Returns 0 on success or -1 if the program is full, would underflow the
+ * stack, or loads a matrix whose dimensions do not match earlier ones
+ */
+int matrix_expr_push(matrix_expr_t *expr, matrix_expr_op_t op, const matrix_t *mat,
+                     int a, int b);
+
+/*
+ * Parse an infix expression such as "(A + B) * 3 clamp 0..255"
+ * Matrix names are resolved through 'lookup'. Supported syntax, loosest
+ * binding first: postfix 'clamp <lo>..<hi>' and 'threshold <t>', then
+ * '+' and '-', then '*', then unary '-', parentheses, names and integers.
+ * Operations with an integer operand become scalar instructions, and
+ * constant subexpressions are folded while parsing. Integers and folded
+ * constants must lie in INT_MIN..INT_MAX.
+ *   expr: Expression to initialize with the parsed program
+ *   text: The expression text
+ *   lookup: Resolves matrix names
+ *   ctx: Passed through to 'lookup'
+ * Returns 0 on success or -1 on a syntax error, unknown name or integer
+ * out of range
+ */
+int matrix_expr_parse(matrix_expr_t *expr, const char *text,
+                      matrix_expr_lookup_t lookup, void *ctx);
+
+/*
+ * Evaluate an expression in a single pass, writing the result to 'dest'
+ * 'dest' may be one of the matrices the expression reads.
+ * Returns 0 on success or -1 if the expression is incomplete or 'dest' has
+ * different dimensions than the expression
+ */
+int matrix_expr_eval(const matrix_expr_t *expr, matrix_t *dest);
+
+#endif // MATRIX_OPS_H
@@ -0,0 +1,275 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "instrument.h"
+#include "matrix_stream.h"
+
+// Enough for the "<nrows> <ncols>" line of a text file and any padding around it
+#define TEXT_HEADER_MAX 64
+
+typedef struct stream stream_t;
+
+/*
+ * One buffer of the ring
+ *   stream: The stream it belongs to
+ *   data: MATRIX_STREAM_CHUNK bytes, plus one for a terminating zero
+ *   len: Bytes of the current chunk in 'data'
+ *   busy: Whether a worker has yet to finish reducing the chunk
+ */
+typedef struct {
+    stream_t *stream;
+    char *data;
+    size_t len;
+    int busy;
+} chunk_t;
+
+/*
+ * State shared by the reading thread and the workers. Every field after
+ * 'chunk_done' is protected by 'mutex'.
+ *   op, is_text: What to compute and how the chunks are encoded
+ *   in_flight: Chunks handed to workers and not yet reduced
+ *   sum, max, count: Results of the chunks reduced so far
+ *   error: Set when a chunk held something other than integers
+ */
+struct stream {
+    matrix_stream_op_t op;
+    int is_text;
+    pthread_mutex_t mutex;
+    pthread_cond_t chunk_done;
+    unsigned in_flight;
+    long sum;
+    long max;
+    size_t count;
+    int error;
+};
+
+// Reduces one chunk on a worker and hands its buffer back to the reader.
+static void reduce_chunk(void *arg) {
+    chunk_t *chunk = arg;
+    stream_t *s = chunk->stream;
+    long sum = 0;
+    long max = LONG_MIN;
+    size_t count = 0;
+    int error = 0;
+
+    if (!s->is_text) {
+        const int *values = (const int *) chunk->data;
+        count = chunk->len / sizeof(int);
+        if (s->op == MATRIX_STREAM_SUM) {
+            for (size_t i = 0; i < count; i++) {
+                sum += values[i];
+            }
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                if (max < values[i]) {
+                    max = values[i];
+                }
+            }
+        }
+    } else {
+        // Chunks end on whitespace, so no number is split between two of them.
+        chunk->data[chunk->len] = '\0';
+        char *pos = chunk->data;
+        while (1) {
+            while (isspace((unsigned char) *pos)) {
+                pos++;
+            }
+            if (*pos == '\0') {
+                break;
+            }
+            char *end;
+            errno = 0;
+            long val = strtol(pos, &end, 10);
+            if (end == pos || errno != 0 || val < INT_MIN || val > INT_MAX ||
+                (*end != '\0' && !isspace((unsigned char) *end))) {
+                error = 1;
+                break;
+            }
+            sum += val;
+            if (max < val) {
+                max = val;
+            }
+            count++;
+            pos = end;
+        }
+    }
+
+    pthread_mutex_lock(&s->mutex);
+    s->sum += sum;
+    if (max > s->max) {
+        s->max = max;
+    }
+    s->count += count;
+    s->error |= error;
+    chunk->busy = 0;
+    s->in_flight--;
+    pthread_cond_broadcast(&s->chunk_done);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+// Reads exactly 'len' bytes at 'offset'. Returns 0 on success or -1 on error.
+static int pread_all(int fd, char *dest, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t got = pread(fd, dest, len, offset);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            return -1;
+        }
+        INSTR_COUNT(INSTR_BYTES_READ, got);
+        INSTR_COUNT(INSTR_SYSCALLS, 1);
+        dest += got;
+        len -= got;
+        offset += got;
+    }
+    return 0;
+}
+
+/*
+ * Reads the dimensions of a matrix file and where its elements start and end
+ * Returns 0 on success or -1 on error
+ */
+static int read_header(int fd, int is_text, size_t *n, off_t *start, off_t *end) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    unsigned nrows;
+    unsigned ncols;
+    if (is_text) {
+        char header[TEXT_HEADER_MAX + 1];
+        ssize_t got = pread(fd, header, TEXT_HEADER_MAX, 0);
+        int used;
+        if (got <= 0) {
+            return -1;
+        }
+        header[got] = '\0';
+        if (sscanf(header, "%u %u%n", &nrows, &ncols, &used) != 2) {
+            return -1;
+        }
+        *start = used;
+        *end = st.st_size;
+    } else {
+        unsigned dims[2];
+        if (pread_all(fd, (char *) dims, sizeof(dims), 0) != 0) {
+            return -1;
+        }
+        nrows = dims[0];
+        ncols = dims[1];
+        *start = sizeof(dims);
+        *end = *start + (off_t) nrows * ncols * sizeof(int);
+        if (st.st_size < *end) {
+            return -1;
+        }
+    }
+    *n = (size_t) nrows * ncols;
+    return 0;
+}
+
+int matrix_stream_reduce(const char *file_name, matrix_stream_op_t op, worker_pool_t *pool,
+                         long *result) {
+    size_t name_len = strlen(file_name);
+    int is_text = name_len >= 4 && strcmp(file_name + name_len - 4, ".txt") == 0;
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t n;
+    off_t offset;
+    off_t end;
+    if (read_header(fd, is_text, &n, &offset, &end) != 0 || (op == MATRIX_STREAM_MAX && n == 0)) {
+        close(fd);
+        return -1;
+    }
+    // The kernel can read further ahead when it knows the whole file is wanted in order.
+    posix_fadvise(fd, offset, end - offset, POSIX_FADV_SEQUENTIAL);
+
+    stream_t s = {.op = op, .is_text = is_text, .max = LONG_MIN};
+    pthread_mutex_init(&s.mutex, NULL);
+    pthread_cond_init(&s.chunk_done, NULL);
+    unsigned n_chunks = pool->size + 1;
+    chunk_t *chunks = calloc(n_chunks, sizeof(chunk_t));
+    int ret = chunks == NULL ? -1 : 0;
+    for (unsigned i = 0; i < n_chunks && ret == 0; i++) {
+        chunks[i].stream = &s;
+        chunks[i].data = malloc(MATRIX_STREAM_CHUNK + 1);
+        if (chunks[i].data == NULL) {
+            ret = -1;
+        }
+    }
+
+    INSTR_START(start);
+    // Buffers are reused in ring order, so waiting for the next one to be
+    // free lets every other buffer keep a worker busy meanwhile.
+    for (unsigned next = 0; offset < end && ret == 0; next = (next + 1) % n_chunks) {
+        chunk_t *chunk = &chunks[next];
+        pthread_mutex_lock(&s.mutex);
+        while (chunk->busy) {
+            pthread_cond_wait(&s.chunk_done, &s.mutex);
+        }
+        int error = s.error;
+        pthread_mutex_unlock(&s.mutex);
+        if (error) {
+            break;
+        }
+
+        size_t len = end - offset < MATRIX_STREAM_CHUNK ? end - offset : MATRIX_STREAM_CHUNK;
+        if (pread_all(fd, chunk->data, len, offset) != 0) {
+            ret = -1;
+            break;
+        }
+        if (is_text && offset + (off_t) len < end) {
+            // End the chunk after its last whitespace; the partial number
+            // after it is read again as the start of the next chunk.
+            while (len > 0 && !isspace((unsigned char) chunk->data[len - 1])) {
+                len--;
+            }
+            if (len == 0) {
+                ret = -1;
+                break;
+            }
+        }
+        chunk->len = len;
+        offset += len;
+
+        pthread_mutex_lock(&s.mutex);
+        chunk->busy = 1;
+        s.in_flight++;
+        pthread_mutex_unlock(&s.mutex);
+        if (worker_pool_submit(pool, reduce_chunk, chunk) != 0) {
+            pthread_mutex_lock(&s.mutex);
+            chunk->busy = 0;
+            s.in_flight--;
+            pthread_mutex_unlock(&s.mutex);
+            ret = -1;
+        }
+    }
+
+    pthread_mutex_lock(&s.mutex);
+    while (s.in_flight > 0) {
+        pthread_cond_wait(&s.chunk_done, &s.mutex);
+    }
+    pthread_mutex_unlock(&s.mutex);
+    INSTR_RECORD(op == MATRIX_STREAM_SUM ? INSTR_SUM : INSTR_MAX, start);
+
+    if (ret == 0 && (s.error || s.count != n)) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        *result = op == MATRIX_STREAM_SUM ? s.sum : s.max;
+    }
+    for (unsigned i = 0; chunks != NULL && i < n_chunks; i++) {
+        free(chunks[i].data);
+    }
+    free(chunks);
+    pthread_cond_destroy(&s.chunk_done);
+    pthread_mutex_destroy(&s.mutex);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef MATRIX_STREAM_H
+#define MATRIX_STREAM_H
+
+#include "worker_pool.h"
+
+/*
+ * Reductions over matrix files too large to load. The calling thread reads
+ * the file in MATRIX_STREAM_CHUNK-byte chunks into a ring of buffers, one
+ * more than the pool has workers, and each chunk is reduced on the worker
+ * pool while the following ones are read. Memory use is bounded by the
+ * ring whatever the size of the file. Files ending in ".txt" are read as
+ * written by matrix_write_text, and anything else as written by
+ * matrix_write_bin, ignoring a zone map footer.
+ */
+
+#define MATRIX_STREAM_CHUNK (4 * 1024 * 1024)
+
+typedef enum {
+    MATRIX_STREAM_SUM,
+    MATRIX_STREAM_MAX
+} matrix_stream_op_t;
+
+/*
+ * Sum or maximum of all elements of a matrix file, without loading it
+ *   file_name: The matrix file
+ *   op: Which reduction to compute
+ *   pool: Workers that reduce the chunks. The call must not come from one
+ *     of its workers.
+ *   result: Where the result is stored on success
+ * Returns 0 on success or -1 if the file cannot be read or is malformed,
+ * including a text file holding more or fewer than nrows * ncols values
+ */
+int matrix_stream_reduce(const char *file_name, matrix_stream_op_t op, worker_pool_t *pool,
+                         long *result);
+
+#endif // MATRIX_STREAM_H
@@ -0,0 +1,414 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrix_alloc.h"
+#include "matrix_typed.h"
+
+// Same layout as matrix_t: header in its own cache line, then the elements.
+#define MATRIX_HEADER_SIZE 64
+
+/*
+ * Start of a typed binary file, followed by the elements in row-major order
+ */
+typedef struct {
+    unsigned magic;
+    unsigned type;
+    unsigned nrows;
+    unsigned ncols;
+} typed_file_header_t;
+
+static int write_file_header(FILE *f, unsigned type, unsigned nrows, unsigned ncols) {
+    typed_file_header_t header = {MATRIX_TYPED_MAGIC, type, nrows, ncols};
+    return fwrite(&header, sizeof(header), 1, f) == 1 ? 0 : -1;
+}
+
+// Reads the header and checks that the file holds elements of type 'type'.
+static int read_file_header(FILE *f, unsigned type, unsigned *nrows, unsigned *ncols) {
+    typed_file_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.magic != MATRIX_TYPED_MAGIC || header.type != type) {
+        return -1;
+    }
+    *nrows = header.nrows;
+    *ncols = header.ncols;
+    return 0;
+}
+
+// Reads one element of a text file as an integer or a floating point value.
+static int read_text_value(FILE *f, int is_float, long long *ival, double *fval) {
+    char token[64];
+    if (fscanf(f, "%63s", token) != 1) {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    if (is_float) {
+        *fval = strtod(token, &end);
+    } else {
+        *ival = strtoll(token, &end, 10);
+    }
+    return (*end != '\0' || errno != 0) ? -1 : 0;
+}
+
+#define MATRIX_TYPED_DEFINE(S, elem_t, acc_t, type_code) \
+\
+_Static_assert(sizeof(matrix_##S##_t) <= MATRIX_HEADER_SIZE, \
+               "matrix_" #S "_t must fit its header slot"); \
+\
+static size_t S##_block_size(unsigned nrows, unsigned ncols) { \
+    return MATRIX_HEADER_SIZE + (size_t) nrows * ncols * sizeof(elem_t); \
+} \
+\
+matrix_##S##_t *matrix_##S##_init(unsigned nrows, unsigned ncols) { \
+    char *block = matrix_alloc(S##_block_size(nrows, ncols)); \
+    if (block == NULL) { \
+        return NULL; \
+    } \
+    matrix_##S##_t *mat = (matrix_##S##_t *) block; \
+    mat->data = (elem_t *) (block + MATRIX_HEADER_SIZE); \
+    mat->nrows = nrows; \
+    mat->ncols = ncols; \
+    return mat; \
+} \
+\
+void matrix_##S##_free(matrix_##S##_t *mat) { \
+    matrix_dealloc(mat, S##_block_size(mat->nrows, mat->ncols)); \
+} \
+\
+void matrix_##S##_put(matrix_##S##_t *mat, unsigned i, unsigned j, elem_t val) { \
+    mat->data[(size_t) i * mat->ncols + j] = val; \
+} \
+\
+elem_t matrix_##S##_get(const matrix_##S##_t *mat, unsigned i, unsigned j) { \
+    return mat->data[(size_t) i * mat->ncols + j]; \
+} \
+\
+static acc_t S##_sum_range(const elem_t *data, size_t n) { \
+    acc_t sum = 0; \
+    for (size_t i = 0; i < n; i++) { \
+        sum += data[i]; \
+    } \
+    return sum; \
+} \
+\
+static elem_t S##_max_range(const elem_t *data, size_t n) { \
+    elem_t max = n > 0 ? data[0] : 0; \
+    for (size_t i = 1; i < n; i++) { \
+        if (max < data[i]) { \
+            max = data[i]; \
+        } \
+    } \
+    return max; \
+} \
+\
+acc_t matrix_##S##_sum(const matrix_##S##_t *mat) { \
+    return S##_sum_range(mat->data, (size_t) mat->nrows * mat->ncols); \
+} \
+\
+elem_t matrix_##S##_max(const matrix_##S##_t *mat) { \
+    return S##_max_range(mat->data, (size_t) mat->nrows * mat->ncols); \
+} \
+\
+int matrix_##S##_write_text(const matrix_##S##_t *mat, const char *file_name) { \
+    FILE *f = fopen(file_name, "w"); \
+    if (f == NULL) { \
+        return -1; \
+    } \
+    fprintf(f, "%u %u\n", mat->nrows, mat->ncols); \
+    for (unsigned i = 0; i < mat->nrows; i++) { \
+        for (unsigned j = 0; j < mat->ncols; j++) { \
+            elem_t val = matrix_##S##_get(mat, i, j); \
+            if (MATRIX_ELEM_IS_FLOAT(elem_t)) { \
+                fprintf(f, "%.17g ", (double) val); \
+            } else { \
+                fprintf(f, "%lld ", (long long) val); \
+            } \
+        } \
+        fprintf(f, "\n"); \
+    } \
+    if (fclose(f) != 0) { \
+        return -1; \
+    } \
+    return 0; \
+} \
+\
+matrix_##S##_t *matrix_##S##_read_text(const char *file_name) { \
+    FILE *f = fopen(file_name, "r"); \
+    if (f == NULL) { \
+        return NULL; \
+    } \
+    unsigned nrows; \
+    unsigned ncols; \
+    if (fscanf(f, "%u %u", &nrows, &ncols) != 2) { \
+        fclose(f); \
+        return NULL; \
+    } \
+    matrix_##S##_t *mat = matrix_##S##_init(nrows, ncols); \
+    if (mat == NULL) { \
+        fclose(f); \
+        return NULL; \
+    } \
+    size_t n = (size_t) nrows * ncols; \
+    for (size_t i = 0; i < n; i++) { \
+        long long ival = 0; \
+        double fval = 0; \
+        if (read_text_value(f, MATRIX_ELEM_IS_FLOAT(elem_t), &ival, &fval) != 0 || \
+            (!MATRIX_ELEM_IS_FLOAT(elem_t) && (long long) (elem_t) ival != ival)) { \
+            matrix_##S##_free(mat); \
+            fclose(f); \
+            return NULL; \
+        } \
+        mat->data[i] = MATRIX_ELEM_IS_FLOAT(elem_t) ? (elem_t) fval : (elem_t) ival; \
+    } \
+    fclose(f); \
+    return mat; \
+} \
+\
+int matrix_##S##_write_bin(const matrix_##S##_t *mat, const char *file_name) { \
+    FILE *f = fopen(file_name, "w"); \
+    if (f == NULL) { \
+        return -1; \
+    } \
+    size_t n = (size_t) mat->nrows * mat->ncols; \
+    if (write_file_header(f, type_code, mat->nrows, mat->ncols) != 0 || \
+        fwrite(mat->data, sizeof(elem_t), n, f) != n) { \
+        fclose(f); \
+        return -1; \
+    } \
+    if (fclose(f) != 0) { \
+        return -1; \
+    } \
+    return 0; \
+} \
+\
+matrix_##S##_t *matrix_##S##_read_bin(const char *file_name) { \
+    FILE *f = fopen(file_name, "r"); \
+    if (f == NULL) { \
+        return NULL; \
+    } \
+    unsigned nrows; \
+    unsigned ncols; \
+    if (read_file_header(f, type_code, &nrows, &ncols) != 0) { \
+        fclose(f); \
+        return NULL; \
+    } \
+    matrix_##S##_t *mat = matrix_##S##_init(nrows, ncols); \
+    if (mat == NULL) { \
+        fclose(f); \
+        return NULL; \
+    } \
+    size_t n = (size_t) nrows * ncols; \
+    if (fread(mat->data, sizeof(elem_t), n, f) != n) { \
+        matrix_##S##_free(mat); \
+        fclose(f); \
+        return NULL; \
+    } \
+    fclose(f); \
+    return mat; \
+} \
+\
+/* \
+ * Work for one thread: a contiguous range of elements and its results \
+ */ \
+typedef struct { \
+    const elem_t *data; \
+    size_t n; \
+    acc_t sum; \
+    elem_t max; \
+} S##_task_t; \
+\
+static void *S##_sum_thread(void *arg) { \
+    S##_task_t *task = arg; \
+    task->sum = S##_sum_range(task->data, task->n); \
+    return NULL; \
+} \
+\
+static void *S##_max_thread(void *arg) { \
+    S##_task_t *task = arg; \
+    if (task->n > 0) { \
+        task->max = S##_max_range(task->data, task->n); \
+    } \
+    return NULL; \
+} \
+\
+/* Splits the elements evenly over 'n_threads' threads running 'func'. */ \
+static int S##_run_threads(const matrix_##S##_t *mat, unsigned n_threads, \
+                           void *(*func)(void *), S##_task_t *tasks) { \
+    pthread_t threads[n_threads]; \
+    size_t n = (size_t) mat->nrows * mat->ncols; \
+    unsigned started = 0; \
+    int ret = 0; \
+    for (unsigned i = 0; i < n_threads; i++) { \
+        size_t start = n * i / n_threads; \
+        tasks[i].data = mat->data + start; \
+        tasks[i].n = n * (i + 1) / n_threads - start; \
+        tasks[i].sum = 0; \
+        tasks[i].max = n > 0 ? mat->data[0] : 0; \
+        int err = pthread_create(&threads[i], NULL, func, &tasks[i]); \
+        if (err != 0) { \
+            fprintf(stderr, "pthread_create: %s\n", strerror(err)); \
+            ret = -1; \
+            break; \
+        } \
+        started++; \
+    } \
+    for (unsigned i = 0; i < started; i++) { \
+        int err = pthread_join(threads[i], NULL); \
+        if (err != 0) { \
+            fprintf(stderr, "pthread_join: %s\n", strerror(err)); \
+            ret = -1; \
+        } \
+    } \
+    return ret; \
+} \
+\
+int matrix_##S##_parallel_sum(const matrix_##S##_t *mat, unsigned n_threads, acc_t *result) { \
+    S##_task_t tasks[n_threads]; \
+    if (S##_run_threads(mat, n_threads, S##_sum_thread, tasks) != 0) { \
+        return -1; \
+    } \
+    acc_t sum = 0; \
+    for (unsigned i = 0; i < n_threads; i++) { \
+        sum += tasks[i].sum; \
+    } \
+    *result = sum; \
+    return 0; \
+} \
+\
+int matrix_##S##_parallel_max(const matrix_##S##_t *mat, unsigned n_threads, elem_t *result) { \
+    if ((size_t) mat->nrows * mat->ncols == 0) { \
+        return -1; \
+    } \
+    S##_task_t tasks[n_threads]; \
+    if (S##_run_threads(mat, n_threads, S##_max_thread, tasks) != 0) { \
+        return -1; \
+    } \
+    elem_t max = tasks[0].max; \
+    for (unsigned i = 1; i < n_threads; i++) { \
+        if (max < tasks[i].max) { \
+            max = tasks[i].max; \
+        } \
+    } \
+    *result = max; \
+    return 0; \
+}
+
+MATRIX_TYPED_FOR_EACH(MATRIX_TYPED_DEFINE)
+
+// Number of elements of at most 32 bits whose sum always fits in int64_t
+#define SUM_BLOCK ((size_t) 1 << 32)
+
+#ifdef MATRIX_HAVE_INT128
+/*
+ * Exact sum of 'n' 64-bit elements. The signed high and unsigned low halves
+ * of the elements are summed separately, each in 64 bits like a narrow type,
+ * so the loop still vectorizes and only each block's total needs 128 bits.
+ */
+static __int128 i64_sum_wide_range(const int64_t *data, size_t n) {
+    __int128 sum = 0;
+    for (size_t done = 0; done < n; done += SUM_BLOCK) {
+        size_t end = n - done < SUM_BLOCK ? n : done + SUM_BLOCK;
+        int64_t high = 0;
+        uint64_t low = 0;
+        for (size_t i = done; i < end; i++) {
+            high += data[i] >> 32;
+            low += (uint32_t) data[i];
+        }
+        sum += (__int128) high * ((int64_t) 1 << 32) + low;
+    }
+    return sum;
+}
+
+__int128 matrix_i64_sum_wide(const matrix_i64_t *mat) {
+    return i64_sum_wide_range(mat->data, (size_t) mat->nrows * mat->ncols);
+}
+#endif
+
+// Sum of 'n' 64-bit elements. Returns 0 on success or -1 if it overflows.
+static int i64_sum_checked_range(const int64_t *data, size_t n, int64_t *result) {
+#ifdef MATRIX_HAVE_INT128
+    __int128 sum = i64_sum_wide_range(data, n);
+    if (sum < INT64_MIN || sum > INT64_MAX) {
+        return -1;
+    }
+    *result = (int64_t) sum;
+#else
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (__builtin_add_overflow(sum, data[i], &sum)) {
+            return -1;
+        }
+    }
+    *result = sum;
+#endif
+    return 0;
+}
+
+#define MATRIX_TYPED_DEFINE_CHECKED(S, elem_t, acc_t, type_code) \
+int matrix_##S##_sum_checked(const matrix_##S##_t *mat, acc_t *result) { \
+    size_t n = (size_t) mat->nrows * mat->ncols; \
+    if (sizeof(elem_t) > sizeof(int32_t)) { \
+        return i64_sum_checked_range((const int64_t *) mat->data, n, result); \
+    } \
+    /* Blocks of narrow elements cannot overflow, so only their totals are checked. */ \
+    acc_t sum = 0; \
+    for (size_t done = 0; done < n; done += SUM_BLOCK) { \
+        size_t len = n - done < SUM_BLOCK ? n - done : SUM_BLOCK; \
+        if (__builtin_add_overflow(sum, S##_sum_range(mat->data + done, len), &sum)) { \
+            return -1; \
+        } \
+    } \
+    *result = sum; \
+    return 0; \
+}
+
+MATRIX_TYPED_FOR_EACH_INT(MATRIX_TYPED_DEFINE_CHECKED)
+
+size_t matrix_elem_size(matrix_elem_type_t type) {
+    switch (type) {
+#define ELEM_SIZE_CASE(S, elem_t, acc_t, type_code) \
+    case type_code: \
+        return sizeof(elem_t);
+    MATRIX_TYPED_FOR_EACH(ELEM_SIZE_CASE)
+#undef ELEM_SIZE_CASE
+    }
+    return 0;
+}
+
+const char *matrix_elem_type_name(matrix_elem_type_t type) {
+    switch (type) {
+#define TYPE_NAME_CASE(S, elem_t, acc_t, type_code) \
+    case type_code: \
+        return #S;
+    MATRIX_TYPED_FOR_EACH(TYPE_NAME_CASE)
+#undef TYPE_NAME_CASE
+    }
+    return NULL;
+}
+
+int matrix_elem_type_parse(const char *name) {
+#define TYPE_PARSE_CASE(S, elem_t, acc_t, type_code) \
+    if (strcmp(name, #S) == 0) { \
+        return type_code; \
+    }
+    MATRIX_TYPED_FOR_EACH(TYPE_PARSE_CASE)
+#undef TYPE_PARSE_CASE
+    return -1;
+}
+
+int matrix_typed_file_type(const char *file_name) {
+    FILE *f = fopen(file_name, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    typed_file_header_t header;
+    int type = -1;
+    if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == MATRIX_TYPED_MAGIC &&
+        matrix_elem_size(header.type) != 0) {
+        type = header.type;
+    }
+    fclose(f);
+    return type;
+}
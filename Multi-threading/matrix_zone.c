@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "instrument.h"
+#include "matrix_io.h"
+#include "matrix_zone.h"
+
+// Bytes before the elements: nrows and ncols
+#define HEADER_SIZE (2 * sizeof(unsigned))
+// Bytes after the zones: zone_elems and magic
+#define TRAILER_SIZE (2 * sizeof(uint32_t))
+
+static matrix_zone_t zone_of(const int *data, size_t n) {
+    matrix_zone_t zone = {INT_MAX, INT_MIN, 0};
+    for (size_t i = 0; i < n; i++) {
+        if (data[i] < zone.min) {
+            zone.min = data[i];
+        }
+        if (data[i] > zone.max) {
+            zone.max = data[i];
+        }
+        zone.sum += data[i];
+    }
+    return zone;
+}
+
+int matrix_write_bin_zones(const matrix_t *mat, const char *file_name) {
+    INSTR_START(start);
+    size_t n = (size_t) mat->nrows * mat->ncols;
+    size_t n_zones = (n + MATRIX_ZONE_ELEMS - 1) / MATRIX_ZONE_ELEMS;
+    matrix_zone_t *zones = malloc((n_zones + 1) * sizeof(matrix_zone_t));
+    if (zones == NULL) {
+        return -1;
+    }
+    for (size_t z = 0; z < n_zones; z++) {
+        size_t first = z * MATRIX_ZONE_ELEMS;
+        size_t len = n - first < MATRIX_ZONE_ELEMS ? n - first : MATRIX_ZONE_ELEMS;
+        zones[z] = zone_of(mat->data + first, len);
+    }
+
+    // One short block covers a small matrix, so record only what it holds.
+    uint32_t zone_elems = n >= MATRIX_ZONE_ELEMS ? MATRIX_ZONE_ELEMS : n > 0 ? n : 1;
+    uint32_t trailer[2] = {zone_elems, MATRIX_ZONE_MAGIC};
+    unsigned dims[2] = {mat->nrows, mat->ncols};
+    size_t size = HEADER_SIZE + n * sizeof(int) + n_zones * sizeof(matrix_zone_t) + TRAILER_SIZE;
+    matrix_io_file_t file;
+    if (matrix_io_open_write(&file, file_name, size) != 0) {
+        free(zones);
+        return -1;
+    }
+    int ret = 0;
+    if (matrix_io_write(&file, dims, sizeof(dims)) != 0 ||
+        matrix_io_write(&file, mat->data, n * sizeof(int)) != 0 ||
+        matrix_io_write(&file, zones, n_zones * sizeof(matrix_zone_t)) != 0 ||
+        matrix_io_write(&file, trailer, sizeof(trailer)) != 0) {
+        ret = -1;
+    }
+    free(zones);
+    if (matrix_io_close(&file) != 0) {
+        ret = -1;
+    }
+    INSTR_RECORD(INSTR_WRITE_BIN, start);
+    return ret;
+}
+
+int matrix_zone_map_read(matrix_zone_map_t *map, const char *file_name) {
+    FILE *f = fopen(file_name, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fileno(f), &st) == -1 ||
+        fread(&map->nrows, sizeof(unsigned), 1, f) != 1 ||
+        fread(&map->ncols, sizeof(unsigned), 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+    size_t n = (size_t) map->nrows * map->ncols;
+    size_t data_end = HEADER_SIZE + n * sizeof(int);
+    if ((size_t) st.st_size < data_end) {
+        fclose(f);
+        return -1;
+    }
+    map->zone_elems = MATRIX_ZONE_ELEMS;
+    map->n_zones = (n + MATRIX_ZONE_ELEMS - 1) / MATRIX_ZONE_ELEMS;
+    map->zones = NULL;
+
+    // A footer is there only if the trailer is, and it accounts for every byte.
+    uint32_t trailer[2];
+    if ((size_t) st.st_size < data_end + TRAILER_SIZE ||
+        fseeko(f, st.st_size - TRAILER_SIZE, SEEK_SET) != 0 ||
+        fread(trailer, sizeof(trailer), 1, f) != 1 || trailer[1] != MATRIX_ZONE_MAGIC) {
+        fclose(f);
+        return 1;
+    }
+    // Blocks are allocated at this size, so it must fit the matrix.
+    if (trailer[0] == 0 || trailer[0] > (n > 0 ? n : 1)) {
+        fclose(f);
+        return -1;
+    }
+    size_t n_zones = (n + trailer[0] - 1) / trailer[0];
+    if ((size_t) st.st_size != data_end + n_zones * sizeof(matrix_zone_t) + TRAILER_SIZE) {
+        fclose(f);
+        return 1;
+    }
+
+    matrix_zone_t *zones = malloc((n_zones + 1) * sizeof(matrix_zone_t));
+    if (zones == NULL) {
+        fclose(f);
+        return -1;
+    }
+    if (fseeko(f, data_end, SEEK_SET) != 0 ||
+        fread(zones, sizeof(matrix_zone_t), n_zones, f) != n_zones) {
+        free(zones);
+        fclose(f);
+        return -1;
+    }
+    INSTR_COUNT(INSTR_BYTES_READ, HEADER_SIZE + n_zones * sizeof(matrix_zone_t) + TRAILER_SIZE);
+    fclose(f);
+    map->zone_elems = trailer[0];
+    map->n_zones = n_zones;
+    map->zones = zones;
+    return 0;
+}
+
+void matrix_zone_map_free(matrix_zone_map_t *map) {
+    free(map->zones);
+    map->zones = NULL;
+}
+
+long matrix_zone_map_sum(const matrix_zone_map_t *map) {
+    long sum = 0;
+    for (size_t z = 0; z < map->n_zones; z++) {
+        sum += map->zones[z].sum;
+    }
+    return sum;
+}
+
+long matrix_zone_map_min(const matrix_zone_map_t *map) {
+    long min = map->n_zones > 0 ? map->zones[0].min : 0;
+    for (size_t z = 1; z < map->n_zones; z++) {
+        if (map->zones[z].min < min) {
+            min = map->zones[z].min;
+        }
+    }
+    return min;
+}
+
+long matrix_zone_map_max(const matrix_zone_map_t *map) {
+    long max = map->n_zones > 0 ? map->zones[0].max : 0;
+    for (size_t z = 1; z < map->n_zones; z++) {
+        if (map->zones[z].max > max) {
+            max = map->zones[z].max;
+        }
+    }
+    return max;
+}
+
+// Reads exactly 'len' bytes at 'offset'. Returns 0 on success or -1 on error.
+static int pread_all(int fd, void *buf, size_t len, off_t offset) {
+    char *dest = buf;
+    while (len > 0) {
+        ssize_t got = pread(fd, dest, len, offset);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            return -1;
+        }
+        INSTR_COUNT(INSTR_BYTES_READ, got);
+        INSTR_COUNT(INSTR_SYSCALLS, 1);
+        dest += got;
+        len -= got;
+        offset += got;
+    }
+    return 0;
+}
+
+int matrix_zone_count_range(const matrix_zone_map_t *map, const char *file_name, int lo, int hi,
+                            long *count, long *sum, size_t *blocks_read) {
+    size_t n = (size_t) map->nrows * map->ncols;
+    int *block = malloc((size_t) map->zone_elems * sizeof(int));
+    if (block == NULL) {
+        return -1;
+    }
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        free(block);
+        return -1;
+    }
+
+    long total_count = 0;
+    long total_sum = 0;
+    size_t n_read = 0;
+    int ret = 0;
+    for (size_t z = 0; z < map->n_zones; z++) {
+        size_t first = z * map->zone_elems;
+        size_t len = n - first < map->zone_elems ? n - first : map->zone_elems;
+        if (map->zones != NULL) {
+            const matrix_zone_t *zone = &map->zones[z];
+            if (zone->max < lo || zone->min > hi) {
+                continue;
+            }
+            if (zone->min >= lo && zone->max <= hi) {
+                total_count += len;
+                total_sum += zone->sum;
+                continue;
+            }
+        }
+        if (pread_all(fd, block, len * sizeof(int), HEADER_SIZE + first * sizeof(int)) != 0) {
+            ret = -1;
+            break;
+        }
+        n_read++;
+        for (size_t i = 0; i < len; i++) {
+            if (block[i] >= lo && block[i] <= hi) {
+                total_count++;
+                total_sum += block[i];
+            }
+        }
+    }
+
+    close(fd);
+    free(block);
+    *count = total_count;
+    *sum = total_sum;
+    if (blocks_read != NULL) {
+        *blocks_read = n_read;
+    }
+    return ret;
+}
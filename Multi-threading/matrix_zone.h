@@ -0,0 +1,96 @@
+#ifndef MATRIX_ZONE_H
+#define MATRIX_ZONE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "matrix.h"
+
+/*
+ * Zone maps: the minimum, maximum and sum of every block of elements in a
+ * binary matrix file, stored in a footer after the elements. Sums and
+ * maxima then come from the footer alone, and range queries read only the
+ * blocks whose values straddle a bound. matrix_read_bin ignores the footer,
+ * so files with zones load like any other binary file.
+ *
+ * Footer layout, in native byte order like the rest of the file:
+ *   matrix_zone_t zones[n_zones]: One per block of MATRIX_ZONE_ELEMS
+ *     elements in row-major order, the last block possibly shorter
+ *   uint32_t zone_elems: Elements per block, at most the number of elements,
+ *     or 1 for an empty matrix
+ *   uint32_t magic: MATRIX_ZONE_MAGIC
+ */
+
+#define MATRIX_ZONE_ELEMS 65536
+#define MATRIX_ZONE_MAGIC 0x315a4d53u // "SMZ1" in little-endian byte order
+
+/*
+ * Summary of one block
+ */
+typedef struct {
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+} matrix_zone_t;
+
+/*
+ * The zone map of one file
+ *   nrows, ncols: Dimensions of the matrix in the file
+ *   zone_elems: Elements per block
+ *   n_zones: Number of blocks
+ *   zones: Summary of every block, or NULL if the file has no footer
+ */
+typedef struct {
+    unsigned nrows;
+    unsigned ncols;
+    unsigned zone_elems;
+    size_t n_zones;
+    matrix_zone_t *zones;
+} matrix_zone_map_t;
+
+/*
+ * Write a matrix to a binary file like matrix_write_bin, followed by its
+ * zone map
+ * 'mat': Pointer to matrix instance to write
+ * 'file_name': String storing name of file to write to
+ * Returns 0 on success or -1 on error
+ */
+int matrix_write_bin_zones(const matrix_t *mat, const char *file_name);
+
+/*
+ * Read the header and zone map of a binary file, without its elements
+ * A file without a footer still gets its dimensions and n_zones filled in,
+ * with 'zones' set to NULL.
+ * 'map': Zone map to initialize
+ * 'file_name': String storing name of file to read
+ * Returns 0 if the file has zones, 1 if it has none, or -1 on error or if
+ * the footer's block size does not fit the matrix
+ */
+int matrix_zone_map_read(matrix_zone_map_t *map, const char *file_name);
+
+/*
+ * Free the zones of a map read by matrix_zone_map_read
+ */
+void matrix_zone_map_free(matrix_zone_map_t *map);
+
+/*
+ * Sum, minimum and maximum of the whole matrix, from a map that has zones
+ */
+long matrix_zone_map_sum(const matrix_zone_map_t *map);
+long matrix_zone_map_min(const matrix_zone_map_t *map);
+long matrix_zone_map_max(const matrix_zone_map_t *map);
+
+/*
+ * Count and sum the elements of a binary file that lie in [lo, hi]. Blocks
+ * entirely outside the range are skipped and blocks entirely inside it are
+ * taken from their zones, so only the rest are read. Without zones, every
+ * block is read.
+ * 'map': Zone map of the file, from matrix_zone_map_read
+ * 'file_name': String storing name of the file
+ * 'count', 'sum': Pointers to memory where the results will be stored
+ * 'blocks_read': If not NULL, where the number of blocks read is stored
+ * Returns 0 on success or -1 on error
+ */
+int matrix_zone_count_range(const matrix_zone_map_t *map, const char *file_name, int lo, int hi,
+                            long *count, long *sum, size_t *blocks_read);
+
+#endif // MATRIX_ZONE_H
@@ -0,0 +1,480 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrix.h"
+#include "session.h"
+
+#define SESSION_INITIAL_BUCKETS 64
+
+static size_t matrix_bytes(unsigned nrows, unsigned ncols) {
+    return (size_t) nrows * ncols * sizeof(int);
+}
+
+// FNV-1a, which is fast and spreads short names well.
+static unsigned long hash_name(const char *name) {
+    unsigned long hash = 14695981039346656037UL;
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static session_entry_t **find_slot(const session_t *session, const char *name) {
+    session_entry_t **slot = &session->buckets[hash_name(name) & (session->n_buckets - 1)];
+    while (*slot != NULL && strcmp((*slot)->name, name) != 0) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static int grow_table(session_t *session) {
+    unsigned n_buckets = session->n_buckets * 2;
+    session_entry_t **buckets = calloc(n_buckets, sizeof(session_entry_t *));
+    if (buckets == NULL) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < session->n_buckets; i++) {
+        session_entry_t *entry = session->buckets[i];
+        while (entry != NULL) {
+            session_entry_t *next = entry->next;
+            unsigned idx = hash_name(entry->name) & (n_buckets - 1);
+            entry->next = buckets[idx];
+            buckets[idx] = entry;
+            entry = next;
+        }
+    }
+
+    free(session->buckets);
+    session->buckets = buckets;
+    session->n_buckets = n_buckets;
+    return 0;
+}
+
+static void release_buf(session_t *session, session_buf_t *buf) {
+    buf->refcount--;
+    if (buf->refcount > 0) {
+        return;
+    }
+    if (buf->shm != NULL) {
+        // The matrix is only a view of the segment.
+        matrix_shm_detach(buf->shm);
+        free(buf->shm);
+        free(buf->mat);
+    } else if (buf->mat != NULL) {
+        session->mem_used -= matrix_bytes(buf->nrows, buf->ncols);
+        matrix_free(buf->mat);
+    }
+    free(buf->source);
+    free(buf);
+}
+
+/*
+ * Evict least recently used reloadable matrices until 'needed' more bytes
+ * fit in the budget. Matrices used by the current command, or by any command
+ * since the held clock value, are never evicted. The budget is soft: if
+ * nothing else can be evicted, we go over it.
+ */
+static void make_room(session_t *session, size_t needed) {
+    if (session->mem_budget == 0) {
+        return;
+    }
+    unsigned long keep_from = session->clock;
+    if (session->hold_from != 0 && session->hold_from < keep_from) {
+        keep_from = session->hold_from;
+    }
+
+    while (session->mem_used + needed > session->mem_budget) {
+        session_buf_t *victim = NULL;
+        for (unsigned i = 0; i < session->n_buckets; i++) {
+            for (session_entry_t *e = session->buckets[i]; e != NULL; e = e->next) {
+                session_buf_t *buf = e->buf;
+                if (buf->mat == NULL || buf->source == NULL || buf->pins > 0 ||
+                    buf->last_used >= keep_from) {
+                    continue;
+                }
+                if (victim == NULL || buf->last_used < victim->last_used) {
+                    victim = buf;
+                }
+            }
+        }
+        if (victim == NULL) {
+            return;
+        }
+        session->mem_used -= matrix_bytes(victim->nrows, victim->ncols);
+        matrix_free(victim->mat);
+        victim->mat = NULL;
+    }
+}
+
+static matrix_t *load_file(const char *file_name) {
+    size_t len = strlen(file_name);
+    if (len >= 4 && strcmp(file_name + len - 4, ".txt") == 0) {
+        return matrix_read_text(file_name);
+    }
+    return matrix_read_bin(file_name);
+}
+
+/*
+ * Point 'name' at 'buf', replacing whatever it referred to before
+ * Takes over the caller's reference to 'buf'
+ * Returns 0 on success or -1 on error
+ */
+static int bind_name(session_t *session, const char *name, session_buf_t *buf) {
+    session_entry_t **slot = find_slot(session, name);
+    if (*slot != NULL) {
+        release_buf(session, (*slot)->buf);
+        (*slot)->buf = buf;
+        return 0;
+    }
+
+    session_entry_t *entry = malloc(sizeof(session_entry_t));
+    if (entry == NULL) {
+        return -1;
+    }
+    entry->name = strdup(name);
+    if (entry->name == NULL) {
+        free(entry);
+        return -1;
+    }
+    entry->buf = buf;
+    entry->next = NULL;
+    *slot = entry;
+    session->n_entries++;
+
+    // Keep chains short by allowing at most two entries per bucket on average.
+    if (session->n_entries > 2 * session->n_buckets) {
+        grow_table(session); // Still correct if this fails, just slower
+    }
+    return 0;
+}
+
+static session_buf_t *new_buf(session_t *session, matrix_t *mat, const char *source) {
+    session_buf_t *buf = malloc(sizeof(session_buf_t));
+    if (buf == NULL) {
+        return NULL;
+    }
+    buf->source = NULL;
+    if (source != NULL) {
+        buf->source = strdup(source);
+        if (buf->source == NULL) {
+            free(buf);
+            return NULL;
+        }
+    }
+    buf->mat = mat;
+    buf->nrows = mat->nrows;
+    buf->ncols = mat->ncols;
+    buf->refcount = 1;
+    buf->pins = 0;
+    buf->last_used = session->clock;
+    buf->shm = NULL;
+    session->mem_used += matrix_bytes(mat->nrows, mat->ncols);
+    return buf;
+}
+
+int session_init(session_t *session, size_t mem_budget) {
+    session->buckets = calloc(SESSION_INITIAL_BUCKETS, sizeof(session_entry_t *));
+    if (session->buckets == NULL) {
+        return -1;
+    }
+    int err = pthread_mutex_init(&session->mutex, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_mutex_init: %s\n", strerror(err));
+        free(session->buckets);
+        return -1;
+    }
+    session->n_buckets = SESSION_INITIAL_BUCKETS;
+    session->n_entries = 0;
+    session->mem_used = 0;
+    session->mem_budget = mem_budget;
+    session->clock = 0;
+    session->hold_from = 0;
+    return 0;
+}
+
+void session_free(session_t *session) {
+    for (unsigned i = 0; i < session->n_buckets; i++) {
+        session_entry_t *entry = session->buckets[i];
+        while (entry != NULL) {
+            session_entry_t *next = entry->next;
+            release_buf(session, entry->buf);
+            free(entry->name);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(session->buckets);
+    session->buckets = NULL;
+    session->n_entries = 0;
+    pthread_mutex_destroy(&session->mutex);
+}
+
+unsigned long session_next_command(session_t *session) {
+    pthread_mutex_lock(&session->mutex);
+    unsigned long clock = ++session->clock;
+    pthread_mutex_unlock(&session->mutex);
+    return clock;
+}
+
+void session_hold(session_t *session, unsigned long since) {
+    pthread_mutex_lock(&session->mutex);
+    session->hold_from = since;
+    pthread_mutex_unlock(&session->mutex);
+}
+
+void session_set_budget(session_t *session, size_t mem_budget) {
+    pthread_mutex_lock(&session->mutex);
+    session->mem_budget = mem_budget;
+    make_room(session, 0);
+    pthread_mutex_unlock(&session->mutex);
+}
+
+int session_load(session_t *session, const char *name, const char *file_name) {
+    // Read the file without the lock so loads overlap with other commands.
+    matrix_t *mat = load_file(file_name);
+    if (mat == NULL) {
+        return -1;
+    }
+
+    int ret_val = 0;
+    pthread_mutex_lock(&session->mutex);
+    make_room(session, matrix_bytes(mat->nrows, mat->ncols));
+    session_buf_t *buf = new_buf(session, mat, file_name);
+    if (buf == NULL) {
+        matrix_free(mat);
+        ret_val = -1;
+    } else if (bind_name(session, name, buf) != 0) {
+        release_buf(session, buf);
+        ret_val = -1;
+    }
+    pthread_mutex_unlock(&session->mutex);
+    return ret_val;
+}
+
+int session_store(session_t *session, const char *name, matrix_t *mat) {
+    int ret_val = 0;
+    pthread_mutex_lock(&session->mutex);
+    make_room(session, matrix_bytes(mat->nrows, mat->ncols));
+    session_buf_t *buf = new_buf(session, mat, NULL);
+    if (buf == NULL) {
+        ret_val = -1;
+    } else if (bind_name(session, name, buf) != 0) {
+        // Hand 'mat' back to the caller rather than freeing it.
+        session->mem_used -= matrix_bytes(mat->nrows, mat->ncols);
+        free(buf);
+        ret_val = -1;
+    }
+    pthread_mutex_unlock(&session->mutex);
+    return ret_val;
+}
+
+int session_attach(session_t *session, const char *name) {
+    matrix_shm_t *shm = malloc(sizeof(matrix_shm_t));
+    matrix_t *view = malloc(sizeof(matrix_t));
+    if (shm == NULL || view == NULL || matrix_shm_attach(shm, name) != 0) {
+        free(shm);
+        free(view);
+        return -1;
+    }
+    // Elements are never written through the view, as the mapping is read-only.
+    view->data = (int *) shm->data;
+    view->nrows = shm->header->nrows;
+    view->ncols = shm->header->ncols;
+    view->agg = NULL;
+
+    int ret_val = 0;
+    pthread_mutex_lock(&session->mutex);
+    session_buf_t *buf = new_buf(session, view, NULL);
+    if (buf == NULL) {
+        matrix_shm_detach(shm);
+        free(shm);
+        free(view);
+        ret_val = -1;
+    } else {
+        // The elements live in the segment, not in memory of the session's own.
+        session->mem_used -= matrix_bytes(view->nrows, view->ncols);
+        buf->shm = shm;
+        if (bind_name(session, name, buf) != 0) {
+            release_buf(session, buf); // Detaches the segment too
+            ret_val = -1;
+        }
+    }
+    pthread_mutex_unlock(&session->mutex);
+    return ret_val;
+}
+
+int session_shm_version(session_t *session, uint64_t *version) {
+    pthread_mutex_lock(&session->mutex);
+    int count = 0;
+    uint64_t total = 0;
+    for (unsigned i = 0; i < session->n_buckets && count != -1; i++) {
+        for (session_entry_t *e = session->buckets[i]; e != NULL; e = e->next) {
+            uint64_t seq;
+            if (e->buf->shm == NULL) {
+                continue;
+            } else if (matrix_shm_read_begin(e->buf->shm, &seq) != 0) {
+                count = -1;
+                break;
+            }
+            total += seq;
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&session->mutex);
+    *version = total;
+    return count;
+}
+
+int session_alias(session_t *session, const char *new_name, const char *name) {
+    int ret_val = 0;
+    pthread_mutex_lock(&session->mutex);
+    session_entry_t *entry = *find_slot(session, name);
+    if (entry == NULL) {
+        ret_val = -1;
+    } else if (strcmp(new_name, name) != 0) {
+        session_buf_t *buf = entry->buf;
+        buf->refcount++;
+        if (bind_name(session, new_name, buf) != 0) {
+            release_buf(session, buf);
+            ret_val = -1;
+        }
+    }
+    pthread_mutex_unlock(&session->mutex);
+    return ret_val;
+}
+
+int session_remove(session_t *session, const char *name) {
+    pthread_mutex_lock(&session->mutex);
+    session_entry_t **slot = find_slot(session, name);
+    session_entry_t *entry = *slot;
+    if (entry == NULL) {
+        pthread_mutex_unlock(&session->mutex);
+        return -1;
+    }
+    *slot = entry->next;
+    session->n_entries--;
+    release_buf(session, entry->buf);
+    pthread_mutex_unlock(&session->mutex);
+    free(entry->name);
+    free(entry);
+    return 0;
+}
+
+// session_get with the session's mutex already held
+static matrix_t *get_locked(session_t *session, const char *name) {
+    session_entry_t *entry = *find_slot(session, name);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    session_buf_t *buf = entry->buf;
+    buf->last_used = session->clock;
+    if (buf->mat == NULL) {
+        // Evicted earlier, so bring it back from its file.
+        make_room(session, matrix_bytes(buf->nrows, buf->ncols));
+        buf->mat = load_file(buf->source);
+        if (buf->mat == NULL) {
+            return NULL;
+        }
+        session->mem_used += matrix_bytes(buf->nrows, buf->ncols);
+    }
+    return buf->mat;
+}
+
+matrix_t *session_get(session_t *session, const char *name) {
+    pthread_mutex_lock(&session->mutex);
+    matrix_t *mat = get_locked(session, name);
+    pthread_mutex_unlock(&session->mutex);
+    return mat;
+}
+
+// session_get_mut with the session's mutex already held
+static matrix_t *get_mut_locked(session_t *session, const char *name) {
+    session_entry_t *entry = *find_slot(session, name);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    matrix_t *mat = get_locked(session, name);
+    if (mat == NULL) {
+        return NULL;
+    }
+
+    session_buf_t *buf = entry->buf;
+    if (buf->refcount > 1 || buf->shm != NULL) {
+        // Copy on write: give this handle its own storage.
+        make_room(session, matrix_bytes(buf->nrows, buf->ncols));
+        matrix_t *copy = buf->shm != NULL ? matrix_init(buf->nrows, buf->ncols) : matrix_copy(mat);
+        if (copy == NULL) {
+            return NULL;
+        } else if (buf->shm != NULL && matrix_shm_copy(buf->shm, copy->data) != 0) {
+            matrix_free(copy);
+            return NULL;
+        }
+        session_buf_t *own = new_buf(session, copy, NULL);
+        if (own == NULL) {
+            matrix_free(copy);
+            return NULL;
+        }
+        release_buf(session, buf);
+        entry->buf = own;
+        return copy;
+    }
+
+    // The in-memory copy no longer matches the file, so it must stay resident.
+    free(buf->source);
+    buf->source = NULL;
+    return mat;
+}
+
+matrix_t *session_get_mut(session_t *session, const char *name) {
+    pthread_mutex_lock(&session->mutex);
+    matrix_t *mat = get_mut_locked(session, name);
+    pthread_mutex_unlock(&session->mutex);
+    return mat;
+}
+
+matrix_t *session_pin(session_t *session, const char *name, session_buf_t **pin) {
+    pthread_mutex_lock(&session->mutex);
+    matrix_t *mat = get_locked(session, name);
+    if (mat != NULL) {
+        *pin = (*find_slot(session, name))->buf;
+        (*pin)->refcount++;
+        (*pin)->pins++;
+    }
+    pthread_mutex_unlock(&session->mutex);
+    return mat;
+}
+
+void session_unpin(session_t *session, session_buf_t *pin) {
+    pthread_mutex_lock(&session->mutex);
+    pin->pins--;
+    release_buf(session, pin);
+    pthread_mutex_unlock(&session->mutex);
+}
+
+void session_list(session_t *session, FILE *out) {
+    pthread_mutex_lock(&session->mutex);
+    for (unsigned i = 0; i < session->n_buckets; i++) {
+        for (session_entry_t *e = session->buckets[i]; e != NULL; e = e->next) {
+            session_buf_t *buf = e->buf;
+            const char *state = buf->mat == NULL ? "evicted" : "resident";
+            if (buf->shm != NULL) {
+                state = buf->shm->header->retired ? "shared, republished since attach" : "shared";
+            }
+            fprintf(out, "  %s: %u x %u, %s, refs %u%s%s\n", e->name, buf->nrows, buf->ncols,
+                    state, buf->refcount - buf->pins,
+                    buf->source != NULL ? ", from " : "",
+                    buf->source != NULL ? buf->source : "");
+        }
+    }
+    fprintf(out, "  %zu bytes resident", session->mem_used);
+    if (session->mem_budget != 0) {
+        fprintf(out, " of %zu byte budget", session->mem_budget);
+    }
+    fprintf(out, "\n");
+    pthread_mutex_unlock(&session->mutex);
+}
@@ -0,0 +1,185 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "matrix.h"
+#include "matrix_shm.h"
+
+/*
+ * Reference counted matrix storage shared by one or more session handles
+ *   mat: The matrix, or NULL while evicted
+ *   nrows, ncols: Dimensions of the matrix, kept while evicted
+ *   refcount: Number of handles and pins referring to this buffer
+ *   pins: Number of pins, which keep the matrix resident and unchanged
+ *   source: File the matrix can be reloaded from, or NULL if it has been
+ *           modified (or never came from a file) and so cannot be evicted
+ *   last_used: Session clock value when the matrix was last accessed
+ *   shm: Shared memory segment 'mat' reads from, or NULL for private memory.
+ *     Attached matrices use no memory of the session's own and are copied
+ *     before any modification.
+ */
+typedef struct {
+    matrix_t *mat;
+    unsigned nrows;
+    unsigned ncols;
+    unsigned refcount;
+    unsigned pins;
+    char *source;
+    unsigned long last_used;
+    matrix_shm_t *shm;
+} session_buf_t;
+
+/*
+ * A named handle in the session's hash table
+ *   name: The handle's name
+ *   buf: The storage this handle refers to
+ *   next: Next entry in the same hash bucket
+ */
+typedef struct session_entry {
+    char *name;
+    session_buf_t *buf;
+    struct session_entry *next;
+} session_entry_t;
+
+/*
+ * A registry of named matrices
+ *   buckets: Hash table of handles, chained within each bucket
+ *   n_buckets: Number of buckets, always a power of two
+ *   n_entries: Number of handles in the table
+ *   mem_used: Bytes of matrix data currently resident
+ *   mem_budget: Resident bytes allowed before eviction starts, 0 for no limit
+ *   clock: Advanced once per command to order buffers by recent use
+ *   hold_from: Matrices used at or after this clock value are never evicted,
+ *     0 if only the current command's matrices are protected
+ *   mutex: Protects all of the above. Session functions may be called from
+ *     several threads at once, as long as no two threads use the same name
+ *     while one of them modifies it.
+ */
+typedef struct {
+    session_entry_t **buckets;
+    unsigned n_buckets;
+    unsigned n_entries;
+    size_t mem_used;
+    size_t mem_budget;
+    unsigned long clock;
+    unsigned long hold_from;
+    pthread_mutex_t mutex;
+} session_t;
+
+/*
+ * Initialize an empty session
+ *   session: The session to initialize
+ *   mem_budget: Resident bytes allowed before eviction starts, 0 for no limit
+ * Returns 0 on success or -1 on error
+ */
+int session_init(session_t *session, size_t mem_budget);
+
+/*
+ * Free a session along with every matrix it holds
+ */
+void session_free(session_t *session);
+
+/*
+ * Start a new command. Matrices accessed during the current command are
+ * never evicted, so pointers returned by session_get stay valid until the
+ * next call to this function.
+ * Returns the session clock value of the new command
+ */
+unsigned long session_next_command(session_t *session);
+
+/*
+ * Protect every matrix accessed by commands started at or after clock value
+ * 'since' from eviction, for when several commands run at once. Pointers
+ * returned by session_get then stay valid until the hold moves past the
+ * command that got them. Pass 0 to protect only the current command again.
+ */
+void session_hold(session_t *session, unsigned long since);
+
+/*
+ * Change the memory budget, evicting matrices if the new one is exceeded
+ *   mem_budget: Resident bytes allowed before eviction starts, 0 for no limit
+ */
+void session_set_budget(session_t *session, size_t mem_budget);
+
+/*
+ * Load a matrix from a file under 'name', replacing any existing handle.
+ * Files ending in ".txt" are read as text, anything else as binary. The
+ * matrix remembers its file so it can be evicted and reloaded later.
+ * Returns 0 on success or -1 on error
+ */
+int session_load(session_t *session, const char *name, const char *file_name);
+
+/*
+ * Store 'mat' under 'name', replacing any existing handle. The session takes
+ * ownership of 'mat', which has no file to reload from and is never evicted.
+ * Returns 0 on success or -1 on error, in which case 'mat' is not taken
+ */
+int session_store(session_t *session, const char *name, matrix_t *mat);
+
+/*
+ * Attach the shared memory segment published as 'name' under the same name,
+ * replacing any existing handle. The matrix is read where it was published,
+ * without a copy.
+ * Returns 0 on success or -1 on error
+ */
+int session_attach(session_t *session, const char *name);
+
+/*
+ * Take the combined sequence count of every attached segment, waiting for
+ * publishes in progress. A command that only reads matrices and finds the
+ * count changed afterwards may have read a mix of old and new elements.
+ *   version: Where the count is stored
+ * Returns the number of attached segments, or -1 if a publisher died before
+ * finishing
+ */
+int session_shm_version(session_t *session, uint64_t *version);
+
+/*
+ * Make 'new_name' another handle to the same storage as 'name' without
+ * copying. The storage is copied only if one of the handles is modified.
+ * Returns 0 on success or -1 if 'name' does not exist
+ */
+int session_alias(session_t *session, const char *new_name, const char *name);
+
+/*
+ * Remove a handle, freeing its storage once no other handle refers to it
+ * Returns 0 on success or -1 if 'name' does not exist
+ */
+int session_remove(session_t *session, const char *name);
+
+/*
+ * Retrieve a matrix for reading, reloading it from disk if it was evicted
+ * Returns the matrix, or NULL if 'name' does not exist or reloading failed
+ */
+matrix_t *session_get(session_t *session, const char *name);
+
+/*
+ * Retrieve a matrix for modification. Storage shared with other handles is
+ * copied first, and the matrix stops being eligible for eviction.
+ * Returns the matrix, or NULL if 'name' does not exist or copying failed
+ */
+matrix_t *session_get_mut(session_t *session, const char *name);
+
+/*
+ * Retrieve a matrix for reading for as long as the caller needs it, even
+ * while other threads run commands. Until session_unpin, the matrix is never
+ * evicted or freed, and modifying 'name' copies it first.
+ *   pin: Location to store the pin to pass to session_unpin
+ * Returns the matrix, or NULL if 'name' does not exist or reloading failed
+ */
+matrix_t *session_pin(session_t *session, const char *name, session_buf_t **pin);
+
+/*
+ * Release a pin taken by session_pin
+ */
+void session_unpin(session_t *session, session_buf_t *pin);
+
+/*
+ * Print every handle with its dimensions and storage state to 'out'
+ */
+void session_list(session_t *session, FILE *out);
+
+#endif // SESSION_H
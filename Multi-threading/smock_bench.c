@@ -0,0 +1,614 @@
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "matrix.h"
+#include "matrix_alloc.h"
+#include "worker_pool.h"
+
+/*
+ * Throughput benchmark for the Multithreading backends: serial matrix_sum and
+ * matrix_max, threads created per call (matrix_4.c) and the worker pool
+ * (worker_pool.c). Multi-processing/smock_bench.c measures the serial and
+ * forked backends there and prints results in the same format. The serial
+ * sum is also compared with matrix_sum_checked and with summing into an int,
+ * to show what the 64-bit and overflow-checked sums cost.
+ *
+ * Matrices of every size from MIN_ELEMENTS up to the maximum, growing 4x at a
+ * time, are run as square, tall (16 columns) and wide (16 rows) shapes. Each
+ * backend runs 'warmup' untimed and 'reps' timed repetitions for every worker
+ * count, and its results are checked against the serial ones. With pinning
+ * on, a run with N workers is restricted to the first N usable CPUs, and the
+ * threads it creates inherit that restriction.
+ *
+ * Every row also shows how much of the matrix is backed by huge pages and,
+ * where the hardware counter is available, data TLB load misses per KB
+ * scanned. The counter follows the threads a call creates, but not the
+ * worker pool's, which were started before it. With -H each matrix is
+ * run twice, first on normal pages (SMOCK_HUGE_PAGES=off) and then as
+ * configured, to show what huge pages save.
+ *
+ * The dynamic and guided rows are matrix_parallel_sum and
+ * matrix_parallel_max with self-scheduling (see matrix_sched_t). With -l N,
+ * N threads spin on the first N usable CPUs for the whole run, the way
+ * other tenants or SMT siblings slow some cores on a shared host. The p99
+ * column then shows how much a slowed thread holds up each schedule.
+ *
+ * With -b N, a background thread sums an N-element matrix on the worker pool
+ * over and over at normal priority while the other cases run, like a batch
+ * job sharing the pool. The pool row then shows a query waiting behind the
+ * batch job's rows, and the pool_hi row the same query at high priority.
+ */
+
+#define DEFAULT_REPS 11
+#define DEFAULT_WARMUP 2
+#define DEFAULT_MAX_ELEMENTS (1u << 22)
+#define MIN_ELEMENTS (1u << 16)
+#define NARROW_DIM 16
+#define POOL_QUEUE_SIZE 1024
+
+/*
+ * Benchmark settings from the command line
+ *   reps: Number of timed repetitions per measurement
+ *   warmup: Number of untimed repetitions before them
+ *   max_workers: Largest worker count to run
+ *   max_elements: Largest matrix size, in elements
+ *   pin: Whether to restrict each run to as many CPUs as it has workers
+ *   json: Whether to print JSON instead of a table
+ *   compare_pages: Whether to run each matrix on normal pages first
+ *   load: Number of threads spinning in the background
+ *   batch: Elements of the matrix summed on the pool in the background, 0 for none
+ */
+typedef struct {
+    unsigned reps;
+    unsigned warmup;
+    unsigned max_workers;
+    unsigned max_elements;
+    int pin;
+    int json;
+    int compare_pages;
+    unsigned load;
+    unsigned batch;
+} bench_opts_t;
+
+/*
+ * One backend and operation under test
+ *   backend, op: Names used in the output
+ *   parallel: Whether the function takes a worker count
+ *   counted: Whether all of its work runs in threads the TLB counter follows
+ *   func: Computes the result for 'mat' with 'workers' workers
+ */
+typedef struct {
+    const char *backend;
+    const char *op;
+    int parallel;
+    int counted;
+    int (*func)(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result);
+} bench_case_t;
+
+/*
+ * Timing summary of one measurement
+ *   median_ns, p99_ns: Median and 99th percentile time of one repetition
+ *   tlb_misses_per_kb: Data TLB load misses per KB scanned, or -1 if not counted
+ *   correct: Whether every repetition produced the expected result
+ */
+typedef struct {
+    double median_ns;
+    double p99_ns;
+    double tlb_misses_per_kb;
+    int correct;
+} bench_result_t;
+
+static int serial_sum(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result) {
+    *result = matrix_sum(mat);
+    return 0;
+}
+
+// The int accumulator the shells used to have, as a baseline for the wide sums
+static int narrow_sum(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result) {
+    size_t n = (size_t) mat->nrows * mat->ncols;
+    unsigned sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += (unsigned) mat->data[i];
+    }
+    *result = (int) sum;
+    return 0;
+}
+
+static int checked_sum(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result) {
+    return matrix_sum_checked(mat, result);
+}
+
+static int serial_max(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result) {
+    *result = matrix_max(mat);
+    return 0;
+}
+
+static int threads_sum(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result) {
+    return matrix_parallel_sum(mat, workers, result);
+}
+
+static int threads_max(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result) {
+    return matrix_parallel_max(mat, workers, result);
+}
+
+static int dynamic_sum(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result) {
+    return matrix_parallel_sum_sched(mat, workers, MATRIX_SCHED_DYNAMIC, NULL, result);
+}
+
+static int dynamic_max(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result) {
+    return matrix_parallel_max_sched(mat, workers, MATRIX_SCHED_DYNAMIC, NULL, result);
+}
+
+static int guided_sum(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result) {
+    return matrix_parallel_sum_sched(mat, workers, MATRIX_SCHED_GUIDED, NULL, result);
+}
+
+static int guided_max(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result) {
+    return matrix_parallel_max_sched(mat, workers, MATRIX_SCHED_GUIDED, NULL, result);
+}
+
+static int pool_sum(const matrix_t *mat, unsigned workers, worker_pool_t *pool, long *result) {
+    return matrix_parallel_sum_pool(mat, pool, result);
+}
+
+static int pool_high_sum(const matrix_t *mat, unsigned workers, worker_pool_t *pool,
+                         long *result) {
+    task_class_t cls = {TASK_PRIORITY_HIGH, 0};
+    return matrix_parallel_sum_pool_cancel(mat, pool, cls, NULL, result);
+}
+
+// Serial cases come first: they provide the expected results and baselines.
+// Later serial cases for the same operation are compared against the first.
+static const bench_case_t cases[] = {
+    {"serial", "sum", 0, 1, serial_sum},
+    {"serial", "max", 0, 1, serial_max},
+    {"narrow", "sum", 0, 1, narrow_sum},
+    {"checked", "sum", 0, 1, checked_sum},
+    {"threads", "sum", 1, 1, threads_sum},
+    {"threads", "max", 1, 1, threads_max},
+    {"dynamic", "sum", 1, 1, dynamic_sum},
+    {"dynamic", "max", 1, 1, dynamic_max},
+    {"guided", "sum", 1, 1, guided_sum},
+    {"guided", "max", 1, 1, guided_max},
+    {"pool", "sum", 1, 0, pool_sum},
+    {"pool_hi", "sum", 1, 0, pool_high_sum},
+};
+#define N_CASES (sizeof(cases) / sizeof(cases[0]))
+
+// CPUs this process was allowed to run on when it started.
+static cpu_set_t usable_cpus;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Restricts this process and the threads it creates to 'n' usable CPUs.
+static int pin_to_cpus(unsigned n) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    unsigned count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < n; cpu++) {
+        if (CPU_ISSET(cpu, &usable_cpus)) {
+            CPU_SET(cpu, &set);
+            count++;
+        }
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Open a counter of data TLB load misses in this thread and in the threads
+ * and processes it creates while the counter is open, starting disabled.
+ * Returns its descriptor, or -1 where the hardware or kernel offers none
+ */
+static int tlb_counter_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Make matrices created from now on use normal pages, or go back to the
+ * huge page setting the benchmark was started with
+ *   configured: That setting, or NULL if SMOCK_HUGE_PAGES was not set
+ */
+static void use_normal_pages(int normal, const char *configured) {
+    if (normal) {
+        setenv("SMOCK_HUGE_PAGES", "off", 1);
+    } else if (configured != NULL) {
+        setenv("SMOCK_HUGE_PAGES", configured, 1);
+    } else {
+        unsetenv("SMOCK_HUGE_PAGES");
+    }
+}
+
+// Set to stop the background load threads.
+static volatile int stop_load;
+
+static void *spin(void *arg) {
+    while (!stop_load) {
+    }
+    return NULL;
+}
+
+// Starts 'n' spinning threads, each on one of the first 'n' usable CPUs.
+// Returns the number started.
+static unsigned start_load(unsigned n, pthread_t *threads) {
+    unsigned started = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && started < n; cpu++) {
+        if (!CPU_ISSET(cpu, &usable_cpus)) {
+            continue;
+        }
+        int err = pthread_create(&threads[started], NULL, spin, NULL);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(threads[started], sizeof(set), &set);
+        started++;
+    }
+    // More threads than CPUs share the ones already loaded.
+    for (; started < n; started++) {
+        if (pthread_create(&threads[started], NULL, spin, NULL) != 0) {
+            break;
+        }
+    }
+    return started;
+}
+
+/*
+ * A batch job summing a matrix on a worker pool until told to stop
+ *   mat, pool: What it sums, and where
+ *   stop: Set to make it return after the current sum
+ */
+typedef struct {
+    const matrix_t *mat;
+    worker_pool_t *pool;
+    volatile int stop;
+} batch_job_t;
+
+static void *run_batch(void *arg) {
+    batch_job_t *job = arg;
+    while (!job->stop) {
+        long result;
+        if (matrix_parallel_sum_pool(job->mat, job->pool, &result) != 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Fills 'mat' with the same pseudo-random values on every run.
+static void fill_matrix(matrix_t *mat, unsigned seed) {
+    for (unsigned i = 0; i < mat->nrows; i++) {
+        for (unsigned j = 0; j < mat->ncols; j++) {
+            matrix_put(mat, i, j, rand_r(&seed) % 2001 - 1000);
+        }
+    }
+}
+
+static int measure(const bench_case_t *c, const matrix_t *mat, unsigned workers,
+                   worker_pool_t *pool, long expected, const bench_opts_t *opts,
+                   bench_result_t *out) {
+    double *samples = malloc(opts->reps * sizeof(double));
+    if (samples == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    int tlb_fd = c->counted ? tlb_counter_open() : -1;
+    out->correct = 1;
+    for (unsigned rep = 0; rep < opts->warmup + opts->reps; rep++) {
+        long result;
+        if (rep == opts->warmup && tlb_fd != -1) {
+            ioctl(tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        double start = now_ns();
+        if (c->func(mat, workers, pool, &result) != 0) {
+            if (tlb_fd != -1) {
+                close(tlb_fd);
+            }
+            free(samples);
+            return -1;
+        }
+        double elapsed = now_ns() - start;
+        if (result != expected) {
+            out->correct = 0;
+        }
+        if (rep >= opts->warmup) {
+            samples[rep - opts->warmup] = elapsed;
+        }
+    }
+
+    out->tlb_misses_per_kb = -1;
+    if (tlb_fd != -1) {
+        uint64_t misses;
+        double kb = (double) mat->nrows * mat->ncols * sizeof(int) / 1024 * opts->reps;
+        if (read(tlb_fd, &misses, sizeof(misses)) == sizeof(misses) && kb > 0) {
+            out->tlb_misses_per_kb = misses / kb;
+        }
+        close(tlb_fd);
+    }
+
+    qsort(samples, opts->reps, sizeof(double), compare_doubles);
+    unsigned mid = opts->reps / 2;
+    out->median_ns = opts->reps % 2 ? samples[mid] : (samples[mid - 1] + samples[mid]) / 2;
+    // Nearest-rank percentile
+    unsigned rank = (opts->reps * 99 + 99) / 100;
+    out->p99_ns = samples[rank - 1];
+    free(samples);
+    return 0;
+}
+
+static void print_result(const bench_opts_t *opts, const bench_case_t *c, const matrix_t *mat,
+                         unsigned workers, const bench_result_t *res, double baseline_ns,
+                         double huge_pct) {
+    static int printed_any = 0;
+    double bytes = (double) mat->nrows * mat->ncols * sizeof(int);
+    double gb_per_s = bytes / res->median_ns;
+    double speedup = baseline_ns / res->median_ns;
+    char tlb[32];
+    snprintf(tlb, sizeof(tlb), "%.3f", res->tlb_misses_per_kb);
+
+    if (opts->json) {
+        printf("%s\n    {\"backend\": \"%s\", \"op\": \"%s\", \"nrows\": %u, \"ncols\": %u, "
+               "\"workers\": %u, \"median_ns\": %.0f, \"p99_ns\": %.0f, "
+               "\"gb_per_s\": %.3f, \"speedup\": %.3f, \"huge_pct\": %.1f, "
+               "\"tlb_misses_per_kb\": %s, \"correct\": %s}",
+               printed_any ? "," : "", c->backend, c->op, mat->nrows, mat->ncols, workers,
+               res->median_ns, res->p99_ns, gb_per_s, speedup, huge_pct,
+               res->tlb_misses_per_kb < 0 ? "null" : tlb, res->correct ? "true" : "false");
+    } else {
+        printf("%-8s %-4s %9u x %-9u %7u %12.1f %12.1f %8.2f %8.2f %6.1f %10s%s\n", c->backend,
+               c->op, mat->nrows, mat->ncols, workers, res->median_ns / 1e3, res->p99_ns / 1e3,
+               gb_per_s, speedup, huge_pct, res->tlb_misses_per_kb < 0 ? "-" : tlb,
+               res->correct ? "" : "  WRONG RESULT");
+    }
+    printed_any = 1;
+}
+
+// Runs every case on one matrix. Returns 0 on success or -1 on error.
+static int bench_matrix(const matrix_t *mat, const matrix_t *batch_mat,
+                        const bench_opts_t *opts) {
+    long expected[N_CASES];
+    double baseline_ns[N_CASES];
+    size_t size = (size_t) mat->nrows * mat->ncols * sizeof(int);
+    matrix_page_usage_t usage;
+    double huge_pct = 0;
+    if (matrix_alloc_page_usage(mat->data, size, &usage) == 0 && size > 0) {
+        huge_pct = 100.0 * usage.huge / size;
+    }
+
+    // Serial baselines, on a single CPU
+    if (opts->pin && pin_to_cpus(1) != 0) {
+        return -1;
+    }
+    for (unsigned k = 0; k < N_CASES; k++) {
+        if (cases[k].parallel) {
+            continue;
+        }
+        unsigned base = 0;
+        while (strcmp(cases[base].op, cases[k].op) != 0) {
+            base++;
+        }
+        bench_result_t res;
+        cases[k].func(mat, 1, NULL, &expected[k]);
+        if (measure(&cases[k], mat, 1, NULL, expected[base], opts, &res) != 0) {
+            return -1;
+        }
+        baseline_ns[k] = res.median_ns;
+        print_result(opts, &cases[k], mat, 1, &res, baseline_ns[base], huge_pct);
+    }
+
+    // Worker counts double from 1, ending with max_workers itself.
+    unsigned workers = 1;
+    while (1) {
+        if (opts->pin && pin_to_cpus(workers) != 0) {
+            return -1;
+        }
+        worker_pool_t pool;
+        if (worker_pool_init(&pool, workers, POOL_QUEUE_SIZE) != 0) {
+            return -1;
+        }
+        batch_job_t batch = {batch_mat, &pool, 0};
+        pthread_t batch_thread;
+        if (batch_mat != NULL) {
+            int err = pthread_create(&batch_thread, NULL, run_batch, &batch);
+            if (err != 0) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                worker_pool_free(&pool);
+                return -1;
+            }
+        }
+        int ret = 0;
+        for (unsigned k = 0; k < N_CASES && ret == 0; k++) {
+            if (!cases[k].parallel) {
+                continue;
+            }
+            // Compare against the serial case for the same operation.
+            unsigned base = 0;
+            while (cases[base].parallel || strcmp(cases[base].op, cases[k].op) != 0) {
+                base++;
+            }
+            bench_result_t res;
+            ret = measure(&cases[k], mat, workers, &pool, expected[base], opts, &res);
+            if (ret == 0) {
+                print_result(opts, &cases[k], mat, workers, &res, baseline_ns[base], huge_pct);
+            }
+        }
+        if (batch_mat != NULL) {
+            batch.stop = 1;
+            pthread_join(batch_thread, NULL);
+        }
+        worker_pool_free(&pool);
+        if (ret != 0) {
+            return -1;
+        }
+        if (workers == opts->max_workers) {
+            break;
+        }
+        workers = workers * 2 < opts->max_workers ? workers * 2 : opts->max_workers;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (sched_getaffinity(0, sizeof(usable_cpus), &usable_cpus) == -1) {
+        perror("sched_getaffinity");
+        return 1;
+    }
+
+    bench_opts_t opts = {DEFAULT_REPS, DEFAULT_WARMUP, CPU_COUNT(&usable_cpus),
+                         DEFAULT_MAX_ELEMENTS, 1, 0, 0, 0, 0};
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:t:s:l:b:njH")) != -1) {
+        switch (opt) {
+        case 'r':
+            opts.reps = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            opts.warmup = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            opts.max_workers = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            opts.max_elements = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            opts.load = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            opts.batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            opts.pin = 0;
+            break;
+        case 'j':
+            opts.json = 1;
+            break;
+        case 'H':
+            opts.compare_pages = 1;
+            break;
+        default:
+            printf("Usage: %s [-r reps] [-w warmup] [-t max_workers] [-s max_elements] "
+                   "[-l background_threads] [-b batch_elements] [-n (no CPU pinning)] "
+                   "[-j (JSON output)] [-H (compare with normal pages)]\n", argv[0]);
+            return 0;
+        }
+    }
+    if (opts.reps == 0 || opts.max_workers == 0 || opts.max_elements < MIN_ELEMENTS) {
+        printf("Error: reps and max_workers must be positive and max_elements at least %u\n",
+               MIN_ELEMENTS);
+        return 1;
+    }
+
+    if (opts.json) {
+        printf("{\"benchmark\": \"smock_bench\", \"cpus\": %d, \"reps\": %u, \"warmup\": %u, "
+               "\"pinned\": %s, \"background_threads\": %u, \"batch_elements\": %u, "
+               "\"results\": [", CPU_COUNT(&usable_cpus), opts.reps, opts.warmup,
+               opts.pin ? "true" : "false", opts.load, opts.batch);
+    } else {
+        printf("%-8s %-4s %21s %7s %12s %12s %8s %8s %6s %10s\n", "backend", "op", "shape",
+               "workers", "median_us", "p99_us", "GB/s", "speedup", "huge%", "tlbmiss/KB");
+    }
+
+    char *configured = getenv("SMOCK_HUGE_PAGES");
+    if (configured != NULL) {
+        configured = strdup(configured);
+    }
+
+    // The batch job's matrix has rows as wide as the square shapes' largest.
+    matrix_t *batch_mat = NULL;
+    if (opts.batch > 0) {
+        unsigned ncols = 1;
+        while (ncols * ncols < opts.max_elements) {
+            ncols *= 2;
+        }
+        batch_mat = matrix_init((opts.batch + ncols - 1) / ncols, ncols);
+        if (batch_mat == NULL) {
+            printf("Matrix creation failed\n");
+            free(configured);
+            return 1;
+        }
+        fill_matrix(batch_mat, 0);
+    }
+
+    pthread_t load_threads[opts.load > 0 ? opts.load : 1];
+    unsigned n_load = start_load(opts.load, load_threads);
+
+    int ret = 0;
+    for (unsigned n = MIN_ELEMENTS; n <= opts.max_elements && ret == 0; n *= 4) {
+        unsigned side = 1;
+        while (side * side < n) {
+            side *= 2;
+        }
+        unsigned shapes[3][2] = {{side, n / side}, {n / NARROW_DIM, NARROW_DIM},
+                                 {NARROW_DIM, n / NARROW_DIM}};
+        for (int s = 0; s < 3 && ret == 0; s++) {
+            // Comparisons run each shape on normal pages first.
+            for (int normal = opts.compare_pages; normal >= 0 && ret == 0; normal--) {
+                if (opts.compare_pages) {
+                    use_normal_pages(normal, configured);
+                }
+                matrix_t *mat = matrix_init(shapes[s][0], shapes[s][1]);
+                if (mat == NULL) {
+                    printf("Matrix creation failed\n");
+                    ret = -1;
+                    break;
+                }
+                fill_matrix(mat, n + s);
+                ret = bench_matrix(mat, batch_mat, &opts);
+                matrix_free(mat);
+            }
+        }
+        if (n > opts.max_elements / 4) {
+            break;
+        }
+    }
+
+    if (opts.json) {
+        printf("\n]}\n");
+    }
+    stop_load = 1;
+    for (unsigned i = 0; i < n_load; i++) {
+        pthread_join(load_threads[i], NULL);
+    }
+    if (batch_mat != NULL) {
+        matrix_free(batch_mat);
+    }
+    free(configured);
+    return ret == 0 ? 0 : 1;
+}
@@ -1,214 +1,1348 @@
+#include <ctype.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "batch.h"
+#include "cancel.h"
+#include "cli.h"
+#include "instrument.h"
 #include "matrix.h"
+#include "matrix_alloc.h"
+#include "matrix_auto.h"
+#include "matrix_gen.h"
+#include "matrix_nt.h"
+#include "matrix_ops.h"
+#include "matrix_shm.h"
+#include "matrix_stream.h"
+#include "matrix_typed.h"
+#include "matrix_zone.h"
+#include "session.h"
+#include "snapshot.h"
 #include "worker_pool.h"
 
 #define MAX_INPUT_LEN 128
+#define MAX_LINE_LEN 1024
+#define MAX_ARGS 64
 #define PROMPT ">> "
 
-int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        printf("Usage: %s <num_workers> <queue_size>\n", argv[0]);
+/*
+ * State shared by every command in one run of the shell
+ *   session: Named matrices
+ *   mat: The current (unnamed) matrix, or NULL if there is none
+ *   workers: Worker pool used by parallel_sum_pool
+ *   in: Where matrix elements missing from 'new' commands are read from
+ *   saves: Background saves not yet reported
+ *   schedule: How parallel_sum and parallel_max divide a matrix between threads
+ *   timeout_ms: Time a query may run before it is stopped, 0 for no limit
+ *   cls: Priority and tenant the shell's queries queue their pool tasks under
+ * Commands write their results to a stream of their own, so that a batch
+ * script can run several at once.
+ */
+typedef struct {
+    session_t session;
+    matrix_t *mat;
+    worker_pool_t workers;
+    FILE *in;
+    snapshot_list_t saves;
+    matrix_sched_t schedule;
+    unsigned timeout_ms;
+    task_class_t cls;
+} shell_t;
+
+// Whether the shell is waiting for a command at the prompt
+static volatile sig_atomic_t at_prompt;
+
+// Ctrl-C stops the running queries instead of the shell.
+static void on_interrupt(int sig) {
+    (void) sig;
+    cancel_interrupt();
+    if (at_prompt) {
+        // Nothing is running, so just start a fresh line.
+        ssize_t ret = write(STDOUT_FILENO, "\n" PROMPT, sizeof("\n" PROMPT) - 1);
+        (void) ret;
+    }
+}
+
+// Prints why a query failed: 'message' unless it was cancelled.
+static void print_query_failure(FILE *out, const cancel_token_t *cancel, const char *message) {
+    switch (cancel_requested(cancel)) {
+    case CANCEL_REQUESTED:
+        fprintf(out, "Query cancelled\n");
+        break;
+    case CANCEL_DEADLINE:
+        fprintf(out, "Query timed out\n");
+        break;
+    case CANCEL_NONE:
+        fprintf(out, "%s\n", message);
+        break;
+    }
+}
+
+static int is_number(const char *str) {
+    if (*str == '-') {
+        str++;
+    }
+    if (*str == '\0') {
         return 0;
     }
-    int num_workers = atoi(argv[1]);
-    if (num_workers <= 0) {
-        printf("Error: Number of workers must be positive\n");
-        return 1;
+    for (; *str != '\0'; str++) {
+        if (!isdigit((unsigned char) *str)) {
+            return 0;
+        }
     }
-    int queue_size = atoi(argv[2]);
-    if (queue_size <= 0) {
-        printf("Error: Work queue size must be positive\n");
+    return 1;
+}
+
+// Splits 'line' on whitespace in place. Returns the number of arguments.
+static int split_line(char *line, char **args, int max_args) {
+    int n_args = 0;
+    char *save;
+    for (char *tok = strtok_r(line, " \t\r\n", &save); tok != NULL && n_args < max_args;
+         tok = strtok_r(NULL, " \t\r\n", &save)) {
+        args[n_args++] = tok;
+    }
+    return n_args;
+}
+
+static const matrix_t *lookup_named(void *ctx, const char *name) {
+    return session_get((session_t *) ctx, name);
+}
+
+/*
+ * Finds the matrix a command operates on: the named matrix when 'name' is
+ * given, otherwise the current matrix. Prints an error if there is none.
+ */
+static matrix_t *target_matrix(shell_t *sh, FILE *out, const char *name, int for_write) {
+    if (name == NULL) {
+        if (sh->mat == NULL) {
+            fprintf(out, "Error: There is no active matrix\n");
+        }
+        return sh->mat;
+    }
+    matrix_t *mat = for_write ? session_get_mut(&sh->session, name)
+                              : session_get(&sh->session, name);
+    if (mat == NULL) {
+        fprintf(out, "Error: No matrix named '%s'\n", name);
+    }
+    return mat;
+}
+
+/*
+ * new [name] <nrows> <ncols> <values...>
+ * Values not given on the command line are read from the input stream.
+ */
+static void cmd_new(shell_t *sh, FILE *out, int n_args, char **args) {
+    int first = (n_args > 1 && !is_number(args[1])) ? 2 : 1;
+    const char *name = first == 2 ? args[1] : NULL;
+    if (n_args < first + 2) {
+        fprintf(out, "Error: Usage: new [name] <nrows> <ncols>\n");
+        return;
+    }
+    if (name == NULL && sh->mat != NULL) {
+        fprintf(out, "Error: You must clear the current matrix first\n");
+        return;
+    }
+
+    unsigned nrows = strtoul(args[first], NULL, 10);
+    unsigned ncols = strtoul(args[first + 1], NULL, 10);
+    matrix_t *mat = matrix_init(nrows, ncols);
+    if (mat == NULL) {
+        fprintf(out, "Matrix creation failed\n");
+        return;
+    }
+
+    size_t n = (size_t) nrows * ncols;
+    size_t i = 0;
+    for (int a = first + 2; a < n_args && i < n; a++) {
+        mat->data[i++] = atoi(args[a]);
+    }
+    if (i < n) {
+        for (; i < n; i++) {
+            if (fscanf(sh->in, "%d", &mat->data[i]) != 1) {
+                mat->data[i] = 0;
+            }
+        }
+        // Discard the rest of the last line of values.
+        int c;
+        while ((c = fgetc(sh->in)) != EOF && c != '\n') {
+        }
+    }
+
+    if (name == NULL) {
+        sh->mat = mat;
+    } else if (session_store(&sh->session, name, mat) != 0) {
+        fprintf(out, "Matrix creation failed\n");
+        matrix_free(mat);
+    }
+}
+
+static void cmd_gen(shell_t *sh, FILE *out, int n_args, char **args) {
+    int first = (n_args > 1 && !is_number(args[1])) ? 2 : 1;
+    const char *name = first == 2 ? args[1] : NULL;
+    if (n_args < first + 4) {
+        fprintf(out, "Error: Usage: gen [name] <nrows> <ncols> <dist> <seed>\n");
+        return;
+    }
+    if (name == NULL && sh->mat != NULL) {
+        fprintf(out, "Error: You must clear the current matrix first\n");
+        return;
+    }
+
+    matrix_gen_dist_t dist;
+    if (matrix_gen_parse(args[first + 2], &dist) != 0) {
+        fprintf(out, "Error: Invalid distribution '%s'; use uniform[:lo:hi], "
+                     "normal[:mean:stddev], sparse[:density] or const:<value>\n",
+                args[first + 2]);
+        return;
+    }
+    char *end;
+    uint64_t seed = strtoull(args[first + 3], &end, 10);
+    if (!isdigit((unsigned char) args[first + 3][0]) || *end != '\0') {
+        fprintf(out, "Error: Seed must be a non-negative integer\n");
+        return;
+    }
+
+    unsigned nrows = strtoul(args[first], NULL, 10);
+    unsigned ncols = strtoul(args[first + 1], NULL, 10);
+    matrix_t *mat = matrix_init(nrows, ncols);
+    if (mat == NULL) {
+        fprintf(out, "Matrix creation failed\n");
+        return;
+    }
+    if (matrix_gen_fill(mat, &dist, seed, &sh->workers) != 0) {
+        fprintf(out, "Failed to generate matrix\n");
+        matrix_free(mat);
+        return;
+    }
+
+    if (name == NULL) {
+        sh->mat = mat;
+    } else if (session_store(&sh->session, name, mat) != 0) {
+        fprintf(out, "Matrix creation failed\n");
+        matrix_free(mat);
+    }
+}
+
+static void cmd_eval(shell_t *sh, FILE *out, int n_args, char **args) {
+    if (n_args < 3) {
+        fprintf(out, "Error: Usage: eval <name> <expr>\n");
+        return;
+    }
+    // The parser ignores whitespace, so rejoin the tokens of the expression.
+    char expr_text[MAX_LINE_LEN];
+    expr_text[0] = '\0';
+    for (int a = 2; a < n_args; a++) {
+        strncat(expr_text, args[a], sizeof(expr_text) - strlen(expr_text) - 2);
+        strcat(expr_text, " ");
+    }
+
+    matrix_expr_t expr;
+    if (matrix_expr_parse(&expr, expr_text, lookup_named, &sh->session) != 0) {
+        fprintf(out, "Error: Invalid expression\n");
+        return;
+    }
+    matrix_t *dest = matrix_init(expr.nrows, expr.ncols);
+    if (dest == NULL) {
+        fprintf(out, "Matrix creation failed\n");
+        return;
+    }
+    if (matrix_expr_eval(&expr, dest) != 0) {
+        fprintf(out, "Error: Expression evaluation failed\n");
+        matrix_free(dest);
+    } else if (session_store(&sh->session, args[1], dest) != 0) {
+        fprintf(out, "Matrix creation failed\n");
+        matrix_free(dest);
+    }
+}
+
+/*
+ * pool_stats
+ * Prints the worker pool's queue telemetry and the counters of each worker.
+ */
+static void cmd_pool_stats(shell_t *sh, FILE *out) {
+    worker_stats_t workers[sh->workers.size];
+    work_queue_stats_t queue;
+    if (worker_pool_get_stats(&sh->workers, &queue, workers) != 0) {
+        fprintf(out, "Failed to read worker pool statistics\n");
+        return;
+    }
+
+    fprintf(out, "queue: %u/%u slots used, high water %u, %lu puts, "
+            "%lu blocked for %.3f ms (%lu by quotas)\n", queue.depth, queue.capacity,
+            queue.high_water, queue.puts, queue.put_blocks, queue.put_blocked_ns / 1e6,
+            queue.quota_blocks);
+    for (int p = 0; p < TASK_N_PRIORITIES; p++) {
+        fprintf(out, "  %-6s weight %u, %u queued, %lu taken\n", task_priority_name(p),
+                queue.lane_weight[p], queue.lane_depth[p], queue.lane_gets[p]);
+    }
+    fprintf(out, "%6s %10s %12s %12s %10s %6s\n", "worker", "tasks", "busy_ms", "idle_ms",
+            "wakeups", "busy%");
+    for (unsigned i = 0; i < sh->workers.size; i++) {
+        uint64_t total = workers[i].busy_ns + workers[i].idle_ns;
+        fprintf(out, "%6u %10lu %12.3f %12.3f %10lu %6.1f\n", i, workers[i].tasks_run,
+                workers[i].busy_ns / 1e6, workers[i].idle_ns / 1e6, workers[i].wakeups,
+                total > 0 ? 100.0 * workers[i].busy_ns / total : 0.0);
+    }
+    if (queue.n_samples > 0) {
+        fprintf(out, "depth samples (ms:depth):");
+        for (unsigned i = 0; i < queue.n_samples; i++) {
+            fprintf(out, " %.1f:%u", queue.samples[i].time_ns / 1e6, queue.samples[i].depth);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+/*
+ * nt_tune
+ * Times the streaming kernels' prefetch distances again and prints the results.
+ */
+static void cmd_nt_tune(FILE *out) {
+    static const unsigned distances[MATRIX_NT_N_DISTANCES] = MATRIX_NT_DISTANCES;
+    matrix_nt_config_t config;
+    if (matrix_nt_tune() != 0) {
+        fprintf(out, "Failed to allocate tuning buffers\n");
+        return;
+    }
+    matrix_nt_get_config(&config);
+    for (unsigned d = 0; d < MATRIX_NT_N_DISTANCES; d++) {
+        fprintf(out, "  %4u bytes ahead: %.2f ms%s\n", distances[d], config.tune_ns[d] / 1e6,
+                distances[d] == config.prefetch_distance ? " (chosen)" : "");
+    }
+    if (config.min_bytes == SIZE_MAX) {
+        fprintf(out, "Non-temporal stores are off\n");
+    } else {
+        fprintf(out, "Non-temporal stores from %zu KB\n", config.min_bytes / 1024);
+    }
+}
+
+// Prints a backend as e.g. "threads x4".
+static void print_backend(FILE *out, const matrix_auto_model_t *model) {
+    fprintf(out, "%s", matrix_backend_name(model->backend));
+    if (model->backend != MATRIX_BACKEND_SERIAL) {
+        fprintf(out, " x%u", model->n_threads);
+    }
+}
+
+/*
+ * calibrate
+ * Times every reduction backend again, saves the profile and prints the
+ * fitted costs.
+ */
+static void cmd_calibrate(shell_t *sh, FILE *out) {
+    matrix_auto_profile_t profile;
+    if (matrix_auto_calibrate(&sh->workers) != 0 ||
+        matrix_auto_get_profile(&sh->workers, &profile) != 0) {
+        fprintf(out, "Failed to calibrate\n");
+        return;
+    }
+    for (unsigned m = 0; m < profile.n_models; m++) {
+        const matrix_auto_model_t *model = &profile.models[m];
+        fprintf(out, "  ");
+        print_backend(out, model);
+        fprintf(out, ": %.1f us + %.2f ns/row + %.3f ns/element\n", model->fixed_ns / 1e3,
+                model->row_ns, model->elem_ns);
+    }
+}
+
+/*
+ * auto_sum [name], auto_max [name], auto_plan [name]
+ * Reduces a matrix on the backend predicted to be fastest, or for auto_plan
+ * prints every backend's predicted time and which would be chosen.
+ */
+static void cmd_auto(shell_t *sh, FILE *out, const cancel_token_t *cancel, int n_args,
+                     char **args) {
+    matrix_t *mat = target_matrix(sh, out, n_args > 1 ? args[1] : NULL, 0);
+    if (mat == NULL) {
+        return;
+    }
+    if (strcmp("auto_plan", args[0]) != 0) {
+        int is_max = strcmp("auto_max", args[0]) == 0;
+        long result;
+        int ret = is_max ? matrix_auto_max(mat, &sh->workers, sh->cls, cancel, &result)
+                         : matrix_auto_sum(mat, &sh->workers, sh->cls, cancel, &result);
+        if (ret != 0) {
+            print_query_failure(out, cancel, is_max ? "Matrix max failed" : "Matrix sum failed");
+        } else {
+            fprintf(out, "%ld\n", result);
+        }
+        return;
+    }
+
+    matrix_auto_profile_t profile;
+    matrix_auto_model_t sum_choice;
+    matrix_auto_model_t max_choice;
+    if (matrix_auto_get_profile(&sh->workers, &profile) != 0 ||
+        matrix_auto_choose(mat, 0, &sh->workers, &sum_choice) != 0 ||
+        matrix_auto_choose(mat, 1, &sh->workers, &max_choice) != 0) {
+        fprintf(out, "Failed to calibrate\n");
+        return;
+    }
+    for (unsigned m = 0; m < profile.n_models; m++) {
+        const matrix_auto_model_t *model = &profile.models[m];
+        fprintf(out, "  ");
+        print_backend(out, model);
+        if (model->backend == MATRIX_BACKEND_THREADS && model->n_threads > mat->nrows) {
+            fprintf(out, ": more threads than rows\n");
+        } else {
+            fprintf(out, ": %.3f ms%s\n", matrix_auto_predict(model, mat->nrows, mat->ncols) / 1e6,
+                    model->backend == MATRIX_BACKEND_POOL ? " (sum only)" : "");
+        }
+    }
+    if (matrix_agg_valid(mat)) {
+        fprintf(out, "Sum and max are cached, so both are read serially\n");
+    }
+    fprintf(out, "sum: ");
+    print_backend(out, &sum_choice);
+    fprintf(out, ", max: ");
+    print_backend(out, &max_choice);
+    fprintf(out, " (profile %s)\n", profile.from_file ? "read from file" : "measured now");
+}
+
+// Whether 'x' converts to an element of type 'type' without changing
+static int fits_elem_type(int x, matrix_elem_type_t type) {
+    switch (type) {
+    case MATRIX_TYPE_I8:
+        return x >= INT8_MIN && x <= INT8_MAX;
+    case MATRIX_TYPE_I16:
+        return x >= INT16_MIN && x <= INT16_MAX;
+    case MATRIX_TYPE_F32:
+        // Converting back to int would be undefined for floats rounded past INT_MAX.
+        return (double) (float) x == (double) x;
+    default:
         return 1;
     }
+}
 
-    printf("SMOCK - Simple Matrix Operations for C Knowledge\n");
-    printf("Commands:\n");
-    printf("  new <nrows> <ncols>: Create new <nrows> x <ncols> matrix\n");
-    printf("  put <i> <j> <value>: Change entry (i,j) of current matrix\n");
-    printf("  get <i> <j>: Retrieve entry (i,j) of current matrix\n");
-    printf("  print: Print out entries in the current matrix\n");
-    printf("  sum: Compute and print out sum of all elements in current matrix\n");
-    printf("  max: Compute and print out maximum of all elements in current matrix\n");
-    printf("  clear: Delete current matrix\n");
-    printf("  read_text <file_name>: Read a matrix from a text file\n");
-    printf("  parallel_sum <n_threads>: Compute matrix sum with multiple threads\n");
-    printf("  parallel_max <n_threads>: Compute matrix max with multiple threads\n");
-    printf("  parallel_sum_pool: Compute matrix sum with pre-existing worker threads\n");
-    printf("  exit: Quit this program\n");
+/*
+ * typed_save <type> <file_name> [name]
+ * Writes a matrix to a typed binary file with elements of type <type>.
+ */
+static void cmd_typed_save(shell_t *sh, FILE *out, int n_args, char **args) {
+    int type = n_args > 2 ? matrix_elem_type_parse(args[1]) : -1;
+    if (type == -1) {
+        fprintf(out, "Error: Usage: typed_save <i8|i16|i32|i64|f32|f64> <file_name> [name]\n");
+        return;
+    }
+    const matrix_t *mat = target_matrix(sh, out, n_args > 3 ? args[3] : NULL, 0);
+    if (mat == NULL) {
+        return;
+    }
 
-    char input[MAX_INPUT_LEN];
-    matrix_t *mat = NULL;
-    worker_pool_t workers;
-    if (worker_pool_init(&workers, num_workers, queue_size) == -1) {
+    size_t n = (size_t) mat->nrows * mat->ncols;
+    int ret = -1;
+    switch (type) {
+#define TYPED_SAVE_CASE(S, elem_t, acc_t, type_code) \
+    case type_code: { \
+        matrix_##S##_t *typed = matrix_##S##_init(mat->nrows, mat->ncols); \
+        if (typed == NULL) { \
+            break; \
+        } \
+        /* i32 and f32 are checked first and then converted by a streaming kernel. */ \
+        int streamed = type_code == MATRIX_TYPE_I32 || type_code == MATRIX_TYPE_F32; \
+        size_t i = 0; \
+        for (; i < n && fits_elem_type(mat->data[i], type_code); i++) { \
+            if (!streamed) { \
+                typed->data[i] = (elem_t) mat->data[i]; \
+            } \
+        } \
+        if (i == n && type_code == MATRIX_TYPE_I32) { \
+            matrix_nt_copy((int *) typed->data, mat->data, n); \
+        } else if (i == n && type_code == MATRIX_TYPE_F32) { \
+            matrix_nt_convert_f32((float *) typed->data, mat->data, n); \
+        } \
+        if (i < n) { \
+            fprintf(out, "Error: %d cannot be stored as %s\n", mat->data[i], #S); \
+        } else { \
+            ret = matrix_##S##_write_bin(typed, args[2]); \
+        } \
+        matrix_##S##_free(typed); \
+        break; \
+    }
+    MATRIX_TYPED_FOR_EACH(TYPED_SAVE_CASE)
+#undef TYPED_SAVE_CASE
+    }
+    if (ret != 0) {
+        fprintf(out, "Failed to write matrix to '%s'\n", args[2]);
+    }
+}
+
+/*
+ * typed_stats <file_name> [n_threads]
+ * Prints the element type, sum and maximum of a typed binary file.
+ */
+static void cmd_typed_stats(FILE *out, int n_args, char **args) {
+    if (n_args < 2) {
+        fprintf(out, "Error: Usage: typed_stats <file_name> [n_threads]\n");
+        return;
+    }
+    unsigned n_threads = n_args > 2 ? strtoul(args[2], NULL, 10) : 1;
+    if (n_threads == 0) {
+        fprintf(out, "Error: Invalid n_threads argument\n");
+        return;
+    }
+
+    int ret = -1;
+    switch (matrix_typed_file_type(args[1])) {
+#define TYPED_STATS_CASE(S, elem_t, acc_t, type_code) \
+    case type_code: { \
+        matrix_##S##_t *mat = matrix_##S##_read_bin(args[1]); \
+        acc_t sum; \
+        elem_t max; \
+        if (mat == NULL) { \
+            break; \
+        } \
+        ret = matrix_##S##_parallel_sum(mat, n_threads, &sum) == 0 && \
+              matrix_##S##_parallel_max(mat, n_threads, &max) == 0 ? 0 : -1; \
+        if (ret == 0 && MATRIX_ELEM_IS_FLOAT(elem_t)) { \
+            fprintf(out, "%s %u x %u: sum %.17g max %.17g\n", #S, mat->nrows, \
+                    mat->ncols, (double) sum, (double) max); \
+        } else if (ret == 0) { \
+            fprintf(out, "%s %u x %u: sum %lld max %lld\n", #S, mat->nrows, \
+                    mat->ncols, (long long) sum, (long long) max); \
+        } \
+        matrix_##S##_free(mat); \
+        break; \
+    }
+    MATRIX_TYPED_FOR_EACH(TYPED_STATS_CASE)
+#undef TYPED_STATS_CASE
+    }
+    if (ret != 0) {
+        fprintf(out, "Failed to read typed matrix from '%s'\n", args[1]);
+    }
+}
+
+/*
+ * Runs one command, writing its results to 'out'
+ *   cancel: Token the command's queries stop on
+ * Returns 1 if the shell should exit, 0 otherwise
+ */
+static int run_command(shell_t *sh, FILE *out, const cancel_token_t *cancel, int n_args,
+                       char **args) {
+    const char *cmd = args[0];
+
+    if (strcmp("exit", cmd) == 0) {
         return 1;
     }
 
-    while (1) { // Keep reading until we break out of loop
-        printf("%s", PROMPT);
+    else if (strcmp("new", cmd) == 0) {
+        cmd_new(sh, out, n_args, args);
+    }
 
-        if (scanf("%s", input) == EOF) {
-            printf("\n");
-            break;
+    else if (strcmp("gen", cmd) == 0) {
+        cmd_gen(sh, out, n_args, args);
+    }
+
+    else if (strcmp("clear", cmd) == 0) {
+        if (sh->mat == NULL) {
+            fprintf(out, "Error: There is no active matrix\n");
+        } else {
+            matrix_free(sh->mat);
+            sh->mat = NULL;
         }
+    }
 
-        if (strcmp("exit", input) == 0) {
-            break;
+    else if (strcmp("print", cmd) == 0) {
+        matrix_t *mat = target_matrix(sh, out, n_args > 1 ? args[1] : NULL, 0);
+        if (mat != NULL) {
+            for (unsigned i = 0; i < mat->nrows; i++) {
+                fprintf(out, "  ");
+                for (unsigned j = 0; j < mat->ncols; j++) {
+                    fprintf(out, "%d ", matrix_get(mat, i, j));
+                }
+                fprintf(out, "\n");
+            }
         }
+    }
 
-        else if (strcmp("new", input) == 0) {
-            // Always need to read in nrows and ncols
-            unsigned nrows;
-            unsigned ncols;
-            scanf("%u %u", &nrows, &ncols);
+    else if (strcmp("get", cmd) == 0) {
+        // get [name] <i> <j>
+        int named = n_args > 3;
+        if (n_args < 3) {
+            fprintf(out, "Error: Usage: get [name] <i> <j>\n");
+        } else {
+            matrix_t *mat = target_matrix(sh, out, named ? args[1] : NULL, 0);
             if (mat != NULL) {
-                printf("Error: You must clear the current matrix first\n");
-            } else {
-                mat = matrix_init(nrows, ncols);
-                if (mat == NULL) {
-                    printf("Matrix creation failed\n");
-                } else {
-                    int val;
-                    for (int i = 0; i < nrows; i++) {
-                        for (int j = 0; j < ncols; j++) {
-                            scanf("%d", &val);
-                            matrix_put(mat, i , j, val);
-                        }
-                    }
-                }
+                unsigned i = strtoul(args[1 + named], NULL, 10);
+                unsigned j = strtoul(args[2 + named], NULL, 10);
+                fprintf(out, "%d\n", matrix_get(mat, i, j));
             }
         }
+    }
 
-        else if (strcmp("clear", input) == 0) {
-            if (mat == NULL) {
-                printf("Error: There is no active matrix\n");
+    else if (strcmp("put", cmd) == 0) {
+        // put [name] <i> <j> <value>
+        int named = n_args > 4;
+        if (n_args < 4) {
+            fprintf(out, "Error: Usage: put [name] <i> <j> <value>\n");
+        } else {
+            matrix_t *mat = target_matrix(sh, out, named ? args[1] : NULL, 1);
+            if (mat != NULL) {
+                unsigned i = strtoul(args[1 + named], NULL, 10);
+                unsigned j = strtoul(args[2 + named], NULL, 10);
+                // Puts tend to be followed by sums and maxes, so keep them
+                // cached from now on. Without memory for it, they just scan.
+                matrix_agg_enable(mat);
+                matrix_put(mat, i, j, atoi(args[3 + named]));
+            }
+        }
+    }
+
+    else if (strcmp("sum", cmd) == 0) {
+        matrix_t *mat = target_matrix(sh, out, n_args > 1 ? args[1] : NULL, 0);
+        if (mat != NULL) {
+            fprintf(out, "%ld\n", matrix_sum(mat));
+        }
+    }
+
+    else if (strcmp("max", cmd) == 0) {
+        matrix_t *mat = target_matrix(sh, out, n_args > 1 ? args[1] : NULL, 0);
+        if (mat != NULL) {
+            fprintf(out, "%ld\n", matrix_max(mat));
+        }
+    }
+
+    else if (strcmp("pages", cmd) == 0) {
+        matrix_t *mat = target_matrix(sh, out, n_args > 1 ? args[1] : NULL, 0);
+        size_t size = mat != NULL ? (size_t) mat->nrows * mat->ncols * sizeof(int) : 0;
+        matrix_page_usage_t usage;
+        if (mat != NULL && matrix_alloc_page_usage(mat->data, size, &usage) != 0) {
+            fprintf(out, "Failed to read page usage\n");
+        } else if (mat != NULL) {
+            fprintf(out, "%zu KB mapped, %zu KB resident, %zu KB in huge pages (%.0f%%)\n",
+                    usage.mapped / 1024, usage.resident / 1024, usage.huge / 1024,
+                    usage.mapped ? 100.0 * usage.huge / usage.mapped : 0.0);
+        }
+    }
+
+    else if (strcmp("read_text", cmd) == 0) {
+        if (n_args < 2) {
+            fprintf(out, "Error: Usage: read_text <file_name>\n");
+        } else if (sh->mat != NULL) {
+            fprintf(out, "Error: You must clear the current matrix first\n");
+        } else {
+            sh->mat = matrix_read_text(args[1]);
+            if (sh->mat == NULL) {
+                fprintf(out, "Failed to read matrix from text file\n");
             } else {
-                matrix_free(mat);
-                mat = NULL;
+                fprintf(out, "Matrix successfully read from text file\n");
             }
         }
+    }
 
-        else if (strcmp("print", input) == 0) {
+    else if (strcmp("parallel_sum", cmd) == 0 || strcmp("parallel_max", cmd) == 0) {
+        // parallel_sum <n_threads> [name]
+        unsigned n_threads = n_args > 1 ? strtoul(args[1], NULL, 10) : 0;
+        if (n_threads == 0) {
+            fprintf(out, "Error: Invalid n_threads argument\n");
+        } else {
+            matrix_t *mat = target_matrix(sh, out, n_args > 2 ? args[2] : NULL, 0);
+            long result;
             if (mat == NULL) {
-                printf("Error: There is no active matrix\n");
+                // Error already printed
+            } else if (strcmp("parallel_sum", cmd) == 0) {
+                if (matrix_parallel_sum_sched(mat, n_threads, sh->schedule, cancel,
+                                              &result) == -1) {
+                    print_query_failure(out, cancel, "Matrix parallel sum failed");
+                } else {
+                    fprintf(out, "%ld\n", result);
+                }
             } else {
-                for (int i = 0; i < mat->nrows; i++) {
-                    printf("  ");
-                    for (int j = 0; j < mat->ncols; j++) {
-                        printf("%d ", matrix_get(mat, i, j));
-                    }
-                    printf("\n");
+                if (matrix_parallel_max_sched(mat, n_threads, sh->schedule, cancel,
+                                              &result) == -1) {
+                    print_query_failure(out, cancel, "Matrix parallel max failed");
+                } else {
+                    fprintf(out, "%ld\n", result);
                 }
             }
         }
+    }
+
+    else if (strcmp("parallel_sum_pool", cmd) == 0) {
+        matrix_t *mat = target_matrix(sh, out, n_args > 1 ? args[1] : NULL, 0);
+        long result;
+        if (mat == NULL) {
+            // Error already printed
+        } else if (matrix_parallel_sum_pool_cancel(mat, &sh->workers, sh->cls, cancel,
+                                                   &result) == -1) {
+            print_query_failure(out, cancel, "Parallel matrix sum failed");
+        } else {
+            fprintf(out, "%ld\n", result);
+        }
+    }
+
+    else if (strcmp("auto_sum", cmd) == 0 || strcmp("auto_max", cmd) == 0 ||
+             strcmp("auto_plan", cmd) == 0) {
+        cmd_auto(sh, out, cancel, n_args, args);
+    }
+
+    else if (strcmp("calibrate", cmd) == 0) {
+        cmd_calibrate(sh, out);
+    }
+
+    else if (strcmp("stream_sum", cmd) == 0 || strcmp("stream_max", cmd) == 0) {
+        int is_sum = strcmp("stream_sum", cmd) == 0;
+        long result;
+        if (n_args < 2) {
+            fprintf(out, "Error: Usage: %s <file_name>\n", cmd);
+        } else if (matrix_stream_reduce(args[1], is_sum ? MATRIX_STREAM_SUM : MATRIX_STREAM_MAX,
+                                        &sh->workers, &result) != 0) {
+            fprintf(out, "Failed to read matrix from '%s'\n", args[1]);
+        } else {
+            fprintf(out, "%ld\n", result);
+        }
+    }
+
+    else if (strcmp("load", cmd) == 0) {
+        if (n_args < 3) {
+            fprintf(out, "Error: Usage: load <name> <file_name>\n");
+        } else if (session_load(&sh->session, args[1], args[2]) != 0) {
+            fprintf(out, "Failed to load matrix from '%s'\n", args[2]);
+        }
+    }
 
-        else if (strcmp("get", input) == 0) {
-            // Still have to read these even if no active matrix
-            unsigned i;
-            unsigned j;
-            scanf("%u %u", &i, &j);
+    else if (strcmp("save", cmd) == 0) {
+        int zones = n_args > 3 && strcmp(args[3], "zones") == 0;
+        if (n_args < 3 || (n_args > 3 && !zones)) {
+            fprintf(out, "Error: Usage: save <name> <file_name> [zones]\n");
+        } else {
+            matrix_t *mat = target_matrix(sh, out, args[1], 0);
+            size_t len = strlen(args[2]);
+            int is_text = len >= 4 && strcmp(args[2] + len - 4, ".txt") == 0;
             if (mat == NULL) {
-                printf("Error: There is no active matrix\n");
-            } else {
-                printf("%d\n", matrix_get(mat, i, j));
+                // Error already printed
+            } else if (is_text && zones) {
+                fprintf(out, "Error: Zone maps need a binary file\n");
+            } else if ((is_text ? matrix_write_text(mat, args[2])
+                        : zones ? matrix_write_bin_zones(mat, args[2])
+                                : matrix_write_bin(mat, args[2])) != 0) {
+                fprintf(out, "Failed to write matrix to '%s'\n", args[2]);
             }
         }
+    }
 
-        else if (strcmp("put", input) == 0) {
-            // Still have to read these even if no active matrix
-            unsigned i;
-            unsigned j;
-            int val;
-            scanf("%u %u %d", &i, &j, &val);
-            if (mat == NULL) {
-                printf("Error: There is no active matrix\n");
-            } else {
-                matrix_put(mat, i, j, val);
+    else if (strcmp("save_async", cmd) == 0) {
+        // save_async [name] <file_name>
+        int named = n_args > 2;
+        if (n_args < 2) {
+            fprintf(out, "Error: Usage: save_async [name] <file_name>\n");
+        } else {
+            matrix_t *mat = target_matrix(sh, out, named ? args[1] : NULL, 0);
+            if (mat != NULL && snapshot_save(&sh->saves, mat, args[1 + named]) != 0) {
+                fprintf(out, "Failed to write matrix to '%s'\n", args[1 + named]);
             }
         }
+    }
 
-        else if (strcmp("sum", input) == 0) {
-            if (mat == NULL) {
-                printf("Error: There is no active matrix\n");
-            } else {
-                printf("%ld\n", matrix_sum(mat));
+    else if (strcmp("save_wait", cmd) == 0) {
+        snapshot_poll(&sh->saves, out, 1);
+    }
+
+    else if (strcmp("publish", cmd) == 0) {
+        if (n_args < 2) {
+            fprintf(out, "Error: Usage: publish <name>\n");
+        } else {
+            matrix_t *mat = target_matrix(sh, out, args[1], 0);
+            if (mat != NULL && matrix_shm_publish(args[1], mat->data, mat->nrows, mat->ncols) != 0) {
+                fprintf(out, "Failed to publish matrix '%s'\n", args[1]);
             }
         }
+    }
 
-        else if (strcmp("max", input) == 0) {
-            if (mat == NULL) {
-                printf("Error: There is no active matrix\n");
+    else if (strcmp("attach", cmd) == 0) {
+        if (n_args < 2) {
+            fprintf(out, "Error: Usage: attach <name>\n");
+        } else if (session_attach(&sh->session, args[1]) != 0) {
+            fprintf(out, "Failed to attach shared matrix '%s'\n", args[1]);
+        }
+    }
+
+    else if (strcmp("unpublish", cmd) == 0) {
+        if (n_args < 2) {
+            fprintf(out, "Error: Usage: unpublish <name>\n");
+        } else if (matrix_shm_unpublish(args[1]) != 0) {
+            fprintf(out, "Error: No shared matrix named '%s'\n", args[1]);
+        }
+    }
+
+    else if (strcmp("zone_stats", cmd) == 0) {
+        matrix_zone_map_t map;
+        int ret = n_args < 2 ? -2 : matrix_zone_map_read(&map, args[1]);
+        if (ret == -2) {
+            fprintf(out, "Error: Usage: zone_stats <file_name>\n");
+        } else if (ret == -1) {
+            fprintf(out, "Failed to read matrix from '%s'\n", args[1]);
+        } else if (ret == 1) {
+            fprintf(out, "Error: '%s' has no zone map\n", args[1]);
+        } else {
+            fprintf(out, "%u x %u, %zu zones: sum %ld min %ld max %ld\n", map.nrows, map.ncols,
+                    map.n_zones, matrix_zone_map_sum(&map), matrix_zone_map_min(&map),
+                    matrix_zone_map_max(&map));
+            matrix_zone_map_free(&map);
+        }
+    }
+
+    else if (strcmp("zone_count", cmd) == 0) {
+        matrix_zone_map_t map;
+        long count;
+        long sum;
+        size_t blocks_read;
+        if (n_args < 4) {
+            fprintf(out, "Error: Usage: zone_count <file_name> <lo> <hi>\n");
+        } else if (matrix_zone_map_read(&map, args[1]) == -1) {
+            fprintf(out, "Failed to read matrix from '%s'\n", args[1]);
+        } else {
+            if (matrix_zone_count_range(&map, args[1], atoi(args[2]), atoi(args[3]),
+                                        &count, &sum, &blocks_read) != 0) {
+                fprintf(out, "Failed to read matrix from '%s'\n", args[1]);
             } else {
-                printf("%ld\n", matrix_max(mat));
+                fprintf(out, "count %ld sum %ld (read %zu of %zu blocks)\n", count, sum,
+                        blocks_read, map.n_zones);
             }
+            matrix_zone_map_free(&map);
         }
+    }
 
-        else if (strcmp("read_text", input) == 0) {
-            scanf("%s", input); // Read in file name
-            if (mat != NULL) {
-                printf("Error: You must clear the current matrix first\n");
-            } else {
-                mat = matrix_read_text(input);
-                if (mat == NULL) {
-                    printf("Failed to read matrix from text file\n");
-                } else {
-                    printf("Matrix successfully read from text file\n");
+    else if (strcmp("free", cmd) == 0) {
+        if (n_args < 2) {
+            fprintf(out, "Error: Usage: free <name>\n");
+        } else if (session_remove(&sh->session, args[1]) != 0) {
+            fprintf(out, "Error: No matrix named '%s'\n", args[1]);
+        }
+    }
+
+    else if (strcmp("alias", cmd) == 0) {
+        if (n_args < 3) {
+            fprintf(out, "Error: Usage: alias <new_name> <name>\n");
+        } else if (session_alias(&sh->session, args[1], args[2]) != 0) {
+            fprintf(out, "Error: No matrix named '%s'\n", args[2]);
+        }
+    }
+
+    else if (strcmp("list", cmd) == 0) {
+        session_list(&sh->session, out);
+    }
+
+    else if (strcmp("budget", cmd) == 0) {
+        if (n_args < 2 || !is_number(args[1])) {
+            fprintf(out, "Error: Usage: budget <megabytes>\n");
+        } else {
+            session_set_budget(&sh->session, strtoul(args[1], NULL, 10) << 20);
+        }
+    }
+
+    else if (strcmp("schedule", cmd) == 0) {
+        int sched = n_args > 1 ? matrix_sched_parse(args[1]) : (int) sh->schedule;
+        if (sched == -1) {
+            fprintf(out, "Error: Usage: schedule [static|dynamic|guided]\n");
+        } else if (n_args > 1) {
+            sh->schedule = sched;
+        } else {
+            fprintf(out, "%s\n", matrix_sched_name(sh->schedule));
+        }
+    }
+
+    else if (strcmp("timeout", cmd) == 0) {
+        if (n_args > 1 && !is_number(args[1])) {
+            fprintf(out, "Error: Usage: timeout [milliseconds]\n");
+        } else if (n_args > 1) {
+            sh->timeout_ms = strtoul(args[1], NULL, 10);
+        } else if (sh->timeout_ms == 0) {
+            fprintf(out, "none\n");
+        } else {
+            fprintf(out, "%u ms\n", sh->timeout_ms);
+        }
+    }
+
+    else if (strcmp("priority", cmd) == 0) {
+        // priority [high|normal|low] [tenant]
+        int priority = n_args > 1 ? task_priority_parse(args[1]) : (int) sh->cls.priority;
+        unsigned tenant = n_args > 2 ? strtoul(args[2], NULL, 10) : 0;
+        if (priority == -1 || (n_args > 2 && !is_number(args[2])) ||
+            tenant >= WORK_QUEUE_MAX_TENANTS) {
+            fprintf(out, "Error: Usage: priority [high|normal|low] [tenant], tenant below %d\n",
+                    WORK_QUEUE_MAX_TENANTS);
+        } else if (n_args > 1) {
+            sh->cls.priority = priority;
+            sh->cls.tenant = tenant;
+        } else {
+            fprintf(out, "%s, tenant %u\n", task_priority_name(sh->cls.priority), sh->cls.tenant);
+        }
+    }
+
+    else if (strcmp("weight", cmd) == 0) {
+        int priority = n_args > 2 ? task_priority_parse(args[1]) : -1;
+        if (priority == -1 || !is_number(args[2]) ||
+            work_queue_set_weight(&sh->workers.queue, priority,
+                                  strtoul(args[2], NULL, 10)) != 0) {
+            fprintf(out, "Error: Usage: weight <high|normal|low> <weight>\n");
+        }
+    }
+
+    else if (strcmp("quota", cmd) == 0) {
+        if (n_args < 3 || !is_number(args[1]) || !is_number(args[2]) ||
+            work_queue_set_quota(&sh->workers.queue, strtoul(args[1], NULL, 10),
+                                 strtoul(args[2], NULL, 10)) != 0) {
+            fprintf(out, "Error: Usage: quota <tenant> <max_queued_tasks>, tenant from 1 to %d\n",
+                    WORK_QUEUE_MAX_TENANTS - 1);
+        }
+    }
+
+    else if (strcmp("store", cmd) == 0) {
+        if (n_args < 2) {
+            fprintf(out, "Error: Usage: store <name>\n");
+        } else if (sh->mat == NULL) {
+            fprintf(out, "Error: There is no active matrix\n");
+        } else {
+            matrix_t *copy = matrix_copy(sh->mat);
+            if (copy == NULL || session_store(&sh->session, args[1], copy) != 0) {
+                fprintf(out, "Matrix creation failed\n");
+                if (copy != NULL) {
+                    matrix_free(copy);
                 }
             }
         }
+    }
 
-        else if (strcmp("parallel_sum", input) == 0) {
-            unsigned n_threads;
-            scanf("%u", &n_threads); // Read in desired number of threads
-            if (n_threads == 0) {
-                printf("Error: Invalid n_threads argument\n");
-            } else if (mat == NULL) {
-                printf("Error: There is no active matrix\n");
-            } else {
-                long result;
-                if (matrix_parallel_sum(mat, n_threads, &result) == -1) {
-                    printf("Matrix parallel sum failed\n");
-                } else {
-                    printf("%ld\n", result);
+    else if (strcmp("recall", cmd) == 0) {
+        if (n_args < 2) {
+            fprintf(out, "Error: Usage: recall <name>\n");
+        } else if (sh->mat != NULL) {
+            fprintf(out, "Error: You must clear the current matrix first\n");
+        } else {
+            matrix_t *mat = target_matrix(sh, out, args[1], 0);
+            if (mat != NULL) {
+                sh->mat = matrix_copy(mat);
+                if (sh->mat == NULL) {
+                    fprintf(out, "Matrix creation failed\n");
                 }
             }
         }
+    }
 
-        else if (strcmp("parallel_max", input) == 0) {
-            unsigned n_threads;
-            scanf("%u", &n_threads); // Read in desired number of threads
-            if (n_threads == 0) {
-                printf("Error: Invalid n_threads argument\n");
-            } else if (mat == NULL) {
-                printf("Error: There is no active matrix\n");
-            } else {
-                long result;
-                if (matrix_parallel_max(mat, n_threads, &result) == -1) {
-                    printf("Matrix parallel max failed\n");
-                } else {
-                    printf("%ld\n", result);
-                }
+    else if (strcmp("eval", cmd) == 0) {
+        cmd_eval(sh, out, n_args, args);
+    }
+
+    else if (strcmp("fill", cmd) == 0) {
+        // fill [name] <value>
+        if (n_args < 2) {
+            fprintf(out, "Error: Usage: fill [name] <value>\n");
+        } else {
+            matrix_t *mat = target_matrix(sh, out, n_args > 2 ? args[1] : NULL, 1);
+            if (mat != NULL) {
+                matrix_nt_fill(mat->data, atoi(args[n_args > 2 ? 2 : 1]),
+                               (size_t) mat->nrows * mat->ncols);
+                matrix_agg_invalidate(mat);
             }
         }
+    }
 
-        else if (strcmp("parallel_sum_pool", input) == 0) {
-            long result;
-            if (matrix_parallel_sum_pool(mat, &workers, &result) == -1) {
-                printf("Parallel matrix sum failed\n");
-            } else {
-                printf("%ld\n", result);
+    else if (strcmp("byteswap", cmd) == 0) {
+        matrix_t *mat = target_matrix(sh, out, n_args > 1 ? args[1] : NULL, 1);
+        if (mat != NULL) {
+            matrix_nt_bswap(mat->data, mat->data, (size_t) mat->nrows * mat->ncols);
+            matrix_agg_invalidate(mat);
+        }
+    }
+
+    else if (strcmp("nt_tune", cmd) == 0) {
+        cmd_nt_tune(out);
+    }
+
+    else if (strcmp("pool_stats", cmd) == 0) {
+        cmd_pool_stats(sh, out);
+    }
+
+    else if (strcmp("stats", cmd) == 0) {
+        instr_report(out);
+    }
+
+    else if (strcmp("typed_save", cmd) == 0) {
+        cmd_typed_save(sh, out, n_args, args);
+    }
+
+    else if (strcmp("typed_stats", cmd) == 0) {
+        cmd_typed_stats(out, n_args, args);
+    }
+
+    else {
+        fprintf(out, "Unknown command'%s'\n", cmd);
+    }
+    return 0;
+}
+
+// Whether a command only reads matrices, so that running it twice does no harm
+static int reads_only(const char *cmd) {
+    static const char *const names[] = {"print", "get", "sum", "max", "parallel_sum",
+                                        "parallel_max", "parallel_sum_pool", "auto_sum",
+                                        "auto_max"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(names[i], cmd) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Runs a command under a cancellation token of its own, with the shell's
+ * timeout. If it only reads matrices while any are attached, and one of their
+ * segments is republished meanwhile, the command may have read a mix of old
+ * and new elements. Its output is then thrown away and it runs again, unless
+ * it was cancelled.
+ */
+static int run_consistent(shell_t *sh, FILE *out, int n_args, char **args) {
+    cancel_token_t cancel;
+    cancel_token_init(&cancel, sh->timeout_ms);
+    uint64_t version;
+    int n_attached = reads_only(args[0]) ? session_shm_version(&sh->session, &version) : 0;
+    while (n_attached != 0) {
+        if (n_attached == -1) {
+            fprintf(out, "Error: A shared matrix's publisher died mid-write\n");
+            return 0;
+        }
+        char *text;
+        size_t len;
+        FILE *attempt = open_memstream(&text, &len);
+        if (attempt == NULL) {
+            perror("open_memstream");
+            break;
+        }
+        run_command(sh, attempt, &cancel, n_args, args);
+        fclose(attempt);
+        uint64_t before = version;
+        n_attached = session_shm_version(&sh->session, &version);
+        if ((n_attached != -1 && version == before) || cancel_requested(&cancel) != CANCEL_NONE) {
+            fwrite(text, 1, len, out);
+            free(text);
+            return 0;
+        }
+        free(text);
+    }
+    return run_command(sh, out, &cancel, n_args, args);
+}
+
+// Number of matrix elements a 'new' command takes from the lines after it
+static unsigned new_values_needed(int n_args, char **args) {
+    if (strcmp(args[0], "new") != 0) {
+        return 0;
+    }
+    int first = (n_args > 1 && !is_number(args[1])) ? 2 : 1;
+    if (n_args < first + 2) {
+        return 0;
+    }
+    size_t n = (size_t) strtoul(args[first], NULL, 10) * strtoul(args[first + 1], NULL, 10);
+    size_t given = n_args - first - 2;
+    return n > given ? n - given : 0;
+}
+
+// Records the matrices named in the expression of an eval command as read.
+static int declare_expr_names(batch_command_t *cmd) {
+    char name[MAX_INPUT_LEN];
+    for (int a = 2; a < cmd->n_args; a++) {
+        const char *pos = cmd->args[a];
+        while (*pos != '\0') {
+            size_t len = 0;
+            int is_name = isalpha((unsigned char) *pos) || *pos == '_';
+            while (isalnum((unsigned char) pos[len]) || pos[len] == '_') {
+                len++;
+            }
+            if (len == 0) {
+                pos++;
+                continue;
             }
+            if (is_name && len < sizeof(name)) {
+                memcpy(name, pos, len);
+                name[len] = '\0';
+                if (batch_access(cmd, BATCH_MATRIX, name, 0) != 0) {
+                    return -1;
+                }
+            }
+            pos += len;
+        }
+    }
+    return 0;
+}
+
+// Records the matrix a command uses: 'name' if given, otherwise the current one.
+static int declare_target(batch_command_t *cmd, const char *name, int write) {
+    return name != NULL ? batch_access(cmd, BATCH_MATRIX, name, write)
+                        : batch_access(cmd, BATCH_CURRENT, NULL, write);
+}
+
+/*
+ * Records which matrices and files a batch command reads and writes, so that
+ * commands using different ones can run at the same time. Commands that use
+ * the worker pool or look at the whole session run alone.
+ * Returns 0 on success or -1 on error
+ */
+static int declare_state(batch_command_t *cmd) {
+    int n_args = cmd->n_args;
+    char **args = cmd->args;
+    const char *name = NULL;
+    const char *cmd_name = args[0];
+
+    if (strcmp("new", cmd_name) == 0) {
+        name = (n_args > 1 && !is_number(args[1])) ? args[1] : NULL;
+        return declare_target(cmd, name, 1);
+    } else if (strcmp("clear", cmd_name) == 0) {
+        return declare_target(cmd, NULL, 1);
+    } else if (strcmp("print", cmd_name) == 0 || strcmp("sum", cmd_name) == 0 ||
+               strcmp("max", cmd_name) == 0 || strcmp("pages", cmd_name) == 0) {
+        return declare_target(cmd, n_args > 1 ? args[1] : NULL, 0);
+    } else if (strcmp("get", cmd_name) == 0) {
+        return declare_target(cmd, n_args > 3 ? args[1] : NULL, 0);
+    } else if (strcmp("put", cmd_name) == 0) {
+        return declare_target(cmd, n_args > 4 ? args[1] : NULL, 1);
+    } else if (strcmp("byteswap", cmd_name) == 0) {
+        return declare_target(cmd, n_args > 1 ? args[1] : NULL, 1);
+    } else if (strcmp("fill", cmd_name) == 0) {
+        return declare_target(cmd, n_args > 2 ? args[1] : NULL, 1);
+    } else if (strcmp("parallel_sum", cmd_name) == 0 || strcmp("parallel_max", cmd_name) == 0) {
+        return declare_target(cmd, n_args > 2 ? args[2] : NULL, 0);
+    } else if (strcmp("read_text", cmd_name) == 0 && n_args > 1) {
+        return declare_target(cmd, NULL, 1) | batch_access(cmd, BATCH_FILE, args[1], 0);
+    } else if (strcmp("load", cmd_name) == 0 && n_args > 2) {
+        return declare_target(cmd, args[1], 1) | batch_access(cmd, BATCH_FILE, args[2], 0);
+    } else if (strcmp("save", cmd_name) == 0 && n_args > 2) {
+        return declare_target(cmd, args[1], 0) | batch_access(cmd, BATCH_FILE, args[2], 1);
+    } else if (strcmp("free", cmd_name) == 0 && n_args > 1) {
+        return declare_target(cmd, args[1], 1);
+    } else if (strcmp("alias", cmd_name) == 0 && n_args > 2) {
+        return declare_target(cmd, args[1], 1) | declare_target(cmd, args[2], 0);
+    } else if (strcmp("store", cmd_name) == 0 && n_args > 1) {
+        return declare_target(cmd, NULL, 0) | declare_target(cmd, args[1], 1);
+    } else if (strcmp("recall", cmd_name) == 0 && n_args > 1) {
+        return declare_target(cmd, args[1], 0) | declare_target(cmd, NULL, 1);
+    } else if (strcmp("eval", cmd_name) == 0 && n_args > 2) {
+        return declare_target(cmd, args[1], 1) | declare_expr_names(cmd);
+    } else if (strcmp("typed_save", cmd_name) == 0 && n_args > 2) {
+        return declare_target(cmd, n_args > 3 ? args[3] : NULL, 0) |
+               batch_access(cmd, BATCH_FILE, args[2], 1);
+    } else if (strcmp("publish", cmd_name) == 0 && n_args > 1) {
+        return declare_target(cmd, args[1], 0) | batch_access(cmd, BATCH_SEGMENT, args[1], 1);
+    } else if (strcmp("attach", cmd_name) == 0 && n_args > 1) {
+        return declare_target(cmd, args[1], 1) | batch_access(cmd, BATCH_SEGMENT, args[1], 0);
+    } else if (strcmp("unpublish", cmd_name) == 0 && n_args > 1) {
+        return batch_access(cmd, BATCH_SEGMENT, args[1], 1);
+    } else if ((strcmp("typed_stats", cmd_name) == 0 || strcmp("zone_stats", cmd_name) == 0 ||
+                strcmp("zone_count", cmd_name) == 0) && n_args > 1) {
+        return batch_access(cmd, BATCH_FILE, args[1], 0);
+    } else if (strcmp("read_text", cmd_name) == 0 || strcmp("load", cmd_name) == 0 ||
+               strcmp("save", cmd_name) == 0 || strcmp("free", cmd_name) == 0 ||
+               strcmp("alias", cmd_name) == 0 || strcmp("store", cmd_name) == 0 ||
+               strcmp("recall", cmd_name) == 0 || strcmp("eval", cmd_name) == 0 ||
+               strcmp("typed_save", cmd_name) == 0 || strcmp("typed_stats", cmd_name) == 0 ||
+               strcmp("zone_stats", cmd_name) == 0 || strcmp("zone_count", cmd_name) == 0 ||
+               strcmp("publish", cmd_name) == 0 || strcmp("attach", cmd_name) == 0 ||
+               strcmp("unpublish", cmd_name) == 0) {
+        // Too few arguments, so the command only prints its usage.
+        return 0;
+    }
+    // parallel_sum_pool, auto_sum, auto_max, auto_plan, calibrate, gen, stream_sum,
+    // stream_max, list, budget, schedule, timeout, priority, weight, quota, stats,
+    // nt_tune, exit and unknown commands.
+    // save_async forks, which must not happen while other threads run commands, and
+    // save_wait waits for it.
+    cmd->barrier = 1;
+    return 0;
+}
+
+static int run_batch_command(void *ctx, int n_args, char **args, FILE *out) {
+    return run_consistent(ctx, out, n_args, args);
+}
+
+/*
+ * Runs a whole script, with independent commands at the same time
+ * Returns 0 on success or -1 on error
+ */
+static int run_script(shell_t *sh, const char *file_name) {
+    FILE *in = strcmp(file_name, "-") == 0 ? stdin : fopen(file_name, "r");
+    if (in == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    batch_script_t script;
+    int ret_val = batch_read(&script, in, new_values_needed);
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (ret_val != 0) {
+        printf("Error: Failed to read script '%s'\n", file_name);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < script.n_commands && ret_val == 0; i++) {
+        ret_val = declare_state(&script.commands[i]);
+    }
+    if (ret_val == 0) {
+        ret_val = batch_run(&script, &sh->session, &sh->workers, run_batch_command, sh, stdout);
+    }
+    snapshot_poll(&sh->saves, stdout, 1);
+    if (ret_val != 0) {
+        printf("Error: Failed to run script '%s'\n", file_name);
+    }
+    batch_free(&script);
+    return ret_val;
+}
+
+int main(int argc, char *argv[]) {
+    instr_report_at_exit_from_env();
+    // A command name instead of a worker count selects the non-interactive mode.
+    if (argc > 1 && !is_number(argv[1])) {
+        return cli_main(argc - 1, argv + 1);
+    }
+    if (argc < 3) {
+        printf("Usage: %s <num_workers> <queue_size> [script_file]\n", argv[0]);
+        printf("       %s <sum|max|stats> [--threads N] [--format text|json|binary] <file>...\n",
+               argv[0]);
+        printf("       %s serve\n", argv[0]);
+        return 0;
+    }
+    int num_workers = atoi(argv[1]);
+    if (num_workers <= 0) {
+        printf("Error: Number of workers must be positive\n");
+        return 1;
+    }
+    int queue_size = atoi(argv[2]);
+    if (queue_size <= 0) {
+        printf("Error: Work queue size must be positive\n");
+        return 1;
+    }
+    // Memory budget for named matrices, in megabytes. Unlimited by default.
+    size_t mem_budget = 0;
+    const char *budget_env = getenv("SMOCK_MEM_BUDGET_MB");
+    if (budget_env != NULL) {
+        mem_budget = strtoul(budget_env, NULL, 10) << 20;
+    }
+
+    shell_t sh;
+    sh.mat = NULL;
+    sh.schedule = MATRIX_SCHED_STATIC;
+    sh.timeout_ms = 0;
+    sh.cls = TASK_CLASS_DEFAULT;
+    sh.in = stdin;
+    sh.saves.head = NULL;
+    if (session_init(&sh.session, mem_budget) == -1) {
+        return 1;
+    }
+    if (worker_pool_init(&sh.workers, num_workers, queue_size) == -1) {
+        session_free(&sh.session);
+        return 1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_interrupt;
+    action.sa_flags = SA_RESTART; // Reads at the prompt carry on after Ctrl-C
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGINT, &action, NULL) == -1) {
+        perror("sigaction");
+    }
+
+    // With a script ("-" for standard input), run it without prompting.
+    if (argc > 3) {
+        int ret_val = run_script(&sh, argv[3]);
+        if (sh.mat != NULL) {
+            matrix_free(sh.mat);
         }
+        session_free(&sh.session);
+        worker_pool_free(&sh.workers);
+        return ret_val == 0 ? 0 : 1;
+    }
+
+    printf("SMOCK - Simple Matrix Operations for C Knowledge\n");
+    printf("Commands:\n");
+    printf("  new [name] <nrows> <ncols>: Create new <nrows> x <ncols> matrix\n");
+    printf("  gen [name] <nrows> <ncols> <dist> <seed>: Create a random matrix on the worker\n"
+           "    pool, <dist> being uniform[:lo:hi], normal[:mean:stddev], sparse[:density]\n"
+           "    or const:<value>\n");
+    printf("  put [name] <i> <j> <value>: Change entry (i,j) of a matrix\n");
+    printf("  get [name] <i> <j>: Retrieve entry (i,j) of a matrix\n");
+    printf("  print [name]: Print out entries in a matrix\n");
+    printf("  sum [name]: Compute and print out sum of all elements in a matrix\n");
+    printf("  max [name]: Compute and print out maximum of all elements in a matrix\n");
+    printf("  pages [name]: Show how much of a matrix is backed by huge pages\n");
+    printf("  clear: Delete current matrix\n");
+    printf("  read_text <file_name>: Read a matrix from a text file\n");
+    printf("  parallel_sum <n_threads> [name]: Compute matrix sum with multiple threads\n");
+    printf("  parallel_max <n_threads> [name]: Compute matrix max with multiple threads\n");
+    printf("  schedule [static|dynamic|guided]: Show or set how parallel_sum and parallel_max\n"
+           "    divide a matrix: fixed runs of rows, or chunks threads take from a shared cursor\n");
+    printf("  parallel_sum_pool [name]: Compute matrix sum with pre-existing worker threads\n");
+    printf("  priority [high|normal|low] [tenant]: Show or set the worker pool lane and tenant\n"
+           "    of this shell's parallel_sum_pool and auto_* tasks\n");
+    printf("  weight <high|normal|low> <weight>: Set a lane's share of the worker pool\n");
+    printf("  quota <tenant> <max_queued_tasks>: Limit a tenant's queued tasks, 0 for no limit\n");
+    printf("  timeout [milliseconds]: Show or set how long parallel_* and auto_* queries may\n"
+           "    run before they are stopped, 0 for no limit. Ctrl-C stops the running query.\n");
+    printf("  auto_sum [name]: Compute matrix sum on the backend predicted to be fastest\n");
+    printf("  auto_max [name]: Compute matrix max on the backend predicted to be fastest\n");
+    printf("  auto_plan [name]: Show each backend's predicted time and the one auto_* uses\n");
+    printf("  calibrate: Time every backend again and save the profile auto_* chooses from\n");
+    printf("  stream_sum <file_name>: Sum a binary or .txt file in chunks, without loading it\n");
+    printf("  stream_max <file_name>: Maximum of a binary or .txt file, without loading it\n");
+    printf("  load <name> <file_name>: Load matrix <name> from a binary or .txt file\n");
+    printf("  save <name> <file_name> [zones]: Write matrix <name> to a binary or .txt file,\n"
+           "    with per-block min/max/sum when 'zones' is given\n");
+    printf("  free <name>: Delete matrix <name>\n");
+    printf("  alias <new_name> <name>: Share matrix <name> under a second name\n");
+    printf("  list: List named matrices\n");
+    printf("  budget <megabytes>: Evict reloadable matrices above this much memory\n");
+    printf("  store <name>: Save a copy of the current matrix under <name>\n");
+    printf("  recall <name>: Make a copy of matrix <name> the current matrix\n");
+    printf("  eval <name> <expr>: Compute e.g. '(A + B) * 3 clamp 0..255' into <name>\n");
+    printf("  fill [name] <value>: Set every element of a matrix to <value>\n");
+    printf("  byteswap [name]: Reverse the byte order of every element of a matrix\n");
+    printf("  typed_save <type> <file_name> [name]: Write a matrix as i8/i16/i32/i64/f32/f64\n");
+    printf("  typed_stats <file_name> [n_threads]: Print type, sum and max of a typed file\n");
+    printf("  save_async [name] <file_name>: Write a snapshot of a matrix in the background\n");
+    printf("  save_wait: Wait for background saves to finish\n");
+    printf("  publish <name>: Share matrix <name> with other processes through shared memory\n");
+    printf("  attach <name>: Use the shared matrix <name> read-only, without copying it\n");
+    printf("  unpublish <name>: Remove the shared matrix <name>\n");
+    printf("  zone_stats <file_name>: Print sum, min and max from a binary file's zone map\n");
+    printf("  zone_count <file_name> <lo> <hi>: Count and sum elements of a binary file in\n"
+           "    [lo, hi], reading only blocks its zone map cannot answer\n");
+    printf("  pool_stats: Print worker pool queue depth and per-worker busy/idle time\n");
+    printf("  nt_tune: Time the streaming write kernels' prefetch distances again\n");
+    printf("  stats: Print command and kernel latencies (built with -DSMOCK_INSTRUMENT)\n");
+    printf("  exit: Quit this program\n");
 
-        else {
-            printf("Unknown command'%s'\n", input);
+    char line[MAX_LINE_LEN];
+    while (1) { // Keep reading until we break out of loop
+        snapshot_poll(&sh.saves, stdout, 0);
+        printf("%s", PROMPT);
+        fflush(stdout);
+
+        at_prompt = 1;
+        char *got = fgets(line, sizeof(line), sh.in);
+        at_prompt = 0;
+        if (got == NULL) {
+            printf("\n");
+            break;
         }
+
+        char *args[MAX_ARGS];
+        int n_args = split_line(line, args, MAX_ARGS);
+        if (n_args == 0) {
+            continue;
+        }
+        INSTR_START(start);
+        session_next_command(&sh.session);
+        if (run_consistent(&sh, stdout, n_args, args) != 0) {
+            break;
+        }
+        INSTR_RECORD_COMMAND(args[0], start);
     }
 
-    if (mat != NULL) {
-        matrix_free(mat);
+    snapshot_poll(&sh.saves, stdout, 1);
+    if (sh.mat != NULL) {
+        matrix_free(sh.mat);
     }
-    worker_pool_free(&workers);
+    session_free(&sh.session);
+    worker_pool_free(&sh.workers);
     return 0;
 }
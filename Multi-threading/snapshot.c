@@ -0,0 +1,84 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "snapshot.h"
+
+// Runs in the child: writes the snapshot and exits with 0 on success.
+static void write_snapshot(const matrix_t *mat, const char *file_name) {
+    char tmp_name[4096];
+    size_t len = strlen(file_name);
+    int is_text = len >= 4 && strcmp(file_name + len - 4, ".txt") == 0;
+    if (snprintf(tmp_name, sizeof(tmp_name), "%s.tmp.%d", file_name, (int) getpid()) >=
+        (int) sizeof(tmp_name)) {
+        _exit(1);
+    }
+    int ret = is_text ? matrix_write_text(mat, tmp_name) : matrix_write_bin(mat, tmp_name);
+    if (ret != 0 || rename(tmp_name, file_name) != 0) {
+        unlink(tmp_name);
+        _exit(1);
+    }
+    // _exit so the child does not flush stdio output copied from the parent.
+    _exit(0);
+}
+
+int snapshot_save(snapshot_list_t *list, const matrix_t *mat, const char *file_name) {
+    snapshot_t *save = malloc(sizeof(snapshot_t));
+    if (save == NULL) {
+        return -1;
+    }
+    save->file_name = strdup(file_name);
+    if (save->file_name == NULL) {
+        free(save);
+        return -1;
+    }
+
+    // Output still buffered would otherwise be printed by the parent only
+    // after lines the child wrote, or be lost if the child exited without it.
+    fflush(NULL);
+    save->pid = fork();
+    if (save->pid == -1) {
+        perror("fork");
+        free(save->file_name);
+        free(save);
+        return -1;
+    } else if (save->pid == 0) {
+        write_snapshot(mat, file_name);
+    }
+    // Appended, so saves finishing together are reported in the order they started.
+    snapshot_t **link = &list->head;
+    while (*link != NULL) {
+        link = &(*link)->next;
+    }
+    save->next = NULL;
+    *link = save;
+    return 0;
+}
+
+unsigned snapshot_poll(snapshot_list_t *list, FILE *out, int wait) {
+    unsigned running = 0;
+    snapshot_t **link = &list->head;
+    while (*link != NULL) {
+        snapshot_t *save = *link;
+        int status;
+        pid_t done = waitpid(save->pid, &status, wait ? 0 : WNOHANG);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        } else if (done == 0) {
+            running++;
+            link = &save->next;
+            continue;
+        }
+        if (done == save->pid && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            fprintf(out, "Background save to '%s' finished\n", save->file_name);
+        } else {
+            fprintf(out, "Failed to write matrix to '%s'\n", save->file_name);
+        }
+        *link = save->next;
+        free(save->file_name);
+        free(save);
+    }
+    return running;
+}
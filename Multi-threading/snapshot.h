@@ -0,0 +1,57 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "matrix.h"
+
+/*
+ * Background saves. snapshot_save forks, and the child writes the matrix
+ * while the parent goes on with its next command. The child sees memory as
+ * it was at the fork, and pages the parent modifies afterwards are copied by
+ * the kernel on first write, so the file holds a consistent snapshot without
+ * the matrix being copied up front.
+ *
+ * The child writes to a temporary file next to the target and renames it
+ * once complete, so readers of the target see either the old file or the
+ * whole new one.
+ *
+ * Forking copies only the calling thread, so no other thread may be
+ * allocating or holding a lock when snapshot_save is called.
+ */
+
+/*
+ * A save running in a child process
+ *   pid: The child writing the file
+ *   file_name: The file being written
+ *   next: Next save started after this one
+ */
+typedef struct snapshot {
+    pid_t pid;
+    char *file_name;
+    struct snapshot *next;
+} snapshot_t;
+
+/*
+ * Saves started and not yet reported
+ *   head: Earliest save still listed, or NULL if there are none
+ */
+typedef struct {
+    snapshot_t *head;
+} snapshot_list_t;
+
+/*
+ * Start writing 'mat' to 'file_name' in the background. Files ending in
+ * ".txt" are written as text, anything else as binary.
+ * Returns 0 if the save was started or -1 on error
+ */
+int snapshot_save(snapshot_list_t *list, const matrix_t *mat, const char *file_name);
+
+/*
+ * Report every finished save to 'out' and forget it
+ *   wait: Whether to wait for running saves to finish as well
+ * Returns the number of saves still running
+ */
+unsigned snapshot_poll(snapshot_list_t *list, FILE *out, int wait);
+
+#endif // SNAPSHOT_H
@@ -18,6 +18,7 @@ int task_group_init(task_group_t *group, unsigned n_tasks) {
 
     group->n_tasks = n_tasks;
     group->completed_tasks = 0;
+    group->cls = TASK_CLASS_DEFAULT;
     return 0;
 }
 
@@ -87,3 +88,18 @@ int task_group_free(task_group_t *group) {
 
     return 0;
 }
+
+static const char *const priority_names[] = {"high", "normal", "low"};
+
+int task_priority_parse(const char *name) {
+    for (int p = TASK_PRIORITY_HIGH; p <= TASK_PRIORITY_LOW; p++) {
+        if (strcmp(name, priority_names[p]) == 0) {
+            return p;
+        }
+    }
+    return -1;
+}
+
+const char *task_priority_name(task_priority_t priority) {
+    return priority_names[priority];
+}
@@ -3,18 +3,47 @@
 
 #include <pthread.h>
 
+/*
+ * Priority classes of queued tasks. Workers take tasks from the classes in
+ * proportion to their weights (see work_queue_set_weight), so a lower class
+ * is slowed down by a busy higher one but never stopped.
+ */
+typedef enum {
+    TASK_PRIORITY_HIGH,
+    TASK_PRIORITY_NORMAL,
+    TASK_PRIORITY_LOW
+} task_priority_t;
+
+#define TASK_N_PRIORITIES 3
+
+/*
+ * How the tasks of one query are queued
+ *   priority: Class the tasks are queued in
+ *   tenant: Whose quota the tasks count against (see work_queue_set_quota),
+ *     or 0 for none
+ */
+typedef struct {
+    task_priority_t priority;
+    unsigned tenant;
+} task_class_t;
+
+#define TASK_CLASS_DEFAULT ((task_class_t) {TASK_PRIORITY_NORMAL, 0})
+
 /*
  * Struct representing a specific task group instance
  *  n_tasks: The number of tasks in the group
  *   completed_tasks: The number of completed tasks, between 0 and n_tasks
  *   mutex: Used for synchronization when checking/modifying task group state
  *   all_tasks_done: Used for a thread to wait until all tasks marked as complete
+ *   cls: Class the group's tasks are queued with, TASK_CLASS_DEFAULT after
+ *     task_group_init
  */
 typedef struct {
     unsigned n_tasks;
     unsigned completed_tasks;
     pthread_mutex_t mutex;
     pthread_cond_t all_tasks_done;
+    task_class_t cls;
 } task_group_t;
 
 /*
@@ -45,4 +74,15 @@ int task_group_wait(task_group_t *group);
  */
 int task_group_free(task_group_t *group);
 
+/*
+ * Parse "high", "normal" or "low"
+ * Returns the priority, or -1 if 'name' is none of them
+ */
+int task_priority_parse(const char *name);
+
+/*
+ * Name of a priority, e.g. "high"
+ */
+const char *task_priority_name(task_priority_t priority);
+
 #endif // TASK_GROUP_H
@@ -1,9 +1,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "instrument.h"
 #include "matrix.h"
 #include "work_queue.h"
 
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Updates the high-water mark and samples the depth. Called with mutex held.
+static void record_depth(work_queue_t *queue) {
+    work_queue_stats_t *stats = &queue->stats;
+    if ((unsigned) queue->buf_len > stats->high_water) {
+        stats->high_water = queue->buf_len;
+    }
+    uint64_t now = now_ns() - queue->created_ns;
+    if (stats->n_samples > 0) {
+        unsigned last = (queue->next_sample + WORK_QUEUE_MAX_SAMPLES - 1) % WORK_QUEUE_MAX_SAMPLES;
+        if (now - stats->samples[last].time_ns < WORK_QUEUE_SAMPLE_INTERVAL_NS) {
+            return;
+        }
+    }
+    stats->samples[queue->next_sample].time_ns = now;
+    stats->samples[queue->next_sample].depth = queue->buf_len;
+    queue->next_sample = (queue->next_sample + 1) % WORK_QUEUE_MAX_SAMPLES;
+    if (stats->n_samples < WORK_QUEUE_MAX_SAMPLES) {
+        stats->n_samples++;
+    }
+}
+
+// Whether a put of an item of class 'cls' must wait. Called with mutex held.
+static int put_must_wait(const work_queue_t *queue, const task_class_t *cls) {
+    unsigned quota = queue->tenant_quota[cls->tenant];
+    return queue->lanes[cls->priority].buf_len >= queue->buf_capacity ||
+           (quota != 0 && queue->tenant_queued[cls->tenant] >= quota);
+}
+
+// The lane with items whose pass is lowest, ties going to the higher
+// priority. Called with mutex held and at least one item queued.
+static work_queue_lane_t *next_lane(work_queue_t *queue) {
+    work_queue_lane_t *next = NULL;
+    for (int p = 0; p < TASK_N_PRIORITIES; p++) {
+        work_queue_lane_t *lane = &queue->lanes[p];
+        if (lane->buf_len > 0 && (next == NULL || lane->pass < next->pass)) {
+            next = lane;
+        }
+    }
+    return next;
+}
+
 int work_queue_init(work_queue_t *queue, unsigned size) {
     if (size == 0) {
         return -1;
@@ -27,8 +76,9 @@ int work_queue_init(work_queue_t *queue, unsigned size) {
         pthread_cond_destroy(&queue->item_available);
     }
 
-    queue->buffer = malloc(size * sizeof(work_queue_item_t));
-    if (queue->buffer == NULL) {
+    // One allocation holds the slots of every lane.
+    work_queue_item_t *buffer = malloc(TASK_N_PRIORITIES * size * sizeof(work_queue_item_t));
+    if (buffer == NULL) {
         perror("malloc");
         pthread_mutex_destroy(&queue->mutex);
         pthread_cond_destroy(&queue->item_available);
@@ -36,16 +86,30 @@ int work_queue_init(work_queue_t *queue, unsigned size) {
         return -1;
     }
 
-    queue->buf_read_idx = 0;
-    queue->buf_write_idx = 0;
+    static const unsigned weights[TASK_N_PRIORITIES] = WORK_QUEUE_DEFAULT_WEIGHTS;
+    for (int p = 0; p < TASK_N_PRIORITIES; p++) {
+        work_queue_lane_t *lane = &queue->lanes[p];
+        lane->buffer = buffer + (size_t) p * size;
+        lane->buf_read_idx = 0;
+        lane->buf_write_idx = 0;
+        lane->buf_len = 0;
+        lane->weight = weights[p];
+        lane->pass = 0;
+    }
     queue->buf_len = 0;
     queue->buf_capacity = size;
+    queue->vtime = 0;
+    memset(queue->tenant_quota, 0, sizeof(queue->tenant_quota));
+    memset(queue->tenant_queued, 0, sizeof(queue->tenant_queued));
     queue->shutdown = 0;
+    memset(&queue->stats, 0, sizeof(queue->stats));
+    queue->created_ns = now_ns();
+    queue->next_sample = 0;
     return 0;
 }
 
 int work_queue_free(work_queue_t *queue) {
-    free(queue->buffer);
+    free(queue->lanes[0].buffer);
     int ret_val = 0;
     int err;
     err = pthread_mutex_destroy(&queue->mutex);
@@ -70,6 +134,11 @@ int work_queue_free(work_queue_t *queue) {
 }
 
 int work_queue_put(work_queue_t *queue, work_queue_item_t *item) {
+    const task_class_t *cls = &item->cls;
+    if ((unsigned) cls->priority >= TASK_N_PRIORITIES || cls->tenant >= WORK_QUEUE_MAX_TENANTS) {
+        fprintf(stderr, "work_queue_put: Invalid priority or tenant\n");
+        return -1;
+    }
     int err = pthread_mutex_lock(&queue->mutex);
     if (err != 0) {
         fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(err));
@@ -86,7 +155,16 @@ int work_queue_put(work_queue_t *queue, work_queue_item_t *item) {
     }
 
 
-    while(queue->buf_len >= queue->buf_capacity) {
+    work_queue_lane_t *lane = &queue->lanes[cls->priority];
+    uint64_t block_start = 0;
+    if (put_must_wait(queue, cls)) {
+        block_start = now_ns();
+        queue->stats.put_blocks++;
+        if (lane->buf_len < queue->buf_capacity) {
+            queue->stats.quota_blocks++;
+        }
+    }
+    while (put_must_wait(queue, cls)) {
         err = pthread_cond_wait(&queue->space_available,&queue->mutex);
         if (err != 0) {
             fprintf(stderr, "pthread_cond_wait: %s\n", strerror(err));
@@ -104,13 +182,26 @@ int work_queue_put(work_queue_t *queue, work_queue_item_t *item) {
             return 1;
         }
     }
-    queue->buffer[queue->buf_write_idx] = *item;
+    if (block_start != 0) {
+        queue->stats.put_blocked_ns += now_ns() - block_start;
+    }
+    if (lane->buf_len == 0 && lane->pass < queue->vtime) {
+        lane->pass = queue->vtime; // No credit for the time the lane sat empty
+    }
+    lane->buffer[lane->buf_write_idx] = *item;
+#ifdef SMOCK_INSTRUMENT
+    lane->buffer[lane->buf_write_idx].enqueued_ns = instr_now();
+#endif
+    lane->buf_len = lane->buf_len + 1;
+    lane->buf_write_idx = lane->buf_write_idx + 1;
     queue->buf_len = queue->buf_len + 1;
-    queue->buf_write_idx = queue->buf_write_idx + 1;
+    queue->tenant_queued[cls->tenant]++;
+    queue->stats.puts++;
+    record_depth(queue);
 
     // If next index is outside of queue, wrap around to beginning.
-    if (queue->buf_write_idx >= queue->buf_capacity) {
-        queue->buf_write_idx = 0;
+    if (lane->buf_write_idx >= queue->buf_capacity) {
+        lane->buf_write_idx = 0;
     }
 
     // Item was added to the queue, so an item is now available.
@@ -129,6 +220,11 @@ int work_queue_put(work_queue_t *queue, work_queue_item_t *item) {
 }
 
 int work_queue_get(work_queue_t *queue, work_queue_item_t *dest) {
+    return work_queue_get_counted(queue, dest, NULL);
+}
+
+int work_queue_get_counted(work_queue_t *queue, work_queue_item_t *dest,
+                           unsigned long *wakeups) {
     int err = pthread_mutex_lock(&queue->mutex);
     if (err != 0) {
         fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(err));
@@ -151,6 +247,9 @@ int work_queue_get(work_queue_t *queue, work_queue_item_t *dest) {
             fprintf(stderr, "pthread_cond_wait: %s\n", strerror(err));
             return -1;
         }
+        if (wakeups != NULL) {
+            (*wakeups)++;
+        }
 
         //Need to make sure queue wasn't put in shutdown while thread waited.
         if (queue->shutdown != 0) {
@@ -163,21 +262,28 @@ int work_queue_get(work_queue_t *queue, work_queue_item_t *dest) {
         }
     }
 
-    
-    *dest = queue->buffer[queue->buf_read_idx];
+    work_queue_lane_t *lane = next_lane(queue);
+    *dest = lane->buffer[lane->buf_read_idx];
+    lane->buf_len = lane->buf_len - 1;
+    lane->buf_read_idx = lane->buf_read_idx + 1;
     queue->buf_len = queue->buf_len - 1;
-    queue->buf_read_idx = queue->buf_read_idx + 1;
+    queue->tenant_queued[dest->cls.tenant]--;
+    queue->vtime = lane->pass;
+    lane->pass += WORK_QUEUE_STRIDE / lane->weight;
+    queue->stats.lane_gets[lane - queue->lanes]++;
+    record_depth(queue);
 
     // If next index is outside of queue, wrap around to beginning.
-    if (queue->buf_read_idx >= queue->buf_capacity) {
-        queue->buf_read_idx = 0;
+    if (lane->buf_read_idx >= queue->buf_capacity) {
+        lane->buf_read_idx = 0;
     }
 
-    // Item was removed from queue, so space is now available.
-    err = pthread_cond_signal(&queue->space_available);
+    // Item was removed from queue, so space is now available. Waiting puts
+    // may be for other lanes or tenants than this item's, so wake them all.
+    err = pthread_cond_broadcast(&queue->space_available);
     if (err != 0) {
         pthread_mutex_unlock(&queue->mutex);
-        fprintf(stderr, "pthread_cond_signal: %s\n", strerror(err));
+        fprintf(stderr, "pthread_cond_broadcast: %s\n", strerror(err));
         return -1;
     }
 
@@ -190,15 +296,85 @@ int work_queue_get(work_queue_t *queue, work_queue_item_t *dest) {
     return 0;
 }
 
-int work_queue_shut_down(work_queue_t *queue) {
-    // No lock; want to update shutdown value before thread with mutex finishes.
-    queue->shutdown = 1;
+int work_queue_get_stats(work_queue_t *queue, work_queue_stats_t *stats) {
+    int err = pthread_mutex_lock(&queue->mutex);
+    if (err != 0) {
+        fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(err));
+        return -1;
+    }
+
+    *stats = queue->stats;
+    stats->capacity = TASK_N_PRIORITIES * queue->buf_capacity;
+    stats->depth = queue->buf_len;
+    for (int p = 0; p < TASK_N_PRIORITIES; p++) {
+        stats->lane_depth[p] = queue->lanes[p].buf_len;
+        stats->lane_weight[p] = queue->lanes[p].weight;
+    }
+    // Unroll the ring so the oldest sample comes first.
+    unsigned oldest = stats->n_samples < WORK_QUEUE_MAX_SAMPLES ? 0 : queue->next_sample;
+    for (unsigned i = 0; i < stats->n_samples; i++) {
+        stats->samples[i] = queue->stats.samples[(oldest + i) % WORK_QUEUE_MAX_SAMPLES];
+    }
 
+    err = pthread_mutex_unlock(&queue->mutex);
+    if (err != 0) {
+        fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+int work_queue_set_weight(work_queue_t *queue, task_priority_t priority, unsigned weight) {
+    if ((unsigned) priority >= TASK_N_PRIORITIES || weight == 0 || weight > WORK_QUEUE_STRIDE) {
+        return -1;
+    }
+    int err = pthread_mutex_lock(&queue->mutex);
+    if (err != 0) {
+        fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(err));
+        return -1;
+    }
+    queue->lanes[priority].weight = weight;
+    err = pthread_mutex_unlock(&queue->mutex);
+    if (err != 0) {
+        fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+int work_queue_set_quota(work_queue_t *queue, unsigned tenant, unsigned max_items) {
+    if (tenant == 0 || tenant >= WORK_QUEUE_MAX_TENANTS) {
+        return -1;
+    }
     int err = pthread_mutex_lock(&queue->mutex);
     if (err != 0) {
         fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(err));
         return -1;
     }
+    queue->tenant_quota[tenant] = max_items;
+    // A raised quota may let waiting puts through.
+    err = pthread_cond_broadcast(&queue->space_available);
+    if (err != 0) {
+        pthread_mutex_unlock(&queue->mutex);
+        fprintf(stderr, "pthread_cond_broadcast: %s\n", strerror(err));
+        return -1;
+    }
+    err = pthread_mutex_unlock(&queue->mutex);
+    if (err != 0) {
+        fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+int work_queue_shut_down(work_queue_t *queue) {
+    int err = pthread_mutex_lock(&queue->mutex);
+    if (err != 0) {
+        fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(err));
+        return -1;
+    }
+    // Waiting threads check this under the mutex, so set it there too.
+    queue->shutdown = 1;
 
     //Want all waiting threads to be notified of shutdown queue.
     err = pthread_cond_broadcast(&queue->item_available);
@@ -2,53 +2,154 @@
 #define WORK_QUEUE_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include "matrix.h"
 #include "task_group.h"
 
 /*
- * Represents one unit of work in the queue
+ * Represents one unit of work in the queue: either a function to call or one
+ * row of a matrix to add up or take the maximum of
+ *   cls: Priority class and tenant the item is queued under
+ *   func, arg: If func is not NULL, the worker calls func(arg) and ignores
+ *     the remaining fields
  *   mat: The matrix to work on
  *   row_num: Which row in the matrix to work on
+ *   is_max: Whether the row's maximum, rather than its sum, is merged into
+ *     the destination
  *   destination: Pointer to the value to update with results of work
  *   dest_mutex: Synchronizes access to the destination memory location
  *   task_group: Task group to notify when work is done
+ *   cancel: If cancelled by the time a worker takes the row, the row is
+ *     skipped and '*stopped' set instead. May be NULL.
+ *   enqueued_ns: When the item was put in the queue (instrumented builds only)
  */
 typedef struct {
+    task_class_t cls;
+    void (*func)(void *arg);
+    void *arg;
     const matrix_t *mat;
     unsigned row_num;
+    int is_max;
     long *destination;
     pthread_mutex_t *dest_mutex;
     task_group_t *task_group;
+    const cancel_token_t *cancel;
+    int *stopped;
+#ifdef SMOCK_INSTRUMENT
+    uint64_t enqueued_ns;
+#endif
 } work_queue_item_t;
 
+// Tenants are numbered from 1 up to WORK_QUEUE_MAX_TENANTS - 1.
+#define WORK_QUEUE_MAX_TENANTS 16
+// Default shares of the high, normal and low priority lanes
+#define WORK_QUEUE_DEFAULT_WEIGHTS {16, 4, 1}
+
+// Number of depth samples a queue keeps; older ones are overwritten.
+#define WORK_QUEUE_MAX_SAMPLES 64
+// Minimum time between two depth samples
+#define WORK_QUEUE_SAMPLE_INTERVAL_NS 1000000
+
+/*
+ * Queue depth at one point in time
+ *   time_ns: Nanoseconds since the queue was initialized
+ *   depth: Number of items in the queue
+ */
+typedef struct {
+    uint64_t time_ns;
+    unsigned depth;
+} work_queue_sample_t;
+
+/*
+ * Snapshot of a work queue's telemetry
+ *   capacity, depth: Number of slots in all lanes and of items currently queued
+ *   high_water: Largest number of items ever queued at once
+ *   puts: Number of items added
+ *   put_blocks: Number of puts that had to wait for a free slot
+ *   put_blocked_ns: Total time puts spent waiting for a free slot
+ *   quota_blocks: Number of those puts that waited for their tenant's quota
+ *   lane_depth, lane_gets, lane_weight: Items queued in, items taken from and
+ *     weight of each priority lane
+ *   n_samples: Number of valid entries in 'samples'
+ *   samples: Depth sampled at most once per WORK_QUEUE_SAMPLE_INTERVAL_NS
+ *     when items are added or removed, oldest first
+ */
+typedef struct {
+    unsigned capacity;
+    unsigned depth;
+    unsigned high_water;
+    unsigned long puts;
+    unsigned long put_blocks;
+    uint64_t put_blocked_ns;
+    unsigned long quota_blocks;
+    unsigned lane_depth[TASK_N_PRIORITIES];
+    unsigned long lane_gets[TASK_N_PRIORITIES];
+    unsigned lane_weight[TASK_N_PRIORITIES];
+    unsigned n_samples;
+    work_queue_sample_t samples[WORK_QUEUE_MAX_SAMPLES];
+} work_queue_stats_t;
+
 /*
- * Represents a work queue instance.
+ * The items of one priority class
  *   buffer: A circular buffer for storing work items
  *   buf_read_idx: Position in buffer of next occupied slot to remove from
  *   buf_write_idx: Position in buffer of next empty slot to store to
  *   buf_len: The number of occupied slots in the buffer
- *   buf_capacity: The total number of slots in the buffer (stays constant)
+ *   weight: Share of the items taken from the queue that come from this lane
+ *   pass: Virtual time of the lane's next item. Taking an item advances it by
+ *     WORK_QUEUE_STRIDE / weight, and the lane with the lowest pass goes next.
+ */
+typedef struct {
+    work_queue_item_t *buffer;
+    int buf_read_idx;
+    int buf_write_idx;
+    int buf_len;
+    unsigned weight;
+    uint64_t pass;
+} work_queue_lane_t;
+
+#define WORK_QUEUE_STRIDE (1u << 20)
+
+/*
+ * Represents a work queue instance. Items wait in one lane per priority
+ * class, and workers take them from the lanes in proportion to the lanes'
+ * weights (stride scheduling), so a flood of low priority items delays a
+ * high priority one by at most a few items.
+ *   lanes: The queued items of each priority class
+ *   buf_len: The number of items in all lanes
+ *   buf_capacity: The number of slots in each lane (stays constant)
+ *   vtime: Pass of the last lane taken from. A lane that was empty starts
+ *     again from here, so it cannot save up a burst while idle.
+ *   tenant_quota: Most items each tenant may have queued at once, 0 for no limit
+ *   tenant_queued: Items each tenant has queued
  *   shutdown: Indicates whether or not work queue is shut down
  *   mutex: Synchronizes access to the work queue
  *   item_avaialble: Used for threads to wait until new work is available
  *   space_avaiable: Used for threads to wait until an open slot is available
+ *   stats: Telemetry, protected by mutex. Its depth, capacity and samples
+ *     fields are filled in by work_queue_get_stats.
+ *   created_ns, next_sample: Creation time and next slot of the sample ring
  */
 typedef struct {
-    work_queue_item_t *buffer;
-    int buf_read_idx;
-    int buf_write_idx;
+    work_queue_lane_t lanes[TASK_N_PRIORITIES];
     int buf_len;
     int buf_capacity;
+    uint64_t vtime;
+    unsigned tenant_quota[WORK_QUEUE_MAX_TENANTS];
+    unsigned tenant_queued[WORK_QUEUE_MAX_TENANTS];
     int shutdown;
     pthread_mutex_t mutex;
     pthread_cond_t item_available;
     pthread_cond_t space_available;
+    work_queue_stats_t stats;
+    uint64_t created_ns;
+    unsigned next_sample;
 } work_queue_t;
 
 /*
  * Initialize a new work queue
  *   queue: The work queue instance to initialize
- *   size: The number of slots in the queue (its capacity)
+ *   size: The number of slots in each priority lane
  * Returns 0 on success or -1 on error
  */
 int work_queue_init(work_queue_t *queue, unsigned size);
@@ -62,7 +163,7 @@ int work_queue_free(work_queue_t *queue);
 
 /*
  * Add a new item to the work queue, blocking if necessary until space in the
- * queue becomes available.
+ * lane of its priority becomes available and its tenant is under its quota.
  *   queue: The queue instance to add to
  *   item: The item to add
  * Returns 0 on success, -1 on error, or 1 if queue was shut down
@@ -78,6 +179,39 @@ int work_queue_put(work_queue_t *queue, work_queue_item_t *item);
  */
 int work_queue_get(work_queue_t *queue, work_queue_item_t *dest);
 
+/*
+ * As work_queue_get, also adding the number of times the caller was woken
+ * while waiting for an item to '*wakeups'
+ */
+int work_queue_get_counted(work_queue_t *queue, work_queue_item_t *dest,
+                           unsigned long *wakeups);
+
+/*
+ * Set the share of items taken from the lane of 'priority'. Weights are
+ * relative, so with weights 16 and 1 a worker takes 16 high priority items
+ * for every low priority one while both lanes have items.
+ *   weight: The lane's new weight, from 1 to WORK_QUEUE_STRIDE
+ * Returns 0 on success or -1 on error
+ */
+int work_queue_set_weight(work_queue_t *queue, task_priority_t priority, unsigned weight);
+
+/*
+ * Limit how many items 'tenant' may have queued at once, over all lanes.
+ * Further puts for the tenant wait until its items are taken, leaving the
+ * rest of the queue to other tenants.
+ *   tenant: The tenant, from 1 to WORK_QUEUE_MAX_TENANTS - 1
+ *   max_items: The quota, or 0 for no limit
+ * Returns 0 on success or -1 on error
+ */
+int work_queue_set_quota(work_queue_t *queue, unsigned tenant, unsigned max_items);
+
+/*
+ * Copy a work queue's telemetry into 'stats'
+ *   queue: The queue to inspect
+ * Returns 0 on success or -1 on error
+ */
+int work_queue_get_stats(work_queue_t *queue, work_queue_stats_t *stats);
+
 /*
  * Shut down the work queue, alerting all threads waiting to perform a put
  * or a get operation.
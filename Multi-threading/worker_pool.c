@@ -1,25 +1,67 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "instrument.h"
 #include "worker_pool.h"
 #include "matrix.h"
 #include "task_group.h"
 
+// Only the owning worker writes its counters, but they are read at any time.
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 void *worker_thread_func(void *arg) {
+    worker_t *self = arg;
+    worker_stats_t *stats = &self->stats;
     while (1) {
         work_queue_item_t current_item;
-        int result = work_queue_get((work_queue_t *)(arg), &current_item);
+        unsigned long wakeups = stats->wakeups;
+        uint64_t wait_start = now_ns();
+        int result = work_queue_get_counted(self->queue, &current_item, &wakeups);
+        uint64_t run_start_ns = now_ns();
+        STORE(stats->wakeups, wakeups);
+        STORE(stats->idle_ns, stats->idle_ns + (run_start_ns - wait_start));
         if (result == 1) {
             break;
+        } else if (current_item.func != NULL) {
+            INSTR_RECORD(INSTR_QUEUE_WAIT, current_item.enqueued_ns);
+            INSTR_START(run_start);
+            current_item.func(current_item.arg);
+            INSTR_RECORD(INSTR_TASK_RUN, run_start);
+            INSTR_COUNT(INSTR_TASKS_RUN, 1);
+            STORE(stats->busy_ns, stats->busy_ns + (now_ns() - run_start_ns));
+            STORE(stats->tasks_run, stats->tasks_run + 1);
         } else {
-            int temp_sum = 0;
-            int n_columns = current_item.mat->ncols;
-            int row = current_item.row_num;
-            int index = row * n_columns;
-
-            //temp_sum is local, so no need for mutex.
-            for (int i = 0; i < n_columns; i++) {
-                temp_sum += current_item.mat->data[index + i];
+            INSTR_RECORD(INSTR_QUEUE_WAIT, current_item.enqueued_ns);
+            INSTR_START(run_start);
+            // A long, like the destination, so wide rows cannot overflow it.
+            long temp_sum = 0;
+            unsigned n_columns = current_item.mat->ncols;
+            const int *row = current_item.mat->data + (size_t) current_item.row_num * n_columns;
+            // Maxima are only taken of matrices with elements.
+            long temp_max = current_item.is_max ? row[0] : 0;
+            // Rows of a cancelled query are only counted off, so the rest of
+            // its queued rows drain quickly and the pool is free again.
+            int skip = cancel_requested(current_item.cancel) != CANCEL_NONE;
+
+            //temp_sum and temp_max are local, so no need for mutex.
+            if (current_item.is_max) {
+                for (unsigned i = 1; i < n_columns && !skip; i++) {
+                    if (row[i] > temp_max) {
+                        temp_max = row[i];
+                    }
+                }
+            } else {
+                for (unsigned i = 0; i < n_columns && !skip; i++) {
+                    temp_sum += row[i];
+                }
             }
 
             result = pthread_mutex_lock(current_item.dest_mutex);
@@ -28,19 +70,28 @@ void *worker_thread_func(void *arg) {
             }
 
             //destination is global, so need to mutex before editing.
-            *current_item.destination += temp_sum;
+            if (!current_item.is_max) {
+                *current_item.destination += temp_sum;
+            } else if (!skip && temp_max > *current_item.destination) {
+                *current_item.destination = temp_max;
+            }
+            if (skip) {
+                *current_item.stopped = 1;
+            }
 
             result = pthread_mutex_unlock(current_item.dest_mutex);
             if (result != 0) {
                 fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(result));
             }
 
-            task_group_done(current_item.task_group);
+            INSTR_RECORD(INSTR_TASK_RUN, run_start);
+            INSTR_COUNT(INSTR_TASKS_RUN, 1);
+            STORE(stats->busy_ns, stats->busy_ns + (now_ns() - run_start_ns));
+            STORE(stats->tasks_run, stats->tasks_run + 1);
 
-            // Need to make sure queue is shutdown if tasks are finished.
-            if (current_item.task_group->completed_tasks >= current_item.task_group->n_tasks) {
-                work_queue_shut_down((work_queue_t *)(arg));
-            }
+            // The waiting caller may free the group as soon as this returns,
+            // and the pool stays up for later groups until worker_pool_free.
+            task_group_done(current_item.task_group);
         }
     }
     return (void *) 0;
@@ -55,15 +106,23 @@ int worker_pool_init(worker_pool_t *pool, unsigned pool_size, unsigned queue_siz
     if (pool->threads == NULL) {
         return -1;
     }
+    pool->workers = aligned_alloc(sizeof(worker_t), pool_size * sizeof(worker_t));
+    if (pool->workers == NULL) {
+        free(pool->threads);
+        return -1;
+    }
 
     if (work_queue_init(&pool->queue, queue_size) == -1) {
+        free(pool->workers);
         free(pool->threads);
         return -1;
     }
     pool->size = pool_size;
 
     for (int i = 0; i < pool_size; i++) {
-        int err = pthread_create(pool->threads + i, NULL, worker_thread_func, &pool->queue);
+        pool->workers[i].queue = &pool->queue;
+        memset(&pool->workers[i].stats, 0, sizeof(worker_stats_t));
+        int err = pthread_create(pool->threads + i, NULL, worker_thread_func, &pool->workers[i]);
         if (err != 0) {
             fprintf(stderr, "pthread_create: %s\n", strerror(err));
             work_queue_shut_down(&pool->queue);
@@ -71,6 +130,7 @@ int worker_pool_init(worker_pool_t *pool, unsigned pool_size, unsigned queue_siz
                 pthread_join(pool->threads[j], NULL);
             }
             work_queue_free(&pool->queue);
+            free(pool->workers);
             free(pool->threads);
             return -1;
         }
@@ -93,44 +153,125 @@ int worker_pool_free(worker_pool_t *pool) {
         }
     }
     free(pool->threads);
+    free(pool->workers);
     if (work_queue_free(&pool->queue) != 0) {
         ret_val = -1;
     }
     return ret_val;
 }
 
+int worker_pool_get_stats(worker_pool_t *pool, work_queue_stats_t *queue_stats,
+                          worker_stats_t *worker_stats) {
+    for (unsigned i = 0; i < pool->size; i++) {
+        worker_stats_t *src = &pool->workers[i].stats;
+        worker_stats[i].tasks_run = LOAD(src->tasks_run);
+        worker_stats[i].wakeups = LOAD(src->wakeups);
+        worker_stats[i].busy_ns = LOAD(src->busy_ns);
+        worker_stats[i].idle_ns = LOAD(src->idle_ns);
+    }
+    return work_queue_get_stats(&pool->queue, queue_stats);
+}
+
+int worker_pool_submit(worker_pool_t *pool, void (*func)(void *arg), void *arg) {
+    return worker_pool_submit_class(pool, TASK_CLASS_DEFAULT, func, arg);
+}
+
+int worker_pool_submit_class(worker_pool_t *pool, task_class_t cls, void (*func)(void *arg),
+                             void *arg) {
+    work_queue_item_t item;
+    memset(&item, 0, sizeof(item));
+    item.cls = cls;
+    item.func = func;
+    item.arg = arg;
+    return work_queue_put(&pool->queue, &item) == 0 ? 0 : -1;
+}
+
 int matrix_parallel_sum_pool(const matrix_t *mat, worker_pool_t *pool, long *result) {
-    *result = 0;
+    return matrix_parallel_sum_pool_cancel(mat, pool, TASK_CLASS_DEFAULT, NULL, result);
+}
+
+/*
+ * Queue one item per row and wait for them, merging every row's sum or
+ * maximum into '*result'
+ *   is_max: Whether to take the maximum rather than the sum
+ */
+static int pool_reduce(const matrix_t *mat, worker_pool_t *pool, task_class_t cls,
+                       const cancel_token_t *cancel, int is_max, long *result) {
+    INSTR_START(start);
+    if (is_max && (size_t) mat->nrows * mat->ncols == 0) {
+        return -1;
+    }
+    *result = is_max ? mat->data[0] : 0;
 
     task_group_t group;
     if (task_group_init(&group, mat->nrows) == -1) {
         printf("Task goup initialization failed\n");
         return -1;
     }
+    group.cls = cls;
 
     pthread_mutex_t result_mutex;
     int err = pthread_mutex_init(&result_mutex, NULL);
     if (err != 0) {
         fprintf(stderr, "pthread_mutex_init: %s\n", strerror(err));
+        task_group_free(&group);
         return -1;
     }
 
     // Put one item into queue for each row of the matrix
+    int ret_val = 0;
+    int stopped = 0;
     work_queue_item_t item;
+    item.cls = group.cls;
+    item.func = NULL;
     item.mat = mat;
+    item.is_max = is_max;
     item.destination = result;
     item.dest_mutex = &result_mutex;
     item.task_group = &group;
-    for (int i = 0; i < mat->nrows; i++) {
+    item.cancel = cancel;
+    item.stopped = &stopped;
+    for (unsigned i = 0; i < mat->nrows; i++) {
         item.row_num = i;
-        if (work_queue_put(&pool->queue, &item) == -1) {
-            return -1;
+        // Once cancelled, queue no more rows; the workers skip those queued.
+        if (cancel_requested(cancel) != CANCEL_NONE) {
+            pthread_mutex_lock(&group.mutex);
+            group.n_tasks = i;
+            pthread_mutex_unlock(&group.mutex);
+            // Workers already running rows set it too, under the same mutex.
+            pthread_mutex_lock(&result_mutex);
+            stopped = 1;
+            pthread_mutex_unlock(&result_mutex);
+            break;
+        }
+        if (work_queue_put(&pool->queue, &item) != 0) {
+            // Rows already queued still refer to the group, so wait for those.
+            pthread_mutex_lock(&group.mutex);
+            group.n_tasks = i;
+            pthread_mutex_unlock(&group.mutex);
+            ret_val = -1;
+            break;
         }
     }
 
-    // Wait for all workers to finish summing each row
-    if (task_group_wait(&group) == -1) {
-        return -1;
+    // Wait for all workers to finish each row
+    if (task_group_wait(&group) == -1 || stopped) {
+        ret_val = -1;
     }
-    return 0;
+    task_group_free(&group);
+    pthread_mutex_destroy(&result_mutex);
+    if (!is_max) {
+        INSTR_RECORD(INSTR_POOL_SUM, start);
+    }
+    return ret_val;
+}
+
+int matrix_parallel_sum_pool_cancel(const matrix_t *mat, worker_pool_t *pool, task_class_t cls,
+                                    const cancel_token_t *cancel, long *result) {
+    return pool_reduce(mat, pool, cls, cancel, 0, result);
+}
+
+int matrix_parallel_max_pool_cancel(const matrix_t *mat, worker_pool_t *pool, task_class_t cls,
+                                    const cancel_token_t *cancel, long *result) {
+    return pool_reduce(mat, pool, cls, cancel, 1, result);
 }
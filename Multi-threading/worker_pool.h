@@ -2,17 +2,45 @@
 #define WORKER_POOL_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include "work_queue.h"
 
+/*
+ * Counters for one worker thread
+ *   tasks_run: Number of work items the worker completed
+ *   wakeups: Number of times the worker was woken while waiting for work
+ *   busy_ns: Time spent running work items
+ *   idle_ns: Time spent waiting for work
+ */
+typedef struct {
+    unsigned long tasks_run;
+    unsigned long wakeups;
+    uint64_t busy_ns;
+    uint64_t idle_ns;
+} worker_stats_t;
+
+/*
+ * Argument of one worker thread, on its own cache line so that updating
+ * the counters of one worker does not slow down the others
+ *   queue: The queue the worker takes work from
+ *   stats: Counters only this worker writes
+ */
+typedef struct {
+    work_queue_t *queue;
+    worker_stats_t stats;
+} __attribute__((aligned(64))) worker_t;
+
 /*
  * Represents a pool of worker threads
  *   queue: The queue from which threads access their work tasks
  *   threads: Array of pthread_t instances representing the workers
+ *   workers: Argument and counters of each worker thread
  *   size: Number of worker threads in the tpool
  */
 typedef struct {
     work_queue_t queue;
     pthread_t *threads;
+    worker_t *workers;
     unsigned size;
 } worker_pool_t;
 
@@ -31,6 +59,32 @@ int worker_pool_init(worker_pool_t *pool, unsigned pool_size, unsigned queue_siz
  */
 int worker_pool_free(worker_pool_t *pool);
 
+/*
+ * Read the telemetry of a worker pool
+ *   pool: The worker pool to inspect
+ *   queue_stats: Location to store the statistics of the pool's queue
+ *   worker_stats: Array of pool->size entries to store each worker's counters
+ * Returns 0 on success or -1 on error
+ */
+int worker_pool_get_stats(worker_pool_t *pool, work_queue_stats_t *queue_stats,
+                          worker_stats_t *worker_stats);
+
+/*
+ * Run func(arg) on one of the pool's workers, blocking while the queue is full
+ *   pool: The worker pool to run on
+ *   func: The function to call. It must not wait for other work in the pool.
+ *   arg: Argument passed to func
+ * Returns 0 on success or -1 on error
+ */
+int worker_pool_submit(worker_pool_t *pool, void (*func)(void *arg), void *arg);
+
+/*
+ * As worker_pool_submit, queueing func(arg) in the lane of cls.priority and
+ * against the quota of cls.tenant rather than as TASK_CLASS_DEFAULT
+ */
+int worker_pool_submit_class(worker_pool_t *pool, task_class_t cls, void (*func)(void *arg),
+                             void *arg);
+
 /*
  * Compute the sum of all matrix elements using a pool of worker threads.
  *   mat: The matrix to sum over
@@ -40,4 +94,23 @@ int worker_pool_free(worker_pool_t *pool);
  */
 int matrix_parallel_sum_pool(const matrix_t *mat, worker_pool_t *pool, long *result);
 
+/*
+ * As matrix_parallel_sum_pool, with the rows queued under a class and
+ * stopping early if 'cancel' is cancelled. Rows already queued when that
+ * happens are skipped by the workers, and the call returns once none of them
+ * refers to the query any more, leaving the pool ready for the next one.
+ *   cls: Priority and tenant the rows are queued under
+ *   cancel: Token checked before each row is queued and summed, or NULL
+ * Returns 0 on success or -1 on error or if cancelled before the last row
+ */
+int matrix_parallel_sum_pool_cancel(const matrix_t *mat, worker_pool_t *pool, task_class_t cls,
+                                    const cancel_token_t *cancel, long *result);
+
+/*
+ * As matrix_parallel_sum_pool_cancel, computing the largest element instead
+ * Returns 0 on success or -1 on error, if cancelled or if the matrix is empty
+ */
+int matrix_parallel_max_pool_cancel(const matrix_t *mat, worker_pool_t *pool, task_class_t cls,
+                                    const cancel_token_t *cancel, long *result);
+
 #endif // WORKER_POOL_H
@@ -107,4 +107,24 @@ matrix_t *matrix_download_udp(const char *host, const char *port, const char *ma
  */
 matrix_t *matrix_download_tcp(const char *host, const char *port, const char *matrix_name);
 
+/*
+ * Connect to a matrix server over TCP and request a matrix
+ * 'host': Host name or IP address of server
+ * 'port': Server port to connect to
+ * 'matrix_name': Name of matrix to download
+ * 'nrows', 'ncols': Set to the dimensions of the matrix being sent
+ * Returns the connected socket, positioned at the first element, or -1 on error
+ */
+int matrix_tcp_request(const char *host, const char *port, const char *matrix_name,
+                       unsigned *nrows, unsigned *ncols);
+
+/*
+ * Receive matrix elements from a socket opened by matrix_tcp_request
+ * 'sock_fd': The connected socket
+ * 'dest': Where to store the elements, converted to host byte order
+ * 'count': Number of elements to receive
+ * Returns 0 on success or -1 on error
+ */
+int matrix_tcp_read_elements(int sock_fd, int *dest, size_t count);
+
 #endif // SMOCK_FUNC_H
@@ -8,12 +8,27 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include "matrix.h"
+#include "matrix_nt.h"
 
 //Included in "question_client_udp.c" from class, but not in the matrix file:
 #include <sys/types.h>
 #include <errno.h>
 #include <signal.h>
 
+/*
+ * Convert 'n' elements received in network byte order into 'dest' in host
+ * byte order. 'dest' may be 'src' itself, but must not overlap it otherwise.
+ */
+static void elements_to_host(int *dest, const int *src, size_t n) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    matrix_nt_bswap(dest, src, n);
+#else
+    if (dest != src) {
+        memcpy(dest, src, n * sizeof(int));
+    }
+#endif
+}
+
 matrix_t *matrix_download_udp(const char *host, const char *port, const char *matrix_name) {
     char *internet_id = "oneil853";
     int matrix_info[1024];
@@ -76,12 +91,8 @@ matrix_t *matrix_download_udp(const char *host, const char *port, const char *ma
     matrix_t * udp_matrix = matrix_init(rows,cols);
 
     for (int row = 0; row < rows; row++) {
-        for (int col = 0; col < cols; col++) {
-            udp_matrix->data[row][col] = ntohl(matrix_info[(row * cols)+(col)+3]);
-            //ntohl, because we need to convert four incoming bytes to little_endian.
-            //For each row that's passed, every column was counted.
-            //Plus 3 ignores the following: success value, # of rows, and # of cols.
-        }
+        //Plus 3 skips the following: success value, # of rows, and # of cols.
+        elements_to_host(udp_matrix->data[row], matrix_info + (row * cols) + 3, cols);
     }
 
     freeaddrinfo(server);
@@ -94,11 +105,31 @@ matrix_t *matrix_download_udp(const char *host, const char *port, const char *ma
     return udp_matrix;
 }
 
-matrix_t *matrix_download_tcp(const char *host, const char *port, const char *matrix_name) {
+// Reads exactly 'len' bytes, since TCP may deliver data in smaller pieces.
+static int read_full(int sock_fd, void *buf, size_t len) {
+    char *pos = buf;
+    while (len > 0) {
+        ssize_t n = read(sock_fd, pos, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "read: Connection closed early\n");
+            return -1;
+        }
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
 
+int matrix_tcp_request(const char *host, const char *port, const char *matrix_name,
+                       unsigned *nrows, unsigned *ncols) {
     char *internet_id = "oneil853";
-    unsigned rows;
-    unsigned cols;
 
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -106,101 +137,102 @@ matrix_t *matrix_download_tcp(const char *host, const char *port, const char *ma
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
     struct addrinfo *server;
-    
 
     int ret_val = getaddrinfo(host, port, &hints, &server);
-    if (ret_val == -1) {
+    if (ret_val != 0) {
         printf("getaddrinfo failed: %s\n", gai_strerror(ret_val));
-        return NULL;
+        return -1;
     }
 
     int sock_fd = socket(server->ai_family,server->ai_socktype,server->ai_protocol);
     if (sock_fd == -1) {
         perror("socket");
         freeaddrinfo(server);
-        return NULL;
+        return -1;
     }
 
     if (connect(sock_fd,server->ai_addr,server->ai_addrlen) == -1) {
         perror("connect");
         close(sock_fd);
         freeaddrinfo(server);
-        return NULL;
+        return -1;
     }
+    freeaddrinfo(server);
 
     if (write(sock_fd,internet_id,strlen(internet_id)) == -1) {
         perror("write");
         close(sock_fd);
-        freeaddrinfo(server);
-        return NULL;
+        return -1;
     }
 
     if (write(sock_fd,matrix_name,strlen(matrix_name)) == -1) {
-        //Subtracting "sizeof(char)" to disinclude '\0' from request
         perror("write");
         close(sock_fd);
-        freeaddrinfo(server);
-        return NULL;
+        return -1;
     }
 
     int success;
-    if (read(sock_fd,&success,sizeof(success)) == -1) {
-        perror("read");
+    if (read_full(sock_fd, &success, sizeof(success)) == -1) {
         close(sock_fd);
-        freeaddrinfo(server);
-        return NULL;
+        return -1;
     }
 
     if (ntohl(success) == 1) {
         //Need to convert bytes to correct Endianness
         close(sock_fd);
-        freeaddrinfo(server);
-        return NULL;
+        return -1;
     }
 
-    if (read(sock_fd,&rows,sizeof(rows)) == -1) {
-        perror("read");
+    unsigned dims[2];
+    if (read_full(sock_fd, dims, sizeof(dims)) == -1) {
         close(sock_fd);
-        freeaddrinfo(server);
-        return NULL;
+        return -1;
     }
 
+    //Need to convert bytes to correct Endianness
+    *nrows = ntohl(dims[0]);
+    *ncols = ntohl(dims[1]);
+    return sock_fd;
+}
 
-    if (read(sock_fd,&cols,sizeof(cols)) == -1) {
-        perror("read");
-        close(sock_fd);
-        freeaddrinfo(server);
-        return NULL;
+int matrix_tcp_read_elements(int sock_fd, int *dest, size_t count) {
+    if (read_full(sock_fd, dest, count * sizeof(int)) == -1) {
+        return -1;
     }
-
     //Need to convert bytes to correct Endianness
-    rows = ntohl(rows);
-    cols = ntohl(cols);
+    elements_to_host(dest, dest, count);
+    return 0;
+}
+
+matrix_t *matrix_download_tcp(const char *host, const char *port, const char *matrix_name) {
+    unsigned rows;
+    unsigned cols;
+
+    int sock_fd = matrix_tcp_request(host, port, matrix_name, &rows, &cols);
+    if (sock_fd == -1) {
+        return NULL;
+    }
 
     matrix_t *tcp_matrix = matrix_init(rows,cols);
-    for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < cols; j++) {
-            int entry;
-            if (read(sock_fd,&entry,sizeof(int)) == -1) {
-                perror("read");
-                close(sock_fd);
-                freeaddrinfo(server);
-                return NULL;
-            }    
-            //Need to convert bytes to correct Endianness
-            entry = ntohl(entry);
-            matrix_put(tcp_matrix, i, j, entry);
+    if (tcp_matrix == NULL) {
+        close(sock_fd);
+        return NULL;
+    }
 
+    //Receive a whole row per read instead of one element at a time.
+    for (int i = 0; i < rows; i++) {
+        if (matrix_tcp_read_elements(sock_fd, tcp_matrix->data[i], cols) == -1) {
+            matrix_free(tcp_matrix);
+            close(sock_fd);
+            return NULL;
         }
     }
-    
-    freeaddrinfo(server);
+
     if (close(sock_fd) == -1) {
         perror("close");
+        matrix_free(tcp_matrix);
         return NULL;
     }
 
     return tcp_matrix;
-    
 }
-
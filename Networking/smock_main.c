@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "matrix.h"
+#include "sparse.h"
 
 #define MAX_INPUT_LEN 128
 #define PROMPT ">> "
@@ -22,10 +23,18 @@ int main(int argc, char *argv[]) {
     printf("  read_bin <file_name>: Read current matrix from a binary file\n");
     printf("  download_udp <host> <port> <name>: Download a binary matrix over UDP\n");
     printf("  download_tcp <host> <port> <name>: Download a binary matrix over TCP\n");
+    printf("  write_sparse_text <file_name>: Write current matrix to a sparse text file\n");
+    printf("  write_sparse_bin <file_name>: Write current matrix to a sparse binary file\n");
+    printf("  to_sparse: Store the current matrix in sparse (CSR) form\n");
+    printf("  to_dense: Store the current matrix in dense form\n");
+    printf("  format: Print how the current matrix is stored\n");
+    printf("  transpose: Replace the current matrix with its transpose\n");
+    printf("  multiply <file_name>: Multiply current matrix by a dense binary matrix\n");
     printf("  exit: Quit this program\n");
 
     char input[MAX_INPUT_LEN];
     matrix_t *mat = NULL;
+    sparse_matrix_t *sp = NULL; // At most one of 'mat' and 'sp' is set
     while (1) { // Keep reading until we break out of loop
         printf("%s", PROMPT);
 
@@ -43,7 +52,7 @@ int main(int argc, char *argv[]) {
             unsigned nrows;
             unsigned ncols;
             scanf("%u %u", &nrows, &ncols);
-            if (mat != NULL) {
+            if (mat != NULL || sp != NULL) {
                 printf("Error: You must clear the current matrix first\n");
             } else {
                 mat = matrix_init(nrows, ncols);
@@ -62,7 +71,10 @@ int main(int argc, char *argv[]) {
         }
 
         else if (strcmp("clear", input) == 0) {
-            if (mat == NULL) {
+            if (sp != NULL) {
+                sparse_free(sp);
+                sp = NULL;
+            } else if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
                 matrix_free(mat);
@@ -71,7 +83,15 @@ int main(int argc, char *argv[]) {
         }
 
         else if (strcmp("print", input) == 0) {
-            if (mat == NULL) {
+            if (sp != NULL) {
+                for (unsigned i = 0; i < sp->nrows; i++) {
+                    printf("  ");
+                    for (unsigned j = 0; j < sp->ncols; j++) {
+                        printf("%d ", sparse_get(sp, i, j));
+                    }
+                    printf("\n");
+                }
+            } else if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
                 for (int i = 0; i < mat->nrows; i++) {
@@ -89,7 +109,9 @@ int main(int argc, char *argv[]) {
             unsigned i;
             unsigned j;
             scanf("%u %u", &i, &j);
-            if (mat == NULL) {
+            if (sp != NULL) {
+                printf("%d\n", sparse_get(sp, i, j));
+            } else if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
                 printf("%d\n", matrix_get(mat, i, j));
@@ -102,7 +124,11 @@ int main(int argc, char *argv[]) {
             unsigned j;
             int val;
             scanf("%u %u %d", &i, &j, &val);
-            if (mat == NULL) {
+            if (sp != NULL) {
+                if (sparse_put(sp, i, j, val) != 0) {
+                    printf("Error: Failed to store element\n");
+                }
+            } else if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
                 matrix_put(mat, i, j, val);
@@ -110,7 +136,9 @@ int main(int argc, char *argv[]) {
         }
 
         else if (strcmp("sum", input) == 0) {
-            if (mat == NULL) {
+            if (sp != NULL) {
+                printf("%ld\n", sparse_sum(sp));
+            } else if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
                 printf("%ld\n", matrix_sum(mat));
@@ -118,7 +146,9 @@ int main(int argc, char *argv[]) {
         }
 
         else if (strcmp("max", input) == 0) {
-            if (mat == NULL) {
+            if (sp != NULL) {
+                printf("%d\n", sparse_max(sp));
+            } else if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
                 printf("%d\n", matrix_max(mat));
@@ -127,7 +157,18 @@ int main(int argc, char *argv[]) {
 
         else if (strcmp("write_text", input) == 0) {
             scanf("%s", input); // Read in file name
-            if (mat == NULL) {
+            if (sp != NULL) {
+                // The dense format stores every element, zeros included
+                matrix_t *dense = sparse_to_dense(sp);
+                if (dense == NULL || matrix_write_text(dense, input) != 0) {
+                    printf("Failed to write matrix to text file\n");
+                } else {
+                    printf("Matrix successfully written to text file\n");
+                }
+                if (dense != NULL) {
+                    matrix_free(dense);
+                }
+            } else if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
                 if (matrix_write_text(mat, input) != 0) {
@@ -140,11 +181,10 @@ int main(int argc, char *argv[]) {
 
         else if (strcmp("read_text", input) == 0) {
             scanf("%s", input); // Read in file name
-            if (mat != NULL) {
+            if (mat != NULL || sp != NULL) {
                 printf("Error: You must clear the current matrix first\n");
             } else {
-                mat = matrix_read_text(input);
-                if (mat == NULL) {
+                if (matrix_read_text_auto(input, &mat, &sp) != 0) {
                     printf("Failed to read matrix from text file\n");
                 } else {
                     printf("Matrix successfully read from text file\n");
@@ -154,7 +194,18 @@ int main(int argc, char *argv[]) {
 
         else if (strcmp("write_bin", input) == 0) {
             scanf("%s", input); // Read in file name
-            if (mat == NULL) {
+            if (sp != NULL) {
+                // The dense format stores every element, zeros included
+                matrix_t *dense = sparse_to_dense(sp);
+                if (dense == NULL || matrix_write_bin(dense, input) != 0) {
+                    printf("Failed to write matrix to binary file\n");
+                } else {
+                    printf("Matrix successfully written to binary file\n");
+                }
+                if (dense != NULL) {
+                    matrix_free(dense);
+                }
+            } else if (mat == NULL) {
                 printf("Error: There is no active matrix\n");
             } else {
                 if (matrix_write_bin(mat, input) != 0) {
@@ -167,11 +218,10 @@ int main(int argc, char *argv[]) {
 
         else if (strcmp("read_bin", input) == 0) {
             scanf("%s", input); // Read in file name
-            if (mat != NULL) {
+            if (mat != NULL || sp != NULL) {
                 printf("Error: You must clear the current matrix first\n");
             } else {
-                mat = matrix_read_bin(input);
-                if (mat == NULL) {
+                if (matrix_read_bin_auto(input, &mat, &sp) != 0) {
                     printf("Failed to read matrix from binary file\n");
                 } else {
                     printf("Matrix successfully read from binary file\n");
@@ -189,7 +239,7 @@ int main(int argc, char *argv[]) {
             scanf("%s",port);
             scanf("%s",name); // Read in file name
 
-            if (mat != NULL) {
+            if (mat != NULL || sp != NULL) {
                 printf("Error: You must clear the current matrix first\n");
             } else {
                 mat = matrix_download_udp(ip,port,name);
@@ -211,11 +261,10 @@ int main(int argc, char *argv[]) {
             scanf("%s",port);
             scanf("%s",name); // Read in file name
 
-            if (mat != NULL) {
+            if (mat != NULL || sp != NULL) {
                 printf("Error: You must clear the current matrix first\n");
             } else {
-                mat = matrix_download_tcp(ip,port,name);
-                if (mat == NULL) {
+                if (matrix_download_tcp_auto(ip, port, name, &mat, &sp) != 0) {
                     printf("Failed to download matrix over TCP\n");
                 } else {
                     printf("Matrix successfully downloaded over TCP\n");
@@ -223,6 +272,125 @@ int main(int argc, char *argv[]) {
             }
         }
 
+        else if (strcmp("write_sparse_text", input) == 0 ||
+                 strcmp("write_sparse_bin", input) == 0) {
+            int is_text = strcmp("write_sparse_text", input) == 0;
+            scanf("%s", input); // Read in file name
+            if (mat == NULL && sp == NULL) {
+                printf("Error: There is no active matrix\n");
+            } else {
+                sparse_matrix_t *to_write = sp != NULL ? sp : sparse_from_dense(mat);
+                if (to_write == NULL ||
+                    (is_text ? sparse_write_text(to_write, input)
+                             : sparse_write_bin(to_write, input)) != 0) {
+                    printf("Failed to write sparse matrix\n");
+                } else {
+                    printf("Sparse matrix successfully written\n");
+                }
+                if (to_write != NULL && to_write != sp) {
+                    sparse_free(to_write);
+                }
+            }
+        }
+
+        else if (strcmp("to_sparse", input) == 0) {
+            if (mat == NULL) {
+                printf("Error: There is no active dense matrix\n");
+            } else {
+                sp = sparse_from_dense(mat);
+                if (sp == NULL) {
+                    printf("Sparse conversion failed\n");
+                } else {
+                    matrix_free(mat);
+                    mat = NULL;
+                }
+            }
+        }
+
+        else if (strcmp("to_dense", input) == 0) {
+            if (sp == NULL) {
+                printf("Error: There is no active sparse matrix\n");
+            } else {
+                mat = sparse_to_dense(sp);
+                if (mat == NULL) {
+                    printf("Dense conversion failed\n");
+                } else {
+                    sparse_free(sp);
+                    sp = NULL;
+                }
+            }
+        }
+
+        else if (strcmp("format", input) == 0) {
+            if (sp != NULL) {
+                printf("sparse %u x %u, %zu stored elements\n", sp->nrows, sp->ncols, sp->nnz);
+            } else if (mat != NULL) {
+                printf("dense %u x %u\n", mat->nrows, mat->ncols);
+            } else {
+                printf("Error: There is no active matrix\n");
+            }
+        }
+
+        else if (strcmp("transpose", input) == 0) {
+            if (mat == NULL && sp == NULL) {
+                printf("Error: There is no active matrix\n");
+            } else {
+                // Dense matrices are transposed through CSR, which only moves nonzeros
+                sparse_matrix_t *src = sp != NULL ? sp : sparse_from_dense(mat);
+                sparse_matrix_t *t = src != NULL ? sparse_transpose(src) : NULL;
+                if (src != NULL && src != sp) {
+                    sparse_free(src);
+                }
+                if (t == NULL) {
+                    printf("Matrix transpose failed\n");
+                } else if (sp != NULL) {
+                    sparse_free(sp);
+                    sp = t;
+                } else {
+                    matrix_t *dense_t = sparse_to_dense(t);
+                    sparse_free(t);
+                    if (dense_t == NULL) {
+                        printf("Matrix transpose failed\n");
+                    } else {
+                        matrix_free(mat);
+                        mat = dense_t;
+                    }
+                }
+            }
+        }
+
+        else if (strcmp("multiply", input) == 0) {
+            scanf("%s", input); // Read in file name
+            if (mat == NULL && sp == NULL) {
+                printf("Error: There is no active matrix\n");
+            } else {
+                sparse_matrix_t *lhs = sp != NULL ? sp : sparse_from_dense(mat);
+                matrix_t *rhs = matrix_read_bin(input);
+                matrix_t *product = NULL;
+                if (lhs != NULL && rhs != NULL) {
+                    product = sparse_mul_dense(lhs, rhs);
+                }
+                if (lhs != NULL && lhs != sp) {
+                    sparse_free(lhs);
+                }
+                if (rhs != NULL) {
+                    matrix_free(rhs);
+                }
+                if (product == NULL) {
+                    printf("Matrix multiplication failed\n");
+                } else {
+                    // The product replaces the current matrix, stored densely
+                    if (sp != NULL) {
+                        sparse_free(sp);
+                        sp = NULL;
+                    } else {
+                        matrix_free(mat);
+                    }
+                    mat = product;
+                    printf("Matrix successfully multiplied\n");
+                }
+            }
+        }
 
         else {
             printf("Unknown command'%s'\n", input);
@@ -232,5 +400,8 @@ int main(int argc, char *argv[]) {
     if (mat != NULL) {
         matrix_free(mat);
     }
+    if (sp != NULL) {
+        sparse_free(sp);
+    }
     return 0;
 }
@@ -0,0 +1,167 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stddef.h>
+#include "matrix.h"
+
+/*
+ * Matrices at most this dense (fraction of nonzero elements) are loaded as
+ * sparse matrices. CSR stores 8 bytes per nonzero against 4 per element for
+ * a dense matrix, so anything under half full saves memory; the lower cut
+ * off leaves room for the row offsets and keeps reductions clearly faster.
+ */
+#define SPARSE_DENSITY_THRESHOLD 0.25
+
+// First word of a sparse binary file. Dense files start with nrows instead.
+#define SPARSE_BIN_MAGIC 0x31525053u // "SPR1" in little-endian byte order
+
+/*
+ * Sparse matrix in compressed sparse row (CSR) form
+ * nrows, ncols: Dimensions of the matrix
+ * nnz: Number of stored elements
+ * capacity: Number of elements col_idx and values have room for
+ * row_ptr: nrows + 1 offsets; row i is stored in [row_ptr[i], row_ptr[i + 1])
+ * col_idx: Column of each stored element, increasing within a row
+ * values: Value of each stored element
+ */
+typedef struct {
+    unsigned nrows;
+    unsigned ncols;
+    size_t nnz;
+    size_t capacity;
+    size_t *row_ptr;
+    unsigned *col_idx;
+    int *values;
+} sparse_matrix_t;
+
+/*
+ * Sparse matrix in coordinate (COO) form, used to build a CSR matrix from
+ * elements given in any order
+ * nrows, ncols: Dimensions of the matrix
+ * nnz: Number of elements added so far
+ * capacity: Number of elements the arrays have room for
+ * rows, cols, values: Position and value of each element
+ */
+typedef struct {
+    unsigned nrows;
+    unsigned ncols;
+    size_t nnz;
+    size_t capacity;
+    unsigned *rows;
+    unsigned *cols;
+    int *values;
+} sparse_coo_t;
+
+/*
+ * Create an empty CSR matrix
+ * 'capacity': Number of nonzero elements to reserve room for
+ * Returns a pointer to a new sparse_matrix_t on success or NULL on failure
+ */
+sparse_matrix_t *sparse_init(unsigned nrows, unsigned ncols, size_t capacity);
+
+/*
+ * Free all of the memory associated with a sparse matrix
+ */
+void sparse_free(sparse_matrix_t *sp);
+
+/*
+ * Initialize an empty COO matrix
+ * Returns 0 on success or -1 on error
+ */
+int sparse_coo_init(sparse_coo_t *coo, unsigned nrows, unsigned ncols);
+
+/*
+ * Add an element to a COO matrix. If the same position is added more than
+ * once, the last value wins.
+ * Returns 0 on success or -1 on error
+ */
+int sparse_coo_add(sparse_coo_t *coo, unsigned i, unsigned j, int val);
+
+/*
+ * Free the arrays of a COO matrix
+ */
+void sparse_coo_free(sparse_coo_t *coo);
+
+/*
+ * Convert a COO matrix to CSR, dropping elements whose value is zero
+ * Returns a pointer to a new sparse_matrix_t on success or NULL on failure
+ */
+sparse_matrix_t *sparse_from_coo(const sparse_coo_t *coo);
+
+/*
+ * Convert between dense and sparse representations
+ * Return a pointer to the new matrix on success or NULL on failure
+ */
+sparse_matrix_t *sparse_from_dense(const matrix_t *mat);
+matrix_t *sparse_to_dense(const sparse_matrix_t *sp);
+
+/*
+ * Retrieve a matrix element. Elements that are not stored are zero.
+ * You may assume that 'i' and 'j' are valid for the dimensions of 'sp'
+ */
+int sparse_get(const sparse_matrix_t *sp, unsigned i, unsigned j);
+
+/*
+ * Set a matrix element. Setting an element that is not stored inserts it,
+ * which moves every element stored after it.
+ * You may assume that 'i' and 'j' are valid for the dimensions of 'sp'
+ * Returns 0 on success or -1 on error
+ */
+int sparse_put(sparse_matrix_t *sp, unsigned i, unsigned j, int val);
+
+/*
+ * Sum and maximum of all elements, including the implicit zeros
+ * These only visit stored elements.
+ */
+long sparse_sum(const sparse_matrix_t *sp);
+int sparse_max(const sparse_matrix_t *sp);
+
+/*
+ * Compute the transpose of a sparse matrix
+ * Returns a pointer to a new sparse_matrix_t on success or NULL on failure
+ */
+sparse_matrix_t *sparse_transpose(const sparse_matrix_t *sp);
+
+/*
+ * Multiply a sparse matrix by a dense one
+ * 'sp': Left operand, nrows x k
+ * 'mat': Right operand, k x ncols
+ * Returns a pointer to the new nrows x ncols dense product, or NULL if the
+ * dimensions do not match or allocation fails
+ */
+matrix_t *sparse_mul_dense(const sparse_matrix_t *sp, const matrix_t *mat);
+
+/*
+ * Write a sparse matrix to a text file: a "sparse <nrows> <ncols> <nnz>"
+ * line followed by one "<i> <j> <value>" line per stored element
+ * Returns 0 on success or -1 on error
+ */
+int sparse_write_text(const sparse_matrix_t *sp, const char *file_name);
+
+/*
+ * Write a sparse matrix to a binary file: SPARSE_BIN_MAGIC, nrows, ncols
+ * and nnz, then the row_ptr, col_idx and values arrays
+ * Returns 0 on success or -1 on error
+ */
+int sparse_write_bin(const sparse_matrix_t *sp, const char *file_name);
+
+/*
+ * Read a matrix from a text or binary file in either the dense or the sparse
+ * format, choosing the in-memory representation from its density. Dense
+ * files are converted row by row, so a sparse result never needs memory for
+ * the dense matrix.
+ * 'dense', 'sparse': Exactly one is set to the new matrix, the other to NULL
+ * Returns 0 on success or -1 on error
+ */
+int matrix_read_text_auto(const char *file_name, matrix_t **dense, sparse_matrix_t **sparse);
+int matrix_read_bin_auto(const char *file_name, matrix_t **dense, sparse_matrix_t **sparse);
+
+/*
+ * Download a matrix over TCP, choosing the representation as above while
+ * the rows arrive
+ * Returns 0 on success or -1 on error
+ */
+int matrix_download_tcp_auto(const char *host, const char *port, const char *matrix_name,
+                             matrix_t **dense, sparse_matrix_t **sparse);
+
+#endif // SPARSE_H